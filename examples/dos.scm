@@ -2,9 +2,10 @@
 ; Gaussian smoothing functions around each computed frequency point.
 ; This scheme was suggested by Xavier Gonze and implemented in ABINIT
 ; (http://www.mapr.ucl.ac.be/Fr/PCPM/ABINIT/), with further
-; suggestions by Doug Allan of Corning.  (There are also more
-; sophisticated algorithms employing the group velocity, but we have
-; not implemented them yet.)
+; suggestions by Doug Allan of Corning.  (For a more accurate DOS,
+; use the built-in run-dos function instead, which employs the
+; tetrahedron method on a symmetry-reduced k-point mesh, optionally
+; with the group velocities; e.g. (run-dos (vector3 16 16 16) 0 1 100).)
 
 ; To apply it to output, say, the density of states at 100 points
 ; points in the frequency range 0 to 1 you would do the following
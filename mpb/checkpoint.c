@@ -0,0 +1,368 @@
+/* Copyright (C) 1999-2014 Massachusetts Institute of Technology.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Per-k-point checkpointing of band-structure runs, so that a run that
+   is interrupted can be restarted without recomputing the k-points
+   that were already finished.  (See run-parity in mpb.scm.)
+
+   After each k-point, the k-points and frequencies computed so far
+   are written to <fname>.h5, along with a "signature" of the
+   calculation (grid, bands, tolerance, parity, and a checksum of the
+   dielectric function), so that a checkpoint is never used for a
+   different problem.  The frequency file is tiny, and is written to a
+   temporary file and then renamed, so an interruption can never leave
+   a corrupt checkpoint.  Much more expensive is saving the fields H
+   (to <fname>-fields.h5), which is therefore done at most once every
+   so many seconds; on restart, they are loaded to give the eigensolver
+   a good starting guess. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "config.h"
+#include <check.h>
+#include <matrixio.h>
+#include <mpiglue.h>
+#include <mpi_utils.h>
+#include <maxwell.h>
+
+#include <ctl-io.h>
+#include <ctlgeom.h>
+
+#include "mpb.h"
+
+/**************************************************************************/
+
+#define SIGNATURE_LEN 8
+
+static struct {
+     int nk, nalloc, num_bands;
+     real *k; /* 3 x nk k-points (reciprocal basis) */
+     real *freqs; /* nk x num_bands frequencies */
+     int fields_index; /* index of the k-point whose H is saved, or -1 */
+     time_t fields_time; /* when H was last saved */
+} ckpt = { 0, 0, 0, NULL, NULL, -1, 0 };
+
+static void checkpoint_reset(void)
+{
+     free(ckpt.k);
+     free(ckpt.freqs);
+     ckpt.k = ckpt.freqs = NULL;
+     ckpt.nk = ckpt.nalloc = 0;
+     ckpt.num_bands = num_bands;
+     ckpt.fields_index = -1;
+     ckpt.fields_time = time(NULL);
+}
+
+/* A checksum of the dielectric function eps_inv (or mu_inv), weighted
+   by position so that it changes if the structure is shifted. */
+static double medium_checksum(const symmetric_matrix *m_inv)
+{
+     int i, N, offset;
+     double sum = 0;
+
+     if (!m_inv)
+	  return 0;
+     N = mdata->fft_output_size;
+#ifdef HAVE_MPI
+     offset = mdata->local_y_start * mdata->nx * mdata->nz;
+#else
+     offset = mdata->local_x_start * mdata->ny * mdata->nz;
+#endif
+     for (i = 0; i < N; ++i)
+	  sum += (m_inv[i].m00 + m_inv[i].m11 + m_inv[i].m22)
+	       * (1.0 + ((i + offset) % 1009) * (1.0 / 1009));
+     mpi_allreduce_1(&sum, double, MPI_DOUBLE, MPI_SUM, mpb_comm);
+     return sum;
+}
+
+static void get_signature(real sig[SIGNATURE_LEN])
+{
+     sig[0] = mdata->nx;
+     sig[1] = mdata->ny;
+     sig[2] = mdata->nz;
+     sig[3] = num_bands;
+     sig[4] = tolerance;
+     sig[5] = target_freq;
+     sig[6] = medium_checksum(mdata->eps_inv);
+     sig[7] = medium_checksum(mdata->mu_inv);
+}
+
+static char *fields_fname(const char *fname)
+{
+     char *s;
+     CHK_MALLOC(s, char, strlen(fname) + 20);
+     strcpy(s, fname);
+     strcat(s, "-fields");
+     return s;
+}
+
+/* true if the HDF5 file fname (without the .h5 suffix) exists */
+int h5file_exists(const char *fname)
+{
+     int exists = 0;
+     if (mpi_is_master()) {
+	  char *s;
+	  FILE *f;
+	  CHK_MALLOC(s, char, strlen(fname) + 4);
+	  strcpy(s, fname);
+	  strcat(s, ".h5");
+	  if ((f = fopen(s, "r"))) {
+	       fclose(f);
+	       exists = 1;
+	  }
+	  free(s);
+     }
+     MPI_Bcast(&exists, 1, MPI_INT, 0, mpb_comm);
+     return exists;
+}
+
+/* rename fname-tmp.h5 to fname.h5, once all processes are done with it */
+static void commit_tmp_file(const char *fname)
+{
+     MPI_Barrier(mpb_comm);
+     if (mpi_is_master()) {
+	  char *tmp, *s;
+	  CHK_MALLOC(tmp, char, strlen(fname) + 10);
+	  CHK_MALLOC(s, char, strlen(fname) + 10);
+	  strcpy(tmp, fname); strcat(tmp, "-tmp.h5");
+	  strcpy(s, fname); strcat(s, ".h5");
+	  CHECK(!rename(tmp, s), "error renaming checkpoint file");
+	  free(s);
+	  free(tmp);
+     }
+     MPI_Barrier(mpb_comm);
+}
+
+/**************************************************************************/
+
+/* Look for a checkpoint fname from a previous run of the same problem,
+   returning the number of k-points at the start of the kpoints list
+   that were already computed.  If the saved fields are for one of these
+   k-points, they are loaded into H as a starting guess.  Should be
+   called after init-params. */
+integer checkpoint_resume(string fname, vector3_list kpoints)
+{
+     matrixio_id file_id;
+     real sig[SIGNATURE_LEN], *sig0, *fi, *k, *f;
+     int rank, dims[2], ndone = 0, i, nk;
+     char *par;
+
+     CHECK(mdata, "init-params must be called before checkpoint-resume");
+     checkpoint_reset();
+     get_signature(sig);
+
+     if (!h5file_exists(fname))
+	  return 0;
+
+     file_id = matrixio_open_serial(fname, 1);
+     sig0 = matrixio_read_data_attr(file_id, "signature", &rank, 1, dims);
+     par = matrixio_read_string_attr(file_id, "parity");
+     if (!sig0 || dims[0] != SIGNATURE_LEN
+	 || strcmp(par ? par : "", parity_string(mdata)))
+	  goto mismatch;
+     for (i = 0; i < SIGNATURE_LEN; ++i)
+	  if (fabs(sig[i] - sig0[i]) > 1e-10 * (fabs(sig[i]) + fabs(sig0[i])))
+	       goto mismatch;
+
+     rank = 2;
+     k = matrixio_read_real_data(file_id, "kpoints", &rank, dims, 0,0,0, NULL);
+     nk = k ? dims[0] : 0;
+     rank = 2;
+     f = matrixio_read_real_data(file_id, "freqs", &rank, dims, 0,0,0, NULL);
+     CHECK(!nk || (f && dims[0] == nk && dims[1] == num_bands),
+	   "corrupt checkpoint file");
+     fi = matrixio_read_data_attr(file_id, "fields-kpoint", &rank, 0, dims);
+     matrixio_close(file_id);
+
+     while (ndone < nk && ndone < kpoints.num_items
+	    && fabs(k[3*ndone+0] - kpoints.items[ndone].x) < 1e-10
+	    && fabs(k[3*ndone+1] - kpoints.items[ndone].y) < 1e-10
+	    && fabs(k[3*ndone+2] - kpoints.items[ndone].z) < 1e-10)
+	  ++ndone;
+
+     ckpt.nk = ckpt.nalloc = ndone;
+     ckpt.k = k;
+     ckpt.freqs = f;
+     if (fi && *fi >= 0 && *fi < ndone) {
+	  char *s = fields_fname(fname);
+	  if (h5file_exists(s)) {
+	       mpi_one_printf("Loading checkpoint fields for k-point %d...\n",
+			      (int) *fi + 1);
+	       load_evectmatrix(s, H, 0);
+	       curfield_reset();
+	       ckpt.fields_index = *fi;
+	  }
+	  free(s);
+     }
+     free(fi);
+     mpi_one_printf("Resuming from checkpoint %s.h5: %d of %d k-points "
+		    "already computed.\n", fname, ndone, kpoints.num_items);
+     free(sig0);
+     free(par);
+     return ndone;
+
+ mismatch:
+     matrixio_close(file_id);
+     mpi_one_printf("Ignoring checkpoint %s.h5 from a different "
+		    "calculation.\n", fname);
+     free(sig0);
+     free(par);
+     return 0;
+}
+
+/* Output the i-th checkpointed k-point (0 <= i < checkpoint-resume
+   result) as if it had just been computed by solve-kpoint, except that
+   the fields are not available. */
+void checkpoint_restore_kpoint(integer i)
+{
+     int b;
+
+     CHECK(i >= 0 && i < ckpt.nk, "invalid checkpoint k-point index");
+
+     if (!kpoint_index && mpi_is_master()) {
+	  printf("%sfreqs:, k index, k1, k2, k3, kmag/2pi",
+		 parity_string(mdata));
+	  for (b = 0; b < num_bands; ++b)
+	       printf(", %s%sband %d",
+		      parity_string(mdata),
+		      mdata->parity == NO_PARITY ? "" : " ",
+		      b + 1);
+	  printf("\n");
+     }
+
+     cur_kvector.x = ckpt.k[3*i+0];
+     cur_kvector.y = ckpt.k[3*i+1];
+     cur_kvector.z = ckpt.k[3*i+2];
+     curfield_reset();
+
+     if (num_write_output_vars > 0)
+	  destroy_output_vars();
+     CHK_MALLOC(parity, char, strlen(parity_string(mdata)) + 1);
+     parity = strcpy(parity, parity_string(mdata));
+     iterations = 0;
+     freqs.num_items = num_bands;
+     CHK_MALLOC(freqs.items, number, freqs.num_items);
+
+     set_kpoint_index(kpoint_index + 1);
+
+     mpi_one_printf("%sfreqs:, %d, %g, %g, %g, %g", parity, kpoint_index,
+		    cur_kvector.x, cur_kvector.y, cur_kvector.z,
+		    vector3_norm(matrix3x3_vector3_mult(Gm, cur_kvector)));
+     for (b = 0; b < num_bands; ++b) {
+	  freqs.items[b] = ckpt.freqs[i * num_bands + b];
+	  mpi_one_printf(", %g", freqs.items[b]);
+     }
+     mpi_one_printf("\n");
+}
+
+/* Append the k-point just computed by solve-kpoint to the checkpoint
+   fname, also saving the fields if it has been at least
+   fields_interval seconds since they were last saved (never, if
+   fields_interval < 0). */
+void checkpoint_kpoint(string fname, number fields_interval)
+{
+     int b, save_fields = 0;
+
+     CHECK(mdata, "init-params must be called before checkpoint-kpoint");
+     if (ckpt.num_bands != num_bands)
+	  checkpoint_reset();
+
+     if (ckpt.nk == ckpt.nalloc) {
+	  ckpt.nalloc = ckpt.nalloc * 2 + 16;
+	  ckpt.k = (real *) realloc(ckpt.k, sizeof(real) * 3 * ckpt.nalloc);
+	  ckpt.freqs = (real *) realloc(ckpt.freqs, sizeof(real)
+					* num_bands * ckpt.nalloc);
+	  CHECK(ckpt.k && ckpt.freqs, "out of memory!");
+     }
+     ckpt.k[3*ckpt.nk+0] = cur_kvector.x;
+     ckpt.k[3*ckpt.nk+1] = cur_kvector.y;
+     ckpt.k[3*ckpt.nk+2] = cur_kvector.z;
+     for (b = 0; b < num_bands; ++b)
+	  ckpt.freqs[ckpt.nk * num_bands + b] = freqs.items[b];
+     ckpt.nk++;
+
+     /* decide on the master, since the fields output is collective */
+     if (mpi_is_master())
+	  save_fields = fields_interval >= 0 &&
+	       difftime(time(NULL), ckpt.fields_time) >= fields_interval;
+     MPI_Bcast(&save_fields, 1, MPI_INT, 0, mpb_comm);
+     if (save_fields) {
+	  char *s = fields_fname(fname), *tmp;
+	  CHK_MALLOC(tmp, char, strlen(s) + 10);
+	  strcpy(tmp, s); strcat(tmp, "-tmp");
+	  save_evectmatrix(tmp, H, 1, 0); /* always full precision */
+	  commit_tmp_file(s);
+	  free(tmp);
+	  free(s);
+	  ckpt.fields_index = ckpt.nk - 1;
+	  ckpt.fields_time = time(NULL);
+     }
+
+     if (mpi_is_master()) {
+	  matrixio_id file_id, data_id;
+	  real sig[SIGNATURE_LEN];
+	  real fi = ckpt.fields_index;
+	  int dims[2], start[2] = {0,0}, sigdims = SIGNATURE_LEN;
+	  char *tmp;
+
+	  CHK_MALLOC(tmp, char, strlen(fname) + 10);
+	  strcpy(tmp, fname); strcat(tmp, "-tmp");
+	  file_id = matrixio_create_serial(tmp);
+	  free(tmp);
+
+	  dims[0] = ckpt.nk; dims[1] = 3;
+	  data_id = matrixio_create_dataset(file_id, "kpoints", NULL, 2, dims);
+	  matrixio_write_real_data(data_id, dims, start, 1, ckpt.k);
+	  matrixio_close_dataset(data_id);
+	  dims[1] = num_bands;
+	  data_id = matrixio_create_dataset(file_id, "freqs", NULL, 2, dims);
+	  matrixio_write_real_data(data_id, dims, start, 1, ckpt.freqs);
+	  matrixio_close_dataset(data_id);
+
+	  get_signature(sig);
+	  matrixio_write_data_attr(file_id, "signature", sig, 1, &sigdims);
+	  matrixio_write_data_attr(file_id, "fields-kpoint", &fi, 0, &sigdims);
+	  matrixio_write_string_attr(file_id, "parity", parity_string(mdata));
+	  matrixio_close(file_id);
+     }
+     else { /* get_signature is collective */
+	  real sig[SIGNATURE_LEN];
+	  get_signature(sig);
+     }
+     commit_tmp_file(fname);
+}
+
+/* Delete the checkpoint fname (and its fields), e.g. at the end of a
+   successful run. */
+void checkpoint_remove(string fname)
+{
+     checkpoint_reset();
+     if (mpi_is_master()) {
+	  char *s, *f = fields_fname(fname);
+	  CHK_MALLOC(s, char, strlen(f) + 4);
+	  strcpy(s, f); strcat(s, ".h5");
+	  remove(s);
+	  strcpy(s, fname); strcat(s, ".h5");
+	  remove(s);
+	  free(s);
+	  free(f);
+     }
+}
@@ -0,0 +1,661 @@
+/* Copyright (C) 1999-2014 Massachusetts Institute of Technology.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Density of states (DOS) computation by linear tetrahedron
+   integration over a regular k-point mesh.  The mesh is reduced to
+   the irreducible Brillouin zone using the point operations of the
+   lattice that also leave the dielectric structure invariant (plus
+   time-reversal symmetry, which always holds), and the irreducible
+   k-points are ordered along a Hilbert curve so that each solve-kpoint
+   gets a good starting guess from the previous one.
+
+   The intended use (see run-dos in mpb.scm) is:
+
+      (dos-kpoints mesh kshift? symmetry?)
+                                  -- after init-params, returns the
+                                     irreducible k-points to solve
+      (dos-store-kpoint velocity?) -- after each solve-kpoint
+      (dos-compute ...)            -- integrate, output, return DOS
+
+   If the group velocities are stored, the integration can use them
+   to linearly extrapolate each band over the mesh cell surrounding
+   each k-point (rather than interpolating between neighboring
+   k-points), which avoids the spurious features that band crossings
+   otherwise cause in the tetrahedron method. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "config.h"
+#include <check.h>
+#include <matrixio.h>
+#include <mpiglue.h>
+#include <mpi_utils.h>
+#include <maxwell.h>
+
+#include <ctl-io.h>
+#include <ctlgeom.h>
+
+#include "mpb.h"
+
+/**************************************************************************/
+
+typedef int symop[3][3]; /* point operation in the lattice basis */
+
+typedef struct {
+     int n[3]; /* mesh size */
+     int s2[3]; /* twice the mesh offset, in units of the mesh spacing */
+     int nops; /* number of k-space symmetry operations */
+     symop *W; /* the operations, acting on real-space coordinates */
+     int nk; /* number of irreducible k-points */
+     int *kmesh; /* 3*nk mesh coordinates of the irreducible k-points */
+     int *rep, *op; /* irreducible k-point and operation for each mesh pt */
+     int num_bands;
+     real *freqs; /* nk x num_bands frequencies, once solved */
+     real *vel; /* nk x num_bands x 3 d(freq)/dk in the reciprocal basis */
+     int *solved;
+} dos_mesh;
+
+static dos_mesh dos = { {0,0,0}, {0,0,0}, 0, NULL, 0, NULL, NULL, NULL,
+			0, NULL, NULL, NULL };
+
+static void dos_reset(void)
+{
+     free(dos.W); free(dos.kmesh); free(dos.rep); free(dos.op);
+     free(dos.freqs); free(dos.vel); free(dos.solved);
+     memset(&dos, 0, sizeof(dos_mesh));
+}
+
+/**************************************************************************/
+
+/* Find all integer matrices W (in the lattice basis, with entries
+   -1/0/1) that preserve the metric of the lattice vectors Rm, storing
+   them in W and returning the number found (at most 48). */
+static int lattice_point_ops(symop *W)
+{
+     double g[3][3], gmax = 0;
+     vector3 r[3];
+     int code, nops = 0;
+
+     r[0] = Rm.c0; r[1] = Rm.c1; r[2] = Rm.c2;
+     for (code = 0; code < 3; ++code) {
+	  int j;
+	  for (j = 0; j < 3; ++j)
+	       g[code][j] = vector3_dot(r[code], r[j]);
+	  gmax = MAX2(gmax, g[code][code]);
+     }
+
+     for (code = 0; code < 19683; ++code) { /* 3^9 candidate matrices */
+	  int w[3][3], i, j, k, l, c = code, ok = 1;
+	  for (i = 0; i < 3; ++i)
+	       for (j = 0; j < 3; ++j) {
+		    w[i][j] = c % 3 - 1;
+		    c /= 3;
+	       }
+	  if (abs(w[0][0] * (w[1][1]*w[2][2] - w[1][2]*w[2][1])
+		  - w[0][1] * (w[1][0]*w[2][2] - w[1][2]*w[2][0])
+		  + w[0][2] * (w[1][0]*w[2][1] - w[1][1]*w[2][0])) != 1)
+	       continue;
+	  /* check W^T g W == g */
+	  for (i = 0; i < 3 && ok; ++i)
+	       for (j = 0; j < 3 && ok; ++j) {
+		    double gij = 0;
+		    for (k = 0; k < 3; ++k)
+			 for (l = 0; l < 3; ++l)
+			      gij += w[k][i] * g[k][l] * w[l][j];
+		    ok = fabs(gij - g[i][j]) <= 1e-8 * gmax;
+	       }
+	  if (ok) {
+	       CHECK(nops < 48, "too many lattice point operations");
+	       memcpy(W[nops++], w, sizeof(w));
+	  }
+     }
+     return nops;
+}
+
+/* Compute the action of the real-space operation W on the reciprocal
+   lattice coordinates, M = (W^-1)^T = adj(W)^T / det(W). */
+static void kspace_op(int M[3][3], int W[3][3])
+{
+     int i, j, det;
+     for (i = 0; i < 3; ++i)
+	  for (j = 0; j < 3; ++j)
+	       M[i][j] = W[(i+1)%3][(j+1)%3] * W[(i+2)%3][(j+2)%3]
+		    - W[(i+1)%3][(j+2)%3] * W[(i+2)%3][(j+1)%3];
+     det = W[0][0]*M[0][0] + W[0][1]*M[0][1] + W[0][2]*M[0][2];
+     for (i = 0; i < 3; ++i)
+	  for (j = 0; j < 3; ++j)
+	       M[i][j] *= det;
+}
+
+/* Map the mesh point m through the k-space operation M, returning 0
+   (and leaving m2 undefined) if the image is not on the mesh.  A mesh
+   point m corresponds to k = (m + s2/2) / n. */
+static int mesh_image(int m2[3], int M[3][3], const int m[3])
+{
+     int i, j;
+     for (i = 0; i < 3; ++i) {
+	  /* 2 n_i k'_i - s2_i, computed exactly in integers */
+	  long num = 0, den = 1, t;
+	  for (j = 0; j < 3; ++j) {
+	       num = num * dos.n[j] + den * M[i][j] * (2*m[j] + dos.s2[j]);
+	       den *= dos.n[j];
+	  }
+	  /* now 2 k'_i = num / den */
+	  num *= dos.n[i];
+	  if (num % den)
+	       return 0;
+	  t = num / den - dos.s2[i];
+	  if (t % 2)
+	       return 0;
+	  t /= 2;
+	  m2[i] = (int) (((t % dos.n[i]) + dos.n[i]) % dos.n[i]);
+     }
+     return 1;
+}
+
+#define MESH_INDEX(m) (((m)[0] * dos.n[1] + (m)[1]) * dos.n[2] + (m)[2])
+
+/* Return the index along a 3d Hilbert curve of the point x, whose
+   coordinates are < 2^b, using J. Skilling's algorithm (AIP Conf. Proc.
+   707, 381, 2004). */
+static unsigned long hilbert_index(const int xin[3], int b)
+{
+     unsigned int x[3], M = 1U << (b - 1), P, Q, t;
+     unsigned long h = 0;
+     int i, j;
+
+     for (i = 0; i < 3; ++i)
+	  x[i] = xin[i];
+     for (Q = M; Q > 1; Q >>= 1) {
+	  P = Q - 1;
+	  for (i = 0; i < 3; ++i)
+	       if (x[i] & Q)
+		    x[0] ^= P;
+	       else {
+		    t = (x[0] ^ x[i]) & P;
+		    x[0] ^= t;
+		    x[i] ^= t;
+	       }
+     }
+     for (i = 1; i < 3; ++i)
+	  x[i] ^= x[i-1];
+     t = 0;
+     for (Q = M; Q > 1; Q >>= 1)
+	  if (x[2] & Q)
+	       t ^= Q - 1;
+     for (i = 0; i < 3; ++i)
+	  x[i] ^= t;
+     for (j = b - 1; j >= 0; --j)
+	  for (i = 0; i < 3; ++i)
+	       h = (h << 1) | ((x[i] >> j) & 1);
+     return h;
+}
+
+typedef struct {
+     unsigned long key;
+     int ik;
+} hilbert_sort_data;
+
+static int hilbert_cmp(const void *a, const void *b)
+{
+     unsigned long ka = ((const hilbert_sort_data *) a)->key;
+     unsigned long kb = ((const hilbert_sort_data *) b)->key;
+     return ka < kb ? -1 : (ka > kb ? 1 : 0);
+}
+
+static vector3 mesh_kpoint(const int m[3])
+{
+     real k[3];
+     vector3 kv;
+     int i;
+     for (i = 0; i < 3; ++i) {
+	  k[i] = (m[i] + 0.5 * dos.s2[i]) / dos.n[i];
+	  if (k[i] > 0.5)
+	       k[i] -= 1.0;
+     }
+     kv.x = k[0]; kv.y = k[1]; kv.z = k[2];
+     return kv;
+}
+
+/**************************************************************************/
+
+/* Set up an n1 x n2 x n3 k-point mesh (rounding the components of
+   mesh to integers, and ignoring dimensions beyond the dimensionality
+   of the computation), offset by half a mesh spacing if kshiftp
+   (a Monkhorst-Pack mesh), and return the list of irreducible
+   k-points (in the reciprocal lattice basis) to be solved, in the
+   order they should be solved.  If !symmetryp, the mesh is not
+   reduced, and all of its points are returned.  init-params must be
+   called first. */
+vector3_list dos_kpoints(vector3 mesh, boolean kshiftp, boolean symmetryp)
+{
+     symop Wlat[48], M[48];
+     int keep[48], nlat, i, j, N, b, ik, iid = -1;
+     vector3_list klist;
+     hilbert_sort_data *order;
+     int *newik;
+
+     CHECK(mdata, "init-params must be called before dos-kpoints");
+     dos_reset();
+
+     dos.n[0] = MAX2(1, (int) floor(mesh.x + 0.5));
+     dos.n[1] = dimensions > 1 ? MAX2(1, (int) floor(mesh.y + 0.5)) : 1;
+     dos.n[2] = dimensions > 2 ? MAX2(1, (int) floor(mesh.z + 0.5)) : 1;
+     for (i = 0; i < 3; ++i)
+	  dos.s2[i] = kshiftp && dos.n[i] > 1;
+     N = dos.n[0] * dos.n[1] * dos.n[2];
+
+     /* k-space symmetries: lattice operations W that, possibly combined
+	with time reversal (k -> -k), leave the structure invariant */
+     nlat = lattice_point_ops(Wlat);
+     if (symmetryp)
+	  check_medium_symmetries(nlat, Wlat, keep);
+     CHK_MALLOC(dos.W, symop, nlat);
+     for (i = 0; i < nlat; ++i) {
+	  int negkeep = 0, Wneg[3][3], m[3] = {0,0,0}, m2[3], ok, isid;
+	  isid = Wlat[i][0][0] == 1 && Wlat[i][1][1] == 1
+	       && Wlat[i][2][2] == 1 && Wlat[i][0][1] == 0
+	       && Wlat[i][0][2] == 0 && Wlat[i][1][0] == 0
+	       && Wlat[i][1][2] == 0 && Wlat[i][2][0] == 0
+	       && Wlat[i][2][1] == 0;
+	  if (symmetryp) {
+	       for (j = 0; j < 9; ++j)
+		    Wneg[j/3][j%3] = -Wlat[i][j/3][j%3];
+	       for (j = 0; j < nlat; ++j)
+		    if (!memcmp(Wneg, Wlat[j], sizeof(Wneg)))
+			 negkeep = keep[j];
+	  }
+	  if (symmetryp ? !keep[i] && !negkeep : !isid)
+	       continue; /* without symmetry, only the identity is kept */
+	  /* the operation must also map the mesh to itself; since the
+	     mapping is affine, it suffices to check four points */
+	  kspace_op(M[dos.nops], Wlat[i]);
+	  ok = mesh_image(m2, M[dos.nops], m);
+	  for (j = 0; j < 3 && ok; ++j) {
+	       m[j] = 1;
+	       ok = mesh_image(m2, M[dos.nops], m);
+	       m[j] = 0;
+	  }
+	  if (!ok)
+	       continue;
+	  if (isid)
+	       iid = dos.nops;
+	  memcpy(dos.W[dos.nops++], Wlat[i], sizeof(Wlat[i]));
+     }
+     CHECK(iid >= 0, "bug: identity is not a symmetry operation");
+
+     /* reduce the mesh to the irreducible k-points */
+     CHK_MALLOC(dos.rep, int, N);
+     CHK_MALLOC(dos.op, int, N);
+     CHK_MALLOC(dos.kmesh, int, 3 * N);
+     for (i = 0; i < N; ++i)
+	  dos.rep[i] = -1;
+     for (i = 0; i < N; ++i)
+	  if (dos.rep[i] < 0) {
+	       int m[3], m2[3], o;
+	       m[0] = i / (dos.n[1] * dos.n[2]);
+	       m[1] = (i / dos.n[2]) % dos.n[1];
+	       m[2] = i % dos.n[2];
+	       dos.rep[i] = dos.nk;
+	       dos.op[i] = iid;
+	       for (o = 0; o < dos.nops; ++o)
+		    if (mesh_image(m2, M[o], m) && dos.rep[MESH_INDEX(m2)] < 0) {
+			 dos.rep[MESH_INDEX(m2)] = dos.nk;
+			 dos.op[MESH_INDEX(m2)] = o;
+		    }
+	       for (j = 0; j < 3; ++j)
+		    dos.kmesh[3*dos.nk + j] = m[j];
+	       ++dos.nk;
+	  }
+
+     /* order the irreducible k-points along a Hilbert curve */
+     for (b = 1; (1 << b) < MAX2(dos.n[0], MAX2(dos.n[1], dos.n[2])); ++b)
+	  ;
+     CHK_MALLOC(order, hilbert_sort_data, dos.nk);
+     CHK_MALLOC(newik, int, dos.nk);
+     for (ik = 0; ik < dos.nk; ++ik) {
+	  order[ik].key = hilbert_index(dos.kmesh + 3*ik, b);
+	  order[ik].ik = ik;
+     }
+     qsort(order, dos.nk, sizeof(hilbert_sort_data), hilbert_cmp);
+     {
+	  int *kmesh;
+	  CHK_MALLOC(kmesh, int, 3 * dos.nk);
+	  for (ik = 0; ik < dos.nk; ++ik) {
+	       newik[order[ik].ik] = ik;
+	       for (j = 0; j < 3; ++j)
+		    kmesh[3*ik + j] = dos.kmesh[3*order[ik].ik + j];
+	  }
+	  free(dos.kmesh);
+	  dos.kmesh = kmesh;
+     }
+     for (i = 0; i < N; ++i)
+	  dos.rep[i] = newik[dos.rep[i]];
+     free(newik);
+     free(order);
+
+     mpi_one_printf("DOS k-point mesh is %d x %d x %d%s: %d symmetry "
+		    "operations, %d of %d k-points are irreducible.\n",
+		    dos.n[0], dos.n[1], dos.n[2],
+		    kshiftp ? " (shifted)" : "",
+		    dos.nops, dos.nk, N);
+
+     klist.num_items = dos.nk;
+     CHK_MALLOC(klist.items, vector3, dos.nk);
+     for (ik = 0; ik < dos.nk; ++ik)
+	  klist.items[ik] = mesh_kpoint(dos.kmesh + 3*ik);
+
+     CHK_MALLOC(dos.solved, int, dos.nk);
+     for (ik = 0; ik < dos.nk; ++ik)
+	  dos.solved[ik] = 0;
+
+     return klist;
+}
+
+/* Store the frequencies (and, if velocityp, the group velocities)
+   of the k-point just solved, which should be the (kpoint-index)-th
+   point returned by dos-kpoints. */
+void dos_store_kpoint(boolean velocityp)
+{
+     int ik = kpoint_index - 1, b;
+     vector3 k;
+
+     CHECK(dos.nk > 0, "dos-kpoints must be called before dos-store-kpoint");
+     CHECK(ik >= 0 && ik < dos.nk, "k-point index is outside the DOS mesh");
+     k = mesh_kpoint(dos.kmesh + 3*ik);
+     CHECK(vector3_norm(vector3_minus(k, cur_kvector)) < 1e-8,
+	   "k-point does not match the DOS mesh");
+
+     if (!dos.freqs) {
+	  dos.num_bands = num_bands;
+	  CHK_MALLOC(dos.freqs, real, dos.nk * num_bands);
+     }
+     CHECK(dos.num_bands == num_bands, "num-bands changed during DOS run");
+     for (b = 0; b < num_bands; ++b)
+	  dos.freqs[ik * num_bands + b] = freqs.items[b];
+
+     if (velocityp) {
+	  int j;
+	  if (!dos.vel)
+	       CHK_MALLOC(dos.vel, real, dos.nk * num_bands * 3);
+	  for (j = 0; j < 3; ++j) {
+	       vector3 d = {0,0,0};
+	       number_list v;
+	       double Gnorm;
+
+	       if (dos.n[j] == 1) { /* no dispersion needed along j */
+		    for (b = 0; b < num_bands; ++b)
+			 dos.vel[(ik * num_bands + b) * 3 + j] = 0;
+		    continue;
+	       }
+	       if (j == 0) d.x = 1; else if (j == 1) d.y = 1; else d.z = 1;
+	       Gnorm = vector3_norm(matrix3x3_vector3_mult(Gm, d));
+
+	       /* d(freq)/dk_j = |G_j| * (group velocity along G_j) */
+	       v = compute_group_velocity_component(d);
+	       for (b = 0; b < num_bands; ++b)
+		    dos.vel[(ik * num_bands + b) * 3 + j] = Gnorm * v.items[b];
+	       free(v.items);
+	  }
+     }
+
+     dos.solved[ik] = 1;
+}
+
+/**************************************************************************/
+
+static double sqr(double x) { return x * x; }
+
+/* Return the fraction of the volume of a simplex (a segment, triangle,
+   or tetrahedron for dim = 1, 2, 3) in which the linear function with
+   the (sorted) vertex values e[0..dim] is < E.  For dim == 3, this is
+   the usual formula of the linear tetrahedron method (see P. E. Bloechl
+   et al., Phys. Rev. B 49, 16223, 1994). */
+static double simplex_fraction(int dim, const double *e, double E)
+{
+     if (E <= e[0])
+	  return 0.0;
+     if (E >= e[dim])
+	  return 1.0;
+     switch (dim) {
+	 case 1:
+	      return (E - e[0]) / (e[1] - e[0]);
+	 case 2:
+	      if (E < e[1])
+		   return sqr(E - e[0]) / ((e[1] - e[0]) * (e[2] - e[0]));
+	      return 1.0 - sqr(e[2] - E) / ((e[2] - e[0]) * (e[2] - e[1]));
+	 default:
+	      if (E < e[1])
+		   return sqr(E - e[0]) * (E - e[0])
+			/ ((e[1] - e[0]) * (e[2] - e[0]) * (e[3] - e[0]));
+	      if (E < e[2]) {
+		   double e10 = e[1] - e[0], x = E - e[1];
+		   return (sqr(e10) + 3 * e10 * x + 3 * sqr(x)
+			   - (e[2] - e[0] + e[3] - e[1])
+			   / ((e[2] - e[1]) * (e[3] - e[1])) * sqr(x) * x)
+			/ ((e[2] - e[0]) * (e[3] - e[0]));
+	      }
+	      return 1.0 - sqr(e[3] - E) * (e[3] - E)
+		   / ((e[3] - e[0]) * (e[3] - e[1]) * (e[3] - e[2]));
+     }
+}
+
+/* Add the contribution of one simplex, with weight w and unsorted
+   vertex values e[0..dim], to the integrated DOS sampled at the ne
+   energies E0 + i*dE.  Energies above the simplex are accounted for by
+   adding w to step[i], to be accumulated afterwards. */
+static void add_simplex(int dim, double *e, double w,
+			double E0, double dE, int ne,
+			double *idos, double *step)
+{
+     int i, j, ilo, ihi;
+     for (i = 1; i <= dim; ++i) { /* insertion sort */
+	  double x = e[i];
+	  for (j = i; j > 0 && e[j-1] > x; --j)
+	       e[j] = e[j-1];
+	  e[j] = x;
+     }
+     ilo = (int) ceil((e[0] - E0) / dE);
+     ihi = (int) ceil((e[dim] - E0) / dE);
+     ilo = MAX2(0, MIN2(ne, ilo));
+     ihi = MAX2(0, MIN2(ne, ihi));
+     for (i = ilo; i < ihi; ++i)
+	  idos[i] += w * simplex_fraction(dim, e, E0 + i * dE);
+     step[ihi] += w;
+}
+
+/* Integrate the DOS from the stored frequencies, at num_freq points
+   from freq_min to freq_max, returning the DOS (per unit frequency,
+   normalized to num-bands states per unit cell) and outputting it
+   along with the integrated DOS (IDOS) to a file prefix + "dos.h5".
+   Each mesh cell is split into simplices along its shortest diagonal.
+   If velocityp, the cells are centered on the k-points and each band
+   is linearly extrapolated from the k-point using the group velocity;
+   otherwise, the cells are between k-points and the (sorted) bands
+   are linearly interpolated. */
+number_list dos_compute(number freq_min, number freq_max, integer num_freq,
+			boolean velocityp, string prefix)
+{
+     int dim = 0, axes[3], nsimp, simp[6][4], ncorners;
+     int i, j, b, N, ne, flip = 0;
+     double df, E0, dE, w, *idos, *step;
+     number_list dos_list = { 0, 0 };
+
+     CHECK(dos.nk > 0, "dos-kpoints must be called before dos-compute");
+     for (i = 0; i < dos.nk; ++i)
+	  CHECK(dos.solved[i], "not all DOS k-points have been solved");
+     CHECK(!velocityp || dos.vel,
+	   "group velocities were not stored for the DOS k-points");
+     CHECK(num_freq >= 2 && freq_max > freq_min, "invalid DOS frequency range");
+
+     for (i = 0; i < 3; ++i)
+	  if (dos.n[i] > 1)
+	       axes[dim++] = i;
+     CHECK(dim > 0, "DOS mesh must have more than one k-point");
+     ncorners = 1 << dim;
+
+     /* find the shortest cell diagonal, from corner flip to ~flip */
+     {
+	  double dmin = HUGE_VAL;
+	  int f;
+	  for (f = 0; f < (dim == 1 ? 1 : (dim == 2 ? 2 : 4)); ++f) {
+	       int fmask = f ? 1 << (f - 1) : 0;
+	       vector3 d = {0,0,0};
+	       real dk[3] = {0,0,0};
+	       double len;
+	       for (j = 0; j < dim; ++j)
+		    dk[axes[j]] = ((fmask >> j) & 1 ? -1.0 : 1.0) / dos.n[axes[j]];
+	       d.x = dk[0]; d.y = dk[1]; d.z = dk[2];
+	       len = vector3_norm(matrix3x3_vector3_mult(Gm, d));
+	       if (len < dmin) {
+		    dmin = len;
+		    flip = fmask;
+	       }
+	  }
+     }
+
+     /* simplices (as corner bitmasks): one for each permutation of
+	the axes, walking from corner flip along the diagonal */
+     {
+	  static const int perms[6][3] = {{0,1,2},{0,2,1},{1,0,2},
+					  {1,2,0},{2,0,1},{2,1,0}};
+	  int p;
+	  nsimp = 0;
+	  for (p = 0; p < 6; ++p) {
+	       int ok = 1, c = 0;
+	       /* for dim < 3, permute only the first dim axes */
+	       for (j = 0; j < 3; ++j)
+		    ok = ok && (j < dim ? perms[p][j] < dim : perms[p][j] == j);
+	       if (!ok)
+		    continue;
+	       simp[nsimp][0] = flip;
+	       for (j = 0; j < dim; ++j) {
+		    c |= 1 << perms[p][j];
+		    simp[nsimp][j+1] = c ^ flip;
+	       }
+	       ++nsimp;
+	  }
+     }
+
+     N = dos.n[0] * dos.n[1] * dos.n[2];
+     w = 1.0 / (N * nsimp);
+     df = (freq_max - freq_min) / (num_freq - 1);
+     E0 = freq_min - 0.5 * df;
+     dE = 0.5 * df;
+     ne = 2 * num_freq + 1; /* bin edges and centers */
+     CHK_MALLOC(idos, double, ne);
+     CHK_MALLOC(step, double, ne + 1);
+     for (i = 0; i < ne; ++i)
+	  idos[i] = step[i] = 0;
+     step[ne] = 0;
+
+     for (i = 0; i < N; ++i) {
+	  int m[3], c, s;
+	  double vals[8], e[4];
+	  m[0] = i / (dos.n[1] * dos.n[2]);
+	  m[1] = (i / dos.n[2]) % dos.n[1];
+	  m[2] = i % dos.n[2];
+	  for (b = 0; b < dos.num_bands; ++b) {
+	       if (velocityp) {
+		    /* linear extrapolation from the k-point at the center,
+		       transforming the gradient from the irreducible point
+		       by g -> W g */
+		    int ik = dos.rep[i], (*W)[3] = dos.W[dos.op[i]];
+		    const real *g0 = dos.vel + (ik * dos.num_bands + b) * 3;
+		    double g[3];
+		    for (j = 0; j < 3; ++j)
+			 g[j] = W[j][0]*g0[0] + W[j][1]*g0[1] + W[j][2]*g0[2];
+		    for (c = 0; c < ncorners; ++c) {
+			 vals[c] = dos.freqs[ik * dos.num_bands + b];
+			 for (j = 0; j < dim; ++j)
+			      vals[c] += g[axes[j]] * (((c >> j) & 1) - 0.5)
+				   / dos.n[axes[j]];
+		    }
+	       }
+	       else
+		    for (c = 0; c < ncorners; ++c) {
+			 int mc[3];
+			 mc[0] = m[0]; mc[1] = m[1]; mc[2] = m[2];
+			 for (j = 0; j < dim; ++j)
+			      mc[axes[j]] = (mc[axes[j]] + ((c >> j) & 1))
+				   % dos.n[axes[j]];
+			 vals[c] = dos.freqs[dos.rep[MESH_INDEX(mc)]
+					     * dos.num_bands + b];
+		    }
+	       for (s = 0; s < nsimp; ++s) {
+		    for (j = 0; j <= dim; ++j)
+			 e[j] = vals[simp[s][j]];
+		    add_simplex(dim, e, w, E0, dE, ne, idos, step);
+	       }
+	  }
+     }
+     {
+	  double cumstep = 0;
+	  for (i = 0; i < ne; ++i) {
+	       cumstep += step[i];
+	       idos[i] += cumstep;
+	  }
+     }
+
+     dos_list.num_items = num_freq;
+     CHK_MALLOC(dos_list.items, number, num_freq);
+     for (i = 0; i < num_freq; ++i) {
+	  dos_list.items[i] = (idos[2*i + 2] - idos[2*i]) / df;
+	  mpi_one_printf("%sdos:, %g, %g, %g\n", parity,
+			 freq_min + i * df, dos_list.items[i], idos[2*i + 1]);
+     }
+
+     if (mpi_is_master()) {
+	  char *fname, description[200];
+	  matrixio_id file_id, data_id;
+	  int start = 0;
+	  real *vals;
+
+	  CHK_MALLOC(fname, char, strlen(prefix) + 20);
+	  strcpy(fname, prefix);
+	  strcat(fname, "dos");
+	  printf("Outputting DOS to %s.h5...\n", fname);
+	  file_id = matrixio_create_serial(fname);
+	  free(fname);
+
+	  CHK_MALLOC(vals, real, num_freq);
+	  for (j = 0; j < 3; ++j) {
+	       static const char *names[3] = { "freqs", "dos", "idos" };
+	       for (i = 0; i < num_freq; ++i)
+		    vals[i] = j == 0 ? freq_min + i * df
+			 : (j == 1 ? dos_list.items[i] : idos[2*i + 1]);
+	       data_id = matrixio_create_dataset(file_id, names[j], NULL,
+						 1, &num_freq);
+	       matrixio_write_real_data(data_id, &num_freq, &start, 1, vals);
+	       matrixio_close_dataset(data_id);
+	  }
+	  free(vals);
+
+	  sprintf(description, "%stetrahedron DOS, %d x %d x %d k-point mesh "
+		  "(%d irreducible)%s", parity, dos.n[0], dos.n[1], dos.n[2],
+		  dos.nk, velocityp ? ", group-velocity extrapolation" : "");
+	  matrixio_write_string_attr(file_id, "description", description);
+	  matrixio_close(file_id);
+     }
+
+     free(step);
+     free(idos);
+     return dos_list;
+}
@@ -82,35 +82,17 @@ static void material_epsilon(material_type material,
      }
 }
 
-/* Given a position r in the basis of the lattice vectors, return the
-   corresponding dielectric tensor and its inverse.  Should be
-   called from within init_params (or after init_params), so that the
-   geometry input variables will have been read in (for use in libgeom).
-
-   This function is passed to set_maxwell_dielectric to initialize
-   the dielectric tensor array for eigenvector calculations. */
-
-static void epsilon_func(symmetric_matrix *eps, symmetric_matrix *eps_inv,
-			 const real r[3], void *edata)
+/* Given the result (tp, oi) of searching the geometry tree for the
+   point p (in the lattice unit-vector basis, shifted into the unit
+   cell), corresponding to r in the basis of the lattice vectors,
+   return the dielectric tensor and its inverse at p. */
+static void epsilon_at(symmetric_matrix *eps, symmetric_matrix *eps_inv,
+		       const real r[3], vector3 p, geom_box_tree tp, int oi,
+		       medium_func_data *d)
 {
-     medium_func_data *d = (medium_func_data *) edata;
-     geom_box_tree tp;
-     int oi;
      material_type material;
-     vector3 p;
      boolean inobject;
 
-     /* p needs to be in the lattice *unit* vector basis, while r is
-	in the lattice vector basis.  Also, shift origin to the center
-        of the grid. */
-     p.x = no_size_x ? 0 : (r[0] - 0.5) * geometry_lattice.size.x;
-     p.y = no_size_y ? 0 : (r[1] - 0.5) * geometry_lattice.size.y;
-     p.z = no_size_z ? 0 : (r[2] - 0.5) * geometry_lattice.size.z;
-
-     /* call search routine from libctl/utils/libgeom/geom.c: 
-        (we have to use the lower-level geom_tree_search to
-         support material-grid types, which have funny semantics) */
-     tp = geom_tree_search(p = shift_to_unit_cell(p), geometry_tree, &oi);
      if (tp) {
 	  inobject = 1;
 	  material = tp->objects[oi].o->material;
@@ -183,6 +165,167 @@ static void epsilon_func(symmetric_matrix *eps, symmetric_matrix *eps_inv,
      }
 }
 
+/* Given a position r in the basis of the lattice vectors, return the
+   corresponding dielectric tensor and its inverse.  Should be
+   called from within init_params (or after init_params), so that the
+   geometry input variables will have been read in (for use in libgeom).
+
+   This function is passed to set_maxwell_dielectric to initialize
+   the dielectric tensor array for eigenvector calculations. */
+
+static void epsilon_func(symmetric_matrix *eps, symmetric_matrix *eps_inv,
+			 const real r[3], void *edata)
+{
+     medium_func_data *d = (medium_func_data *) edata;
+     geom_box_tree tp;
+     int oi;
+     vector3 p = lattice_point(r);
+
+     /* call search routine from libctl/utils/libgeom/geom.c: 
+        (we have to use the lower-level geom_tree_search to
+         support material-grid types, which have funny semantics) */
+     tp = geom_tree_search(p, d->tree, &oi);
+     epsilon_at(eps, eps_inv, r, p, tp, oi, d);
+}
+
+/* Return the data of the MEDIUM or MEDIUM_ANISOTROPIC material that
+   epsilon_at would use for the search result (tp, oi), or NULL if
+   epsilon there may vary with the point (material functions, material
+   grids, and the epsilon file). */
+static const void *epsilon_constant_material(geom_box_tree tp, int oi,
+					     medium_func_data *d)
+{
+     material_type m = tp ? tp->objects[oi].o->material : default_material;
+     boolean inobject = tp != NULL;
+
+     if (m.which_subclass == MATERIAL_TYPE_SELF) {
+	  m = default_material;
+	  inobject = 0;
+     }
+     if ((!inobject && d->epsilon_file_func)
+	 || variable_material(m.which_subclass))
+	  return NULL;
+     if (m.which_subclass == MEDIUM_ANISOTROPIC)
+	  return m.subclass.medium_anisotropic_data;
+     return m.subclass.medium_data;
+}
+
+/* Batched version of epsilon_func, for the mesh averages in
+   update_maxwell_dielectric (see maxwell_dielectric_batch_function).
+   The points of a batch are close together, so the tree search starts
+   from the deepest subtree common to all of them (see batch_subtree),
+   and consecutive points in the same constant material copy its
+   tensors rather than evaluating the material again. */
+static void epsilon_func_batch(symmetric_matrix *eps,
+			       symmetric_matrix *eps_inv,
+			       int n, const real *r, void *edata)
+{
+     medium_func_data *d = (medium_func_data *) edata;
+     vector3 pbuf[BATCH_STACK_POINTS], *p = pbuf;
+     const void *last = NULL;
+     geom_box_tree t;
+     int i;
+
+     if (n > BATCH_STACK_POINTS)
+	  CHK_MALLOC(p, vector3, n);
+     for (i = 0; i < n; ++i)
+	  p[i] = lattice_point(r + 3*i);
+     t = batch_subtree(d->tree, p, n);
+
+     for (i = 0; i < n; ++i) {
+	  geom_box_tree tp;
+	  const void *constant;
+	  int oi;
+	  tp = geom_tree_search(p[i], t, &oi);
+	  constant = epsilon_constant_material(tp, oi, d);
+	  if (constant && constant == last) {
+	       eps[i] = eps[i-1];
+	       eps_inv[i] = eps_inv[i-1];
+	  }
+	  else
+	       epsilon_at(eps + i, eps_inv + i, r + 3*i, p[i], tp, oi, d);
+	  last = constant;
+     }
+
+     if (p != pbuf)
+	  free(p);
+}
+
+/* Mean epsilon for a material grid covering the whole cell (see
+   material_grid_mesh_mean), giving the same result as the brute-force
+   mesh average in update_maxwell_dielectric, except that the normal
+   vector is taken from the slope of epsilon over the sub-mesh rather
+   than from its moment over a sphere.  Returns 0 if the fast path
+   is not available, in which case we fall back to the brute-force
+   average. */
+static int mean_matgrid_epsilon(symmetric_matrix *meps,
+				symmetric_matrix *meps_inv, real n[3],
+				real d1, real d2, real d3,
+				const real r[3], const material_grid *g)
+{
+     double mean, mean_inv, slope[3], c[3], len = 0;
+     real s[3];
+     int ms[3], i, j;
+
+     s[0] = d1; s[1] = d2; s[2] = d3;
+     ms[0] = MAX2(mesh_size, 1);
+     ms[1] = dimensions > 1 ? MAX2(mesh_size, 1) : 1;
+     ms[2] = dimensions > 2 ? MAX2(mesh_size, 1) : 1;
+     if (!material_grid_mesh_mean(g, r, s, ms,
+				  g->epsilon_min, g->epsilon_max,
+				  &mean, &mean_inv, slope))
+	  return 0;
+
+     /* Cartesian gradient (the G[j] are the dual basis of the R[j]) */
+     for (i = 0; i < 3; ++i) {
+	  c[i] = slope[0] * G[0][i] + slope[1] * G[1][i] + slope[2] * G[2][i];
+	  len += c[i] * c[i];
+     }
+     n[0] = n[1] = n[2] = 0;
+     if (fabs(1.0 / mean - mean_inv) > 1e-6 && len > 0) {
+	  /* normal in the lattice-vector basis, n = (R R^T)^-1 R c */
+	  for (i = 0; i < 3; ++i)
+	       for (j = 0; j < 3; ++j)
+		    n[i] += (G[i][0]*G[j][0] + G[i][1]*G[j][1]
+			     + G[i][2]*G[j][2]) * slope[j];
+	  len = 1.0 / sqrt(len);
+	  c[0] *= len; c[1] *= len; c[2] *= len;
+     }
+     else
+	  c[0] = c[1] = c[2] = 0;
+
+#ifdef KOTTKE
+     /* the tensor whose inverse is mean_inv along the normal and
+	1/mean perpendicular to it, as for the brute-force average */
+     {
+	  double a = 1.0 / mean_inv - mean, ai = mean_inv - 1.0 / mean;
+	  meps->m00 = mean + a * c[0] * c[0];
+	  meps->m11 = mean + a * c[1] * c[1];
+	  meps->m22 = mean + a * c[2] * c[2];
+	  ASSIGN_ESCALAR(meps->m01, a * c[0] * c[1], 0);
+	  ASSIGN_ESCALAR(meps->m02, a * c[0] * c[2], 0);
+	  ASSIGN_ESCALAR(meps->m12, a * c[1] * c[2], 0);
+	  meps_inv->m00 = 1.0 / mean + ai * c[0] * c[0];
+	  meps_inv->m11 = 1.0 / mean + ai * c[1] * c[1];
+	  meps_inv->m22 = 1.0 / mean + ai * c[2] * c[2];
+	  ASSIGN_ESCALAR(meps_inv->m01, ai * c[0] * c[1], 0);
+	  ASSIGN_ESCALAR(meps_inv->m02, ai * c[0] * c[2], 0);
+	  ASSIGN_ESCALAR(meps_inv->m12, ai * c[1] * c[2], 0);
+     }
+#else
+     /* update_maxwell_dielectric combines these with the normal */
+     meps->m00 = meps->m11 = meps->m22 = mean;
+     meps_inv->m00 = meps_inv->m11 = meps_inv->m22 = mean_inv;
+     ASSIGN_ESCALAR(meps->m01, 0, 0);
+     ASSIGN_ESCALAR(meps->m02, 0, 0);
+     ASSIGN_ESCALAR(meps->m12, 0, 0);
+     ASSIGN_ESCALAR(meps_inv->m01, 0, 0);
+     ASSIGN_ESCALAR(meps_inv->m02, 0, 0);
+     ASSIGN_ESCALAR(meps_inv->m12, 0, 0);
+#endif
+     return 1;
+}
+
 static int mean_epsilon_func(symmetric_matrix *meps, 
 			     symmetric_matrix *meps_inv,
 			     real n[3],
@@ -210,6 +353,10 @@ static int mean_epsilon_func(symmetric_matrix *meps,
 	    {-1,1,1},{-1,1,-1},{-1,-1,1},{-1,-1,-1} }
      };
 
+     if (d->cell_grid && !d->epsilon_file_func)
+	  return mean_matgrid_epsilon(meps, meps_inv, n, d1, d2, d3,
+				      r, d->cell_grid);
+
      /* p needs to be in the lattice *unit* vector basis, while r is
         in the lattice vector basis.  Also, shift origin to the center
         of the grid. */
@@ -235,7 +382,7 @@ static int mean_epsilon_func(symmetric_matrix *meps,
 	  q.y = p.y + neighbors[dimensions - 1][i][1] * d2;
 	  q.z = p.z + neighbors[dimensions - 1][i][2] * d3;
 	  z = shift_to_unit_cell(q);
-	  o = object_of_point_in_tree(z, geometry_tree, &shiftby, &id);
+	  o = object_of_point_in_tree(z, d->tree, &shiftby, &id);
 	  shiftby = vector3_plus(shiftby, vector3_minus(q, z));
 	  if ((id == id1 && vector3_equal(shiftby, shiftby1)) ||
 	      (id == id2 && vector3_equal(shiftby, shiftby2)))
@@ -308,12 +455,12 @@ static int mean_epsilon_func(symmetric_matrix *meps,
      if (id1 > id2) {
 	  pixel.low = vector3_minus(pixel.low, shiftby1);
 	  pixel.high = vector3_minus(pixel.high, shiftby1);
-	  fill = box_overlap_with_object(pixel, *o1, tol, 100/tol);
+	  fill = fast_box_overlap_with_object(pixel, *o1, tol, 100/tol);
      }
      else {
 	  pixel.low = vector3_minus(pixel.low, shiftby2);
 	  pixel.high = vector3_minus(pixel.high, shiftby2);
-	  fill = 1 - box_overlap_with_object(pixel, *o2, tol, 100/tol);
+	  fill = 1 - fast_box_overlap_with_object(pixel, *o2, tol, 100/tol);
      }
 
      {
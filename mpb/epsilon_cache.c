@@ -0,0 +1,403 @@
+/* Copyright (C) 1999-2014 Massachusetts Institute of Technology.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* An on-disk cache of the dielectric function, for batches of jobs
+   (different k-points, parities, numbers of bands...) that share the
+   same structure.  If epsilon-cache-directory is set, init-params
+   stores the computed eps_inv (and mu_inv, if any) in a file of that
+   directory named by a hash of everything that determines them: the
+   grid, lattice, geometry, materials, mesh-size, epsilon/mu input
+   files, and build options.  Later jobs with the same hash load the
+   file instead of recomputing the dielectric function.
+
+   The arrays are stored in their raw (transformed, if MPI) layout,
+   as one dataset written collectively by all processes, so the
+   cache can be shared by jobs with different numbers of processes.
+   Geometries involving material-function objects cannot be hashed,
+   and are never cached. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+#include <check.h>
+#include <mpiglue.h>
+#include <mpi_utils.h>
+#include <matrixio.h>
+#include <maxwell.h>
+
+#include <ctl-io.h>
+#include <ctlgeom.h>
+
+#include "mpb.h"
+
+/* increment when the computation of eps_inv changes: */
+#define EPSILON_CACHE_VERSION 2
+
+/* number of real values per symmetric_matrix */
+#define SYMMETRIC_MATRIX_NREALS ((int) (sizeof(symmetric_matrix) / sizeof(real)))
+
+/**************************************************************************/
+
+/* A 64-bit hash, as two 32-bit FNV-1a hashes with different seeds. */
+typedef struct {
+     unsigned long h[2];
+     int cacheable;
+} cache_hash;
+
+static void hash_bytes(cache_hash *h, const void *data, size_t n)
+{
+     const unsigned char *p = (const unsigned char *) data;
+     size_t i;
+     for (i = 0; i < n; ++i) {
+	  h->h[0] = ((h->h[0] ^ p[i]) * 16777619UL) & 0xffffffffUL;
+	  h->h[1] = ((h->h[1] ^ p[i]) * 16777619UL + 0x9e3779b9UL)
+	       & 0xffffffffUL;
+     }
+}
+
+static void hash_int(cache_hash *h, int i)
+{
+     hash_bytes(h, &i, sizeof(int));
+}
+
+static void hash_number(cache_hash *h, double x)
+{
+     if (x == 0) x = 0; /* -0 == 0 */
+     hash_bytes(h, &x, sizeof(double));
+}
+
+static void hash_vector3(cache_hash *h, vector3 v)
+{
+     hash_number(h, v.x);
+     hash_number(h, v.y);
+     hash_number(h, v.z);
+}
+
+static void hash_string(cache_hash *h, const char *s)
+{
+     hash_bytes(h, s, strlen(s) + 1);
+}
+
+static void hash_material(cache_hash *h, material_type m)
+{
+     hash_int(h, m.which_subclass);
+     switch (m.which_subclass) {
+	 case MEDIUM:
+	      hash_number(h, m.subclass.medium_data->epsilon);
+	      hash_number(h, m.subclass.medium_data->mu);
+	      break;
+	 case MEDIUM_ANISOTROPIC: {
+	      medium_anisotropic *a = m.subclass.medium_anisotropic_data;
+	      hash_vector3(h, a->epsilon_diag);
+	      hash_bytes(h, &a->epsilon_offdiag, sizeof(cvector3));
+	      hash_vector3(h, a->epsilon_offdiag_imag);
+	      hash_vector3(h, a->mu_diag);
+	      hash_bytes(h, &a->mu_offdiag, sizeof(cvector3));
+	      hash_vector3(h, a->mu_offdiag_imag);
+	      break;
+	 }
+	 case MATERIAL_GRID: {
+	      material_grid *g = m.subclass.material_grid_data;
+	      int n = material_grids_ntot(g, 1);
+	      double *u;
+	      hash_int(h, g->material_grid_kind);
+	      hash_number(h, g->epsilon_min);
+	      hash_number(h, g->epsilon_max);
+	      hash_number(h, g->mu_min);
+	      hash_number(h, g->mu_max);
+	      hash_vector3(h, g->size);
+	      CHK_MALLOC(u, double, n);
+	      material_grids_get(u, g, 1);
+	      hash_bytes(h, u, sizeof(double) * n);
+	      free(u);
+	      break;
+	 }
+	 case MATERIAL_FUNCTION: /* arbitrary user code: can't hash */
+	      h->cacheable = 0;
+	      break;
+	 case MATERIAL_TYPE_SELF: /* the default material */
+	      break;
+	 default:
+	      h->cacheable = 0; /* unknown material subclass */
+	      break;
+     }
+}
+
+static void hash_object(cache_hash *h, geometric_object o)
+{
+     hash_material(h, o.material);
+     hash_vector3(h, o.center);
+     hash_int(h, o.which_subclass);
+     switch (o.which_subclass) {
+	 case SPHERE:
+	      hash_number(h, o.subclass.sphere_data->radius);
+	      break;
+	 case CYLINDER: {
+	      cylinder *c = o.subclass.cylinder_data;
+	      hash_vector3(h, c->axis);
+	      hash_number(h, c->radius);
+	      hash_number(h, c->height);
+	      hash_int(h, c->which_subclass);
+	      if (c->which_subclass == CONE)
+		   hash_number(h, c->subclass.cone_data->radius2);
+	      else if (c->which_subclass != CYLINDER_SELF)
+		   h->cacheable = 0; /* unknown cylinder subclass */
+	      break;
+	 }
+	 case BLOCK: {
+	      block *b = o.subclass.block_data;
+	      hash_vector3(h, b->e1);
+	      hash_vector3(h, b->e2);
+	      hash_vector3(h, b->e3);
+	      hash_vector3(h, b->size);
+	      hash_int(h, b->which_subclass);
+	      break;
+	 }
+	 case COMPOUND_GEOMETRIC_OBJECT: {
+	      geometric_object_list l = o.subclass.
+		   compound_geometric_object_data->component_objects;
+	      int i;
+	      hash_int(h, l.num_items);
+	      for (i = 0; i < l.num_items; ++i)
+		   hash_object(h, l.items[i]);
+	      break;
+	 }
+	 default:
+	      h->cacheable = 0; /* unknown object subclass: shape not hashed */
+	      break;
+     }
+}
+
+static void hash_file(cache_hash *h, const char *fname)
+{
+     double mtime, size;
+     hash_string(h, fname);
+     if (fname[0] && get_file_stamp(fname, &mtime, &size)) {
+	  hash_number(h, mtime);
+	  hash_number(h, size);
+     }
+}
+
+/* Return the cache file name (without .h5) for the current structure,
+   or NULL if caching is disabled or impossible.  Must be called after
+   the geometry is fixed up by init_epsilon. */
+static char *epsilon_cache_fname(void)
+{
+     cache_hash h = { { 2166136261UL, 84696351UL }, 1 };
+     char *fname;
+     int i;
+
+     if (!epsilon_cache_directory || !epsilon_cache_directory[0])
+	  return NULL;
+
+     /* build options that affect the computation or storage layout: */
+     hash_int(&h, EPSILON_CACHE_VERSION);
+     hash_int(&h, SYMMETRIC_MATRIX_NREALS);
+     hash_int(&h, (int) sizeof(real));
+#ifdef SCALAR_COMPLEX
+     hash_int(&h, 1);
+#else
+     hash_int(&h, 0);
+#endif
+#ifdef HAVE_MPI
+     hash_int(&h, 1); /* transposed output layout */
+#else
+     hash_int(&h, 0);
+#endif
+
+     hash_int(&h, mdata->nx);
+     hash_int(&h, mdata->ny);
+     hash_int(&h, mdata->nz);
+     hash_int(&h, mesh_size);
+     hash_int(&h, dimensions);
+     hash_int(&h, ensure_periodicity);
+     hash_int(&h, force_mup);
+     hash_int(&h, negative_epsilon_okp);
+     hash_vector3(&h, geometry_lattice.size);
+     hash_vector3(&h, geometry_lattice.basis.c0);
+     hash_vector3(&h, geometry_lattice.basis.c1);
+     hash_vector3(&h, geometry_lattice.basis.c2);
+     hash_vector3(&h, geometry_center);
+     hash_material(&h, default_material);
+     hash_file(&h, epsilon_input_file);
+     hash_file(&h, mu_input_file);
+     hash_int(&h, geometry.num_items);
+     for (i = 0; i < geometry.num_items; ++i)
+	  hash_object(&h, geometry.items[i]);
+
+     if (!h.cacheable) {
+	  mpi_one_printf("(Not caching epsilon: material-function "
+			 "objects can't be hashed.)\n");
+	  return NULL;
+     }
+
+     CHK_MALLOC(fname, char, strlen(epsilon_cache_directory) + 32);
+     sprintf(fname, "%s/eps-%08lx%08lx", epsilon_cache_directory,
+	     h.h[0], h.h[1]);
+     return fname;
+}
+
+/**************************************************************************/
+
+static void get_cache_layout(int dims[2], int local_dims[2], int start[2])
+{
+     int N = mdata->fft_output_size;
+
+     mpi_allreduce_1(&N, int, MPI_INT, MPI_SUM, mpb_comm);
+     dims[0] = N;
+     dims[1] = local_dims[1] = SYMMETRIC_MATRIX_NREALS;
+     local_dims[0] = mdata->fft_output_size;
+#ifdef HAVE_MPI
+     /* each process stores its fft_output_size points after those of
+	the lower ranks; we can't compute this from local_y_start, since
+	the slabs of real-field (r2c) output aren't N/ny points per y */
+     {
+	  int n = mdata->fft_output_size, nsum;
+	  MPI_Scan(&n, &nsum, 1, MPI_INT, MPI_SUM, mpb_comm);
+	  start[0] = nsum - n; /* exclusive prefix sum */
+     }
+#else
+     start[0] = 0;
+#endif
+     start[1] = 0;
+}
+
+/* Load eps_inv (and mu_inv, if present) from the cache file fname,
+   returning whether this succeeded. */
+static int epsilon_cache_load(const char *fname)
+{
+     matrixio_id file_id;
+     int dims[2], local_dims[2], start[2], rank, mdims, have_mu, ok = 1;
+     real *means;
+
+     if (!h5file_exists(fname))
+	  return 0;
+     get_cache_layout(dims, local_dims, start);
+
+     mpi_one_printf("Loading epsilon from cache %s.h5...\n", fname);
+     file_id = matrixio_open(fname, 1);
+     means = matrixio_read_data_attr(file_id, "means", &rank, 1, &mdims);
+     if (!means || rank != 1 || mdims != 2) {
+	  matrixio_close(file_id);
+	  free(means);
+	  mpi_one_printf("    ...invalid cache file, ignoring it.\n");
+	  return 0;
+     }
+     rank = 2;
+     ok = ok && matrixio_read_real_data(file_id, "eps_inv", &rank, dims,
+					local_dims[0], start[0], 1,
+					(real *) mdata->eps_inv) != NULL;
+     have_mu = matrixio_dataset_exists(file_id, "mu_inv");
+     if (ok && have_mu) {
+	  if (!mdata->mu_inv)
+	       CHK_MALLOC(mdata->mu_inv, symmetric_matrix,
+			  mdata->fft_output_size);
+	  rank = 2;
+	  ok = matrixio_read_real_data(file_id, "mu_inv", &rank, dims,
+				       local_dims[0], start[0], 1,
+				       (real *) mdata->mu_inv) != NULL;
+     }
+     matrixio_close(file_id);
+     CHECK(ok, "error reading epsilon cache file");
+
+     mdata->eps_inv_mean = means[0];
+     if (have_mu)
+	  mdata->mu_inv_mean = means[1];
+     free(means);
+     return 1;
+}
+
+/* Save eps_inv (and mu_inv, if any) to the cache file fname, via a
+   temporary file so that concurrent jobs never see a partial file. */
+static void epsilon_cache_save(const char *fname)
+{
+     matrixio_id file_id, data_id;
+     int dims[2], local_dims[2], start[2], two = 2, id = 0;
+     real means[2];
+     char *tmp;
+
+     get_cache_layout(dims, local_dims, start);
+
+     /* a temporary name unique to this job */
+#ifdef HAVE_UNISTD_H
+     if (mpi_is_master())
+	  id = getpid();
+     MPI_Bcast(&id, 1, MPI_INT, 0, mpb_comm);
+#endif
+     CHK_MALLOC(tmp, char, strlen(fname) + 32);
+     sprintf(tmp, "%s-tmp%d", fname, id);
+
+     mpi_one_printf("Saving epsilon to cache %s.h5...\n", fname);
+     file_id = matrixio_create(tmp);
+     data_id = matrixio_create_dataset(file_id, "eps_inv", NULL, 2, dims);
+     matrixio_write_real_data(data_id, local_dims, start, 1,
+			      (real *) mdata->eps_inv);
+     matrixio_close_dataset(data_id);
+     if (mdata->mu_inv) {
+	  data_id = matrixio_create_dataset(file_id, "mu_inv", NULL, 2, dims);
+	  matrixio_write_real_data(data_id, local_dims, start, 1,
+				   (real *) mdata->mu_inv);
+	  matrixio_close_dataset(data_id);
+     }
+     means[0] = mdata->eps_inv_mean;
+     means[1] = mdata->mu_inv ? mdata->mu_inv_mean : 1.0;
+     matrixio_write_data_attr(file_id, "means", means, 1, &two);
+     matrixio_close(file_id);
+
+     MPI_Barrier(mpb_comm);
+     if (mpi_is_master()) {
+	  char *s, *t;
+	  CHK_MALLOC(s, char, strlen(fname) + 4);
+	  CHK_MALLOC(t, char, strlen(tmp) + 4);
+	  strcpy(s, fname); strcat(s, ".h5");
+	  strcpy(t, tmp); strcat(t, ".h5");
+	  if (rename(t, s))
+	       remove(t); /* e.g. another job saved it first */
+	  free(t);
+	  free(s);
+     }
+     MPI_Barrier(mpb_comm);
+     free(tmp);
+}
+
+/* Initialize the dielectric function like reset_epsilon, but using
+   the cache in epsilon-cache-directory (if any). */
+void reset_epsilon_cached(void)
+{
+#ifdef HAVE_HDF5
+     char *fname;
+
+     material_grids_forget_epsilon();
+     fname = epsilon_cache_fname();
+     if (!fname || !epsilon_cache_load(fname)) {
+	  reset_epsilon();
+	  if (fname)
+	       epsilon_cache_save(fname);
+     }
+     free(fname);
+#else
+     material_grids_forget_epsilon();
+     if (epsilon_cache_directory && epsilon_cache_directory[0])
+	  mpi_one_printf("(Not caching epsilon: compiled without HDF5.)\n");
+     reset_epsilon();
+#endif
+}
@@ -27,10 +27,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include "config.h"
+
+#ifdef HAVE_SYS_STAT_H
+#  include <sys/types.h>
+#  include <sys/stat.h>
+#endif
+
 #include <check.h>
+#include <mpiglue.h>
 #include <mpi_utils.h>
 #include <matrices.h>
 #include <matrixio.h>
@@ -45,6 +53,60 @@ typedef struct {
      real *data;
 } epsilon_file_data;
 
+/* The dielectric files are re-read every time the dielectric function
+   is recomputed (e.g. at every step of an optimization), so we cache
+   the data of the most recently used files, keyed by the file name and
+   its modification time and size.  The cached data are read-only, and
+   are shared by all users of the file. */
+
+#define EPS_FILE_CACHE_SIZE 2 /* enough for epsilon and mu */
+
+typedef struct {
+     char *fname; /* NULL if unused */
+     double mtime, size;
+     int refcount; /* number of get_epsilon_file_func users */
+     epsilon_file_data *d;
+} eps_file_cache_entry;
+
+static eps_file_cache_entry eps_file_cache[EPS_FILE_CACHE_SIZE];
+static int eps_file_cache_clock = 0; /* for replacing the oldest entry */
+static int eps_file_cache_used[EPS_FILE_CACHE_SIZE];
+
+static void free_epsilon_file_data(epsilon_file_data *d)
+{
+     if (d) {
+	  free(d->data);
+	  free(d);
+     }
+}
+
+/* Get the modification time and size of fname (with the same result on
+   all processes), returning 0 if this is not possible.  */
+int get_file_stamp(const char *fname, double *mtime, double *size)
+{
+     double stamp[3] = {0,0,0};
+#ifdef HAVE_SYS_STAT_H
+     if (mpi_is_master()) {
+	  struct stat st;
+	  char *s;
+	  CHK_MALLOC(s, char, strlen(fname) + 4);
+	  strcpy(s, fname);
+	  if (stat(s, &st) && (strcat(s, ".h5"), stat(s, &st)))
+	       stamp[0] = 0;
+	  else {
+	       stamp[0] = 1;
+	       stamp[1] = st.st_mtime;
+	       stamp[2] = st.st_size;
+	  }
+	  free(s);
+     }
+     MPI_Bcast(stamp, 3, MPI_DOUBLE, 0, mpb_comm);
+#endif
+     *mtime = stamp[1];
+     *size = stamp[2];
+     return stamp[0] != 0;
+}
+
 /* Linearly interpolate a given point in a 3d grid of data.  The point
    coordinates should be in the range [0,1], or at the very least [-1,2]
    ... anything outside [0,1] is *mirror* reflected into [0,1] */
@@ -136,15 +198,29 @@ void get_epsilon_file_func(const char *fname,
 	  char *eps_fname;
 	  matrixio_id file_id;
 	  epsilon_file_data *d;
-	  int rank = 3, dims[3];
+	  int rank = 3, dims[3], i, stampp;
+	  double mtime, size;
+
+	  eps_fname = ctl_fix_path(fname);
+	  stampp = get_file_stamp(eps_fname, &mtime, &size);
+	  for (i = 0; stampp && i < EPS_FILE_CACHE_SIZE; ++i)
+	       if (eps_file_cache[i].fname
+		   && !strcmp(eps_file_cache[i].fname, eps_fname)
+		   && eps_file_cache[i].mtime == mtime
+		   && eps_file_cache[i].size == size) {
+		    eps_file_cache[i].refcount++;
+		    eps_file_cache_used[i] = ++eps_file_cache_clock;
+		    free(eps_fname);
+		    *func = epsilon_file_func;
+		    *func_data = (void*) eps_file_cache[i].d;
+		    return;
+	       }
 
 	  CHK_MALLOC(d, epsilon_file_data, 1);
 	  
-	  eps_fname = ctl_fix_path(fname);
 	  mpi_one_printf("Using background dielectric from file \"%s\"...\n",
 			 eps_fname);
 	  file_id = matrixio_open(eps_fname, 1);
-	  free(eps_fname);
 
 	  d->data = matrixio_read_real_data(file_id, NULL, &rank, dims,
 					    0,0,0, NULL);
@@ -158,6 +234,27 @@ void get_epsilon_file_func(const char *fname,
 	  mpi_one_printf("    ...read %dx%dx%d dielectric function\n",
 			 d->nx, d->ny, d->nz);
 
+	  if (stampp) { /* replace the least-recently used unused entry */
+	       int j = -1;
+	       for (i = 0; i < EPS_FILE_CACHE_SIZE; ++i)
+		    if (!eps_file_cache[i].refcount &&
+			(j < 0 || eps_file_cache_used[i]
+			 < eps_file_cache_used[j]))
+			 j = i;
+	       if (j >= 0) {
+		    free(eps_file_cache[j].fname);
+		    free_epsilon_file_data(eps_file_cache[j].d);
+		    eps_file_cache[j].fname = eps_fname;
+		    eps_fname = NULL;
+		    eps_file_cache[j].mtime = mtime;
+		    eps_file_cache[j].size = size;
+		    eps_file_cache[j].refcount = 1;
+		    eps_file_cache[j].d = d;
+		    eps_file_cache_used[j] = ++eps_file_cache_clock;
+	       }
+	  }
+	  free(eps_fname);
+
 	  *func = epsilon_file_func;
 	  *func_data = (void*) d;
      }
@@ -170,8 +267,11 @@ void get_epsilon_file_func(const char *fname,
 void destroy_epsilon_file_func_data(void *func_data)
 {
      epsilon_file_data *d = (epsilon_file_data *) func_data;
-     if (d) {
-	  free(d->data);
-	  free(d);
-     }
+     int i;
+     for (i = 0; d && i < EPS_FILE_CACHE_SIZE; ++i)
+	  if (eps_file_cache[i].d == d) {
+	       eps_file_cache[i].refcount--; /* keep cached data */
+	       return;
+	  }
+     free_epsilon_file_data(d);
 }
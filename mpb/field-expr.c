@@ -0,0 +1,786 @@
+/* Copyright (C) 1999-2014 Massachusetts Institute of Technology.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Native evaluation of simple field expressions, for field-map!,
+   integrate-fields, and compute-field-integral.  Instead of a Scheme
+   procedure, these functions may be passed a *quoted* lambda
+   expression, e.g.
+
+       '(lambda (r e h) (real-part (vector3-cdot e h)))
+
+   If the body uses only the operations below, it is compiled once
+   into a list of instructions, which are then applied to blocks of
+   grid points at a time (in parallel, with OpenMP), with no calls to
+   Guile.  Otherwise, the lambda is simply evaluated by Guile and
+   called at each point as before.
+
+   Values are complex scalars or complex 3-vectors.  The body may use
+   the lambda's parameters, numeric constants, any global variable
+   whose value is a number or vector3, and:
+
+       + - * / vector3+ vector3- vector3* vector3-scale
+       conj real-part imag-part magnitude abs sqrt exp log sin cos expt
+       vector3-dot vector3-cdot vector3-cross vector3-norm vector3
+       vector3-x vector3-y vector3-z
+       < > <= >= = and or not if max min
+       point-in-object? point-in-periodic-object?
+
+   as in Scheme/libctl (with * of two vectors being the dot product,
+   as for vector3*, and comparisons using the real parts).  Booleans
+   (#t, #f, and the results of comparisons, not, and point-in-object?)
+   are a separate type: as in Scheme, only #f is false, so a number
+   is always true, and and/or return the value of the deciding
+   operand.  Expressions that mix booleans and numbers in other ways
+   (e.g. (and (< x 0) x), or arithmetic on booleans), or whose value
+   is a boolean, are left to Guile.  The object
+   argument of point-in-object? is evaluated once, by Guile, so it can
+   be any expression giving a geometric object, e.g. a global variable
+   or (list-ref geometry 0); the point must be a vector expression
+   such as the r parameter of integrate-fields. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "config.h"
+#include <check.h>
+#include <mpiglue.h>
+#include <mpi_utils.h>
+
+#include "field-smob.h"
+
+#include "mpb.h"
+
+#define FE_BLOCK 256 /* number of points per block of evaluation */
+#define FE_MAXARGS 16 /* max args of an operation (e.g. + or *) */
+
+typedef enum {
+     OP_PARAM, OP_CONST,
+     OP_ADD, OP_SUB, OP_NEG, OP_MUL, OP_DIV, OP_SCALE, OP_DIVS,
+     OP_CONJ, OP_RE, OP_IM, OP_ABS, OP_NORM,
+     OP_SQRT, OP_EXP, OP_LOG, OP_SIN, OP_COS, OP_POW, OP_POWI,
+     OP_DOT, OP_CDOT, OP_CROSS, OP_COMP, OP_VEC,
+     OP_LT, OP_GT, OP_LE, OP_GE, OP_EQ, OP_AND, OP_OR, OP_NOT,
+     OP_IF, OP_MAX, OP_MIN,
+     OP_INSIDE, OP_INSIDE_PERIODIC
+} fe_opcode;
+
+/* Each instruction computes one register, with the same index as the
+   instruction, from earlier registers a, b, and c.  For OP_PARAM, a is
+   the parameter index; for OP_COMP and OP_POWI, b is the component or
+   the exponent; and for OP_INSIDE*, b is the index of the object. */
+typedef struct {
+     fe_opcode op;
+     field_expr_type type;
+     int a, b, c;
+     cvector3 val; /* value for OP_CONST */
+} fe_instr;
+
+struct field_expr_struct {
+     int nparams;
+     field_expr_type *ptypes;
+     int *param_reg; /* register of each parameter, or -1 */
+     int ninstr, nalloc;
+     fe_instr *instr;
+     int result; /* register holding the value of the body */
+     int nobjects;
+     geometric_object *objects;
+};
+
+/*************************************************************************/
+
+static int fe_emit(field_expr *e, fe_opcode op, field_expr_type type,
+		   int a, int b, int c)
+{
+     fe_instr *in;
+     if (e->ninstr == e->nalloc) {
+	  e->nalloc = e->nalloc * 2 + 16;
+	  e->instr = (fe_instr *) realloc(e->instr,
+					  sizeof(fe_instr) * e->nalloc);
+	  CHECK(e->instr, "out of memory");
+     }
+     in = e->instr + e->ninstr;
+     in->op = op;
+     in->type = type;
+     in->a = a; in->b = b; in->c = c;
+     in->val.x.re = in->val.x.im = 0;
+     in->val.y = in->val.z = in->val.x;
+     return e->ninstr++;
+}
+
+#define TYPE(r) (e->instr[r].type)
+
+/* a boolean constant (stored as 0 or 1 in the real part) */
+static int fe_bool(field_expr *e, int b)
+{
+     int r = fe_emit(e, OP_CONST, FE_BOOLEAN, 0, 0, 0);
+     e->instr[r].val.x.re = b != 0;
+     return r;
+}
+
+/* a constant from the value v of a Scheme expression, or -1 */
+static int fe_const(field_expr *e, SCM v)
+{
+     int r;
+     if (scm_is_true(scm_boolean_p(v)))
+	  return fe_bool(e, scm_is_true(v));
+     if (scm_is_true(scm_number_p(v))) {
+	  r = fe_emit(e, OP_CONST, FE_SCALAR, 0, 0, 0);
+	  e->instr[r].val.x = ctl_convert_cnumber_to_c(v);
+	  return r;
+     }
+     if (scm_is_true(scm_vector_p(v)) && scm_c_vector_length(v) == 3) {
+	  r = fe_emit(e, OP_CONST, FE_VECTOR, 0, 0, 0);
+	  e->instr[r].val = ctl_convert_cvector3_to_c(v);
+	  return r;
+     }
+     return -1;
+}
+
+static int fe_object(field_expr *e, SCM x)
+{
+     SCM o = scm_primitive_eval(x);
+     if (!object_is_member("geometric-object", o))
+	  return -1;
+     e->objects = (geometric_object *)
+	  realloc(e->objects, sizeof(geometric_object) * (e->nobjects + 1));
+     CHECK(e->objects, "out of memory");
+     geometric_object_input(o, e->objects + e->nobjects);
+     geom_fix_object(e->objects[e->nobjects]);
+     return e->nobjects++;
+}
+
+static int fe_compile(field_expr *e, SCM x, char **names);
+
+/* compile the binary operation a op b, with the type rules of Scheme
+   and libctl's vector3 functions, returning -1 if they are violated */
+static int fe_binary(field_expr *e, const char *name, int a, int b)
+{
+     field_expr_type ta = TYPE(a), tb = TYPE(b);
+     if (!strcmp(name, "and") || !strcmp(name, "or")) {
+	  /* a number is true, so (and x b) is b and (or x b) is x */
+	  if (ta != FE_BOOLEAN)
+	       return !strcmp(name, "and") ? b : a;
+	  if (tb != FE_BOOLEAN) /* #f or a number */
+	       return -1;
+	  return fe_emit(e, !strcmp(name, "and") ? OP_AND : OP_OR,
+			 FE_BOOLEAN, a, b, 0);
+     }
+     if (ta == FE_BOOLEAN || tb == FE_BOOLEAN)
+	  return -1;
+     if (!strcmp(name, "+") || !strcmp(name, "vector3+"))
+	  return ta == tb ? fe_emit(e, OP_ADD, ta, a, b, 0) : -1;
+     if (!strcmp(name, "-") || !strcmp(name, "vector3-"))
+	  return ta == tb ? fe_emit(e, OP_SUB, ta, a, b, 0) : -1;
+     if (!strcmp(name, "*") || !strcmp(name, "vector3*")) {
+	  if (ta == FE_SCALAR && tb == FE_SCALAR)
+	       return fe_emit(e, OP_MUL, FE_SCALAR, a, b, 0);
+	  if (ta == FE_VECTOR && tb == FE_VECTOR)
+	       return fe_emit(e, OP_DOT, FE_SCALAR, a, b, 0);
+	  return ta == FE_SCALAR ? fe_emit(e, OP_SCALE, FE_VECTOR, a, b, 0)
+	       : fe_emit(e, OP_SCALE, FE_VECTOR, b, a, 0);
+     }
+     if (!strcmp(name, "/")) {
+	  if (tb != FE_SCALAR)
+	       return -1;
+	  return fe_emit(e, ta == FE_SCALAR ? OP_DIV : OP_DIVS, ta, a, b, 0);
+     }
+     if (ta != FE_SCALAR || tb != FE_SCALAR)
+	  return -1;
+     if (!strcmp(name, "max"))
+	  return fe_emit(e, OP_MAX, FE_SCALAR, a, b, 0);
+     if (!strcmp(name, "min"))
+	  return fe_emit(e, OP_MIN, FE_SCALAR, a, b, 0);
+     return -1;
+}
+
+static int fe_compile_list(field_expr *e, const char *name, SCM args,
+			   char **names)
+{
+     int r[FE_MAXARGS], n, i;
+     field_expr_type t0;
+     static const struct { const char *name; fe_opcode op; } unary[] = {
+	  { "conj", OP_CONJ },
+	  { "real-part", OP_RE }, { "imag-part", OP_IM },
+	  { "sqrt", OP_SQRT }, { "exp", OP_EXP }, { "log", OP_LOG },
+	  { "sin", OP_SIN }, { "cos", OP_COS }
+     };
+     static const struct { const char *name; fe_opcode op; } compare[] = {
+	  { "<", OP_LT }, { ">", OP_GT }, { "<=", OP_LE }, { ">=", OP_GE },
+	  { "=", OP_EQ }
+     };
+
+     n = list_length(args);
+     if (n < 1 || n > FE_MAXARGS)
+	  return -1;
+
+     if (!strcmp(name, "point-in-object?") ||
+	 !strcmp(name, "point-in-periodic-object?")) {
+	  int p, o;
+	  if (n != 2 || (p = fe_compile(e, scm_car(args), names)) < 0
+	      || TYPE(p) != FE_VECTOR
+	      || (o = fe_object(e, scm_cadr(args))) < 0)
+	       return -1;
+	  return fe_emit(e, !strcmp(name, "point-in-object?")
+			 ? OP_INSIDE : OP_INSIDE_PERIODIC,
+			 FE_BOOLEAN, p, o, 0);
+     }
+
+     for (i = 0; i < n; ++i, args = scm_cdr(args))
+	  if ((r[i] = fe_compile(e, scm_car(args), names)) < 0)
+	       return -1;
+     t0 = TYPE(r[0]);
+
+     if (n == 1) {
+	  if (!strcmp(name, "and") || !strcmp(name, "or"))
+	       return r[0];
+	  if (!strcmp(name, "not")) /* a number is true */
+	       return t0 == FE_BOOLEAN
+		    ? fe_emit(e, OP_NOT, FE_BOOLEAN, r[0], 0, 0)
+		    : fe_bool(e, 0);
+	  if (t0 == FE_BOOLEAN)
+	       return -1;
+	  if (!strcmp(name, "-") || !strcmp(name, "vector3-"))
+	       return fe_emit(e, OP_NEG, t0, r[0], 0, 0);
+	  if (!strcmp(name, "/")) {
+	       int one = fe_emit(e, OP_CONST, FE_SCALAR, 0, 0, 0);
+	       e->instr[one].val.x.re = 1;
+	       return fe_binary(e, name, one, r[0]);
+	  }
+	  if (!strcmp(name, "magnitude") || !strcmp(name, "abs")
+	      || !strcmp(name, "vector3-norm"))
+	       return fe_emit(e, t0 == FE_SCALAR ? OP_ABS : OP_NORM,
+			      FE_SCALAR, r[0], 0, 0);
+	  if (!strcmp(name, "conj") || !strcmp(name, "real-part")
+	      || !strcmp(name, "imag-part"))
+	       return fe_emit(e, !strcmp(name, "conj") ? OP_CONJ :
+			      (!strcmp(name, "real-part") ? OP_RE : OP_IM),
+			      t0, r[0], 0, 0);
+	  if (t0 == FE_VECTOR && !strncmp(name, "vector3-", 8)
+	      && strlen(name) == 9 && strchr("xyz", name[8]))
+	       return fe_emit(e, OP_COMP, FE_SCALAR, r[0], name[8] - 'x', 0);
+	  if (t0 == FE_SCALAR)
+	       for (i = 0; i < (int) (sizeof(unary) / sizeof(unary[0])); ++i)
+		    if (!strcmp(name, unary[i].name))
+			 return fe_emit(e, unary[i].op, FE_SCALAR, r[0], 0, 0);
+	  if (!strcmp(name, "+") || !strcmp(name, "*")
+	      || !strcmp(name, "max") || !strcmp(name, "min"))
+	       return r[0];
+	  return -1;
+     }
+
+     if (n == 2) {
+	  field_expr_type t1 = TYPE(r[1]);
+	  if (t0 == FE_SCALAR && t1 == FE_SCALAR)
+	       for (i = 0; i < (int) (sizeof(compare)/sizeof(compare[0])); ++i)
+		    if (!strcmp(name, compare[i].name))
+			 return fe_emit(e, compare[i].op, FE_BOOLEAN,
+					r[0], r[1], 0);
+	  if (!strcmp(name, "vector3-scale"))
+	       return t0 == FE_SCALAR && t1 == FE_VECTOR
+		    ? fe_emit(e, OP_SCALE, FE_VECTOR, r[0], r[1], 0) : -1;
+	  if (!strcmp(name, "vector3-dot") || !strcmp(name, "vector3-cdot")
+	      || !strcmp(name, "vector3-cross")) {
+	       if (t0 != FE_VECTOR || t1 != FE_VECTOR)
+		    return -1;
+	       if (!strcmp(name, "vector3-cross"))
+		    return fe_emit(e, OP_CROSS, FE_VECTOR, r[0], r[1], 0);
+	       return fe_emit(e, !strcmp(name, "vector3-dot")
+			      ? OP_DOT : OP_CDOT, FE_SCALAR, r[0], r[1], 0);
+	  }
+	  if (!strcmp(name, "expt")) {
+	       const fe_instr *in = e->instr + r[1];
+	       if (t0 != FE_SCALAR || t1 != FE_SCALAR)
+		    return -1;
+	       if (in->op == OP_CONST && in->val.x.im == 0
+		   && in->val.x.re == floor(in->val.x.re)
+		   && fabs(in->val.x.re) <= 64)
+		    return fe_emit(e, OP_POWI, FE_SCALAR,
+				   r[0], (int) in->val.x.re, 0);
+	       return fe_emit(e, OP_POW, FE_SCALAR, r[0], r[1], 0);
+	  }
+     }
+
+     if (n == 3) {
+	  if (!strcmp(name, "if")) {
+	       if (TYPE(r[0]) != FE_BOOLEAN) /* a number is true */
+		    return r[1];
+	       return TYPE(r[1]) == TYPE(r[2])
+		    ? fe_emit(e, OP_IF, TYPE(r[1]), r[0], r[1], r[2]) : -1;
+	  }
+	  if (!strcmp(name, "vector3"))
+	       return (TYPE(r[0]) == FE_SCALAR && TYPE(r[1]) == FE_SCALAR
+		       && TYPE(r[2]) == FE_SCALAR)
+		    ? fe_emit(e, OP_VEC, FE_VECTOR, r[0], r[1], r[2]) : -1;
+     }
+
+     /* left fold of the variadic operations */
+     if (!strcmp(name, "-") || !strcmp(name, "vector3-")
+	 || !strcmp(name, "/") || !strcmp(name, "+")
+	 || !strcmp(name, "vector3+") || !strcmp(name, "*")
+	 || !strcmp(name, "vector3*") || !strcmp(name, "and")
+	 || !strcmp(name, "or") || !strcmp(name, "max")
+	 || !strcmp(name, "min")) {
+	  int acc = r[0];
+	  for (i = 1; i < n && acc >= 0; ++i)
+	       acc = fe_binary(e, name, acc, r[i]);
+	  return acc;
+     }
+     return -1;
+}
+
+/* compile x, returning the index of its register, or -1 if it is not
+   in the language described above */
+static int fe_compile(field_expr *e, SCM x, char **names)
+{
+     if (scm_is_true(scm_symbol_p(x))) {
+	  char *s = ctl_symbol2newstr(x);
+	  int i;
+	  for (i = 0; i < e->nparams && strcmp(s, names[i]); ++i)
+	       ;
+	  free(s);
+	  if (i < e->nparams) {
+	       if (e->param_reg[i] < 0)
+		    e->param_reg[i] = fe_emit(e, OP_PARAM, e->ptypes[i],
+					      i, 0, 0);
+	       return e->param_reg[i];
+	  }
+	  if (!scm_is_true(scm_defined_p(x, SCM_UNDEFINED)))
+	       return -1;
+	  return fe_const(e, scm_primitive_eval(x));
+     }
+     if (scm_is_true(scm_pair_p(x))) {
+	  char *name;
+	  int r;
+	  if (!scm_is_true(scm_symbol_p(scm_car(x)))
+	      || !scm_is_true(scm_list_p(scm_cdr(x))))
+	       return -1;
+	  name = ctl_symbol2newstr(scm_car(x));
+	  r = fe_compile_list(e, name, scm_cdr(x), names);
+	  free(name);
+	  return r;
+     }
+     return fe_const(e, x);
+}
+
+void field_expr_destroy(field_expr *e)
+{
+     if (e) {
+	  int i;
+	  for (i = 0; i < e->nobjects; ++i)
+	       geometric_object_destroy(e->objects[i]);
+	  free(e->objects);
+	  free(e->instr);
+	  free(e->param_reg);
+	  free(e->ptypes);
+	  free(e);
+     }
+}
+
+/* If f is a quoted (lambda (p1 ... pn) body) with nparams parameters,
+   whose body is in the language above, return its compiled form, where
+   ptypes[i] is the type of parameter i; otherwise return NULL. */
+field_expr *field_expr_compile(SCM f, int nparams,
+			       const field_expr_type *ptypes)
+{
+     field_expr *e;
+     char **names;
+     SCM params;
+     int i, ok = 1;
+
+     if (!scm_is_true(scm_list_p(f)) || list_length(f) != 3
+	 || !scm_is_true(scm_symbol_p(scm_car(f))))
+	  return NULL;
+     {
+	  char *s = ctl_symbol2newstr(scm_car(f));
+	  ok = !strcmp(s, "lambda");
+	  free(s);
+     }
+     params = scm_cadr(f);
+     if (!ok || !scm_is_true(scm_list_p(params))
+	 || list_length(params) != nparams)
+	  return NULL;
+
+     CHK_MALLOC(e, field_expr, 1);
+     e->nparams = nparams;
+     CHK_MALLOC(e->ptypes, field_expr_type, nparams);
+     CHK_MALLOC(e->param_reg, int, nparams);
+     e->ninstr = e->nalloc = 0;
+     e->instr = NULL;
+     e->result = -1;
+     e->nobjects = 0;
+     e->objects = NULL;
+     CHK_MALLOC(names, char *, nparams);
+     for (i = 0; i < nparams; ++i, params = scm_cdr(params)) {
+	  e->ptypes[i] = ptypes[i];
+	  e->param_reg[i] = -1;
+	  if (scm_is_true(scm_symbol_p(scm_car(params))))
+	       names[i] = ctl_symbol2newstr(scm_car(params));
+	  else {
+	       names[i] = NULL;
+	       ok = 0;
+	  }
+     }
+     if (ok) {
+	  e->result = fe_compile(e, scm_caddr(f), names);
+	  ok = e->result >= 0 && TYPE(e->result) != FE_BOOLEAN;
+     }
+     for (i = 0; i < nparams; ++i)
+	  free(names[i]);
+     free(names);
+     if (!ok) {
+	  if (verbose)
+	       mpi_one_printf("field expression is not supported natively, "
+			      "calling Guile at each point\n");
+	  field_expr_destroy(e);
+	  return NULL;
+     }
+     return e;
+}
+
+field_expr_type field_expr_result_type(const field_expr *e)
+{
+     return TYPE(e->result);
+}
+
+/* The procedure to call at each point if f could not be compiled:
+   f itself, or the value of the quoted lambda expression f. */
+SCM field_expr_procedure(SCM f)
+{
+     if (scm_is_true(scm_procedure_p(f)))
+	  return f;
+     return scm_primitive_eval(f);
+}
+
+/*************************************************************************/
+/* evaluation */
+
+#define C_MUL_RE(a,b) ((a).re * (b).re - (a).im * (b).im)
+#define C_MUL_IM(a,b) ((a).re * (b).im + (a).im * (b).re)
+
+static cnumber c_mul(cnumber a, cnumber b)
+{
+     cnumber c;
+     c.re = C_MUL_RE(a, b);
+     c.im = C_MUL_IM(a, b);
+     return c;
+}
+
+static cnumber c_div(cnumber a, cnumber b)
+{
+     cnumber c;
+     double d = 1.0 / (b.re * b.re + b.im * b.im);
+     c.re = (a.re * b.re + a.im * b.im) * d;
+     c.im = (a.im * b.re - a.re * b.im) * d;
+     return c;
+}
+
+static cnumber c_exp(cnumber a)
+{
+     cnumber c;
+     double m = exp(a.re);
+     c.re = m * cos(a.im);
+     c.im = m * sin(a.im);
+     return c;
+}
+
+static cnumber c_log(cnumber a)
+{
+     cnumber c;
+     c.re = log(sqrt(a.re * a.re + a.im * a.im));
+     c.im = atan2(a.im, a.re);
+     return c;
+}
+
+static cnumber c_sqrt(cnumber a)
+{
+     cnumber c;
+     double m = sqrt(a.re * a.re + a.im * a.im);
+     c.re = sqrt(0.5 * (m + a.re));
+     c.im = sqrt(0.5 * (m - a.re));
+     if (a.im < 0) c.im = -c.im;
+     return c;
+}
+
+static cnumber c_real(double x)
+{
+     cnumber c;
+     c.re = x; c.im = 0;
+     return c;
+}
+
+/* evaluate e at the m <= FE_BLOCK points whose parameters are
+   args[p * stride + i], storing the results in result[i], using
+   the workspace ws of e->ninstr * FE_BLOCK values */
+static void fe_eval_block(const field_expr *e, int m,
+			  const cvector3 *args, int stride,
+			  cvector3 *result, cvector3 *ws, const cvector3 **reg)
+{
+     int k, i;
+     for (k = 0; k < e->ninstr; ++k) {
+	  const fe_instr *in = e->instr + k;
+	  cvector3 *y = ws + k * FE_BLOCK;
+	  const cvector3 *a, *b, *c;
+	  if (in->op == OP_PARAM) {
+	       reg[k] = args + in->a * stride;
+	       continue;
+	  }
+	  /* (b is not a register for OP_COMP, OP_POWI, and OP_INSIDE*) */
+	  a = in->a < k ? reg[in->a] : NULL;
+	  b = in->b >= 0 && in->b < k ? reg[in->b] : NULL;
+	  c = in->c < k ? reg[in->c] : NULL;
+	  reg[k] = y;
+	  switch (in->op) {
+	      case OP_PARAM: break;
+	      case OP_CONST:
+		   for (i = 0; i < m; ++i) y[i] = in->val;
+		   break;
+#define VLOOP(expr) \
+	           if (in->type == FE_SCALAR) \
+		        for (i = 0; i < m; ++i) { expr(x); } \
+	           else \
+		        for (i = 0; i < m; ++i) { expr(x); expr(y); expr(z); }
+#define ADD(q) y[i].q.re = a[i].q.re + b[i].q.re; \
+		   y[i].q.im = a[i].q.im + b[i].q.im
+#define SUB(q) y[i].q.re = a[i].q.re - b[i].q.re; \
+		   y[i].q.im = a[i].q.im - b[i].q.im
+#define NEG(q) y[i].q.re = -a[i].q.re; y[i].q.im = -a[i].q.im
+#define CONJ(q) y[i].q.re = a[i].q.re; y[i].q.im = -a[i].q.im
+#define RE(q) y[i].q.re = a[i].q.re; y[i].q.im = 0
+#define IM(q) y[i].q.re = a[i].q.im; y[i].q.im = 0
+#define SCALE(q) y[i].q = c_mul(a[i].x, b[i].q)
+#define DIVS(q) y[i].q = c_div(a[i].q, b[i].x)
+	      case OP_ADD: VLOOP(ADD); break;
+	      case OP_SUB: VLOOP(SUB); break;
+	      case OP_NEG: VLOOP(NEG); break;
+	      case OP_CONJ: VLOOP(CONJ); break;
+	      case OP_RE: VLOOP(RE); break;
+	      case OP_IM: VLOOP(IM); break;
+	      case OP_DIVS: VLOOP(DIVS); break;
+	      case OP_SCALE:
+		   for (i = 0; i < m; ++i) { SCALE(x); SCALE(y); SCALE(z); }
+		   break;
+#undef VLOOP
+#undef ADD
+#undef SUB
+#undef NEG
+#undef CONJ
+#undef RE
+#undef IM
+#undef SCALE
+#undef DIVS
+	      case OP_MUL:
+		   for (i = 0; i < m; ++i) y[i].x = c_mul(a[i].x, b[i].x);
+		   break;
+	      case OP_DIV:
+		   for (i = 0; i < m; ++i) y[i].x = c_div(a[i].x, b[i].x);
+		   break;
+	      case OP_ABS:
+		   for (i = 0; i < m; ++i)
+			y[i].x = c_real(sqrt(a[i].x.re * a[i].x.re
+					     + a[i].x.im * a[i].x.im));
+		   break;
+	      case OP_NORM:
+		   for (i = 0; i < m; ++i)
+			y[i].x = c_real(sqrt(
+			     a[i].x.re * a[i].x.re + a[i].x.im * a[i].x.im +
+			     a[i].y.re * a[i].y.re + a[i].y.im * a[i].y.im +
+			     a[i].z.re * a[i].z.re + a[i].z.im * a[i].z.im));
+		   break;
+	      case OP_SQRT:
+		   for (i = 0; i < m; ++i) y[i].x = c_sqrt(a[i].x);
+		   break;
+	      case OP_EXP:
+		   for (i = 0; i < m; ++i) y[i].x = c_exp(a[i].x);
+		   break;
+	      case OP_LOG:
+		   for (i = 0; i < m; ++i) y[i].x = c_log(a[i].x);
+		   break;
+	      case OP_SIN: /* sin(x+iy) = sin x cosh y + i cos x sinh y */
+		   for (i = 0; i < m; ++i) {
+			y[i].x.re = sin(a[i].x.re) * cosh(a[i].x.im);
+			y[i].x.im = cos(a[i].x.re) * sinh(a[i].x.im);
+		   }
+		   break;
+	      case OP_COS: /* cos(x+iy) = cos x cosh y - i sin x sinh y */
+		   for (i = 0; i < m; ++i) {
+			y[i].x.re = cos(a[i].x.re) * cosh(a[i].x.im);
+			y[i].x.im = -sin(a[i].x.re) * sinh(a[i].x.im);
+		   }
+		   break;
+	      case OP_POW:
+		   for (i = 0; i < m; ++i)
+			y[i].x = (a[i].x.re == 0 && a[i].x.im == 0)
+			     ? c_real(b[i].x.re == 0 && b[i].x.im == 0)
+			     : c_exp(c_mul(b[i].x, c_log(a[i].x)));
+		   break;
+	      case OP_POWI:
+		   for (i = 0; i < m; ++i) {
+			cnumber p = c_real(1), s = a[i].x;
+			int n = in->b < 0 ? -in->b : in->b;
+			for (; n; n >>= 1, s = c_mul(s, s))
+			     if (n & 1) p = c_mul(p, s);
+			y[i].x = in->b < 0 ? c_div(c_real(1), p) : p;
+		   }
+		   break;
+	      case OP_DOT:
+		   for (i = 0; i < m; ++i) {
+			y[i].x.re = C_MUL_RE(a[i].x, b[i].x)
+			     + C_MUL_RE(a[i].y, b[i].y)
+			     + C_MUL_RE(a[i].z, b[i].z);
+			y[i].x.im = C_MUL_IM(a[i].x, b[i].x)
+			     + C_MUL_IM(a[i].y, b[i].y)
+			     + C_MUL_IM(a[i].z, b[i].z);
+		   }
+		   break;
+	      case OP_CDOT: /* conj(a) . b */
+		   for (i = 0; i < m; ++i) {
+			y[i].x.re = a[i].x.re * b[i].x.re + a[i].x.im * b[i].x.im
+			     + a[i].y.re * b[i].y.re + a[i].y.im * b[i].y.im
+			     + a[i].z.re * b[i].z.re + a[i].z.im * b[i].z.im;
+			y[i].x.im = a[i].x.re * b[i].x.im - a[i].x.im * b[i].x.re
+			     + a[i].y.re * b[i].y.im - a[i].y.im * b[i].y.re
+			     + a[i].z.re * b[i].z.im - a[i].z.im * b[i].z.re;
+		   }
+		   break;
+	      case OP_CROSS:
+		   for (i = 0; i < m; ++i) {
+			cvector3 v;
+			v.x.re = C_MUL_RE(a[i].y, b[i].z) - C_MUL_RE(a[i].z, b[i].y);
+			v.x.im = C_MUL_IM(a[i].y, b[i].z) - C_MUL_IM(a[i].z, b[i].y);
+			v.y.re = C_MUL_RE(a[i].z, b[i].x) - C_MUL_RE(a[i].x, b[i].z);
+			v.y.im = C_MUL_IM(a[i].z, b[i].x) - C_MUL_IM(a[i].x, b[i].z);
+			v.z.re = C_MUL_RE(a[i].x, b[i].y) - C_MUL_RE(a[i].y, b[i].x);
+			v.z.im = C_MUL_IM(a[i].x, b[i].y) - C_MUL_IM(a[i].y, b[i].x);
+			y[i] = v;
+		   }
+		   break;
+	      case OP_COMP:
+		   for (i = 0; i < m; ++i)
+			y[i].x = in->b == 0 ? a[i].x
+			     : (in->b == 1 ? a[i].y : a[i].z);
+		   break;
+	      case OP_VEC:
+		   for (i = 0; i < m; ++i) {
+			y[i].x = a[i].x; y[i].y = b[i].x; y[i].z = c[i].x;
+		   }
+		   break;
+#define CMP(op, expr) case op: \
+		   for (i = 0; i < m; ++i) y[i].x = c_real(expr); \
+		   break
+	      CMP(OP_LT, a[i].x.re < b[i].x.re);
+	      CMP(OP_GT, a[i].x.re > b[i].x.re);
+	      CMP(OP_LE, a[i].x.re <= b[i].x.re);
+	      CMP(OP_GE, a[i].x.re >= b[i].x.re);
+	      CMP(OP_EQ, a[i].x.re == b[i].x.re && a[i].x.im == b[i].x.im);
+	      CMP(OP_AND, a[i].x.re != 0 && b[i].x.re != 0);
+	      CMP(OP_OR, a[i].x.re != 0 || b[i].x.re != 0);
+	      CMP(OP_NOT, a[i].x.re == 0);
+	      CMP(OP_MAX, a[i].x.re > b[i].x.re ? a[i].x.re : b[i].x.re);
+	      CMP(OP_MIN, a[i].x.re < b[i].x.re ? a[i].x.re : b[i].x.re);
+#undef CMP
+	      case OP_IF:
+		   for (i = 0; i < m; ++i)
+			y[i] = a[i].x.re != 0 ? b[i] : c[i];
+		   break;
+	      case OP_INSIDE:
+	      case OP_INSIDE_PERIODIC:
+		   for (i = 0; i < m; ++i) {
+			vector3 p;
+			p.x = a[i].x.re; p.y = a[i].y.re; p.z = a[i].z.re;
+			y[i].x = c_real(in->op == OP_INSIDE
+				 ? point_in_fixed_objectp(p, e->objects[in->b])
+				 : point_in_periodic_fixed_objectp(
+				      p, e->objects[in->b]));
+		   }
+		   break;
+	  }
+     }
+     for (i = 0; i < m; ++i)
+	  result[i] = reg[e->result][i];
+}
+
+/*************************************************************************/
+
+/* A batch of points at which to evaluate e.  The caller stores the
+   parameters of each point with FIELD_EXPR_ARG and calls
+   field_expr_batch_push; when the batch is full, it is evaluated
+   with field_expr_batch_eval or field_expr_batch_sum.  The batch is
+   large enough that the evaluation can be split among threads. */
+
+void field_expr_batch_init(field_expr_batch *b, const field_expr *e)
+{
+     b->e = e;
+     b->n = 0;
+     b->nmax = FE_BLOCK * 64;
+     CHK_MALLOC(b->args, cvector3, e->nparams * b->nmax);
+     CHK_MALLOC(b->result, cvector3, b->nmax);
+}
+
+void field_expr_batch_destroy(field_expr_batch *b)
+{
+     free(b->result);
+     free(b->args);
+}
+
+/* evaluate the b->n pending points, storing the results in b->result */
+void field_expr_batch_eval(field_expr_batch *b)
+{
+     int nblocks = (b->n + FE_BLOCK - 1) / FE_BLOCK;
+#ifdef USE_OPENMP
+#pragma omp parallel if (nblocks > 1)
+#endif
+     {
+	  cvector3 *ws;
+	  const cvector3 **reg;
+	  int ib;
+	  CHK_MALLOC(ws, cvector3, b->e->ninstr * FE_BLOCK);
+	  CHK_MALLOC(reg, const cvector3 *, b->e->ninstr);
+#ifdef USE_OPENMP
+#pragma omp for schedule(static)
+#endif
+	  for (ib = 0; ib < nblocks; ++ib) {
+	       int i0 = ib * FE_BLOCK;
+	       int m = b->n - i0 < FE_BLOCK ? b->n - i0 : FE_BLOCK;
+	       fe_eval_block(b->e, m, b->args + i0, b->nmax,
+			     b->result + i0, ws, reg);
+	  }
+	  free(reg);
+	  free(ws);
+     }
+}
+
+/* evaluate the pending points, returning the sum of the (scalar)
+   results, and empty the batch */
+cnumber field_expr_batch_sum(field_expr_batch *b)
+{
+     cnumber sum = {0,0};
+     double re = 0, im = 0;
+     int i;
+     field_expr_batch_eval(b);
+#ifdef USE_OPENMP
+#pragma omp parallel for reduction(+:re,im) if (b->n > FE_BLOCK)
+#endif
+     for (i = 0; i < b->n; ++i) {
+	  re += b->result[i].x.re;
+	  im += b->result[i].x.im;
+     }
+     sum.re = re; sum.im = im;
+     b->n = 0;
+     return sum;
+}
@@ -328,49 +328,128 @@ void field_load(SCM src)
      scm_remember_upto_here_1(src);
 }
 
-void field_mapLB(SCM dest, function f, SCM_list src)
+/* type of the expression parameter corresponding to a field */
+static field_expr_type field_expr_type_of(const field_smob *pf)
+{
+     return pf->type == CVECTOR_FIELD_SMOB ? FE_VECTOR : FE_SCALAR;
+}
+
+/* store the value at index of pf as the next value of parameter p in
+   the batch b, conjugating vectors if conj */
+static void field_expr_arg(field_expr_batch *b, int p,
+			   const field_smob *pf, int index, int conj)
+{
+     cvector3 *v = &FIELD_EXPR_ARG(b, p);
+     switch (pf->type) {
+	 case RSCALAR_FIELD_SMOB:
+	      v->x.re = pf->f.rs[index]; v->x.im = 0;
+	      break;
+	 case CSCALAR_FIELD_SMOB:
+	      v->x.re = CSCALAR_RE(pf->f.cs[index]);
+	      v->x.im = CSCALAR_IM(pf->f.cs[index]);
+	      break;
+	 case CVECTOR_FIELD_SMOB:
+	      *v = cscalar32cvector3(pf->f.cv + 3*index);
+	      if (conj) {
+		   v->x.im = -v->x.im; v->y.im = -v->y.im; v->z.im = -v->z.im;
+	      }
+	      break;
+     }
+}
+
+/* field-map! for a compiled expression e: the batch is evaluated
+   whenever it is full, and the results for points i0..i0+n-1 stored */
+static void field_map_expr(field_smob *pd, const field_expr *e,
+			   field_smob **ps, int nsrc)
+{
+     field_expr_batch b;
+     int i, i0 = 0, j;
+     CHECK(field_expr_result_type(e) == field_expr_type_of(pd),
+	   "field-map! expression does not match the destination type");
+     field_expr_batch_init(&b, e);
+     for (i = 0; i < pd->N; ++i) {
+	  for (j = 0; j < nsrc; ++j)
+	       field_expr_arg(&b, j, ps[j], i, 0);
+	  if (++b.n == b.nmax || i == pd->N - 1) {
+	       int k;
+	       field_expr_batch_eval(&b);
+	       for (k = 0; k < b.n; ++k)
+		    switch (pd->type) {
+			case RSCALAR_FIELD_SMOB:
+			     pd->f.rs[i0 + k] = b.result[k].x.re;
+			     break;
+			case CSCALAR_FIELD_SMOB:
+			     CASSIGN_SCALAR(pd->f.cs[i0 + k],
+					    b.result[k].x.re, b.result[k].x.im);
+			     break;
+			case CVECTOR_FIELD_SMOB:
+			     cvector32cscalar3(pd->f.cv + 3*(i0 + k),
+					       b.result[k]);
+			     break;
+		    }
+	       i0 += b.n;
+	       b.n = 0;
+	  }
+     }
+     field_expr_batch_destroy(&b);
+}
+
+void field_mapLB(SCM dest, SCM f, SCM_list src)
 {
      field_smob *pd = assert_field_smob(dest);
      field_smob **ps;
+     field_expr_type *ptypes;
+     field_expr *e;
      int i, j;
      CHK_MALLOC(ps, field_smob *, src.num_items);
+     CHK_MALLOC(ptypes, field_expr_type, src.num_items + 1);
      for (j = 0; j < src.num_items; ++j) {
 	  ps[j] = assert_field_smob(src.items[j]);
 	  CHECK(fields_conform(pd, ps[j]),
 		"fields for field-map! must conform");
+	  ptypes[j] = field_expr_type_of(ps[j]);
      }
-     for (i = 0; i < pd->N; ++i) {
-	  list arg_list = SCM_EOL;
-	  SCM result;
-	  for (j = src.num_items - 1; j >= 0; --j) {
-	       SCM item = SCM_EOL;
-	       switch (ps[j]->type) {
+     if ((e = field_expr_compile(f, src.num_items, ptypes))) {
+	  field_map_expr(pd, e, ps, src.num_items);
+	  field_expr_destroy(e);
+     }
+     else {
+	  f = field_expr_procedure(f);
+	  for (i = 0; i < pd->N; ++i) {
+	       list arg_list = SCM_EOL;
+	       SCM result;
+	       for (j = src.num_items - 1; j >= 0; --j) {
+		    SCM item = SCM_EOL;
+		    switch (ps[j]->type) {
+			case RSCALAR_FIELD_SMOB:
+			     item = ctl_convert_number_to_scm(ps[j]->f.rs[i]);
+			     break;
+			case CSCALAR_FIELD_SMOB:
+			     item = cnumber2scm(cscalar2cnumber(
+				  ps[j]->f.cs[i]));
+			     break;
+			case CVECTOR_FIELD_SMOB:
+			     item = cvector32scm(cscalar32cvector3(
+				  ps[j]->f.cv+3*i));
+			     break;
+		    }
+		    arg_list = gh_cons(item, arg_list);
+	       }
+	       result = gh_apply(f, arg_list);
+	       switch (pd->type) {
 		   case RSCALAR_FIELD_SMOB:
-			item = ctl_convert_number_to_scm(ps[j]->f.rs[i]);
+			pd->f.rs[i] = ctl_convert_number_to_c(result);
 			break;
 		   case CSCALAR_FIELD_SMOB:
-			item = cnumber2scm(cscalar2cnumber(ps[j]->f.cs[i]));
+			pd->f.cs[i] = cnumber2cscalar(scm2cnumber(result));
 			break;
 		   case CVECTOR_FIELD_SMOB:
-			item = 
-			     cvector32scm(cscalar32cvector3(ps[j]->f.cv+3*i));
+			cvector32cscalar3(pd->f.cv+3*i, scm2cvector3(result));
 			break;
 	       }
-	       arg_list = gh_cons(item, arg_list);
-	  }
-	  result = gh_apply(f, arg_list);
-	  switch (pd->type) {
-	      case RSCALAR_FIELD_SMOB:
-		   pd->f.rs[i] = ctl_convert_number_to_c(result);
-		   break;
-	      case CSCALAR_FIELD_SMOB:
-		   pd->f.cs[i] = cnumber2cscalar(scm2cnumber(result));
-		   break;
-	      case CVECTOR_FIELD_SMOB:
-		   cvector32cscalar3(pd->f.cv+3*i, scm2cvector3(result));
-		   break;
 	  }
      }
+     free(ptypes);
      if (src.num_items == 1 && ps[0]->type == pd->type)
 	  pd->type_char = ps[0]->type_char;
      else if (src.num_items > 1)
@@ -401,8 +480,27 @@ static cvector3 cvector3_conj(cvector3 c)
      return cc;
 }
 
+/* add the point p, with the fields at index, to the batch b for
+   integrate-fields, adding the results to the integral if it is full */
+static void integrate_expr_point(field_expr_batch *b, vector3 p,
+				 field_smob **pf, int nfields, int index,
+				 int conj, cnumber *integral)
+{
+     cvector3 *r = &FIELD_EXPR_ARG(b, 0);
+     int ifield;
+     r->x.re = p.x; r->y.re = p.y; r->z.re = p.z;
+     r->x.im = r->y.im = r->z.im = 0;
+     for (ifield = 0; ifield < nfields; ++ifield)
+	  field_expr_arg(b, ifield + 1, pf[ifield], index, conj);
+     if (++b->n == b->nmax) {
+	  cnumber sum = field_expr_batch_sum(b);
+	  integral->re += sum.re;
+	  integral->im += sum.im;
+     }
+}
+
 /* Compute the integral of f(r, {fields}) over the cell. */
-cnumber integrate_fieldL(function f, SCM_list fields)
+cnumber integrate_fieldL(SCM f, SCM_list fields)
 {
      int i, j, k, n1, n2, n3, n_other, n_last, rank, last_dim;
 #ifdef HAVE_MPI
@@ -412,13 +510,28 @@ cnumber integrate_fieldL(function f, SCM_list fields)
      int ifield;
      field_smob **pf;
      cnumber integral = {0,0};
+     field_expr_type *ptypes;
+     field_expr *e;
+     field_expr_batch b;
 
      CHK_MALLOC(pf, field_smob *, fields.num_items);
+     CHK_MALLOC(ptypes, field_expr_type, fields.num_items + 1);
+     ptypes[0] = FE_VECTOR; /* r */
      for (ifield = 0; ifield < fields.num_items; ++ifield) {
           pf[ifield] = assert_field_smob(fields.items[ifield]);
           CHECK(fields_conform(pf[0], pf[ifield]),
                 "fields for integrate-fields must conform");
+	  ptypes[ifield + 1] = field_expr_type_of(pf[ifield]);
      }
+     e = field_expr_compile(f, fields.num_items + 1, ptypes);
+     free(ptypes);
+     if (e) {
+	  CHECK(field_expr_result_type(e) == FE_SCALAR,
+		"integrate-fields expression must return a number");
+	  field_expr_batch_init(&b, e);
+     }
+     else
+	  f = field_expr_procedure(f);
 
      if (fields.num_items > 0) {
 	  n1 = pf[0]->nx; n2 = pf[0]->ny; n3 = pf[0]->nz;
@@ -544,27 +657,35 @@ cnumber integrate_fieldL(function f, SCM_list fields)
 
 	       p.x = i2 * s1 - c1; p.y = j2 * s2 - c2; p.z = k2 * s3 - c3;
 
-	       for (ifield = fields.num_items - 1; ifield >= 0; --ifield) {
-		    SCM item = SCM_EOL;
-		    switch (pf[ifield]->type) {
-			case RSCALAR_FIELD_SMOB:
-			     item = ctl_convert_number_to_scm(pf[ifield]->f.rs[index]);
-			     break;
-			case CSCALAR_FIELD_SMOB:
-			     item = cnumber2scm(cscalar2cnumber(
-				  pf[ifield]->f.cs[index]));
-			     break;
-			case CVECTOR_FIELD_SMOB:
-                        item = cvector32scm(cscalar32cvector3(
-			     pf[ifield]->f.cv+3*index));
-                        break;
+	       if (e)
+		    integrate_expr_point(&b, p, pf, fields.num_items, index,
+					 0, &integral);
+	       else {
+		    for (ifield = fields.num_items - 1; ifield >= 0;
+			 --ifield) {
+			 SCM item = SCM_EOL;
+			 switch (pf[ifield]->type) {
+			     case RSCALAR_FIELD_SMOB:
+				  item = ctl_convert_number_to_scm(
+				       pf[ifield]->f.rs[index]);
+				  break;
+			     case CSCALAR_FIELD_SMOB:
+				  item = cnumber2scm(cscalar2cnumber(
+				       pf[ifield]->f.cs[index]));
+				  break;
+			     case CVECTOR_FIELD_SMOB:
+				  item = cvector32scm(cscalar32cvector3(
+				       pf[ifield]->f.cv+3*index));
+				  break;
+			 }
+			 arg_list = gh_cons(item, arg_list);
 		    }
-		    arg_list = gh_cons(item, arg_list);
+		    arg_list = gh_cons(vector32scm(p), arg_list);
+		    integrand =
+			 ctl_convert_cnumber_to_c(gh_apply(f, arg_list));
+		    integral.re += integrand.re;
+		    integral.im += integrand.im;
 	       }
-	       arg_list = gh_cons(vector32scm(p), arg_list);
-	       integrand = ctl_convert_cnumber_to_c(gh_apply(f, arg_list));
-	       integral.re += integrand.re;
-	       integral.im += integrand.im;
 
 #ifndef SCALAR_COMPLEX
 	       {
@@ -586,32 +707,38 @@ cnumber integrate_fieldL(function f, SCM_list fields)
                          p.x = i2c * s1 - c1;
                          p.y = j2c * s2 - c2;
 			 p.z = k2c * s3 - c3;
-			 arg_list = SCM_EOL;
-			 for (ifield = fields.num_items - 1; 
-			      ifield >= 0; --ifield) {
-			      SCM item = SCM_UNDEFINED;
-			      switch (pf[ifield]->type) {
-				  case RSCALAR_FIELD_SMOB:
-				       item = ctl_convert_number_to_scm(
-					    pf[ifield]->f.rs[index]);
-				       break;
-				  case CSCALAR_FIELD_SMOB:
-				       item = cnumber2scm(cscalar2cnumber(
-					    pf[ifield]->f.cs[index]));
-				       break;
-				  case CVECTOR_FIELD_SMOB:
-				       item = cvector32scm(
-					    cvector3_conj(cscalar32cvector3(
-						 pf[ifield]->f.cv+3*index)));
-				       break;
+			 if (e)
+			      integrate_expr_point(&b, p, pf, fields.num_items,
+						   index, 1, &integral);
+			 else {
+			      arg_list = SCM_EOL;
+			      for (ifield = fields.num_items - 1; 
+				   ifield >= 0; --ifield) {
+				   SCM item = SCM_UNDEFINED;
+				   switch (pf[ifield]->type) {
+				       case RSCALAR_FIELD_SMOB:
+					    item = ctl_convert_number_to_scm(
+						 pf[ifield]->f.rs[index]);
+					    break;
+				       case CSCALAR_FIELD_SMOB:
+					    item = cnumber2scm(cscalar2cnumber(
+						 pf[ifield]->f.cs[index]));
+					    break;
+				       case CVECTOR_FIELD_SMOB:
+					    item = cvector32scm(cvector3_conj(
+						 cscalar32cvector3(
+						      pf[ifield]->f.cv
+						      + 3*index)));
+					    break;
+				   }
+				   arg_list = gh_cons(item, arg_list);
 			      }
-			      arg_list = gh_cons(item, arg_list);
+			      arg_list = gh_cons(vector32scm(p), arg_list);
+			      integrand = ctl_convert_cnumber_to_c(
+				   gh_apply(f, arg_list));
+			      integral.re += integrand.re;
+			      integral.im += integrand.im;
 			 }
-			 arg_list = gh_cons(vector32scm(p), arg_list);
-			 integrand = 
-			      ctl_convert_cnumber_to_c(gh_apply(f, arg_list));
-			 integral.re += integrand.re;
-			 integral.im += integrand.im;
 		    }
 	       }
 #endif
@@ -619,6 +746,13 @@ cnumber integrate_fieldL(function f, SCM_list fields)
      }
 
      free(pf);
+     if (e) {
+	  cnumber sum = field_expr_batch_sum(&b);
+	  integral.re += sum.re;
+	  integral.im += sum.im;
+	  field_expr_batch_destroy(&b);
+	  field_expr_destroy(e);
+     }
 
      integral.re *= Vol / (n1 * n2 * n3);
      integral.im *= Vol / (n1 * n2 * n3);
@@ -54,4 +54,29 @@ extern field_smob *update_curfield_smob(void);
 extern void register_field_smobs(void);
 extern field_smob *assert_field_smob(SCM fo);
 
+/* field-expr.c: natively-evaluated field expressions */
+
+typedef enum { FE_SCALAR, FE_VECTOR, FE_BOOLEAN } field_expr_type;
+typedef struct field_expr_struct field_expr;
+
+typedef struct {
+     const field_expr *e;
+     int n, nmax; /* number of pending points, and max number */
+     cvector3 *args; /* args[p * nmax + i] is parameter p at point i */
+     cvector3 *result; /* result[i] is the value at point i */
+} field_expr_batch;
+
+/* parameter p of the next point to add to the batch b */
+#define FIELD_EXPR_ARG(b, p) ((b)->args[(p) * (b)->nmax + (b)->n])
+
+extern field_expr *field_expr_compile(SCM f, int nparams,
+				      const field_expr_type *ptypes);
+extern void field_expr_destroy(field_expr *e);
+extern field_expr_type field_expr_result_type(const field_expr *e);
+extern SCM field_expr_procedure(SCM f);
+extern void field_expr_batch_init(field_expr_batch *b, const field_expr *e);
+extern void field_expr_batch_destroy(field_expr_batch *b);
+extern void field_expr_batch_eval(field_expr_batch *b);
+extern cnumber field_expr_batch_sum(field_expr_batch *b);
+
 #endif /* FIELD_SMOB_H */
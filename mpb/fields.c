@@ -17,6 +17,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <ctype.h>
 #include <stddef.h>
@@ -546,9 +547,14 @@ void fix_field_phase(void)
 /* Functions to return epsilon, fields, energies, etcetera, at a specified
    point, linearly interpolating if necessary. */
 
-static real get_val(int ix, int iy, int iz,
-		    int nx, int ny, int nz, int last_dim_size,
-		    real *data, int stride, int conjugate)
+/* Return a pointer to the data for the grid point (ix,iy,iz), or NULL
+   if that point is stored on another process.  For real fields, where
+   the last dimension is cut in half, *conjugate is set if the point
+   is stored as the conjugate of its mirror image. */
+static real *get_val_ptr(int ix, int iy, int iz,
+			 int nx, int ny, int nz, int last_dim_size,
+			 int local_ny, int local_y_start,
+			 real *data, int stride, int *conjugate)
 {
 #ifndef SCALAR_COMPLEX
      {
@@ -557,111 +563,191 @@ static real get_val(int ix, int iy, int iz,
 	       ix = ix ? nx - ix : ix;
 	       iy = iy ? ny - iy : iy;
 	       iz = iz ? nz - iz : iz;
-	       conjugate = conjugate ? 1 : 0;
+	       *conjugate = 1;
 	  }
 	  else
-	       conjugate = 0;
+	       *conjugate = 0;
 	  if (nz > 1) nz = nlast; else if (ny > 1) ny = nlast; else nx = nlast;
      }
 #else
-     conjugate = 0;
+     *conjugate = 0;
 #endif
 
 #ifdef HAVE_MPI
-     CHECK(0, "get-*-point not yet implemented for MPI!");
+     /* first two dimensions are transposed in MPI output, and this
+	process only has local_ny of the y coordinates: */
+     if (iy < local_y_start || iy >= local_y_start + local_ny)
+	  return NULL;
+     return data + (((iy - local_y_start) * nx + ix) * nz + iz) * stride;
 #else
-     if (conjugate)
-	  return -data[(((ix * ny) + iy) * nz + iz) * stride];
-     else
-	  return data[(((ix * ny) + iy) * nz + iz) * stride];
+     return data + (((ix * ny) + iy) * nz + iz) * stride;
 #endif
 }
 
-static real interp_val(vector3 p, int nx, int ny, int nz, int last_dim_size,
-		       real *data, int stride, int conjugate)
+/* Linearly interpolate the nv real components data[0..nv-1] of each grid
+   point (separated by stride) at the npts points p, storing component c
+   at point i in vals[i*nv + c].  The components c >= cstart are
+   (re,im) pairs, whose imaginary parts are negated at conjugated grid
+   points.  The grid weights are computed once per point, not once per
+   component.  Under MPI, each process adds in the grid points that it
+   owns, and a single allreduce for all of the points sums the results.
+   Threads are only used for at least INTERP_OMP_MIN points, so that the
+   one-point get-*-point calls don't pay for a parallel region. */
+#define INTERP_OMP_MIN 256
+static void interp_vals(int npts, const vector3 *p,
+			int nx, int ny, int nz, int last_dim_size,
+			int local_ny, int local_y_start,
+			real *data, int stride, int nv, int cstart,
+			real *vals)
 {
-     double ipart;
-     real rx, ry, rz, dx, dy, dz;
-     int x, y, z, x2, y2, z2;
-
-     rx = modf(p.x/geometry_lattice.size.x + 0.5, &ipart); if (rx < 0) rx += 1;
-     ry = modf(p.y/geometry_lattice.size.y + 0.5, &ipart); if (ry < 0) ry += 1;
-     rz = modf(p.z/geometry_lattice.size.z + 0.5, &ipart); if (rz < 0) rz += 1;
-
-     /* get the point corresponding to r in the grid: */
-     x = rx * nx;
-     y = ry * ny;
-     z = rz * nz;
-
-     /* get the difference between (x,y,z) and the actual point */
-     dx = rx * nx - x;
-     dy = ry * ny - y;
-     dz = rz * nz - z;
-
-     /* get the other closest point in the grid, with periodic boundaries: */
-     x2 = (nx + (dx >= 0.0 ? x + 1 : x - 1)) % nx;
-     y2 = (ny + (dy >= 0.0 ? y + 1 : y - 1)) % ny;
-     z2 = (nz + (dz >= 0.0 ? z + 1 : z - 1)) % nz;
-
-     /* take abs(d{xyz}) to get weights for {xyz} and {xyz}2: */
-     dx = fabs(dx);
-     dy = fabs(dy);
-     dz = fabs(dz);
-
-#define D(x,y,z) (get_val(x,y,z,nx,ny,nz,last_dim_size, data,stride,conjugate))
-
-     return(((D(x,y,z)*(1.0-dx) + D(x2,y,z)*dx) * (1.0-dy) +
-             (D(x,y2,z)*(1.0-dx) + D(x2,y2,z)*dx) * dy) * (1.0-dz) +
-            ((D(x,y,z2)*(1.0-dx) + D(x2,y,z2)*dx) * (1.0-dy) +
-             (D(x,y2,z2)*(1.0-dx) + D(x2,y2,z2)*dx) * dy) * dz);
-
-#undef D
-}
+     int i;
+     real *vals_local;
 
-static scalar_complex interp_cval(vector3 p, 
-				  int nx, int ny, int nz, int last_dim_size,
-				  real *data, int stride)
-{
-     scalar_complex cval;
-     cval.re = interp_val(p, nx,ny,nz,last_dim_size, data, stride, 0);
-     cval.im = interp_val(p, nx,ny,nz,last_dim_size,data + 1, stride, 1);
-     return cval;
+#ifdef HAVE_MPI
+     CHK_MALLOC(vals_local, real, npts * nv);
+#else
+     vals_local = vals;
+#endif
+
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static) if (npts >= INTERP_OMP_MIN)
+#endif
+     for (i = 0; i < npts; ++i) {
+	  double ipart;
+	  real rx, ry, rz, dx, dy, dz;
+	  int x, y, z, x2, y2, z2, c, corner;
+	  real *v = vals_local + i * nv;
+
+	  rx = modf(p[i].x/geometry_lattice.size.x + 0.5, &ipart);
+	  if (rx < 0) rx += 1;
+	  ry = modf(p[i].y/geometry_lattice.size.y + 0.5, &ipart);
+	  if (ry < 0) ry += 1;
+	  rz = modf(p[i].z/geometry_lattice.size.z + 0.5, &ipart);
+	  if (rz < 0) rz += 1;
+
+	  /* get the point corresponding to r in the grid: */
+	  x = rx * nx;
+	  y = ry * ny;
+	  z = rz * nz;
+
+	  /* get the difference between (x,y,z) and the actual point */
+	  dx = rx * nx - x;
+	  dy = ry * ny - y;
+	  dz = rz * nz - z;
+
+	  /* get the other closest point in the grid, with periodic
+	     boundaries: */
+	  x2 = (nx + (dx >= 0.0 ? x + 1 : x - 1)) % nx;
+	  y2 = (ny + (dy >= 0.0 ? y + 1 : y - 1)) % ny;
+	  z2 = (nz + (dz >= 0.0 ? z + 1 : z - 1)) % nz;
+
+	  /* take abs(d{xyz}) to get weights for {xyz} and {xyz}2: */
+	  dx = fabs(dx);
+	  dy = fabs(dy);
+	  dz = fabs(dz);
+
+	  for (c = 0; c < nv; ++c)
+	       v[c] = 0;
+
+	  /* bit 0/1/2 of corner selects x2/y2/z2: */
+	  for (corner = 0; corner < 8; ++corner) {
+	       int conjugate;
+	       real w = ((corner & 1) ? dx : 1.0 - dx)
+		    * ((corner & 2) ? dy : 1.0 - dy)
+		    * ((corner & 4) ? dz : 1.0 - dz);
+	       real *d = get_val_ptr((corner & 1) ? x2 : x,
+				     (corner & 2) ? y2 : y,
+				     (corner & 4) ? z2 : z,
+				     nx, ny, nz, last_dim_size,
+				     local_ny, local_y_start,
+				     data, stride, &conjugate);
+	       if (!d)
+		    continue;
+	       for (c = 0; c < nv; ++c)
+		    if (conjugate && c >= cstart && (c - cstart) % 2)
+			 v[c] -= w * d[c];
+		    else
+			 v[c] += w * d[c];
+	  }
+     }
+
+#ifdef HAVE_MPI
+     mpi_allreduce(vals_local, vals, npts * nv, real, SCALAR_MPI_TYPE,
+		   MPI_SUM, mpb_comm);
+     free(vals_local);
+#endif
 }
 
-#define f_interp_val(p,f,data,stride,conj) interp_val(p,f->nx,f->ny,f->nz,f->last_dim_size,data,stride,conj)
-#define f_interp_cval(p,f,data,stride) interp_cval(p,f->nx,f->ny,f->nz,f->last_dim_size,data,stride)
+#define f_interp_vals(n,p,f,data,stride,nv,cstart,vals) interp_vals(n,p,f->nx,f->ny,f->nz,f->last_dim_size,f->local_ny,f->local_y_start,data,stride,nv,cstart,vals)
 
-static symmetric_matrix interp_eps_inv(vector3 p)
+static void interp_eps_inv(int npts, const vector3 *p,
+			   symmetric_matrix *eps_inv)
 {
      int stride = sizeof(symmetric_matrix) / sizeof(real);
-     symmetric_matrix eps_inv;
-
-     eps_inv.m00 = f_interp_val(p, mdata, &mdata->eps_inv->m00, stride, 0);
-     eps_inv.m11 = f_interp_val(p, mdata, &mdata->eps_inv->m11, stride, 0);
-     eps_inv.m22 = f_interp_val(p, mdata, &mdata->eps_inv->m22, stride, 0);
 #ifdef WITH_HERMITIAN_EPSILON
-     eps_inv.m01 = f_interp_cval(p, mdata, &mdata->eps_inv->m01.re, stride);
-     eps_inv.m02 = f_interp_cval(p, mdata, &mdata->eps_inv->m02.re, stride);
-     eps_inv.m12 = f_interp_cval(p, mdata, &mdata->eps_inv->m12.re, stride);
+     int cstart = 3; /* m01, m02, m12 are complex */
 #else
-     eps_inv.m01 = f_interp_val(p, mdata, &mdata->eps_inv->m01, stride, 0);
-     eps_inv.m02 = f_interp_val(p, mdata, &mdata->eps_inv->m02, stride, 0);
-     eps_inv.m12 = f_interp_val(p, mdata, &mdata->eps_inv->m12, stride, 0);
+     int cstart = stride;
 #endif
-     return eps_inv;
+     f_interp_vals(npts, p, mdata, (real *) mdata->eps_inv, stride,
+		   stride, cstart, (real *) eps_inv);
+}
+
+/* Convert the interpolated (re,im) x,y,z components in vals to the
+   cvector3 array F, multiplying by the Bloch phase if phase is true. */
+static void vals_to_cvector3(int npts, const vector3 *p, const real *vals,
+			     int phase, cvector3 *F)
+{
+     int i;
+     for (i = 0; i < npts; ++i) {
+	  scalar_complex field[3];
+	  const real *v = vals + i * 6;
+
+	  CASSIGN_SCALAR(field[0], v[0], v[1]);
+	  CASSIGN_SCALAR(field[1], v[2], v[3]);
+	  CASSIGN_SCALAR(field[2], v[4], v[5]);
+
+	  if (phase) {
+	       scalar_complex ph;
+	       double phase_phi = TWOPI * 
+		    (cur_kvector.x * (p[i].x/geometry_lattice.size.x) +
+		     cur_kvector.y * (p[i].y/geometry_lattice.size.y) +
+		     cur_kvector.z * (p[i].z/geometry_lattice.size.z));
+	       CASSIGN_SCALAR(ph, cos(phase_phi), sin(phase_phi));
+	       CASSIGN_MULT(field[0], field[0], ph);
+	       CASSIGN_MULT(field[1], field[1], ph);
+	       CASSIGN_MULT(field[2], field[2], ph);
+	  }
+
+	  F[i].x = cscalar2cnumber(field[0]);
+	  F[i].y = cscalar2cnumber(field[1]);
+	  F[i].z = cscalar2cnumber(field[2]);
+     }
+}
+
+static scalar_complex cscalar_phase(vector3 p, scalar_complex s)
+{
+     scalar_complex phase;
+     double phase_phi = TWOPI * 
+	  (cur_kvector.x * (p.x/geometry_lattice.size.x) +
+	   cur_kvector.y * (p.y/geometry_lattice.size.y) +
+	   cur_kvector.z * (p.z/geometry_lattice.size.z));
+     CASSIGN_SCALAR(phase, cos(phase_phi), sin(phase_phi));
+     CASSIGN_MULT(s, s, phase);
+     return s;
 }
 
 number get_epsilon_point(vector3 p)
 {
      symmetric_matrix eps_inv;
-     eps_inv = interp_eps_inv(p);
+     interp_eps_inv(1, &p, &eps_inv);
      return mean_medium_from_matrix(&eps_inv);
 }
 
 cmatrix3x3 get_epsilon_inverse_tensor_point(vector3 p)
 {
      symmetric_matrix eps_inv;
-     eps_inv = interp_eps_inv(p);
+     interp_eps_inv(1, &p, &eps_inv);
 
 #ifdef WITH_HERMITIAN_EPSILON
      return make_hermitian_cmatrix3x3(eps_inv.m00,eps_inv.m11,eps_inv.m22,
@@ -678,61 +764,46 @@ cmatrix3x3 get_epsilon_inverse_tensor_point(vector3 p)
 
 number get_energy_point(vector3 p)
 {
+     real energy;
      CHECK(curfield && strchr("DHBR", curfield_type),
 	   "compute-field-energy must be called before get-energy-point");
-     return f_interp_val(p, mdata, (real *) curfield, 1, 0);
+     f_interp_vals(1, &p, mdata, (real *) curfield, 1, 1, 1, &energy);
+     return energy;
 }
 
 cvector3 get_bloch_field_point(vector3 p)
 {
-     scalar_complex field[3];
+     real vals[6];
      cvector3 F;
 
      CHECK(curfield && strchr("dhbecv", curfield_type),
 	   "field must be must be loaded before get-*field*-point");
-     field[0] = f_interp_cval(p, mdata, &curfield[0].re, 6);
-     field[1] = f_interp_cval(p, mdata, &curfield[1].re, 6);
-     field[2] = f_interp_cval(p, mdata, &curfield[2].re, 6);
-     F.x = cscalar2cnumber(field[0]);
-     F.y = cscalar2cnumber(field[1]);
-     F.z = cscalar2cnumber(field[2]);
+     f_interp_vals(1, &p, mdata, &curfield[0].re, 6, 6, 0, vals);
+     vals_to_cvector3(1, &p, vals, 0, &F);
      return F;
 }
 
 cvector3 get_field_point(vector3 p)
 {
-     scalar_complex field[3], phase;
+     real vals[6];
      cvector3 F;
 
      CHECK(curfield && strchr("dhbecv", curfield_type),
 	   "field must be must be loaded before get-*field*-point");
-     field[0] = f_interp_cval(p, mdata, &curfield[0].re, 6);
-     field[1] = f_interp_cval(p, mdata, &curfield[1].re, 6);
-     field[2] = f_interp_cval(p, mdata, &curfield[2].re, 6);
-
-     if (curfield_type != 'v') {
-	  double phase_phi = TWOPI * 
-	       (cur_kvector.x * (p.x/geometry_lattice.size.x) +
-		cur_kvector.y * (p.y/geometry_lattice.size.y) +
-		cur_kvector.z * (p.z/geometry_lattice.size.z));
-	  CASSIGN_SCALAR(phase, cos(phase_phi), sin(phase_phi));
-	  CASSIGN_MULT(field[0], field[0], phase);
-	  CASSIGN_MULT(field[1], field[1], phase);
-	  CASSIGN_MULT(field[2], field[2], phase);
-     }
-
-     F.x = cscalar2cnumber(field[0]);
-     F.y = cscalar2cnumber(field[1]);
-     F.z = cscalar2cnumber(field[2]);
+     f_interp_vals(1, &p, mdata, &curfield[0].re, 6, 6, 0, vals);
+     vals_to_cvector3(1, &p, vals, curfield_type != 'v', &F);
      return F;
 }
 
 cnumber get_bloch_cscalar_point(vector3 p)
 {
+     scalar_complex s;
+
      CHECK(curfield && strchr("C", curfield_type),
 	   "cscalar must be must be loaded before get-*cscalar*-point");
      
-     return cscalar2cnumber(f_interp_cval(p, mdata, &curfield[0].re, 2));
+     f_interp_vals(1, &p, mdata, &curfield[0].re, 2, 2, 0, &s.re);
+     return cscalar2cnumber(s);
 }
 
 cnumber get_cscalar_point(vector3 p)
@@ -742,81 +813,57 @@ cnumber get_cscalar_point(vector3 p)
      CHECK(curfield && strchr("C", curfield_type),
 	   "cscalar must be must be loaded before get-*cscalar*-point");
      
-     s = f_interp_cval(p, mdata, &curfield[0].re, 2);
-
-     if (curfield_type == 'C') {
-	  scalar_complex phase;
-	  double phase_phi = TWOPI * 
-	       (cur_kvector.x * (p.x/geometry_lattice.size.x) +
-		cur_kvector.y * (p.y/geometry_lattice.size.y) +
-		cur_kvector.z * (p.z/geometry_lattice.size.z));
-	  CASSIGN_SCALAR(phase, cos(phase_phi), sin(phase_phi));
-	  CASSIGN_MULT(s, s, phase);
-     }
+     f_interp_vals(1, &p, mdata, &curfield[0].re, 2, 2, 0, &s.re);
+
+     if (curfield_type == 'C')
+	  s = cscalar_phase(p, s);
 
      return cscalar2cnumber(s);
 }
 
 number rscalar_field_get_point(SCM fo, vector3 p)
 {
+     real val;
      field_smob *f = assert_field_smob(fo);
      CHECK(f->type == RSCALAR_FIELD_SMOB, 
 	   "invalid argument to rscalar-field-get-point");
-     return f_interp_val(p, f, f->f.rs, 1, 0);
+     f_interp_vals(1, &p, f, f->f.rs, 1, 1, 1, &val);
+     return val;
 }
 
 cvector3 cvector_field_get_point_bloch(SCM fo, vector3 p)
 {
-     scalar_complex field[3];
+     real vals[6];
      cvector3 F;
      field_smob *f = assert_field_smob(fo);
      CHECK(f->type == CVECTOR_FIELD_SMOB, 
 	   "invalid argument to cvector-field-get-point");
-     field[0] = f_interp_cval(p, f, &f->f.cv[0].re, 6);
-     field[1] = f_interp_cval(p, f, &f->f.cv[1].re, 6);
-     field[2] = f_interp_cval(p, f, &f->f.cv[2].re, 6);
-     F.x = cscalar2cnumber(field[0]);
-     F.y = cscalar2cnumber(field[1]);
-     F.z = cscalar2cnumber(field[2]);
+     f_interp_vals(1, &p, f, &f->f.cv[0].re, 6, 6, 0, vals);
+     vals_to_cvector3(1, &p, vals, 0, &F);
      return F;
 }
 
 cvector3 cvector_field_get_point(SCM fo, vector3 p)
 {
-     scalar_complex field[3];
+     real vals[6];
      cvector3 F;
      field_smob *f = assert_field_smob(fo);
      CHECK(f->type == CVECTOR_FIELD_SMOB, 
 	   "invalid argument to cvector-field-get-point");
-
-     field[0] = f_interp_cval(p, f, &f->f.cv[0].re, 6);
-     field[1] = f_interp_cval(p, f, &f->f.cv[1].re, 6);
-     field[2] = f_interp_cval(p, f, &f->f.cv[2].re, 6);
-     
-     if (f->type_char != 'v') { /* v fields have no kvector */
-	  scalar_complex phase;
-	  double phase_phi = TWOPI * 
-	       (cur_kvector.x * (p.x/geometry_lattice.size.x) +
-		cur_kvector.y * (p.y/geometry_lattice.size.y) +
-		cur_kvector.z * (p.z/geometry_lattice.size.z));
-	  CASSIGN_SCALAR(phase, cos(phase_phi), sin(phase_phi));
-	  CASSIGN_MULT(field[0], field[0], phase);
-	  CASSIGN_MULT(field[1], field[1], phase);
-	  CASSIGN_MULT(field[2], field[2], phase);
-     }
-
-     F.x = cscalar2cnumber(field[0]);
-     F.y = cscalar2cnumber(field[1]);
-     F.z = cscalar2cnumber(field[2]);
+     f_interp_vals(1, &p, f, &f->f.cv[0].re, 6, 6, 0, vals);
+     /* v fields have no kvector */
+     vals_to_cvector3(1, &p, vals, f->type_char != 'v', &F);
      return F;
 }
 
 cnumber cscalar_field_get_point_bloch(SCM fo, vector3 p)
 {
+     scalar_complex s;
      field_smob *f = assert_field_smob(fo);
      CHECK(f->type == CSCALAR_FIELD_SMOB, 
 	   "invalid argument to cscalar-field-get-point-bloch");
-     return cscalar2cnumber(f_interp_cval(p, f, &f->f.cv[0].re, 2));
+     f_interp_vals(1, &p, f, &f->f.cs[0].re, 2, 2, 0, &s.re);
+     return cscalar2cnumber(s);
 }
 
 cnumber cscalar_field_get_point(SCM fo, vector3 p)
@@ -826,21 +873,106 @@ cnumber cscalar_field_get_point(SCM fo, vector3 p)
      CHECK(f->type == CSCALAR_FIELD_SMOB, 
 	   "invalid argument to cscalar-field-get-point");
 
-     s = f_interp_cval(p, f, &f->f.cv[0].re, 2);
+     f_interp_vals(1, &p, f, &f->f.cs[0].re, 2, 2, 0, &s.re);
      
-     if (f->type_char == 'C') { /* have kvector */
-	  scalar_complex phase;
-	  double phase_phi = TWOPI * 
-	       (cur_kvector.x * (p.x/geometry_lattice.size.x) +
-		cur_kvector.y * (p.y/geometry_lattice.size.y) +
-		cur_kvector.z * (p.z/geometry_lattice.size.z));
-	  CASSIGN_SCALAR(phase, cos(phase_phi), sin(phase_phi));
-	  CASSIGN_MULT(s, s, phase);
-     }
+     if (f->type_char == 'C') /* have kvector */
+	  s = cscalar_phase(p, s);
 
      return cscalar2cnumber(s);
 }
 
+/* Batched versions of the get-*-point functions, which interpolate
+   a whole list of points at once (with a single MPI reduction),
+   avoiding the per-point overhead of calling from Guile. */
+
+number_list get_epsilon_points(vector3_list p)
+{
+     number_list eps;
+     symmetric_matrix *eps_inv;
+     int i;
+
+     CHK_MALLOC(eps_inv, symmetric_matrix, p.num_items);
+     interp_eps_inv(p.num_items, p.items, eps_inv);
+     eps.num_items = p.num_items;
+     CHK_MALLOC(eps.items, number, eps.num_items);
+     for (i = 0; i < p.num_items; ++i)
+	  eps.items[i] = mean_medium_from_matrix(eps_inv + i);
+     free(eps_inv);
+     return eps;
+}
+
+number_list get_energy_points(vector3_list p)
+{
+     number_list energy;
+     real *vals;
+     int i;
+
+     CHECK(curfield && strchr("DHBR", curfield_type),
+	   "compute-field-energy must be called before get-energy-points");
+     CHK_MALLOC(vals, real, p.num_items);
+     f_interp_vals(p.num_items, p.items, mdata, (real *) curfield, 1, 1, 1,
+		   vals);
+     energy.num_items = p.num_items;
+     CHK_MALLOC(energy.items, number, energy.num_items);
+     for (i = 0; i < p.num_items; ++i)
+	  energy.items[i] = vals[i];
+     free(vals);
+     return energy;
+}
+
+static cvector3_list interp_cvector_points(vector3_list p, real *data,
+					   int nx, int ny, int nz,
+					   int last_dim_size,
+					   int local_ny, int local_y_start,
+					   int phase)
+{
+     cvector3_list F;
+     real *vals;
+
+     CHK_MALLOC(vals, real, p.num_items * 6);
+     interp_vals(p.num_items, p.items, nx, ny, nz, last_dim_size,
+		 local_ny, local_y_start, data, 6, 6, 0, vals);
+     F.num_items = p.num_items;
+     CHK_MALLOC(F.items, cvector3, F.num_items);
+     vals_to_cvector3(p.num_items, p.items, vals, phase, F.items);
+     free(vals);
+     return F;
+}
+
+#define f_interp_cvector_points(p,f,data,phase) interp_cvector_points(p,data,f->nx,f->ny,f->nz,f->last_dim_size,f->local_ny,f->local_y_start,phase)
+
+cvector3_list get_bloch_field_points(vector3_list p)
+{
+     CHECK(curfield && strchr("dhbecv", curfield_type),
+	   "field must be must be loaded before get-*field*-points");
+     return f_interp_cvector_points(p, mdata, &curfield[0].re, 0);
+}
+
+cvector3_list get_field_points(vector3_list p)
+{
+     CHECK(curfield && strchr("dhbecv", curfield_type),
+	   "field must be must be loaded before get-*field*-points");
+     return f_interp_cvector_points(p, mdata, &curfield[0].re,
+				    curfield_type != 'v');
+}
+
+cvector3_list cvector_field_get_points_bloch(SCM fo, vector3_list p)
+{
+     field_smob *f = assert_field_smob(fo);
+     CHECK(f->type == CVECTOR_FIELD_SMOB, 
+	   "invalid argument to cvector-field-get-points");
+     return f_interp_cvector_points(p, f, &f->f.cv[0].re, 0);
+}
+
+cvector3_list cvector_field_get_points(SCM fo, vector3_list p)
+{
+     field_smob *f = assert_field_smob(fo);
+     CHECK(f->type == CVECTOR_FIELD_SMOB, 
+	   "invalid argument to cvector-field-get-points");
+     return f_interp_cvector_points(p, f, &f->f.cv[0].re,
+				    f->type_char != 'v');
+}
+
 /**************************************************************************/
 
 /* compute the fraction of the field energy that is located in the
@@ -973,31 +1105,25 @@ static void output_scalarfield(real *vals,
 	  matrixio_close_dataset(data_id);
 }
 
-/* given the field in curfield, store it to HDF (or whatever) using
-   the matrixio (fieldio) routines.  Allow the component to be specified
-   (which_component 0/1/2 = x/y/z, -1 = all) for vector fields. 
-   Also allow the user to specify a prefix string for the filename. */
-void output_field_to_file(integer which_component, string filename_prefix)
+/* Compute the dimensions, local_dims, and start of this process's part
+   of the position-space fields for output, along with the Bloch
+   wavevector and lattice vectors in the same (possibly transposed)
+   coordinates.  For real fields, also compute where to put the
+   "otherhalf" block of output (see output_scalarfield). */
+static void get_output_layout(int dims[3], int local_dims[3], int start[3],
+			      int *last_dim_index_,
+			      int *last_dim_start_, int *last_dim_size_,
+			      int *first_dim_start_, int *first_dim_size_,
+			      int *write_start0_special_,
+			      real output_k[3], real output_R[3][3])
 {
-     char fname[100], *fname2, description[100];
-     int dims[3], local_dims[3], start[3] = {0,0,0};
-     matrixio_id file_id = {-1,1};
-     int attr_dims[2] = {3, 3};
-     real output_k[3]; /* kvector in reciprocal lattice basis */
-     real output_R[3][3];
-
-     /* where to put "otherhalf" block of output, only used for real scalars */
      int last_dim_index = 0;
      int last_dim_start = 0, last_dim_size = 0;
      int first_dim_start = 0, first_dim_size = 0;
      int write_start0_special = 0;
 
-     if (!curfield) {
-	  mpi_one_fprintf(stderr, 
-		  "fields, energy dens., or epsilon must be loaded first.\n");
-	  return;
-     }
-     
+     start[0] = start[1] = start[2] = 0;
+
 #ifdef HAVE_MPI
      /* The first two dimensions (x and y) of the position-space fields
 	are transposed when we use MPI, so we need to transpose everything. */
@@ -1074,57 +1200,89 @@ void output_field_to_file(integer which_component, string filename_prefix)
      output_R[2][0]=R[2][0]; output_R[2][1]=R[2][1]; output_R[2][2]=R[2][2];
 #endif /* ! HAVE_MPI */
 
-     if (strchr("Rv", curfield_type)) /* generic scalar/vector field */
-	  output_k[0] = output_k[1] = output_k[2] = 0.0; /* don't know k */
-     
-     if (strchr("dhbecv", curfield_type)) { /* outputting vector field */
+     *last_dim_index_ = last_dim_index;
+     *last_dim_start_ = last_dim_start;
+     *last_dim_size_ = last_dim_size;
+     *first_dim_start_ = first_dim_start;
+     *first_dim_size_ = first_dim_size;
+     *write_start0_special_ = write_start0_special;
+}
+
+/* Everything needed to write a field to a file, so that this can be
+   done in the background (see matrixio_async_run) while curfield
+   changes: */
+typedef struct {
+     scalar_complex *field; /* curfield, or our own copy of it */
+     int field_copied;
+     char type;
+     integer which_component;
+     char *fname, description[100];
+     int dims[3], local_dims[3], start[3];
+     int last_dim_index, last_dim_start, last_dim_size;
+     int first_dim_start, first_dim_size, write_start0_special;
+     real output_k[3]; /* kvector in reciprocal lattice basis */
+     real output_R[3][3];
+     matrixio_dataset_options options;
+} field_output;
+
+/* the dataset options given by the output-* input variables */
+static void get_output_options(matrixio_dataset_options *o)
+{
+     o->chunk_size = output_chunk_size;
+     o->deflate_level = output_compression_level;
+     o->shuffle = output_shufflep;
+     o->single_precision = output_single_precisionp;
+}
+
+/* write the field output o (a field_output*) to its file, and
+   deallocate it.  This may be called from a background thread, so
+   it must not use curfield etc. except for epsilon/mu output, which
+   is never done in the background. */
+static void write_field_output(void *data)
+{
+     field_output *o = (field_output *) data;
+     scalar_complex *field = o->field;
+     matrixio_id file_id;
+     int attr_dims[2] = {3, 3};
+     int *dims = o->dims, *local_dims = o->local_dims, *start = o->start;
+
+     file_id = matrixio_create(o->fname);
+     matrixio_set_dataset_options(&file_id, &o->options);
+
+     if (strchr("dhbecv", o->type)) { /* outputting vector field */
 	  matrixio_id data_id[6] = {{-1,1},{-1,1},{-1,1},{-1,1},{-1,1},{-1,1}};
 	  int i;
 
-	  sprintf(fname, "%c.k%02d.b%02d",
-		  curfield_type, kpoint_index, curfield_band);
-	  if (which_component >= 0) {
-	       char comp_str[] = ".x";
-	       comp_str[1] = 'x' + which_component;
-	       strcat(fname, comp_str);
-	  }
-	  sprintf(description, "%c field, kpoint %d, band %d, freq=%g",
-		  curfield_type, kpoint_index, curfield_band, 
-		  freqs.items[curfield_band - 1]);
-	  fname2 = fix_fname(fname, filename_prefix, mdata, 1);
-	  mpi_one_printf("Outputting fields to %s...\n", fname2);
-	  file_id = matrixio_create(fname2);
-	  free(fname2);
-	  fieldio_write_complex_field(curfield, 3, dims, local_dims, start,
-				      which_component, 3, output_k,
+	  fieldio_write_complex_field(field, 3, dims, local_dims, start,
+				      o->which_component, 3, o->output_k,
 				      file_id, 0, data_id);
 
 #ifndef SCALAR_COMPLEX
 	  /* Here's where it gets hairy. */
-	  maxwell_vectorfield_otherhalf(mdata, curfield,
-					output_k[0], output_k[1], output_k[2]);
-	  start[last_dim_index] = last_dim_start;
-	  local_dims[last_dim_index] = last_dim_size;
-	  start[0] = first_dim_start;
-	  local_dims[0] = first_dim_size;
-	  if (write_start0_special) {
+	  maxwell_vectorfield_otherhalf(mdata, field, o->output_k[0],
+					o->output_k[1], o->output_k[2]);
+	  start[o->last_dim_index] = o->last_dim_start;
+	  local_dims[o->last_dim_index] = o->last_dim_size;
+	  start[0] = o->first_dim_start;
+	  local_dims[0] = o->first_dim_size;
+	  if (o->write_start0_special) {
 	       /* The conjugated array half may be discontiguous.
 		  First, write the part not containing start[0], and
 		  then write the start[0] slab. */
-	       fieldio_write_complex_field(curfield + 
+	       fieldio_write_complex_field(field + 
 					   3 * local_dims[1] * local_dims[2],
 					   3, dims, local_dims, start,
-					   which_component, 3, NULL, 
+					   o->which_component, 3, NULL, 
 					   file_id, 1, data_id);
 	       local_dims[0] = 1;
 	       start[0] = 0;
-	       fieldio_write_complex_field(curfield, 3, dims,local_dims,start,
-					   which_component, 3, NULL,
+	       fieldio_write_complex_field(field, 3, dims,local_dims,start,
+					   o->which_component, 3, NULL,
 					   file_id, 1, data_id);
 	  }
 	  else {
-	       fieldio_write_complex_field(curfield, 3, dims,local_dims,start,
-					   which_component, 3, NULL,
+	       fieldio_write_complex_field(field, 3, dims,local_dims,start,
+					   o->which_component, 3, NULL,
 					   file_id, 1, data_id);
 	  }
 #endif
@@ -1133,51 +1291,42 @@ void output_field_to_file(integer which_component, string filename_prefix)
 	       if (data_id[i].id >= 0)
 		    matrixio_close_dataset(data_id[i]);
 	  matrixio_write_data_attr(file_id, "Bloch wavevector",
-				   output_k, 1, attr_dims);
+				   o->output_k, 1, attr_dims);
      }
-     else if (strchr("C", curfield_type)) { /* outputting cmplx scalar field */
+     else if (o->type == 'C') { /* outputting cmplx scalar field */
 	  matrixio_id data_id[2] = {{-1,1},{-1,1}};
 	  int i;
 
-	  sprintf(fname, "%c.k%02d.b%02d",
-		  curfield_type, kpoint_index, curfield_band);
-	  sprintf(description, "%c field, kpoint %d, band %d, freq=%g",
-		  curfield_type, kpoint_index, curfield_band, 
-		  freqs.items[curfield_band - 1]);
-	  fname2 = fix_fname(fname, filename_prefix, mdata, 1);
-	  mpi_one_printf("Outputting complex scalar field to %s...\n", fname2);
-	  file_id = matrixio_create(fname2);
-	  free(fname2);
-	  fieldio_write_complex_field(curfield, 3, dims, local_dims, start,
-				      which_component, 1, output_k,
+	  fieldio_write_complex_field(field, 3, dims, local_dims, start,
+				      o->which_component, 1, o->output_k,
 				      file_id, 0, data_id);
 
 #ifndef SCALAR_COMPLEX
 	  /* Here's where it gets hairy. */
-	  maxwell_cscalarfield_otherhalf(mdata, curfield,
-					output_k[0], output_k[1], output_k[2]);
-	  start[last_dim_index] = last_dim_start;
-	  local_dims[last_dim_index] = last_dim_size;
-	  start[0] = first_dim_start;
-	  local_dims[0] = first_dim_size;
-	  if (write_start0_special) {
+	  maxwell_cscalarfield_otherhalf(mdata, field, o->output_k[0],
+					 o->output_k[1], o->output_k[2]);
+	  start[o->last_dim_index] = o->last_dim_start;
+	  local_dims[o->last_dim_index] = o->last_dim_size;
+	  start[0] = o->first_dim_start;
+	  local_dims[0] = o->first_dim_size;
+	  if (o->write_start0_special) {
 	       /* The conjugated array half may be discontiguous.
 		  First, write the part not containing start[0], and
 		  then write the start[0] slab. */
-	       fieldio_write_complex_field(curfield + 
+	       fieldio_write_complex_field(field + 
 					   local_dims[1] * local_dims[2],
 					   3, dims, local_dims, start,
-					   which_component, 1, NULL, 
+					   o->which_component, 1, NULL, 
 					   file_id, 1, data_id);
 	       local_dims[0] = 1;
 	       start[0] = 0;
-	       fieldio_write_complex_field(curfield, 3, dims,local_dims,start,
-					   which_component, 1, NULL,
+	       fieldio_write_complex_field(field, 3, dims,local_dims,start,
+					   o->which_component, 1, NULL,
 					   file_id, 1, data_id);
 	  }
 	  else {
-	       fieldio_write_complex_field(curfield, 3, dims,local_dims,start,
-					   which_component, 1, NULL,
+	       fieldio_write_complex_field(field, 3, dims,local_dims,start,
+					   o->which_component, 1, NULL,
 					   file_id, 1, data_id);
 	  }
 #endif
@@ -1186,39 +1335,16 @@ void output_field_to_file(integer which_component, string filename_prefix)
 	       if (data_id[i].id >= 0)
 		    matrixio_close_dataset(data_id[i]);
 	  matrixio_write_data_attr(file_id, "Bloch wavevector",
-				   output_k, 1, attr_dims);
+				   o->output_k, 1, attr_dims);
      }
-     else if (strchr("DHBnmR", curfield_type)) { /* scalar field */
-	  if (curfield_type == 'n') {
-	       sprintf(fname, "epsilon");
-	       sprintf(description, "dielectric function, epsilon");
-	  }
-	  else if (curfield_type == 'm') {
-	       sprintf(fname, "mu");
-	       sprintf(description, "permeability mu");
-	  }
-	  else {
-	       sprintf(fname, "%cpwr.k%02d.b%02d",
-		       tolower(curfield_type), kpoint_index, curfield_band);
-	       sprintf(description,
-		       "%c field energy density, kpoint %d, band %d, freq=%g",
-		       curfield_type, kpoint_index, curfield_band, 
-		       freqs.items[curfield_band - 1]);
-	  }
-	  fname2 = fix_fname(fname, filename_prefix, mdata, 
-			     /* no parity suffix for epsilon: */
-			     curfield_type != 'n' && curfield_type != 'm');
-	  mpi_one_printf("Outputting %s...\n", fname2);
-	  file_id = matrixio_create(fname2);
-	  free(fname2);
-
-	  output_scalarfield((real *) curfield, dims, 
+     else { /* scalar field */
+	  output_scalarfield((real *) field, dims, 
 			     local_dims, start, file_id, "data",
-			     last_dim_index, last_dim_start, last_dim_size,
-			     first_dim_start, first_dim_size,
-			     write_start0_special);
+			     o->last_dim_index, o->last_dim_start,
+			     o->last_dim_size, o->first_dim_start,
+			     o->first_dim_size, o->write_start0_special);
 
-	  if (curfield_type == 'n') {
+	  if (o->type == 'n') {
 	       int c1, c2, inv;
 	       char dataname[100];
 
@@ -1232,11 +1358,12 @@ void output_field_to_file(integer which_component, string filename_prefix)
 			      output_scalarfield((real *) curfield, dims,
 						 local_dims, start,
 						 file_id, dataname,
-						 last_dim_index,
-						 last_dim_start, last_dim_size,
-						 first_dim_start,
-						 first_dim_size,
-						 write_start0_special);
+						 o->last_dim_index,
+						 o->last_dim_start,
+						 o->last_dim_size,
+						 o->first_dim_start,
+						 o->first_dim_size,
+						 o->write_start0_special);
 #if defined(WITH_HERMITIAN_EPSILON)
 			      if (c1 != c2) {
 				   get_epsilon_tensor(c1,c2, 1, inv);
@@ -1247,31 +1374,321 @@ void output_field_to_file(integer which_component, string filename_prefix)
 				   output_scalarfield((real *) curfield, dims,
 						      local_dims, start,
 						      file_id, dataname,
-						      last_dim_index,
-						      last_dim_start,
-						      last_dim_size,
-						      first_dim_start,
-						      first_dim_size,
-						      write_start0_special);
+						      o->last_dim_index,
+						      o->last_dim_start,
+						      o->last_dim_size,
+						      o->first_dim_start,
+						      o->first_dim_size,
+						      o->write_start0_special);
 			      }
 #endif
 			 }
 	  }
 
      }
-     else
+
+     matrixio_write_data_attr(file_id, "lattice vectors",
+			      &o->output_R[0][0], 2, attr_dims);
+     matrixio_write_string_attr(file_id, "description", o->description);
+     matrixio_close(file_id);
+
+     if (o->field_copied)
+	  free(o->field);
+     free(o->fname);
+     free(o);
+}
+
+/* given the field in curfield, store it to HDF (or whatever) using
+   the matrixio (fieldio) routines.  Allow the component to be specified
+   (which_component 0/1/2 = x/y/z, -1 = all) for vector fields. 
+   Also allow the user to specify a prefix string for the filename.
+   If output-async? is true, the file is written in the background
+   from a copy of the field (except for epsilon and mu). */
+void output_field_to_file(integer which_component, string filename_prefix)
+{
+     char fname[100];
+     field_output *o;
+
+     if (!curfield) {
+	  mpi_one_fprintf(stderr, 
+		  "fields, energy dens., or epsilon must be loaded first.\n");
+	  return;
+     }
+     if (!strchr("dhbecvCDHBnmR", curfield_type)) {
 	  mpi_one_fprintf(stderr, "unknown field type!\n");
+	  curfield_reset();
+	  return;
+     }
 
-     if (file_id.id >= 0) {
-	  matrixio_write_data_attr(file_id, "lattice vectors",
-				   &output_R[0][0], 2, attr_dims);
-	  matrixio_write_string_attr(file_id, "description", description);
+     CHK_MALLOC(o, field_output, 1);
+     o->type = curfield_type;
+     o->which_component = which_component;
+     get_output_layout(o->dims, o->local_dims, o->start, &o->last_dim_index,
+		       &o->last_dim_start, &o->last_dim_size,
+		       &o->first_dim_start, &o->first_dim_size,
+		       &o->write_start0_special, o->output_k, o->output_R);
+     get_output_options(&o->options);
 
-	  matrixio_close(file_id);
+     if (strchr("Rv", curfield_type)) /* generic scalar/vector field */
+	  o->output_k[0] = o->output_k[1] = o->output_k[2] = 0.0; /* don't know k */
+     
+     if (strchr("dhbecv", curfield_type)) { /* outputting vector field */
+	  sprintf(fname, "%c.k%02d.b%02d",
+		  curfield_type, kpoint_index, curfield_band);
+	  if (which_component >= 0) {
+	       char comp_str[] = ".x";
+	       comp_str[1] = 'x' + which_component;
+	       strcat(fname, comp_str);
+	  }
+	  sprintf(o->description, "%c field, kpoint %d, band %d, freq=%g",
+		  curfield_type, kpoint_index, curfield_band, 
+		  freqs.items[curfield_band - 1]);
+	  o->fname = fix_fname(fname, filename_prefix, mdata, 1);
+	  mpi_one_printf("Outputting fields to %s...\n", o->fname);
+     }
+     else if (strchr("C", curfield_type)) { /* outputting cmplx scalar field */
+	  sprintf(fname, "%c.k%02d.b%02d",
+		  curfield_type, kpoint_index, curfield_band);
+	  sprintf(o->description, "%c field, kpoint %d, band %d, freq=%g",
+		  curfield_type, kpoint_index, curfield_band, 
+		  freqs.items[curfield_band - 1]);
+	  o->fname = fix_fname(fname, filename_prefix, mdata, 1);
+	  mpi_one_printf("Outputting complex scalar field to %s...\n",
+			 o->fname);
+     }
+     else { /* scalar field */
+	  if (curfield_type == 'n') {
+	       sprintf(fname, "epsilon");
+	       sprintf(o->description, "dielectric function, epsilon");
+	  }
+	  else if (curfield_type == 'm') {
+	       sprintf(fname, "mu");
+	       sprintf(o->description, "permeability mu");
+	  }
+	  else {
+	       sprintf(fname, "%cpwr.k%02d.b%02d",
+		       tolower(curfield_type), kpoint_index, curfield_band);
+	       sprintf(o->description,
+		       "%c field energy density, kpoint %d, band %d, freq=%g",
+		       curfield_type, kpoint_index, curfield_band, 
+		       freqs.items[curfield_band - 1]);
+	  }
+	  o->fname = fix_fname(fname, filename_prefix, mdata, 
+			       /* no parity suffix for epsilon: */
+			       curfield_type != 'n' && curfield_type != 'm');
+	  mpi_one_printf("Outputting %s...\n", o->fname);
+     }
+
+     if (output_asyncp && !strchr("nm", curfield_type)) {
+	  size_t N = mdata->fft_output_size, size;
+	  if (strchr("dhbecv", curfield_type))
+	       size = 3 * N * sizeof(scalar_complex);
+	  else if (curfield_type == 'C')
+	       size = N * sizeof(scalar_complex);
+	  else
+	       size = N * sizeof(real);
+	  o->field = (scalar_complex *) malloc(size);
+	  CHECK(o->field, "out of memory!");
+	  memcpy(o->field, curfield, size);
+	  o->field_copied = 1;
+	  matrixio_async_run(write_field_output, o);
+     }
+     else {
+	  o->field = curfield;
+	  o->field_copied = 0;
+	  write_field_output(o);
      }
 
      /* We have destroyed curfield (by multiplying it by phases,
-	and/or reorganizing in the case of real-amplitude fields). */
+	and/or reorganizing in the case of real-amplitude fields),
+	or it is being written in the background. */
+     curfield_reset();
+}
+
+/* Compute the field_type ('d', 'h', 'b', or 'e') fields for the bands
+   band_min..band_max at the current k point, and output them to a
+   single file, with a first dimension of length band_max-band_min+1
+   indexing the bands (see fieldio_write_complex_field_band).  The fields
+   are computed num_fft_bands at a time with batched FFTs, and the file
+   is only opened once, which is much faster than calling
+   output_field_to_file for each band.  which_component and
+   filename_prefix are as for output_field_to_file.  Destroys curfield. */
+void output_field_bands_to_file(string field_type,
+				integer band_min, integer band_max,
+				integer which_component,
+				string filename_prefix)
+{
+     char fname[100], *fname2, description[100], ftype;
+     int dims[3], local_dims[3], start[3];
+     matrixio_id file_id;
+     matrixio_id data_id[6] = {{-1,1},{-1,1},{-1,1},{-1,1},{-1,1},{-1,1}};
+     int attr_dims[2] = {3, 3};
+     real output_k[3]; /* kvector in reciprocal lattice basis */
+     real output_R[3][3];
+     int last_dim_index, last_dim_start, last_dim_size;
+     int first_dim_start, first_dim_size, write_start0_special;
+     int i, b, N, nbands;
+     scalar_complex *field, *F;
+     real *band_freqs;
+     matrixio_dataset_options options;
+
+     if (!mdata) {
+	  mpi_one_fprintf(stderr,
+			  "init-params must be called before output-fields!\n");
+	  return;
+     }
+     if (!kpoint_index) {
+	  mpi_one_fprintf(stderr,
+			  "solve-kpoint must be called before output-fields!\n");
+	  return;
+     }
+     if (!field_type || strlen(field_type) != 1
+	 || !strchr("dhbe", field_type[0])) {
+	  mpi_one_fprintf(stderr, "field type must be \"d\", \"h\", "
+			  "\"b\", or \"e\"\n");
+	  return;
+     }
+     if (band_min < 1 || band_max > H.p || band_min > band_max) {
+	  mpi_one_fprintf(stderr,
+			  "must have 1 <= band index <= num_bands (%d)\n",H.p);
+	  return;
+     }
+     ftype = field_type[0];
+     nbands = band_max - band_min + 1;
+
+     get_output_layout(dims, local_dims, start, &last_dim_index,
+		       &last_dim_start, &last_dim_size,
+		       &first_dim_start, &first_dim_size,
+		       &write_start0_special, output_k, output_R);
+
+     sprintf(fname, "%c.k%02d.b%02d-b%02d",
+	     ftype, kpoint_index, band_min, band_max);
+     if (which_component >= 0) {
+	  char comp_str[] = ".x";
+	  comp_str[1] = 'x' + which_component;
+	  strcat(fname, comp_str);
+     }
+     sprintf(description, "%c fields, kpoint %d, bands %d-%d",
+	     ftype, kpoint_index, band_min, band_max);
+     fname2 = fix_fname(fname, filename_prefix, mdata, 1);
+     mpi_one_printf("Outputting fields to %s...\n", fname2);
+     get_output_options(&options);
+     file_id = matrixio_create(fname2);
+     matrixio_set_dataset_options(&file_id, &options);
+     free(fname2);
+
+     N = mdata->fft_output_size;
+     field = (scalar_complex *) mdata->fft_data;
+     CHK_MALLOC(F, scalar_complex, 3 * N);
+
+     for (b = band_min - 1; b < band_max; ) {
+	  int nb = MIN2(mdata->num_fft_bands, band_max - b);
+	  int ib;
+
+	  /* compute the fields for bands b..b+nb-1, as in get_dfield etc. */
+	  if (ftype == 'b')
+	       maxwell_compute_h_from_H(mdata, H, field, b, nb);
+	  else if (mdata->mu_inv == NULL) {
+	       if (ftype == 'h')
+		    maxwell_compute_h_from_H(mdata, H, field, b, nb);
+	       else
+		    maxwell_compute_d_from_H(mdata, H, field, b, nb);
+	  }
+	  else {
+	       evectmatrix_resize(&W[0], nb, 0);
+	       maxwell_compute_H_from_B(mdata, H, W[0], field, b, 0, nb);
+	       if (ftype == 'h')
+		    maxwell_compute_h_from_H(mdata, W[0], field, 0, nb);
+	       else
+		    maxwell_compute_d_from_H(mdata, W[0], field, 0, nb);
+	       evectmatrix_resize(&W[0], W[0].alloc_p, 0);
+	  }
+	  if (ftype == 'e')
+	       maxwell_compute_e_from_d(mdata, field, nb);
+
+	  for (ib = 0; ib < nb; ++ib) {
+	       int band_local_dims[3], band_start[3];
+	       double scale;
+
+	       /* normalize as in get_dfield/get_hfield */
+	       if (ftype == 'd' || ftype == 'e')
+		    scale = freqs.items[b + ib] != 0.0 ?
+			 -1.0 / freqs.items[b + ib] : -1.0;
+	       else
+		    scale = 1.0;
+	       scale /= sqrt(Vol);
+
+	       /* extract band ib from the batched field array */
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	       for (i = 0; i < N; ++i) {
+		    int c;
+		    for (c = 0; c < 3; ++c) {
+			 const scalar_complex *f = field + 3*(i*nb + ib) + c;
+			 F[3*i + c].re = f->re * scale;
+			 F[3*i + c].im = f->im * scale;
+		    }
+	       }
+
+	       for (i = 0; i < 3; ++i) {
+		    band_local_dims[i] = local_dims[i];
+		    band_start[i] = start[i];
+	       }
+	       fieldio_write_complex_field_band(F, 3, dims,
+						band_local_dims, band_start,
+						which_component, 3, output_k,
+						file_id, nbands,
+						b + ib - (band_min - 1),
+						data_id);
+
+#ifndef SCALAR_COMPLEX
+	       /* the "otherhalf," as in output_field_to_file */
+	       maxwell_vectorfield_otherhalf(mdata, F, output_k[0],
+					     output_k[1], output_k[2]);
+	       band_start[last_dim_index] = last_dim_start;
+	       band_local_dims[last_dim_index] = last_dim_size;
+	       band_start[0] = first_dim_start;
+	       band_local_dims[0] = first_dim_size;
+	       if (write_start0_special) {
+		    fieldio_write_complex_field_band(
+			 F + 3 * band_local_dims[1] * band_local_dims[2],
+			 3, dims, band_local_dims, band_start,
+			 which_component, 3, NULL, file_id, nbands,
+			 b + ib - (band_min - 1), data_id);
+		    band_local_dims[0] = 1;
+		    band_start[0] = 0;
+	       }
+	       fieldio_write_complex_field_band(F, 3, dims,
+						band_local_dims, band_start,
+						which_component, 3, NULL,
+						file_id, nbands,
+						b + ib - (band_min - 1),
+						data_id);
+#endif
+	  }
+	  b += nb;
+     }
+     free(F);
+
+     for (i = 0; i < 6; ++i)
+	  if (data_id[i].id >= 0)
+	       matrixio_close_dataset(data_id[i]);
+
+     CHK_MALLOC(band_freqs, real, nbands);
+     for (i = 0; i < nbands; ++i)
+	  band_freqs[i] = freqs.items[band_min - 1 + i];
+     matrixio_write_data_attr(file_id, "frequencies",
+			      band_freqs, 1, &nbands);
+     free(band_freqs);
+     matrixio_write_data_attr(file_id, "Bloch wavevector",
+			      output_k, 1, attr_dims);
+     matrixio_write_data_attr(file_id, "lattice vectors",
+			      &output_R[0][0], 2, attr_dims);
+     matrixio_write_string_attr(file_id, "description", description);
+     matrixio_close(file_id);
+
+     /* we have overwritten fft_data, which curfield aliases */
      curfield_reset();
 }
 
@@ -1428,8 +1845,29 @@ number compute_energy_in_object_list(geometric_object_list objects)
 
 /**************************************************************************/
 
+/* add a point, with energy/field F, to the batch b for
+   compute-field-integral, adding the results to the integral if
+   the batch is full */
+static void field_integral_expr_point(field_expr_batch *b, cvector3 F,
+				      real epsilon, vector3 p,
+				      cnumber *integral)
+{
+     cvector3 *v;
+     FIELD_EXPR_ARG(b, 0) = F;
+     v = &FIELD_EXPR_ARG(b, 1);
+     v->x.re = epsilon; v->x.im = 0;
+     v = &FIELD_EXPR_ARG(b, 2);
+     v->x.re = p.x; v->y.re = p.y; v->z.re = p.z;
+     v->x.im = v->y.im = v->z.im = 0;
+     if (++b->n == b->nmax) {
+	  cnumber sum = field_expr_batch_sum(b);
+	  integral->re += sum.re;
+	  integral->im += sum.im;
+     }
+}
+
 /* Compute the integral of f(energy/field, epsilon, r) over the cell. */
-cnumber compute_field_integral(function f)
+cnumber compute_field_integral(SCM f)
 {
      int i, j, k, n1, n2, n3, n_other, n_last, rank, last_dim;
 #ifdef HAVE_MPI
@@ -1440,6 +1878,9 @@ cnumber compute_field_integral(function f)
      real *energy = (real *) curfield;
      cnumber integral = {0,0};
      vector3 kvector = {0,0,0};
+     field_expr_type ptypes[3];
+     field_expr *e;
+     field_expr_batch b;
 
      if (!curfield || !strchr("dhbeDHBRcv", curfield_type)) {
           mpi_one_fprintf(stderr, "The D or H energy/field must be loaded first.\n");
@@ -1450,6 +1891,17 @@ cnumber compute_field_integral(function f)
 
      integrate_energy = strchr("DHBR", curfield_type) != NULL;
 
+     ptypes[0] = integrate_energy ? FE_SCALAR : FE_VECTOR;
+     ptypes[1] = FE_SCALAR; /* epsilon */
+     ptypes[2] = FE_VECTOR; /* r */
+     if ((e = field_expr_compile(f, 3, ptypes))) {
+	  CHECK(field_expr_result_type(e) == FE_SCALAR,
+		"field-integral expression must return a number");
+	  field_expr_batch_init(&b, e);
+     }
+     else
+	  f = field_expr_procedure(f);
+
      n1 = mdata->nx; n2 = mdata->ny; n3 = mdata->nz;
      n_other = mdata->other_dims;
      n_last = mdata->last_dim_size / (sizeof(scalar_complex)/sizeof(scalar));
@@ -1548,7 +2000,13 @@ cnumber compute_field_integral(function f)
 	       epsilon = mean_medium_from_matrix(mdata->eps_inv + index);
 	       
 	       p.x = i2 * s1 - c1; p.y = j2 * s2 - c2; p.z = k2 * s3 - c3;
-	       if (integrate_energy) {
+	       if (integrate_energy && e) {
+		    cvector3 F;
+		    F.x.re = energy[index]; F.x.im = 0;
+		    F.y = F.z = F.x;
+		    field_integral_expr_point(&b, F, epsilon, p, &integral);
+	       }
+	       else if (integrate_energy) {
 		    integral.re +=
 			 ctl_convert_number_to_c(
 			      gh_call3(f,
@@ -1573,14 +2031,19 @@ cnumber compute_field_integral(function f)
 		    CASSIGN_MULT_IM(F.y.im, curfield[3*index+1], phase);
 		    CASSIGN_MULT_RE(F.z.re, curfield[3*index+2], phase);
 		    CASSIGN_MULT_IM(F.z.im, curfield[3*index+2], phase);
-		    integrand =
-			 ctl_convert_cnumber_to_c(
-                              gh_call3(f,
-				       ctl_convert_cvector3_to_scm(F),
-				       ctl_convert_number_to_scm(epsilon),
-                                       ctl_convert_vector3_to_scm(p)));
-		    integral.re += integrand.re;
-		    integral.im += integrand.im;
+		    if (e)
+			 field_integral_expr_point(&b, F, epsilon, p,
+						   &integral);
+		    else {
+			 integrand =
+			      ctl_convert_cnumber_to_c(
+				   gh_call3(f,
+					    ctl_convert_cvector3_to_scm(F),
+					    ctl_convert_number_to_scm(epsilon),
+					    ctl_convert_vector3_to_scm(p)));
+			 integral.re += integrand.re;
+			 integral.im += integrand.im;
+		    }
 	       }
 
 #ifndef SCALAR_COMPLEX
@@ -1603,7 +2066,14 @@ cnumber compute_field_integral(function f)
 			 p.x = i2c * s1 - c1; 
 			 p.y = j2c * s2 - c2; 
 			 p.z = k2c * s3 - c3;
-			 if (integrate_energy)
+			 if (integrate_energy && e) {
+			      cvector3 F;
+			      F.x.re = energy[index]; F.x.im = 0;
+			      F.y = F.z = F.x;
+			      field_integral_expr_point(&b, F, epsilon, p,
+							&integral);
+			 }
+			 else if (integrate_energy)
 			      integral.re += 
 				   ctl_convert_number_to_c(
 					gh_call3(f,
@@ -1637,14 +2107,17 @@ cnumber compute_field_integral(function f)
 			      CASSIGN_MULT_RE(F.z.re, Fz, phase);
 			      CASSIGN_MULT_IM(F.z.im, Fz, phase);
 
-			      integrand =
-				   ctl_convert_cnumber_to_c(
-					gh_call3(f,
-					    ctl_convert_cvector3_to_scm(F),
-				            ctl_convert_number_to_scm(epsilon),
-                                            ctl_convert_vector3_to_scm(p)));
-			      integral.re += integrand.re;
-			      integral.im += integrand.im;
+			      if (e)
+				   field_integral_expr_point(&b, F, epsilon, p,
+							     &integral);
+			      else {
+				   integrand = ctl_convert_cnumber_to_c(gh_call3(
+					f, ctl_convert_cvector3_to_scm(F),
+					ctl_convert_number_to_scm(epsilon),
+					ctl_convert_vector3_to_scm(p)));
+				   integral.re += integrand.re;
+				   integral.im += integrand.im;
+			      }
 			 }
 		    }
 	       }
@@ -1652,6 +2125,14 @@ cnumber compute_field_integral(function f)
 	  }
      }
 
+     if (e) {
+	  cnumber sum = field_expr_batch_sum(&b);
+	  integral.re += sum.re;
+	  integral.im += sum.im;
+	  field_expr_batch_destroy(&b);
+	  field_expr_destroy(e);
+     }
+
      integral.re *= Vol / H.N;
      integral.im *= Vol / H.N;
      {
@@ -1662,7 +2143,7 @@ cnumber compute_field_integral(function f)
      }
 }
 
-number compute_energy_integral(function f)
+number compute_energy_integral(SCM f)
 {
      if (!curfield || !strchr("DHBR", curfield_type)) {
           mpi_one_fprintf(stderr, "The D or H energy density must be loaded first.\n");
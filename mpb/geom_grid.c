@@ -0,0 +1,411 @@
+/* Copyright (C) 1999-2014 Massachusetts Institute of Technology.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* A uniform-grid spatial index of the geometric objects, for
+   supercells with very many objects.
+
+   libctl's create_geom_box_tree0 builds its tree by recursively
+   partitioning the object list, which becomes slow (and is serial)
+   for tens of thousands of objects.  Here, instead, we bin the
+   bounding boxes of the objects (and their periodic images) into a
+   uniform grid of cells, each holding a few objects, in time linear
+   in the number of objects and in parallel.  The result is then
+   linked into a balanced binary geom_box_tree whose leaves are the
+   grid cells, so that it can be used with all of the libctl routines
+   (geom_tree_search, object_of_point_in_tree, restrict_geom_box_tree,
+   destroy_geom_box_tree, ...) exactly like the tree from
+   create_geom_box_tree0.  As in the latter, the objects in each leaf
+   are ordered by decreasing precedence (reverse order in the
+   geometry list), so that searches return the same objects. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "config.h"
+#include <check.h>
+#include <mpiglue.h>
+
+#include <ctl-io.h>
+#include <ctlgeom.h>
+
+#include "mpb.h"
+
+/**************************************************************************/
+
+/* target number of cells per object reference, and bounds on the
+   number of cells per dimension / in total */
+#define CELLS_PER_OBJECT 1.0
+#define MAX_CELLS_PER_DIM 1024
+#define MAX_CELLS (1 << 24)
+
+/* approximate number of sample points for the query statistics */
+#define QUERY_SAMPLES 4096
+
+typedef struct {
+     geom_box b0;
+     int n[3]; /* number of cells in each direction */
+     double cell[3]; /* size of each cell */
+     int *start; /* cell c has refs[start[c] .. start[c+1]-1] */
+     int *refs; /* indices into entries */
+     geom_box_object *entries;
+} grid_index;
+
+static int box_contains_point(const geom_box *b, vector3 p)
+{
+     return (b->low.x <= p.x && p.x <= b->high.x &&
+	     b->low.y <= p.y && p.y <= b->high.y &&
+	     b->low.z <= p.z && p.z <= b->high.z);
+}
+
+static int boxes_intersect(const geom_box *a, const geom_box *b)
+{
+     return (a->low.x <= b->high.x && b->low.x <= a->high.x &&
+	     a->low.y <= b->high.y && b->low.y <= a->high.y &&
+	     a->low.z <= b->high.z && b->low.z <= a->high.z);
+}
+
+/* The periodic shifts of an object that we consider, in the same order
+   as create_geom_box_tree0: -1, 0, +1 periods in each periodic
+   direction.  Returns the number of shifts. */
+static int periodic_shifts(vector3 shifts[27])
+{
+     int i, j, k, n = 0;
+     int m[3];
+     m[0] = ensure_periodicity && !no_size_x && dimensions >= 1;
+     m[1] = ensure_periodicity && !no_size_y && dimensions >= 2;
+     m[2] = ensure_periodicity && !no_size_z && dimensions >= 3;
+     for (i = -m[0]; i <= m[0]; ++i)
+	  for (j = -m[1]; j <= m[1]; ++j)
+	       for (k = -m[2]; k <= m[2]; ++k) {
+		    shifts[n].x = i * geometry_lattice.size.x;
+		    shifts[n].y = j * geometry_lattice.size.y;
+		    shifts[n].z = k * geometry_lattice.size.z;
+		    ++n;
+	       }
+     return n;
+}
+
+static void cell_range(const grid_index *g, const geom_box *b,
+		       int lo[3], int hi[3])
+{
+     double blo[3], bhi[3], glo[3];
+     int d;
+     blo[0] = b->low.x; blo[1] = b->low.y; blo[2] = b->low.z;
+     bhi[0] = b->high.x; bhi[1] = b->high.y; bhi[2] = b->high.z;
+     glo[0] = g->b0.low.x; glo[1] = g->b0.low.y; glo[2] = g->b0.low.z;
+     for (d = 0; d < 3; ++d) {
+	  lo[d] = floor((blo[d] - glo[d]) / g->cell[d]);
+	  hi[d] = floor((bhi[d] - glo[d]) / g->cell[d]);
+	  lo[d] = MIN2(MAX2(lo[d], 0), g->n[d] - 1);
+	  hi[d] = MIN2(MAX2(hi[d], 0), g->n[d] - 1);
+     }
+}
+
+static int compare_ints(const void *a, const void *b)
+{
+     int ia = *((const int *) a), ib = *((const int *) b);
+     return ia < ib ? -1 : (ia > ib);
+}
+
+/* Build the tree for the cells lo <= (i,j,k) < hi, given the leaves. */
+static geom_box_tree link_cells(const grid_index *g, geom_box_tree *leaves,
+				const int lo[3], const int hi[3])
+{
+     geom_box_tree t;
+     int d, dsplit = 0, mid[3], lo2[3];
+
+     for (d = 1; d < 3; ++d)
+	  if (hi[d] - lo[d] > hi[dsplit] - lo[dsplit])
+	       dsplit = d;
+     if (hi[dsplit] - lo[dsplit] == 1)
+	  return leaves[(lo[0] * g->n[1] + lo[1]) * g->n[2] + lo[2]];
+
+     CHK_MALLOC(t, struct geom_box_tree_struct, 1);
+     for (d = 0; d < 3; ++d) {
+	  mid[d] = hi[d];
+	  lo2[d] = lo[d];
+     }
+     mid[dsplit] = lo2[dsplit] = (lo[dsplit] + hi[dsplit]) / 2;
+     t->t1 = link_cells(g, leaves, lo, mid);
+     t->t2 = link_cells(g, leaves, lo2, hi);
+     t->b1 = t->t1->b;
+     t->b2 = t->t2->b;
+     t->b.low = t->b1.low;
+     t->b.high = t->b2.high;
+     t->nobjects = 0;
+     t->objects = NULL;
+     return t;
+}
+
+/* Count the nodes that geom_tree_search visits for the point p in t,
+   and the object bounding boxes that it tests, if p is in none of the
+   objects (the worst case, since a hit stops the search early). */
+static void query_cost(vector3 p, geom_box_tree t, int *nodes, int *tests)
+{
+     if (!t)
+	  return;
+     ++*nodes;
+     *tests += t->nobjects;
+     if (box_contains_point(&t->b1, p))
+	  query_cost(p, t->t1, nodes, tests);
+     if (box_contains_point(&t->b2, p))
+	  query_cost(p, t->t2, nodes, tests);
+}
+
+/* Estimate the cost of point lookups in t (nodes visited and object
+   boxes tested per lookup) from a regular lattice of about
+   QUERY_SAMPLES points in the active dimensions of b0.  Counting the
+   actual lookups would mean instrumenting libctl's tree search in
+   the innermost epsilon loop, so we sample instead. */
+static void query_stats(geom_box_tree t, geom_box b0, const int active[3],
+			geom_grid_stats *stats)
+{
+     int ns[3], d, ndims = 0, nq, i, max_nodes = 0;
+     double nodes_sum = 0, tests_sum = 0;
+
+     for (d = 0; d < 3; ++d)
+	  ndims += active[d];
+     for (d = 0; d < 3; ++d)
+	  ns[d] = active[d] ? MAX2(1, (int) floor(pow(QUERY_SAMPLES,
+						      1.0 / ndims) + 0.5))
+	       : 1;
+     nq = ns[0] * ns[1] * ns[2];
+
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static) \
+     reduction(+:nodes_sum,tests_sum) reduction(max:max_nodes)
+#endif
+     for (i = 0; i < nq; ++i) {
+	  int a = i / (ns[1] * ns[2]), b = (i / ns[2]) % ns[1], c = i % ns[2];
+	  int nodes = 0, tests = 0;
+	  vector3 p;
+	  p.x = b0.low.x + (a + 0.5) * (b0.high.x - b0.low.x) / ns[0];
+	  p.y = b0.low.y + (b + 0.5) * (b0.high.y - b0.low.y) / ns[1];
+	  p.z = b0.low.z + (c + 0.5) * (b0.high.z - b0.low.z) / ns[2];
+	  query_cost(p, t, &nodes, &tests);
+	  nodes_sum += nodes;
+	  tests_sum += tests;
+	  max_nodes = MAX2(max_nodes, nodes);
+     }
+
+     stats->nqueries = nq;
+     stats->mean_nodes_per_query = nodes_sum / nq;
+     stats->mean_tests_per_query = tests_sum / nq;
+     stats->max_nodes_per_query = max_nodes;
+}
+
+/* Like create_geom_box_tree0(geometry, b0), but using a uniform grid
+   of cells as described above.  If stats is non-NULL, it is set to
+   statistics about the grid and the (sampled) cost of lookups in it. */
+geom_box_tree create_geom_grid_tree(geometric_object_list geometry,
+				    geom_box b0, geom_grid_stats *stats)
+{
+     grid_index g;
+     vector3 shifts[27];
+     int nshifts, nobj = geometry.num_items, nentries, nrefs, ncells;
+     int *count, i, d, ndims = 0, active[3];
+     int lo_all[3], hi_all[3];
+     double extent[3], size_sum = 0, vol = 1, h;
+     geom_box_tree *leaves, t;
+     mpiglue_clock_t start_time = MPIGLUE_CLOCK;
+
+     g.b0 = b0;
+     nshifts = periodic_shifts(shifts);
+     extent[0] = b0.high.x - b0.low.x;
+     extent[1] = b0.high.y - b0.low.y;
+     extent[2] = b0.high.z - b0.low.z;
+     active[0] = dimensions >= 1 && !no_size_x && extent[0] > 0;
+     active[1] = dimensions >= 2 && !no_size_y && extent[1] > 0;
+     active[2] = dimensions >= 3 && !no_size_z && extent[2] > 0;
+
+     /* first, find the periodic images of each object (in order of
+	decreasing precedence) whose bounding boxes intersect b0 */
+     CHK_MALLOC(count, int, nobj + 1);
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(dynamic,64)
+#endif
+     for (i = 0; i < nobj; ++i) {
+	  geom_box box;
+	  int s, n = 0;
+	  geom_get_bounding_box(geometry.items[nobj - 1 - i], &box);
+	  for (s = 0; s < nshifts; ++s) {
+	       geom_box sbox;
+	       sbox.low = vector3_plus(box.low, shifts[s]);
+	       sbox.high = vector3_plus(box.high, shifts[s]);
+	       n += boxes_intersect(&sbox, &b0);
+	  }
+	  count[i + 1] = n;
+     }
+     count[0] = 0;
+     for (i = 0; i < nobj; ++i)
+	  count[i + 1] += count[i];
+     nentries = count[nobj];
+     CHK_MALLOC(g.entries, geom_box_object, MAX2(nentries, 1));
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(dynamic,64) reduction(+:size_sum)
+#endif
+     for (i = 0; i < nobj; ++i) {
+	  int io = nobj - 1 - i, s, n = count[i];
+	  geom_box box;
+	  geom_get_bounding_box(geometry.items[io], &box);
+	  for (s = 0; s < nshifts; ++s) {
+	       geom_box_object *e = g.entries + n;
+	       e->box.low = vector3_plus(box.low, shifts[s]);
+	       e->box.high = vector3_plus(box.high, shifts[s]);
+	       if (boxes_intersect(&e->box, &b0)) {
+		    e->o = geometry.items + io;
+		    e->shiftby = shifts[s];
+		    e->precedence = io;
+		    size_sum += (active[0] * (box.high.x - box.low.x)
+				 + active[1] * (box.high.y - box.low.y)
+				 + active[2] * (box.high.z - box.low.z));
+		    ++n;
+	       }
+	  }
+     }
+     free(count);
+
+     /* Choose the cells to be roughly cubic, about as numerous as the
+	object references, but no smaller than half the mean object
+	size (so that each object only lands in a few cells). */
+     for (d = 0; d < 3; ++d)
+	  if (active[d]) {
+	       vol *= extent[d];
+	       ++ndims;
+	  }
+     h = ndims ? pow(vol / MAX2(1, nentries * CELLS_PER_OBJECT),
+		     1.0 / ndims) : 1;
+     if (nentries > 0)
+	  h = MAX2(h, 0.5 * size_sum / (ndims ? ndims : 1) / nentries);
+     ncells = 1;
+     for (d = 0; d < 3; ++d) {
+	  if (active[d])
+	       g.n[d] = MIN2(MAX2(1, (int) ceil(extent[d] / h)),
+			     MAX_CELLS_PER_DIM);
+	  else
+	       g.n[d] = 1;
+	  if (ncells * g.n[d] > MAX_CELLS)
+	       g.n[d] = MAX2(1, MAX_CELLS / ncells);
+	  ncells *= g.n[d];
+	  g.cell[d] = extent[d] > 0 ? extent[d] / g.n[d] : 1;
+     }
+
+     /* bin the object references into the cells (counting sort) */
+     CHK_MALLOC(g.start, int, ncells + 1);
+     for (i = 0; i <= ncells; ++i)
+	  g.start[i] = 0;
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+     for (i = 0; i < nentries; ++i) {
+	  int lo[3], hi[3], a, b, c;
+	  cell_range(&g, &g.entries[i].box, lo, hi);
+	  for (a = lo[0]; a <= hi[0]; ++a)
+	       for (b = lo[1]; b <= hi[1]; ++b)
+		    for (c = lo[2]; c <= hi[2]; ++c) {
+			 int ic = (a * g.n[1] + b) * g.n[2] + c;
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
+			 g.start[ic + 1]++;
+		    }
+     }
+     for (i = 0; i < ncells; ++i)
+	  g.start[i + 1] += g.start[i];
+     nrefs = g.start[ncells];
+     CHK_MALLOC(g.refs, int, MAX2(nrefs, 1));
+     CHK_MALLOC(count, int, ncells);
+     for (i = 0; i < ncells; ++i)
+	  count[i] = g.start[i];
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+     for (i = 0; i < nentries; ++i) {
+	  int lo[3], hi[3], a, b, c;
+	  cell_range(&g, &g.entries[i].box, lo, hi);
+	  for (a = lo[0]; a <= hi[0]; ++a)
+	       for (b = lo[1]; b <= hi[1]; ++b)
+		    for (c = lo[2]; c <= hi[2]; ++c) {
+			 int ic = (a * g.n[1] + b) * g.n[2] + c, pos;
+#ifdef USE_OPENMP
+#pragma omp atomic capture
+#endif
+			 pos = count[ic]++;
+			 g.refs[pos] = i;
+		    }
+     }
+     free(count);
+
+     /* make a leaf for each cell, with its objects in order of
+	decreasing precedence */
+     CHK_MALLOC(leaves, geom_box_tree, ncells);
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(dynamic,64)
+#endif
+     for (i = 0; i < ncells; ++i) {
+	  geom_box_tree leaf;
+	  int a = i / (g.n[1] * g.n[2]), b = (i / g.n[2]) % g.n[1];
+	  int c = i % g.n[2], n = g.start[i + 1] - g.start[i], j;
+	  CHK_MALLOC(leaf, struct geom_box_tree_struct, 1);
+	  leaf->b.low.x = b0.low.x + a * g.cell[0];
+	  leaf->b.low.y = b0.low.y + b * g.cell[1];
+	  leaf->b.low.z = b0.low.z + c * g.cell[2];
+	  leaf->b.high.x = a + 1 == g.n[0] ? b0.high.x : leaf->b.low.x + g.cell[0];
+	  leaf->b.high.y = b + 1 == g.n[1] ? b0.high.y : leaf->b.low.y + g.cell[1];
+	  leaf->b.high.z = c + 1 == g.n[2] ? b0.high.z : leaf->b.low.z + g.cell[2];
+	  leaf->b1 = leaf->b2 = leaf->b;
+	  leaf->t1 = leaf->t2 = NULL;
+	  leaf->nobjects = n;
+	  leaf->objects = NULL;
+	  if (n > 0) {
+	       qsort(g.refs + g.start[i], n, sizeof(int), compare_ints);
+	       CHK_MALLOC(leaf->objects, geom_box_object, n);
+	       for (j = 0; j < n; ++j)
+		    leaf->objects[j] = g.entries[g.refs[g.start[i] + j]];
+	  }
+	  leaves[i] = leaf;
+     }
+
+     for (d = 0; d < 3; ++d) {
+	  lo_all[d] = 0;
+	  hi_all[d] = g.n[d];
+     }
+     t = link_cells(&g, leaves, lo_all, hi_all);
+     t->b = b0;
+
+     if (stats) {
+	  stats->n[0] = g.n[0]; stats->n[1] = g.n[1]; stats->n[2] = g.n[2];
+	  stats->nentries = nentries;
+	  stats->nrefs = nrefs;
+	  stats->max_per_cell = 0;
+	  stats->nonempty_cells = 0;
+	  for (i = 0; i < ncells; ++i) {
+	       int n = g.start[i + 1] - g.start[i];
+	       stats->max_per_cell = MAX2(stats->max_per_cell, n);
+	       stats->nonempty_cells += n > 0;
+	  }
+	  stats->build_time = MPIGLUE_CLOCK_DIFF(MPIGLUE_CLOCK, start_time);
+	  query_stats(t, b0, active, stats);
+     }
+
+     free(leaves);
+     free(g.refs);
+     free(g.start);
+     free(g.entries);
+     return t;
+}
@@ -17,6 +17,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include "config.h"
@@ -39,12 +40,43 @@
    they provided a documented way (scm_array_get_handle) to do this,
    but in this case you are also required to call scm_array_handle_release,
    via material_grid_array_release.  In our code, you can only have
-   one material_grid array pointer at a time. */
+   one material_grid array pointer at a time, except for pinned arrays
+   (below). */
 #ifdef HAVE_SCM_ARRAY_GET_HANDLE
 static scm_t_array_handle cur_material_grid_array_handle;
 #endif
+
+/* Getting an array handle for every interpolated point is expensive,
+   and is not thread-safe.  So, for the duration of a phase that
+   evaluates the material grids many times (e.g. computing epsilon),
+   material_grids_pin() acquires the arrays of all the material grids
+   in the geometry once, and material_grid_array then just looks up
+   the raw pointer, until material_grids_unpin().  Pinning can be
+   nested. */
+typedef struct {
+     material_grid g;
+     double *data;
+#ifdef HAVE_SCM_ARRAY_GET_HANDLE
+     scm_t_array_handle handle;
+#endif
+} pinned_grid;
+static pinned_grid *pinned = NULL;
+static int npinned = 0, pin_count = 0;
+
+static double *pinned_array(const material_grid *g)
+{
+     int i;
+     for (i = 0; i < npinned; ++i)
+	  if (material_grid_equal(g, &pinned[i].g))
+	       return pinned[i].data;
+     return NULL;
+}
+
 static double *material_grid_array(const material_grid *g)
 {
+     double *data = pinned_array(g);
+     if (data)
+	  return data;
 #ifdef HAVE_SCM_ARRAY_GET_HANDLE
      scm_array_get_handle(g->matgrid, &cur_material_grid_array_handle);
      return (double *) scm_array_handle_uniform_writable_elements(
@@ -57,12 +89,60 @@ static double *material_grid_array(const material_grid *g)
 
 static void material_grid_array_release(const material_grid *g)
 {
+     if (pinned_array(g))
+	  return;
 #ifdef HAVE_SCM_ARRAY_GET_HANDLE
-     (void) g;
      scm_array_handle_release(&cur_material_grid_array_handle);
+#endif
+}
+
+void material_grids_pin(void)
+{
+     material_grid *grids;
+     int i, ngrids;
+
+     if (pin_count++ > 0)
+	  return;
+     grids = get_material_grids(geometry, &ngrids);
+     CHK_MALLOC(pinned, pinned_grid, MAX2(1, ngrids));
+     for (i = 0; i < ngrids; ++i) {
+	  pinned[i].g = grids[i];
+#ifdef HAVE_SCM_ARRAY_GET_HANDLE
+	  scm_array_get_handle(grids[i].matgrid, &pinned[i].handle);
+	  pinned[i].data = (double *) 
+	       scm_array_handle_uniform_writable_elements(&pinned[i].handle);
 #else
-     (void) g;
+	  CHECK(SCM_ARRAYP(grids[i].matgrid), "bug: matgrid is not an array");
+	  pinned[i].data = (double *) 
+	       SCM_CELL_WORD_1(SCM_ARRAY_V(grids[i].matgrid));
+#endif
+     }
+     npinned = ngrids;
+     free(grids);
+}
+
+void material_grids_unpin(void)
+{
+     CHECK(pin_count > 0, "bug: unbalanced material_grids_unpin");
+     if (--pin_count > 0)
+	  return;
+#ifdef HAVE_SCM_ARRAY_GET_HANDLE
+     {
+	  int i;
+	  for (i = 0; i < npinned; ++i)
+	       scm_array_handle_release(&pinned[i].handle);
+     }
 #endif
+     free(pinned);
+     pinned = NULL;
+     npinned = 0;
+}
+
+/* true if all the material grids are pinned, in which case they
+   can be evaluated from multiple threads */
+int material_grids_pinned(void)
+{
+     return pin_count > 0;
 }
 
 /* Get the interpolated value at p from the material grid g.
@@ -74,6 +154,10 @@ static void material_grid_array_release(const material_grid *g)
 real material_grid_val(vector3 p, const material_grid *g)
 {
      real val;
+     double *data = pinned_array(g);
+     if (data)
+	  return linear_interpolate(p.x, p.y, p.z, data,
+				    g->size.x, g->size.y, g->size.z, 1);
      CHECK(SCM_ARRAYP(g->matgrid), "bug: matgrid is not an array");
      val = linear_interpolate(p.x, p.y, p.z, material_grid_array(g),
 			      g->size.x, g->size.y, g->size.z, 1);
@@ -94,6 +178,9 @@ static int compatible_matgrids(const material_grid *mg,
 }
 
 static int matgrid_val_count = 0; /* cache for gradient calculation */
+#ifdef USE_OPENMP
+#  pragma omp threadprivate(matgrid_val_count)
+#endif
 double matgrid_val(vector3 p, geom_box_tree tp, int oi,
 		   const material_grid *mg)
 {
@@ -130,6 +217,148 @@ double matgrid_val(vector3 p, geom_box_tree tp, int oi,
 
 /**************************************************************************/
 
+/* Fast path for the sub-pixel averaging of a material grid g that is
+   the default material and covers the whole cell (i.e. there are no
+   geometric objects).  Rather than calling the dielectric function at
+   each of the ms[0] x ms[1] x ms[2] sub-mesh points r[d] + (i -
+   (ms[d]-1)/2) * s[d]/ms[d] around the grid point r (in lattice
+   coordinates), as the brute-force average in
+   update_maxwell_dielectric does, we resample u at all of these
+   points at once.  The trilinear interpolation weights are separable,
+   so we compute them once per axis, gather the few grid values that
+   are needed, and interpolate along x, y, and z in turn; this gives
+   exactly the same values as linear_interpolate at each point.
+
+   Returns the means of v = lo + u * (hi - lo) and of 1/v over the
+   sub-mesh, and the least-squares slope of v along each lattice
+   direction (per unit of r).  Returns 0 if the grid is not pinned
+   (see material_grids_pin) or if the sub-mesh is too fine for the
+   fixed-size buffers, in which case the caller should fall back to
+   point-by-point evaluation. */
+
+#define MESH_MAX 8 /* max sub-mesh points & grid values along each axis */
+
+int material_grid_mesh_mean(const material_grid *g,
+			    const real r[3], const real s[3], const int ms[3],
+			    double lo, double hi,
+			    double *mean, double *mean_inv, double slope[3])
+{
+     double *data = pinned_array(g);
+     int n[3], i1[3][MESH_MAX], i2[3][MESH_MAX], idx[3][MESH_MAX];
+     int nidx[3], d, i, j, k, b, c;
+     double w[3][MESH_MAX], size[3], sum = 0, sum_inv = 0;
+     double B[MESH_MAX][MESH_MAX][MESH_MAX]; /* gathered grid values */
+     double T1[MESH_MAX][MESH_MAX][MESH_MAX], T2[MESH_MAX][MESH_MAX][MESH_MAX];
+     double v[MESH_MAX][MESH_MAX][MESH_MAX];
+     double vsum[3][MESH_MAX];
+
+     if (!data)
+	  return 0;
+     n[0] = g->size.x; n[1] = g->size.y; n[2] = g->size.z;
+     size[0] = no_size_x ? 0 : geometry_lattice.size.x;
+     size[1] = no_size_y ? 0 : geometry_lattice.size.y;
+     size[2] = no_size_z ? 0 : geometry_lattice.size.z;
+
+     /* interpolation indices & weights along each axis, computed
+	exactly as in epsilon_func, matgrid_val, and linear_interpolate
+	(with its mirror boundaries), and stored as positions in the
+	list idx[d] of distinct grid indices along that axis */
+     for (d = 0; d < 3; ++d) {
+	  if (ms[d] > MESH_MAX)
+	       return 0;
+	  nidx[d] = 0;
+	  for (i = 0; i < ms[d]; ++i) {
+	       double x = r[d] + (i - (ms[d] - 1) * 0.5) * (s[d] / ms[d]);
+	       double rx = 0, dx;
+	       int ix, ix2, m;
+	       if (size[d] > 0) {
+		    vector3 p = {0,0,0};
+		    if (d == 0) p.x = (x - 0.5) * size[0];
+		    else if (d == 1) p.y = (x - 0.5) * size[1];
+		    else p.z = (x - 0.5) * size[2];
+		    p = shift_to_unit_cell(p);
+		    rx = (d == 0 ? p.x : (d == 1 ? p.y : p.z)) / size[d];
+	       }
+	       if (rx < 0.0) rx = -rx; else if (rx > 1.0) rx = 1.0 - rx;
+	       ix = rx * n[d]; if (ix == n[d]) --ix;
+	       dx = rx * n[d] - ix - 0.5;
+	       ix2 = (dx >= 0.0 ? ix + 1 : ix - 1);
+	       if (ix2 < 0) ix2++; else if (ix2 == n[d]) ix2--;
+	       w[d][i] = fabs(dx);
+	       for (m = 0; m < nidx[d] && idx[d][m] != ix; ++m) ;
+	       if (m == nidx[d]) {
+		    if (m == MESH_MAX) return 0;
+		    idx[d][nidx[d]++] = ix;
+	       }
+	       i1[d][i] = m;
+	       for (m = 0; m < nidx[d] && idx[d][m] != ix2; ++m) ;
+	       if (m == nidx[d]) {
+		    if (m == MESH_MAX) return 0;
+		    idx[d][nidx[d]++] = ix2;
+	       }
+	       i2[d][i] = m;
+	  }
+     }
+
+     for (i = 0; i < nidx[0]; ++i)
+	  for (b = 0; b < nidx[1]; ++b)
+	       for (c = 0; c < nidx[2]; ++c)
+		    B[i][b][c] = data[(idx[0][i] * n[1] + idx[1][b]) * n[2]
+				      + idx[2][c]];
+
+     /* interpolate along x, then y, then z (the same order of
+	operations as in linear_interpolate) */
+     for (i = 0; i < ms[0]; ++i)
+	  for (b = 0; b < nidx[1]; ++b)
+	       for (c = 0; c < nidx[2]; ++c)
+		    T1[i][b][c] = B[i1[0][i]][b][c] * (1.0 - w[0][i])
+			 + B[i2[0][i]][b][c] * w[0][i];
+     for (i = 0; i < ms[0]; ++i)
+	  for (j = 0; j < ms[1]; ++j)
+	       for (c = 0; c < nidx[2]; ++c)
+		    T2[i][j][c] = T1[i][i1[1][j]][c] * (1.0 - w[1][j])
+			 + T1[i][i2[1][j]][c] * w[1][j];
+     for (d = 0; d < 3; ++d)
+	  for (i = 0; i < ms[d]; ++i)
+	       vsum[d][i] = 0;
+     for (i = 0; i < ms[0]; ++i)
+	  for (j = 0; j < ms[1]; ++j)
+	       for (k = 0; k < ms[2]; ++k) {
+		    double u = T2[i][j][i1[2][k]] * (1.0 - w[2][k])
+			 + T2[i][j][i2[2][k]] * w[2][k];
+		    v[i][j][k] = u * (hi - lo) + lo;
+	       }
+
+     /* the means, summed in the same order as the brute-force average */
+     for (i = 0; i < ms[0]; ++i)
+	  for (j = 0; j < ms[1]; ++j)
+	       for (k = 0; k < ms[2]; ++k) {
+		    sum += v[i][j][k];
+		    sum_inv += 1.0 / v[i][j][k];
+		    vsum[0][i] += v[i][j][k];
+		    vsum[1][j] += v[i][j][k];
+		    vsum[2][k] += v[i][j][k];
+	       }
+     *mean = sum / (ms[0] * ms[1] * ms[2]);
+     *mean_inv = sum_inv / (ms[0] * ms[1] * ms[2]);
+
+     for (d = 0; d < 3; ++d) {
+	  double num = 0, den = 0;
+	  for (i = 0; i < ms[d]; ++i) {
+	       double x = i - (ms[d] - 1) * 0.5;
+	       num += x * vsum[d][i];
+	       den += x * x;
+	  }
+	  slope[d] = den > 0 ? num * ms[d]
+	       / (den * (ms[0] * ms[1] * ms[2]) * (s[d] / ms[d])) : 0;
+     }
+     return 1;
+}
+
+#undef MESH_MAX
+
+/**************************************************************************/
+
 material_grid *get_material_grids(geometric_object_list g, int *ngrids)
 {
      int i, nalloc = 0;
@@ -210,6 +439,212 @@ void material_grids_get(double *u, const material_grid *grids, int ngrids)
      }
 }
 
+/* Set b to the box of grid points whose dielectric tensor may depend on
+   the cells lo..hi (inclusive) of the material grid mg in the object
+   o, or in the default material if o is NULL, returning 0 if there
+   are no such points.  We use the fact that the map from the lattice
+   to the grid coordinates is affine, and test each grid point (with its
+   pixel, dilated by one pixel) against the interpolation support of the
+   changed cells. */
+static int matgrid_cells_grid_box(const material_grid *mg,
+				  const geometric_object *o,
+				  const int lo[3], const int hi[3],
+				  maxwell_grid_box *b)
+{
+     int n[3], sz[3], vlo[3], vhi[3], x[3], d, j, found = 0;
+     double size[3], ulo[3], uhi[3], u0[3], A[3][3], w[3];
+     geom_box_object gbo;
+
+     n[0] = mdata->nx; n[1] = mdata->ny; n[2] = mdata->nz;
+     sz[0] = mg->size.x; sz[1] = mg->size.y; sz[2] = mg->size.z;
+     size[0] = no_size_x ? 0 : geometry_lattice.size.x;
+     size[1] = no_size_y ? 0 : geometry_lattice.size.y;
+     size[2] = no_size_z ? 0 : geometry_lattice.size.z;
+
+     /* range of grid coordinates affected by the changed cells; the
+	mirror boundaries of linear_interpolate extend this at the edges */
+     for (d = 0; d < 3; ++d) {
+	  ulo[d] = lo[d] == 0 ? -HUGE_VAL : (lo[d] - 0.5) / sz[d];
+	  uhi[d] = hi[d] == sz[d] - 1 ? HUGE_VAL : (hi[d] + 1.5) / sz[d];
+     }
+
+     if (o) {
+	  vector3 p0 = {0,0,0}, u;
+	  gbo.o = o;
+	  gbo.shiftby = p0;
+	  gbo.precedence = 0;
+	  geom_get_bounding_box(*o, &gbo.box);
+	  u = to_geom_box_coords(p0, &gbo);
+	  u0[0] = u.x; u0[1] = u.y; u0[2] = u.z;
+	  for (j = 0; j < 3; ++j) {
+	       vector3 p = p0;
+	       if (j == 0) p.x = size[0]; 
+	       else if (j == 1) p.y = size[1]; 
+	       else p.z = size[2];
+	       u = to_geom_box_coords(p, &gbo);
+	       A[0][j] = u.x - u0[0];
+	       A[1][j] = u.y - u0[1];
+	       A[2][j] = u.z - u0[2];
+	  }
+	  {
+	       double blo[3], bhi[3];
+	       blo[0] = gbo.box.low.x; blo[1] = gbo.box.low.y;
+	       blo[2] = gbo.box.low.z;
+	       bhi[0] = gbo.box.high.x; bhi[1] = gbo.box.high.y;
+	       bhi[2] = gbo.box.high.z;
+	       for (d = 0; d < 3; ++d)
+		    if (size[d] == 0) 
+			 vlo[d] = vhi[d] = 0;
+		    else {
+			 vlo[d] = floor((blo[d] / size[d] + 0.5) * n[d]) - 1;
+			 vhi[d] = ceil((bhi[d] / size[d] + 0.5) * n[d]) + 1;
+			 if (vhi[d] - vlo[d] >= 3 * n[d]) { /* huge object */
+			      for (d = 0; d < 3; ++d) {
+				   b->low[d] = 0;
+				   b->high[d] = n[d] - 1;
+			      }
+			      return 1;
+			 }
+		    }
+	  }
+     }
+     else { /* default material: grid coords = lattice coords (mirrored) */
+	  for (d = 0; d < 3; ++d) {
+	       u0[d] = 0;
+	       for (j = 0; j < 3; ++j)
+		    A[d][j] = (d == j && size[d] != 0) ? 1 : 0;
+	       vlo[d] = 0;
+	       vhi[d] = n[d] - 1;
+	  }
+     }
+
+     /* half-width, in grid coordinates, of a pixel dilated by one pixel */
+     for (d = 0; d < 3; ++d)
+	  w[d] = 1.5 * (fabs(A[d][0]) / n[0] + fabs(A[d][1]) / n[1]
+			+ fabs(A[d][2]) / n[2]);
+
+     for (x[0] = vlo[0]; x[0] <= vhi[0]; ++x[0])
+	  for (x[1] = vlo[1]; x[1] <= vhi[1]; ++x[1])
+	       for (x[2] = vlo[2]; x[2] <= vhi[2]; ++x[2]) {
+		    double r[3];
+		    for (j = 0; j < 3; ++j) /* lattice coords / size */
+			 r[j] = (double) x[j] / n[j] - 0.5;
+		    for (d = 0; d < 3; ++d) {
+			 double u = u0[d] + A[d][0] * r[0] + A[d][1] * r[1]
+			      + A[d][2] * r[2];
+			 if (!(u - w[d] <= uhi[d] && u + w[d] >= ulo[d])
+			     && (o || !(-u - w[d] <= uhi[d]
+					&& -u + w[d] >= ulo[d])))
+			      break;
+		    }
+		    if (d < 3)
+			 continue;
+		    if (!found) {
+			 for (d = 0; d < 3; ++d)
+			      b->low[d] = b->high[d] = x[d];
+			 found = 1;
+		    }
+		    else
+			 for (d = 0; d < 3; ++d) {
+			      if (x[d] < b->low[d]) b->low[d] = x[d];
+			      if (x[d] > b->high[d]) b->high[d] = x[d];
+			 }
+	       }
+     return found;
+}
+
+/* The grid values u for which the dielectric function was last
+   computed by material_grids_set_epsilon, or eps_u_n < 0 if the
+   dielectric function has been recomputed from scratch since then
+   (see material_grids_forget_epsilon).  We compare against this
+   private copy rather than against the grid arrays themselves, since
+   the latter can be changed from Scheme (e.g. by
+   randomize-material-grid! or load-material-grid!) without updating
+   epsilon. */
+static double *eps_u = NULL;
+static int eps_u_n = -1;
+
+/* Called whenever the whole dielectric function is recomputed (or
+   loaded), after which eps_u no longer describes it. */
+void material_grids_forget_epsilon(void)
+{
+     eps_u_n = -1;
+}
+
+/* Like material_grids_set followed by reset_epsilon, but only
+   recomputes the dielectric function near the grid cells whose values
+   differ from those of the previous call (doing a full reset_epsilon
+   the first time, or if epsilon was recomputed in between). */
+void material_grids_set_epsilon(const double *u,
+				material_grid *grids, int ngrids)
+{
+     maxwell_grid_box *boxes = NULL;
+     int i, j = 0, nboxes = 0, nalloc = 0, changed = 0, ntot_all;
+
+     CHECK(sizeof(real) == sizeof(double), "material grids require double precision");
+     ntot_all = material_grids_ntot(grids, ngrids);
+
+     if (eps_u_n != ntot_all) { /* no usable snapshot: start from scratch */
+	  material_grids_set(u, grids, ngrids);
+	  reset_epsilon();
+	  free(eps_u);
+	  CHK_MALLOC(eps_u, double, ntot_all + 1);
+	  memcpy(eps_u, u, sizeof(double) * ntot_all);
+	  eps_u_n = ntot_all;
+	  return;
+     }
+
+     for (i = 0; i < ngrids; ++i) {
+	  int sz[3], lo[3], hi[3], k, ig;
+	  int ntot = grids[i].size.x * grids[i].size.y * grids[i].size.z;
+	  double *a = material_grid_array(&grids[i]);
+	  sz[0] = grids[i].size.x; sz[1] = grids[i].size.y;
+	  sz[2] = grids[i].size.z;
+	  lo[0] = lo[1] = lo[2] = ntot;
+	  hi[0] = hi[1] = hi[2] = -1;
+	  for (k = 0; k < ntot; ++k) {
+	       if (eps_u[j + k] != u[j + k]) {
+		    int x[3], d;
+		    x[0] = k / (sz[1] * sz[2]);
+		    x[1] = (k / sz[2]) % sz[1];
+		    x[2] = k % sz[2];
+		    for (d = 0; d < 3; ++d) {
+			 if (x[d] < lo[d]) lo[d] = x[d];
+			 if (x[d] > hi[d]) hi[d] = x[d];
+		    }
+		    eps_u[j + k] = u[j + k];
+	       }
+	       a[k] = u[j + k];
+	  }
+	  material_grid_array_release(&grids[i]);
+	  j += ntot;
+	  if (hi[0] < 0)
+	       continue; /* this grid is unchanged */
+	  changed = 1;
+
+	  for (ig = 0; ig <= geometry.num_items; ++ig) {
+	       const geometric_object *o = ig < geometry.num_items
+		    ? geometry.items + ig : NULL;
+	       const material_type *m = o ? &o->material : &default_material;
+	       if (m->which_subclass != MATERIAL_GRID ||
+		   !material_grid_equal(grids + i,
+					m->subclass.material_grid_data))
+		    continue;
+	       if (nboxes == nalloc) {
+		    nalloc = nalloc * 2 + 4;
+		    boxes = (maxwell_grid_box *)
+			 realloc(boxes, sizeof(maxwell_grid_box) * nalloc);
+		    CHECK(boxes, "out of memory");
+	       }
+	       nboxes += matgrid_cells_grid_box(grids + i, o, lo, hi,
+						boxes + nboxes);
+	  }
+     }
+     if (changed)
+	  update_epsilon_boxes(nboxes, boxes);
+     free(boxes);
+}
+
 /**************************************************************************/
 /* The addgradient function adds to v the gradient, scaled by
    scalegrad, of the frequency of the given band, with respect to
@@ -382,25 +817,187 @@ static void material_grids_addgradient_point(double *v,
      }
 }
 
-void material_grids_addgradient(double *v,
-				double scalegrad, int band,
-				const material_grid *grids, int ngrids)
+/* Since material_grids_addgradient is called at every step of an
+   optimization, but the geometry does not change between steps, we
+   precompute the purely geometric part of the gradient: for each grid
+   point, the material-grid cells that it interpolates, and with what
+   weights.  Each (grid point, overlapping material grid) pair is an
+   "interpolation group" of 8 cells, and the transpose of this
+   voxel-to-cell map is stored in compressed-sparse-row form, indexed by
+   the grid cell.  Each gradient evaluation then only folds in the
+   u-dependent chain-rule factors (for U_MIN/U_PROD/U_SUM) per group,
+   and does one sparse matrix-vector product with |E|^2.  The
+   precomputed operator is rebuilt whenever geometry_tree is. */
+
+typedef struct {
+     int index; /* index of the grid point in the curfield array */
+     int ig; /* which material grid */
+     int x, y, z, x2, y2, z2; /* the interpolated cells of grid ig... */
+     real dx, dy, dz; /* ...and the interpolation weights */
+} gradient_group;
+
+static struct {
+     int generation, ngrids, ntot; /* validity of the precomputation */
+     int npoints, ngroups, nalloc_points, nalloc_groups;
+     int *point_start; /* groups of point i are point_start[i..i+1)-1 */
+     int *point_kind; /* material_grid_kind for each point */
+     double *point_scale; /* epsilon_max - epsilon_min for each point */
+     gradient_group *groups;
+     int *cell_start, *cell_entries; /* CSR: 8*group+corner of each cell */
+     double *factor; /* chain-rule factor of each group (per call) */
+} gop = { -1, 0, 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
+
+static void gradient_operator_destroy(void)
 {
-     int i, j, k, n1, n2, n3, n_other, n_last, rank, last_dim;
+     free(gop.point_start); free(gop.point_kind); free(gop.point_scale);
+     free(gop.groups); free(gop.cell_start); free(gop.cell_entries);
+     free(gop.factor);
+     gop.point_start = gop.point_kind = NULL;
+     gop.point_scale = NULL;
+     gop.groups = NULL;
+     gop.cell_start = gop.cell_entries = NULL;
+     gop.factor = NULL;
+     gop.npoints = gop.ngroups = gop.nalloc_points = gop.nalloc_groups = 0;
+     gop.generation = -1;
+}
+
+/* add an interpolation group for the point r (in the coordinates of
+   grid ig) to the current point, using the same cells and weights as
+   linear_interpolate (see add_interpolate_weights) */
+static void gradient_operator_add_group(int index, int ig,
+					real rx, real ry, real rz,
+					int nx, int ny, int nz)
+{
+     gradient_group *g;
+     if (gop.ngroups == gop.nalloc_groups) {
+	  gop.nalloc_groups = gop.nalloc_groups * 2 + 1024;
+	  gop.groups = (gradient_group *)
+	       realloc(gop.groups, sizeof(gradient_group) * gop.nalloc_groups);
+	  CHECK(gop.groups, "out of memory");
+     }
+     g = gop.groups + gop.ngroups++;
+     g->index = index;
+     g->ig = ig;
+
+     if (rx < 0.0) rx = -rx; else if (rx > 1.0) rx = 1.0 - rx;
+     if (ry < 0.0) ry = -ry; else if (ry > 1.0) ry = 1.0 - ry;
+     if (rz < 0.0) rz = -rz; else if (rz > 1.0) rz = 1.0 - rz;
+
+     g->x = rx * nx; if (g->x == nx) --g->x;
+     g->y = ry * ny; if (g->y == ny) --g->y;
+     g->z = rz * nz; if (g->z == nz) --g->z;
+
+     g->dx = rx * nx - g->x - 0.5;
+     g->dy = ry * ny - g->y - 0.5;
+     g->dz = rz * nz - g->z - 0.5;
+
+     g->x2 = (g->dx >= 0.0 ? g->x + 1 : g->x - 1);
+     if (g->x2 < 0) g->x2++; else if (g->x2 == nx) g->x2--;
+     g->y2 = (g->dy >= 0.0 ? g->y + 1 : g->y - 1);
+     if (g->y2 < 0) g->y2++; else if (g->y2 == ny) g->y2--;
+     g->z2 = (g->dz >= 0.0 ? g->z + 1 : g->z - 1);
+     if (g->z2 < 0) g->z2++; else if (g->z2 == nz) g->z2--;
+
+     g->dx = fabs(g->dx);
+     g->dy = fabs(g->dy);
+     g->dz = fabs(g->dz);
+}
+
+static int find_grid(const material_grid *grids, int ngrids,
+		     const material_grid *g)
+{
+     int i;
+     for (i = 0; i < ngrids && !material_grid_equal(grids + i, g); ++i)
+	  ;
+     CHECK(i < ngrids, "bug in material_grid_gradient_point");
+     return i;
+}
+
+/* add the interpolation groups of the grid point p (with index
+   index in the curfield array), in the same order as matgrid_val */
+static void gradient_operator_add_point(vector3 p, int index,
+					const material_grid *grids,
+					int ngrids)
+{
+     geom_box_tree tp;
+     int oi;
+     material_grid *mg;
+
+     tp = geom_tree_search(p, geometry_tree, &oi);
+     if (tp && tp->objects[oi].o->material.which_subclass == MATERIAL_GRID)
+          mg = tp->objects[oi].o->material.subclass.material_grid_data;
+     else if (!tp && default_material.which_subclass == MATERIAL_GRID)
+	  mg = default_material.subclass.material_grid_data;
+     else
+          return; /* no material grids at this point */
+
+     if (gop.npoints + 1 >= gop.nalloc_points) {
+	  gop.nalloc_points = gop.nalloc_points * 2 + 1024;
+	  gop.point_start = (int *) realloc(gop.point_start, sizeof(int)
+					    * (gop.nalloc_points + 1));
+	  gop.point_kind = (int *) realloc(gop.point_kind, sizeof(int)
+					   * gop.nalloc_points);
+	  gop.point_scale = (double *) realloc(gop.point_scale, sizeof(double)
+					       * gop.nalloc_points);
+	  CHECK(gop.point_start && gop.point_kind && gop.point_scale,
+		"out of memory");
+     }
+     gop.point_start[gop.npoints] = gop.ngroups;
+     gop.point_kind[gop.npoints] = mg->material_grid_kind;
+     gop.point_scale[gop.npoints] = mg->epsilon_max - mg->epsilon_min;
+     gop.npoints++;
+
+     if (tp) {
+	  do {
+	       vector3 pb = to_geom_box_coords(p, &tp->objects[oi]);
+	       const material_grid *g = tp->objects[oi].o->material
+		    .subclass.material_grid_data;
+	       gradient_operator_add_group(index, find_grid(grids, ngrids, g),
+					   pb.x, pb.y, pb.z,
+					   g->size.x, g->size.y, g->size.z);
+	       tp = geom_tree_search_next(p, tp, &oi);
+	  } while (tp &&
+		   compatible_matgrids(mg, &tp->objects[oi].o->material));
+     }
+     if (!tp && compatible_matgrids(mg, &default_material)) {
+	  const material_grid *g = default_material.subclass.material_grid_data;
+	  vector3 pb;
+	  pb.x = no_size_x ? 0 : p.x / geometry_lattice.size.x;
+	  pb.y = no_size_y ? 0 : p.y / geometry_lattice.size.y;
+	  pb.z = no_size_z ? 0 : p.z / geometry_lattice.size.z;
+	  gradient_operator_add_group(index, find_grid(grids, ngrids, g),
+				      pb.x, pb.y, pb.z,
+				      g->size.x, g->size.y, g->size.z);
+     }
+     gop.point_start[gop.npoints] = gop.ngroups;
+}
+
+/* offset in u (or v) of each of the grids */
+static int *grid_offsets(const material_grid *grids, int ngrids)
+{
+     int *off, i;
+     CHK_MALLOC(off, int, ngrids + 1);
+     off[0] = 0;
+     for (i = 0; i < ngrids; ++i)
+	  off[i+1] = off[i] + (int) (grids[i].size.x * grids[i].size.y
+				     * grids[i].size.z);
+     return off;
+}
+
+#define GROUP_CELL(g, off, grids, c) ((off)[(g)->ig] + \
+     ((((c) & 1 ? (g)->x2 : (g)->x) * (int) (grids)[(g)->ig].size.y \
+       + ((c) & 2 ? (g)->y2 : (g)->y)) * (int) (grids)[(g)->ig].size.z \
+      + ((c) & 4 ? (g)->z2 : (g)->z)))
+
+static void gradient_operator_build(const material_grid *grids, int ngrids)
+{
+     int i, j, k, n1, n2, n3, n_other, n_last, rank, last_dim, ntot, *off;
 #ifdef HAVE_MPI
      int local_n2, local_y_start, local_n3;
 #endif
      real s1, s2, s3, c1, c2, c3;
-     real *Esqr;
 
-     CHECK(band <= num_bands, "addgradient called for uncomputed band");
-     if (band) {
-	  scalegrad *= -freqs.items[band - 1]/2;
-	  get_efield(band);
-     }
-     compute_field_squared();
-     Esqr = (real *) curfield;
-     scalegrad *= Vol / H.N;
+     gradient_operator_destroy();
 
      n1 = mdata->nx; n2 = mdata->ny; n3 = mdata->nz;
      n_other = mdata->other_dims;
@@ -498,8 +1095,7 @@ void material_grids_addgradient(double *v,
 
 	       p.x = i2 * s1 - c1; p.y = j2 * s2 - c2; p.z = k2 * s3 - c3;
 
-	       material_grids_addgradient_point(
-		    v, p, Esqr[index]*scalegrad, grids,ngrids);
+	       gradient_operator_add_point(p, index, grids, ngrids);
 
 #ifndef SCALAR_COMPLEX
 	       {
@@ -522,8 +1118,7 @@ void material_grids_addgradient(double *v,
 			 p.y = j2c * s2 - c2; 
 			 p.z = k2c * s3 - c3;
 			 
-			 material_grids_addgradient_point(
-			      v, p, Esqr[index]*scalegrad, grids,ngrids);
+			 gradient_operator_add_point(p, index, grids, ngrids);
 		    }
 	       }
 #endif /* !SCALAR_COMPLEX */
@@ -531,6 +1126,245 @@ void material_grids_addgradient(double *v,
 	  }
 
      }
+
+#ifdef HAVE_MPI
+#  undef i2
+#  undef k2
+#endif
+
+     /* the transposed (cell -> group corner) map, by a counting sort */
+     off = grid_offsets(grids, ngrids);
+     ntot = off[ngrids];
+     CHK_MALLOC(gop.cell_start, int, ntot + 1);
+     CHK_MALLOC(gop.cell_entries, int, 8 * gop.ngroups + 1);
+     CHK_MALLOC(gop.factor, double, gop.ngroups + 1);
+     for (i = 0; i <= ntot; ++i)
+	  gop.cell_start[i] = 0;
+     for (i = 0; i < gop.ngroups; ++i)
+	  for (k = 0; k < 8; ++k)
+	       gop.cell_start[GROUP_CELL(gop.groups+i, off, grids, k) + 1]++;
+     for (i = 0; i < ntot; ++i)
+	  gop.cell_start[i+1] += gop.cell_start[i];
+     for (i = 0; i < gop.ngroups; ++i)
+	  for (k = 0; k < 8; ++k) {
+	       int c = GROUP_CELL(gop.groups+i, off, grids, k);
+	       gop.cell_entries[gop.cell_start[c]++] = 8*i + k;
+	  }
+     for (i = ntot; i > 0; --i) /* undo the shift from the fill */
+	  gop.cell_start[i] = gop.cell_start[i-1];
+     gop.cell_start[0] = 0;
+     free(off);
+
+     gop.ngrids = ngrids;
+     gop.ntot = ntot;
+     gop.generation = geometry_tree_generation;
+}
+
+/* Update the operator if needed, and compute the chain-rule factors
+   for the current u (cf. matgrid_val and add_interpolate_weights). */
+static void gradient_operator_prepare(const material_grid *grids, int ngrids)
+{
+     int i, *off;
+     double *u;
+
+     if (gop.generation != geometry_tree_generation || gop.ngrids != ngrids
+	 || gop.ntot != material_grids_ntot(grids, ngrids))
+	  gradient_operator_build(grids, ngrids);
+
+     off = grid_offsets(grids, ngrids);
+     CHK_MALLOC(u, double, MAX2(1, gop.ntot));
+     material_grids_get(u, grids, ngrids);
+
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+     for (i = 0; i < gop.npoints; ++i) {
+	  int g, g0 = gop.point_start[i], g1 = gop.point_start[i+1];
+	  int kind = gop.point_kind[i];
+	  double uprod = 1.0, umin = 1.0, usum = 0.0, uval, scale;
+	  for (g = g0; g < g1; ++g) {
+	       const gradient_group *gr = gop.groups + g;
+	       double *ug = u + off[gr->ig];
+	       int ny = grids[gr->ig].size.y, nz = grids[gr->ig].size.z;
+	       real dx = gr->dx, dy = gr->dy, dz = gr->dz, ui;
+#define UG(x,y,z) (ug[((x)*ny + (y))*nz + (z)])
+	       ui = (((UG(gr->x,gr->y,gr->z)*(1.0-dx) + UG(gr->x2,gr->y,gr->z)*dx) * (1.0-dy) +
+		      (UG(gr->x,gr->y2,gr->z)*(1.0-dx) + UG(gr->x2,gr->y2,gr->z)*dx) * dy) * (1.0-dz) +
+		     ((UG(gr->x,gr->y,gr->z2)*(1.0-dx) + UG(gr->x2,gr->y,gr->z2)*dx) * (1.0-dy) +
+		      (UG(gr->x,gr->y2,gr->z2)*(1.0-dx) + UG(gr->x2,gr->y2,gr->z2)*dx) * dy) * dz);
+#undef UG
+	       gop.factor[g] = ui; /* temporarily */
+	       if (ui < umin) umin = ui;
+	       uprod *= ui;
+	       usum += ui;
+	  }
+	  uval = kind == U_MIN ? umin : (kind == U_PROD ? uprod
+					 : usum / (g1 - g0));
+	  scale = gop.point_scale[i];
+	  if (kind == U_SUM)
+	       scale /= g1 - g0;
+	  for (g = g0; g < g1; ++g) {
+	       double ui = gop.factor[g];
+	       if (kind == U_MIN)
+		    gop.factor[g] = ui == uval ? scale : 0.0;
+	       else if (kind == U_PROD)
+		    gop.factor[g] = scale * (uval / ui);
+	       else
+		    gop.factor[g] = scale;
+	  }
+     }
+
+     free(u);
+     free(off);
+}
+
+/* v += scalegrad * (the prepared operator applied to Esqr): this is
+   the sparse product of the interpolation weights and factors with
+   Esqr, one grid cell per row. */
+static void gradient_operator_apply(double *v, double scalegrad,
+				    const real *Esqr)
+{
+     int i;
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+     for (i = 0; i < gop.ntot; ++i) {
+	  int e;
+	  double sum = 0;
+	  for (e = gop.cell_start[i]; e < gop.cell_start[i+1]; ++e) {
+	       int g = gop.cell_entries[e] >> 3, c = gop.cell_entries[e] & 7;
+	       const gradient_group *gr = gop.groups + g;
+	       real w = ((c & 1 ? gr->dx : 1.0 - gr->dx)
+			 * (c & 2 ? gr->dy : 1.0 - gr->dy)
+			 * (c & 4 ? gr->dz : 1.0 - gr->dz));
+	       sum += w * gop.factor[g] * Esqr[gr->index];
+	  }
+	  v[i] += sum * scalegrad;
+     }
+}
+
+void material_grids_addgradient(double *v,
+				double scalegrad, int band,
+				const material_grid *grids, int ngrids)
+{
+     CHECK(band <= num_bands, "addgradient called for uncomputed band");
+     CHECK(sizeof(real) == sizeof(double), "material grids require double precision");
+     if (band) {
+	  scalegrad *= -freqs.items[band - 1]/2;
+	  get_efield(band);
+     }
+     compute_field_squared();
+     scalegrad *= Vol / H.N;
+
+     gradient_operator_prepare(grids, ngrids);
+     gradient_operator_apply(v, scalegrad, (real *) curfield);
+}
+
+/* Like calling material_grids_addgradient(vs[j], scalegrads[j],
+   bands[j], grids, ngrids) for j = 0..nbands-1, but the E fields are
+   computed num_fft_bands at a time with batched FFTs, and the weighted
+   |E|^2 densities for all j with the same output vector vs[j] are
+   summed in a single pass before the (sparse) map to the material
+   grids is applied, once per distinct output vector.  Unlike
+   material_grids_addgradient, the bands must be >= 1, and curfield
+   is reset afterwards. */
+void material_grids_addgradients(double **vs,
+				 const double *scalegrads, const int *bands,
+				 int nbands,
+				 const material_grid *grids, int ngrids)
+{
+     int N, j, nout, b, *out, *which;
+     double *w;
+     real *Esqr;
+     scalar_complex *field;
+
+     CHECK(mdata, "init-params must be called before material-grid gradients");
+     CHECK(sizeof(real) == sizeof(double), "material grids require double precision");
+     if (nbands <= 0) return;
+     N = mdata->fft_output_size;
+
+     /* out[j] = index of the distinct output vector for vs[j] */
+     CHK_MALLOC(out, int, nbands);
+     for (nout = j = 0; j < nbands; ++j) {
+	  int j2;
+	  CHECK(bands[j] >= 1 && bands[j] <= num_bands,
+		"addgradients called for uncomputed band");
+	  for (j2 = 0; j2 < j && vs[j2] != vs[j]; ++j2)
+	       ;
+	  out[j] = j2 < j ? out[j2] : nout++;
+     }
+     CHK_MALLOC(Esqr, real, N * nout);
+     for (j = 0; j < N * nout; ++j)
+	  Esqr[j] = 0;
+
+     /* the weight of |E|^2 of each band (before normalization) in each
+	output: the -freq/2 from material_grids_addgradient, times the
+	1/(freq^2 Vol) from the normalization of get_dfield */
+     CHK_MALLOC(w, double, num_bands * nout);
+     CHK_MALLOC(which, int, num_bands);
+     for (j = 0; j < num_bands * nout; ++j)
+	  w[j] = 0;
+     for (j = 0; j < num_bands; ++j)
+	  which[j] = 0;
+     for (j = 0; j < nbands; ++j) {
+	  double f = freqs.items[bands[j] - 1];
+	  if (f != 0.0) {
+	       w[(bands[j] - 1) * nout + out[j]] +=
+		    scalegrads[j] * -0.5 / (f * Vol);
+	       which[bands[j] - 1] = 1;
+	  }
+     }
+
+     field = (scalar_complex *) mdata->fft_data;
+     for (b = 0; b < num_bands; ) {
+	  int nb, i;
+
+	  if (!which[b]) { ++b; continue; }
+	  /* FFT the bands b..b+nb-1, ending at a needed band */
+	  for (nb = MIN2(mdata->num_fft_bands, num_bands - b);
+	       !which[b + nb - 1]; --nb)
+	       ;
+
+	  if (mdata->mu_inv == NULL)
+	       maxwell_compute_d_from_H(mdata, H, field, b, nb);
+	  else {
+	       evectmatrix_resize(&W[0], nb, 0);
+	       maxwell_compute_H_from_B(mdata, H, W[0], field, b, 0, nb);
+	       maxwell_compute_d_from_H(mdata, W[0], field, 0, nb);
+	       evectmatrix_resize(&W[0], W[0].alloc_p, 0);
+	  }
+	  maxwell_compute_e_from_d(mdata, field, nb);
+
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	  for (i = 0; i < N; ++i) {
+	       int ib, k;
+	       for (ib = 0; ib < nb; ++ib) {
+		    const scalar_complex *F = field + 3 * (i * nb + ib);
+		    const double *wb = w + (b + ib) * nout;
+		    real F2;
+		    if (!which[b + ib]) continue;
+		    F2 = (F[0].re * F[0].re + F[0].im * F[0].im
+			  + F[1].re * F[1].re + F[1].im * F[1].im
+			  + F[2].re * F[2].re + F[2].im * F[2].im);
+		    for (k = 0; k < nout; ++k)
+			 Esqr[k * N + i] += wb[k] * F2;
+	       }
+	  }
+	  b += nb;
+     }
+     curfield_reset();
+
+     gradient_operator_prepare(grids, ngrids);
+     for (b = j = 0; j < nbands; ++j)
+	  if (out[j] == b) /* first j for output b */
+	       gradient_operator_apply(vs[j], Vol / H.N, Esqr + N * b++);
+
+     free(which);
+     free(w);
+     free(Esqr);
+     free(out);
 }
 
 /**************************************************************************/
@@ -565,13 +1399,11 @@ number material_grids_approx_gradient(vector3 kpoint, integer band,
      dfdu = u[iu];
      material_grids_get(u, grids, ngrids);
      u[iu] += du;
-     material_grids_set(u, grids, ngrids);
-     reset_epsilon();
+     material_grids_set_epsilon(u, grids, ngrids);
      solve_kpoint(kpoint);
      f1 = freqs.items[band-1];
      u[iu] -= du;
-     material_grids_set(u, grids, ngrids);
-     reset_epsilon();
+     material_grids_set_epsilon(u, grids, ngrids);
      mpi_one_printf("approxgrad: ntot=%d, u[%d] = %g -> f_%d = %g, u += %g -> f_%d = %g; df/du = %g vs. analytic %g\n", ntot, iu, u[iu], band, f0, du, band, f1, (f1-f0)/du, dfdu);
      free(u);
      free(grids);
@@ -898,10 +1730,10 @@ static double match_eps_func(int n, const double *u, double *grad, void *data)
 #endif
      real s1, s2, s3, c1, c2, c3;
 
-     material_grids_set(u, d->grids, d->ngrids);
-     reset_epsilon();
+     material_grids_set_epsilon(u, d->grids, d->ngrids);
      if (grad) memset(work, 0, sizeof(double) * n);
      d->iter++;
+     material_grids_pin();
 
      n1 = mdata->nx; n2 = mdata->ny; n3 = mdata->nz;
      n_other = mdata->other_dims;
@@ -1051,6 +1883,7 @@ static double match_eps_func(int n, const double *u, double *grad, void *data)
 #endif /* !SCALAR_COMPLEX */
 	  }
      }
+     material_grids_unpin();
      if (grad) /* gradient w.r.t. epsilon needs to be summed over processes */
 	  mpi_allreduce(work, grad, n, double, MPI_DOUBLE, 
 			MPI_SUM, mpb_comm);
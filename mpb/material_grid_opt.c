@@ -19,7 +19,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
 
 #include "config.h"
 #include <mpiglue.h>
@@ -32,6 +34,142 @@
 #  include <nlopt.h>
 #endif
 
+/**************************************************************************/
+/* Between optimization steps the structure changes only slightly, so
+   rather than solving each k-point from random fields we restart the
+   eigensolver from that k-point's previous solution.  The fields H (the
+   local part, on each process) are kept in a per-k store, either in
+   memory (optionally rounded to single precision) or in a scratch file,
+   according to the material-grid-field-store input variable. */
+
+typedef enum { STORE_NONE, STORE_DOUBLE, STORE_SINGLE, STORE_DISK } store_kind;
+
+typedef struct {
+     store_kind kind;
+     int nk;
+     size_t nreal; /* number of reals in H (for each k) */
+     char *have; /* have[ik] if fields are stored for k point ik */
+     real *data; /* STORE_DOUBLE */
+     float *fdata; /* STORE_SINGLE */
+     FILE *f; /* STORE_DISK */
+} field_store;
+
+static void field_store_init(field_store *st, int nk)
+{
+     const char *kind = material_grid_field_store;
+     int i;
+
+     st->nk = nk;
+     st->nreal = ((size_t) H.n) * H.alloc_p * (sizeof(scalar) / sizeof(real));
+     st->data = NULL; st->fdata = NULL; st->f = NULL;
+     if (!strcmp(kind, "none"))
+	  st->kind = STORE_NONE;
+     else if (!strcmp(kind, "double") || !kind[0])
+	  st->kind = STORE_DOUBLE;
+     else if (!strcmp(kind, "single"))
+	  st->kind = STORE_SINGLE;
+     else if (!strcmp(kind, "disk"))
+	  st->kind = STORE_DISK;
+     else
+	  CHECK(0, "material-grid-field-store must be \"double\", "
+		"\"single\", \"disk\", or \"none\"");
+
+     CHK_MALLOC(st->have, char, nk);
+     for (i = 0; i < nk; ++i)
+	  st->have[i] = 0;
+
+     switch (st->kind) {
+	 case STORE_DOUBLE:
+	      st->data = (real *) malloc(sizeof(real) * st->nreal * nk);
+	      break;
+	 case STORE_SINGLE:
+	      st->fdata = (float *) malloc(sizeof(float) * st->nreal * nk);
+	      break;
+	 case STORE_DISK:
+	      st->f = tmpfile();
+	      break;
+	 default:
+	      break;
+     }
+     if (st->kind != STORE_NONE && !st->data && !st->fdata && !st->f) {
+	  mpi_one_fprintf(stderr, "Not enough memory to store the fields "
+			  "of %d k-points; starting each solve from random "
+			  "fields.\n", nk);
+	  st->kind = STORE_NONE;
+     }
+     if (st->kind != STORE_NONE)
+	  mpi_one_printf("Storing fields of %d k-points (%s, %g MB/process) "
+			 "between optimization steps.\n", nk, kind,
+			 (st->kind == STORE_SINGLE ? sizeof(float)
+			  : sizeof(real)) * st->nreal * nk / 1048576.0);
+}
+
+static void field_store_destroy(field_store *st)
+{
+     free(st->have);
+     free(st->data);
+     free(st->fdata);
+     if (st->f) fclose(st->f);
+}
+
+static void field_store_save(field_store *st, int ik)
+{
+     const real *r = (const real *) H.data;
+     size_t i, n = st->nreal;
+
+     CHECK(H.p == H.alloc_p, "bug: fields resized at end of solve_kpoint");
+     switch (st->kind) {
+	 case STORE_DOUBLE:
+	      memcpy(st->data + n * ik, r, sizeof(real) * n);
+	      break;
+	 case STORE_SINGLE: {
+	      float *fd = st->fdata + n * ik;
+	      for (i = 0; i < n; ++i)
+		   fd[i] = r[i];
+	      break;
+	 }
+	 case STORE_DISK:
+	      if (fseek(st->f, (long) (sizeof(real) * n * ik), SEEK_SET)
+		  || fwrite(r, sizeof(real), n, st->f) != n)
+		   return; /* just don't use the store for this k */
+	      break;
+	 default:
+	      return;
+     }
+     st->have[ik] = 1;
+}
+
+/* load the stored fields of ik into H; returns whether there were any */
+static int field_store_load(field_store *st, int ik)
+{
+     real *r = (real *) H.data;
+     size_t i, n = st->nreal;
+     int ok = 1;
+
+     if (st->kind == STORE_NONE || !st->have[ik])
+	  ok = 0;
+     else switch (st->kind) {
+	 case STORE_DOUBLE:
+	      memcpy(r, st->data + n * ik, sizeof(real) * n);
+	      break;
+	 case STORE_SINGLE: {
+	      const float *fd = st->fdata + n * ik;
+	      for (i = 0; i < n; ++i)
+		   r[i] = fd[i];
+	      break;
+	 }
+	 default: /* STORE_DISK */
+	      ok = !fseek(st->f, (long) (sizeof(real) * n * ik), SEEK_SET)
+		   && fread(r, sizeof(real), n, st->f) == n;
+	      break;
+     }
+
+     /* all processes must agree, since solve_kpoint is collective
+	and randomize_fields is not */
+     mpi_allreduce_1(&ok, int, MPI_INT, MPI_LAND, mpb_comm);
+     return ok;
+}
+
 /**************************************************************************/
 /* optimization of band gaps as a function of the material grid */
 
@@ -43,7 +181,31 @@ typedef struct {
      material_grid *grids;
      int iter, unsolved;
      double *f1s, *f2s; /* arrays of length ks.num_items for freqs */
-     double *work; /* work array of length ntot */
+     double *work, *work2; /* work arrays of length ntot */
+     int grad_ik; /* index of k point whose gradients are in work/work2 */
+     field_store fields; /* fields of each k point, for warm starts */
+
+     /* with material-grid-kpoint-groups > 1, k point ik is solved by
+	the process group ik % ngroups, and the results are combined in
+	gsum = { f1s, f2s, gradients of constraint 2*ik+kind } */
+     int ngroups, mygroup, have_grads;
+     double *gbuf, *gsum;
+
+     /* adaptive eigensolver tolerance (see update_tolerance) */
+     int adaptive_tol;
+     double tol_min, func_tol, eps_tol;
+     double *uprev, gap_prev;
+
+     int start; /* index of the start in multi-start optimization, or -1 */
+     char name[64]; /* label for the output */
+
+     /* active-set pruning of k points (see kpoint_pruned); the arrays
+	are indexed by constraint 2*ik+kind, or by ik */
+     int active_set, in_mma, npruned;
+     double *as_c, *as_grad; /* f - grad.u and grad at the last solve */
+     int *as_inactive; /* consecutive iterations inactive by the margin */
+     int *as_solved_iter; /* iteration of the last exact solve of ik */
+     int *as_decided_iter, *as_pruned; /* cached decision for ik */
 } maxgap_func_data;
 
 /* the constraint is either an upper bound for band b1
@@ -56,6 +218,146 @@ typedef struct {
      band_constraint_kind kind;
 } band_constraint_data;
 
+/**************************************************************************/
+/* Active-set pruning: typically only a few of the k points have band
+   edges near the current bounds u[n-1] (band-1 max) and u[n-2] (band-2
+   min).  Once both constraints of a k point have been inactive by a
+   relative margin for a few iterations, we skip its eigensolver calls
+   and use the first-order estimate f(u) = f(u0) + grad.(u - u0) from
+   its last exact solution instead.  The k point is solved exactly
+   again every few iterations, or as soon as the estimate gets close
+   to the bound.  The decisions depend only on data that are the same
+   on all processes. */
+
+#define ACTIVE_SET_MARGIN 0.02 /* relative distance from the bound */
+#define ACTIVE_SET_PATIENCE 3 /* inactive iterations before pruning */
+#define ACTIVE_SET_RECHECK 5 /* solve pruned k points every few iterations */
+
+static double active_set_estimate(const maxgap_func_data *d, int ic,
+				  const double *u, int n)
+{
+     const double *g = d->as_grad + ((size_t) ic) * (n-2);
+     double f = d->as_c[ic];
+     int i;
+     for (i = 0; i < n-2; ++i)
+	  f += g[i] * u[i];
+     return f;
+}
+
+static int constraint_inactive(int kind, double f, const double *u, int n)
+{
+     if (kind == BAND1_CONSTRAINT)
+	  return f < u[n-1] * (1 - ACTIVE_SET_MARGIN);
+     else
+	  return f > u[n-2] * (1 + ACTIVE_SET_MARGIN);
+}
+
+/* whether to use the estimates, rather than solving, for k point ik */
+static int kpoint_pruned(maxgap_func_data *d, int ik, const double *u, int n)
+{
+     int kind, pruned = 1;
+
+     if (!d->active_set || !d->in_mma)
+	  return 0;
+     if (d->as_decided_iter[ik] == d->iter)
+	  return d->as_pruned[ik];
+
+     if (d->as_solved_iter[ik] < 0
+	 || d->iter - d->as_solved_iter[ik] >= ACTIVE_SET_RECHECK)
+	  pruned = 0;
+     for (kind = BAND1_CONSTRAINT; pruned && kind <= BAND2_CONSTRAINT; ++kind)
+	  pruned = d->as_inactive[2*ik + kind] >= ACTIVE_SET_PATIENCE
+	       && constraint_inactive(kind, active_set_estimate(d, 2*ik + kind,
+								 u, n), u, n);
+
+     d->as_decided_iter[ik] = d->iter;
+     d->npruned += d->as_pruned[ik] = pruned;
+     return pruned;
+}
+
+/* record the exact value f and gradient grad of constraint (ik,kind) */
+static void active_set_record(maxgap_func_data *d, int ik, int kind,
+			      double f, const double *grad,
+			      const double *u, int n)
+{
+     int ic = 2*ik + kind, i;
+     double *g = d->as_grad + ((size_t) ic) * (n-2);
+
+     if (!d->active_set || !d->in_mma)
+	  return;
+     d->as_c[ic] = f;
+     for (i = 0; i < n-2; ++i) {
+	  g[i] = grad[i];
+	  d->as_c[ic] -= grad[i] * u[i];
+     }
+     if (constraint_inactive(kind, f, u, n))
+	  d->as_inactive[ic]++;
+     else
+	  d->as_inactive[ic] = 0;
+     d->as_solved_iter[ik] = d->iter;
+}
+
+/* In k-point group mode, the first constraint evaluated for a given u
+   solves all of this group's k-points (and computes their gradients, if
+   needed), and the results of all the groups are combined with a single
+   global allreduce.  The constraint functions then just look them up. */
+static void solve_kpoint_groups(maxgap_func_data *d, int n, const double *u,
+				int want_grad)
+{
+     int ik, nk = d->ks.num_items, ng = n - 2;
+     size_t len = 2*nk + (want_grad ? ((size_t) 2*nk) * ng : 0);
+
+     memset(d->gbuf, 0, sizeof(double) * len);
+     for (ik = d->mygroup; ik < nk; ik += d->ngroups) {
+	  if (want_grad && kpoint_pruned(d, ik, u, n))
+	       continue;
+	  if (!field_store_load(&d->fields, ik / d->ngroups))
+	       randomize_fields();
+	  solve_kpoint(d->ks.items[ik]);
+	  field_store_save(&d->fields, ik / d->ngroups);
+
+	  /* frequencies are the same on all processes of the group */
+	  if (mpi_is_master()) {
+	       d->gbuf[ik] = freqs.items[d->b1-1];
+	       d->gbuf[nk + ik] = freqs.items[d->b2-1];
+	  }
+	  if (want_grad) {
+	       double *vs[2], scalegrads[2] = { 1.0, -1.0 };
+	       int bands[2];
+	       vs[0] = d->gbuf + 2*nk + ((size_t) 2*ik) * ng;
+	       vs[1] = vs[0] + ng;
+	       bands[0] = d->b1; bands[1] = d->b2;
+	       material_grids_addgradients(vs, scalegrads, bands, 2,
+					   d->grids, d->ngrids);
+	  }
+     }
+
+     begin_global_communications();
+     mpi_allreduce(d->gbuf, d->gsum, len, double, MPI_DOUBLE,
+		   MPI_SUM, mpb_comm);
+     end_global_communications();
+
+     if (want_grad)
+	  for (ik = 0; ik < nk; ++ik) {
+	       int kind;
+	       for (kind = BAND1_CONSTRAINT; kind <= BAND2_CONSTRAINT; ++kind) {
+		    int ic = 2*ik + kind;
+		    double *g = d->gsum + 2*nk + ((size_t) ic) * ng;
+		    if (kpoint_pruned(d, ik, u, n)) {
+			 d->gsum[kind*nk + ik] = active_set_estimate(d, ic, u, n);
+			 memcpy(g, d->as_grad + ((size_t) ic) * ng,
+				sizeof(double) * ng);
+		    }
+		    else
+			 active_set_record(d, ik, kind, d->gsum[kind*nk + ik],
+					   g, u, n);
+	       }
+	  }
+
+     d->unsolved = 0;
+     d->have_grads = want_grad;
+}
+
 static double band_constraint(int n, const double *u, double *grad, void *data)
 {
      band_constraint_data *cdata = (band_constraint_data *) data;
@@ -65,27 +367,69 @@ static double band_constraint(int n, const double *u, double *grad, void *data)
      double *work = d->work;
      double val = 0;
 
+     if (d->ngroups > 1) {
+	  int nk = d->ks.num_items;
+	  if (d->unsolved || (grad && !d->have_grads))
+	       solve_kpoint_groups(d, n, u, grad != NULL);
+	  if (grad) {
+	       memcpy(grad, d->gsum + 2*nk + ((size_t) 2*ik + kind) * (n-2),
+		      sizeof(double) * (n-2));
+	       grad[n-1] = kind == BAND1_CONSTRAINT ? -1 : 0;
+	       grad[n-2] = kind == BAND1_CONSTRAINT ? 0 : 1;
+	  }
+	  if (kind == BAND1_CONSTRAINT)
+	       return (d->f1s[ik] = d->gsum[ik]) - u[n-1];
+	  else
+	       return u[n-2] - (d->f2s[ik] = d->gsum[nk + ik]);
+     }
+
      /* Strictly speaking, we should call material_grids_set here.  However
 	we rely on an implementation detail of our MMA code: it always
 	evaluates the objective function before evaluating the constraints,
 	and hence we can set the material_grids once in the objective. */
 
+     if (grad && kpoint_pruned(d, ik, u, n)) {
+	  double f = active_set_estimate(d, 2*ik + kind, u, n);
+	  memcpy(grad, d->as_grad + ((size_t) 2*ik + kind) * (n-2),
+		 sizeof(double) * (n-2));
+	  grad[n-1] = kind == BAND1_CONSTRAINT ? -1 : 0;
+	  grad[n-2] = kind == BAND1_CONSTRAINT ? 0 : 1;
+	  if (kind == BAND1_CONSTRAINT)
+	       return (d->f1s[ik] = f) - u[n-1];
+	  else
+	       return u[n-2] - (d->f2s[ik] = f);
+     }
+
      /* We will typically have more than one band per k-point
 	(typically 2 bands), and we don't need to call solve_kpoint
 	more than once per band.  Here we exploit the fact that our
 	MMA code always calls all the constraints at once (in
 	sequence); it never changes u in between one constraint & the next. */
      if (!vector3_equal(cur_kvector, d->ks.items[ik]) || d->unsolved) {
-	  randomize_fields();
+	  if (!field_store_load(&d->fields, ik))
+	       randomize_fields();
 	  solve_kpoint(d->ks.items[ik]);
+	  field_store_save(&d->fields, ik);
+	  d->grad_ik = -1;
      }
      d->unsolved = 0;
 
-     if (grad) memset(work, 0, sizeof(double) * (n-2));
+     /* For the same reason, we compute the gradients for both bands
+	at once (sharing the FFTs), and the second constraint at this
+	k-point just picks up its gradient from d->work2. */
+     if (grad && d->grad_ik != ik) {
+	  double *vs[2], scalegrads[2] = { 1.0, -1.0 };
+	  int bands[2];
+	  vs[0] = d->work; vs[1] = d->work2;
+	  bands[0] = d->b1; bands[1] = d->b2;
+	  memset(d->work, 0, sizeof(double) * (n-2));
+	  memset(d->work2, 0, sizeof(double) * (n-2));
+	  material_grids_addgradients(vs, scalegrads, bands, 2,
+				      d->grids, d->ngrids);
+	  d->grad_ik = ik;
+     }
      if (kind == BAND1_CONSTRAINT) {
 	  if (grad) {
-	       material_grids_addgradient(work, 1.0, d->b1, 
-					  d->grids, d->ngrids);
 	       grad[n-1] = -1;
 	       grad[n-2] = 0;
 	  }
@@ -93,20 +437,57 @@ static double band_constraint(int n, const double *u, double *grad, void *data)
      }
      else {
 	  if (grad) {
-	       material_grids_addgradient(work, -1.0, d->b2, 
-					  d->grids, d->ngrids);
+	       work = d->work2;
 	       grad[n-1] = 0;
 	       grad[n-2] = 1;
 	  }
 	  val = u[n-2] - (d->f2s[ik] = freqs.items[d->b2-1]);
      }
-     if (grad) /* gradient w.r.t. epsilon needs to be summed over processes */
+     if (grad) { /* gradient w.r.t. epsilon needs to be summed over processes */
 	  mpi_allreduce(work, grad, n-2, double, MPI_DOUBLE, 
 			MPI_SUM, mpb_comm);
+	  active_set_record(d, ik, kind, kind == BAND1_CONSTRAINT ?
+			    d->f1s[ik] : d->f2s[ik], grad, u, n);
+     }
 
      return val;
 }
 
+/* Early optimization steps don't need accurate eigenvalues, so we
+   start with a loose eigensolver tolerance and tighten it, down to
+   the tolerance input variable, as the optimization converges.  The
+   eigenvalue (relative) error should be small compared to the change
+   in the objective (or func_tol), and the gradient error, which goes
+   as the square root of the eigenvalue error, small compared to the
+   step in u (or eps_tol).  The tolerance is never loosened again, so
+   that MMA sees consistent constraint values as it converges. */
+#define LOOSEST_TOLERANCE 1e-4
+
+static void update_tolerance(maxgap_func_data *d, int n,
+			     const double *u, double gap)
+{
+     int i;
+
+     if (!d->adaptive_tol)
+	  return;
+     if (d->iter > 1) {
+	  double step = 0, tol_f, tol_g, tol;
+	  for (i = 0; i < n-2; ++i)
+	       step = MAX2(step, fabs(u[i] - d->uprev[i]));
+	  tol_f = 0.1 * MAX2(fabs(gap - d->gap_prev), d->func_tol * fabs(gap));
+	  tol_g = 0.01 * MAX2(step, d->eps_tol) * MAX2(step, d->eps_tol);
+	  tol = MAX2(d->tol_min, MIN2(tol_f, tol_g));
+	  if (tol < tolerance) {
+	       tolerance = tol;
+	       if (d->mygroup == 0)
+		    mpi_one_printf("%s: tightening eigensolver tolerance "
+				   "to %g\n", d->name, tolerance);
+	  }
+     }
+     memcpy(d->uprev, u, sizeof(double) * (n-2));
+     d->gap_prev = gap;
+}
+
 static double maxgap_func(int n, const double *u, double *grad, void *data)
 {
      maxgap_func_data *d = (maxgap_func_data *) data;
@@ -114,12 +495,17 @@ static double maxgap_func(int n, const double *u, double *grad, void *data)
 
      /* set the material grids, for use in the constraint functions
 	and also for outputting in verbose mode */
-     material_grids_set(u, d->grids, d->ngrids);
-     reset_epsilon();
+     material_grids_set_epsilon(u, d->grids, d->ngrids);
+     if (d->active_set && d->in_mma && d->npruned && d->mygroup == 0)
+	  mpi_one_printf("%s: %d of %d k-points pruned at iteration %d\n",
+			 d->name, d->npruned, d->ks.num_items, d->iter);
+     d->npruned = 0;
      d->iter++;
      d->unsolved = 1;
+     d->grad_ik = -1;
 
      gap = (f2 - f1) * 2.0 / (f1 + f2);
+     update_tolerance(d, n, u, gap);
      
      if (grad) {
 	  memset(grad, 0, sizeof(double) * (n-2));
@@ -131,32 +517,46 @@ static double maxgap_func(int n, const double *u, double *grad, void *data)
 	  }
      }
 
-     mpi_one_printf("material-grid-%sgap:, %d, %g, %g, %0.15g\n", 
-		    d->do_min ? "min" : "max", d->iter, f1, f2, gap);
+     if (d->mygroup == 0)
+	  mpi_one_printf("%s:, %d, %g, %g, %0.15g\n", 
+			 d->name, d->iter, f1, f2, gap);
      
-     if (verbose) {
+     if (verbose && d->mygroup == 0) {
 	  char prefix[256];
 	  get_epsilon();
-	  snprintf(prefix, 256, "%sgap-%04d-", 
-		   d->do_min ? "min" : "max", d->iter);
+	  if (d->start >= 0)
+	       snprintf(prefix, 256, "%sgap-s%d-%04d-", 
+			d->do_min ? "min" : "max", d->start, d->iter);
+	  else
+	       snprintf(prefix, 256, "%sgap-%04d-", 
+			d->do_min ? "min" : "max", d->iter);
 	  output_field_to_file(-1, prefix);
      }
 
      return d->do_min ? gap : -gap;
 }
 
-static number material_grids_maxmin_gap(boolean do_min,
-					vector3_list kpoints, 
-					integer band1, integer band2,
-					number func_tol, number eps_tol,
-					integer maxeval, number maxtime)
+/* Optimize the gap, starting from the current material grids, or from
+   ugrid (if non-NULL), which is then replaced by the optimized design.
+   The processes are divided into (up to) kpoint_groups groups of k
+   points.  start >= 0 labels the output for multi-start optimization.
+   Returns the gap, and sets *nevals to the number of objective
+   evaluations and *converged to whether the stopping tolerances
+   (rather than maxeval or maxtime) were reached. */
+static number maxmin_gap_run(boolean do_min, vector3_list kpoints, 
+			     integer band1, integer band2,
+			     number func_tol, number eps_tol,
+			     integer maxeval, number maxtime,
+			     double *ugrid, int kpoint_groups, int start,
+			     int *nevals, int *converged)
 {
      maxgap_func_data d;
      int i, n;
      double *u, *lb, *ub, *u_tol, func_min;
      band_constraint_data *cdata;
-     int have_uprod;
+     int have_uprod, nprocs, parity;
 
+     CHECK(mdata, "init-params must be called before material-grid-maxgap");
      CHECK(band1>0 && band1 <= num_bands && band2>0 && band2 <= num_bands,
 	   "invalid band numbers in material-grid-maxgap");
      d.ks = kpoints;
@@ -164,15 +564,83 @@ static number material_grids_maxmin_gap(boolean do_min,
      d.grids = get_material_grids(geometry, &d.ngrids);
      d.iter = 0;
      d.unsolved = 1;
+     d.grad_ik = -1;
      d.do_min = do_min;
+     d.start = start;
+     if (start >= 0)
+	  snprintf(d.name, sizeof(d.name), "material-grid-%sgap-start-%d",
+		   do_min ? "min" : "max", start);
+     else
+	  snprintf(d.name, sizeof(d.name), "material-grid-%sgap",
+		   do_min ? "min" : "max");
      d.f1s = (double *) malloc(sizeof(double) * kpoints.num_items*2);
      d.f2s = d.f1s + kpoints.num_items;
 
+     /* divide the processes into groups that solve different k points,
+	each group with its own copy of the eigensolver data */
+     MPI_Comm_size(mpb_comm, &nprocs);
+     d.ngroups = MIN2(kpoint_groups, nprocs);
+     d.ngroups = MAX2(1, MIN2(d.ngroups, kpoints.num_items));
+     d.mygroup = 0;
+     d.have_grads = 0;
+     d.gbuf = d.gsum = NULL;
+     parity = mdata->parity;
+     if (d.ngroups > 1) {
+	  mpi_one_printf("Dividing %d processes into %d k-point groups.\n",
+			 nprocs, d.ngroups);
+	  d.mygroup = divide_parallel_processes(d.ngroups);
+	  init_params(parity, 1);
+     }
+     field_store_init(&d.fields, (kpoints.num_items - d.mygroup
+				  + d.ngroups - 1) / d.ngroups);
+
+     d.adaptive_tol = material_grid_adaptive_tolerancep;
+     d.tol_min = tolerance;
+     d.func_tol = func_tol;
+     d.eps_tol = eps_tol;
+     if (d.adaptive_tol && tolerance < LOOSEST_TOLERANCE) {
+	  tolerance = LOOSEST_TOLERANCE;
+	  if (d.mygroup == 0)
+	       mpi_one_printf("%s: starting with eigensolver tolerance %g\n",
+			      d.name, tolerance);
+     }
+
      n = material_grids_ntot(d.grids, d.ngrids) + 2;
-     u = (double *) malloc(sizeof(double) * n * 5);
+     u = (double *) malloc(sizeof(double) * n * 7);
      lb = u + n; ub = lb + n; u_tol = ub + n; d.work = u_tol + n;
+     d.work2 = d.work + n; d.uprev = d.work2 + n;
+     if (d.ngroups > 1) {
+	  size_t len = 2*kpoints.num_items * ((size_t) n - 1);
+	  CHK_MALLOC(d.gbuf, double, 2 * len);
+	  d.gsum = d.gbuf + len;
+     }
+
+     d.active_set = material_grid_active_setp;
+     d.in_mma = 0;
+     d.npruned = 0;
+     d.as_c = d.as_grad = NULL;
+     d.as_inactive = d.as_solved_iter = NULL;
+     d.as_decided_iter = d.as_pruned = NULL;
+     if (d.active_set) {
+	  int nc = 2*kpoints.num_items;
+	  CHK_MALLOC(d.as_c, double, nc);
+	  CHK_MALLOC(d.as_grad, double, ((size_t) nc) * (n-2));
+	  CHK_MALLOC(d.as_inactive, int, nc);
+	  CHK_MALLOC(d.as_solved_iter, int, kpoints.num_items);
+	  CHK_MALLOC(d.as_decided_iter, int, kpoints.num_items);
+	  CHK_MALLOC(d.as_pruned, int, kpoints.num_items);
+	  for (i = 0; i < nc; ++i)
+	       d.as_inactive[i] = 0;
+	  for (i = 0; i < kpoints.num_items; ++i)
+	       d.as_solved_iter[i] = d.as_decided_iter[i] = -1;
+     }
 
-     material_grids_get(u, d.grids, d.ngrids);
+     if (ugrid) {
+	  memcpy(u, ugrid, sizeof(double) * (n-2));
+	  material_grids_set_epsilon(u, d.grids, d.ngrids);
+     }
+     else
+	  material_grids_get(u, d.grids, d.ngrids);
      u[n-1] = 0; /* band1 max */
      u[n-2] = HUGE_VAL; /* band2 min */
 
@@ -214,13 +682,16 @@ static number material_grids_maxmin_gap(boolean do_min,
      nlopt_result res;
      extern int mma_verbose;
      mma_verbose = kpoints.num_items*2;
+     d.in_mma = 1;
      res = nlopt_minimize_constrained(
 	  NLOPT_LD_MMA, n, maxgap_func, &d,
 	  kpoints.num_items*2, band_constraint, 
 	  cdata, sizeof(band_constraint_data),
 	  lb, ub, u, &func_min,
 	  -HUGE_VAL, func_tol,0, 0,u_tol, maxeval,maxtime);
+     d.in_mma = 0;
      CHECK(res > 0, "failure of nlopt_minimize");
+     *converged = res != NLOPT_MAXEVAL_REACHED && res != NLOPT_MAXTIME_REACHED;
  }
 #else
      CHECK(0, "nlopt library is required for material-grid-maxgap");
@@ -228,7 +699,8 @@ static number material_grids_maxmin_gap(boolean do_min,
 
      maxgap_func(n, u, NULL, &d);
 
-     /* recompute bands and get actual gap size */
+     /* recompute bands and get actual gap size, to full accuracy */
+     tolerance = d.tol_min;
 
      u[n-1] = 0; /* band1 max */
      u[n-2] = HUGE_VAL; /* band2 min */
@@ -244,19 +716,268 @@ static number material_grids_maxmin_gap(boolean do_min,
      }
 
      func_min = (u[n-2] - u[n-1]) * 2.0 / (u[n-1] + u[n-2]);
-     mpi_one_printf("material-grid-%sgap:, %d, %g, %g, %0.15g\n",
-                    d.do_min ? "min" : "max", d.iter+1, 
-		    u[n-1], u[n-2], func_min);
+     if (d.mygroup == 0)
+	  mpi_one_printf("%s:, %d, %g, %g, %0.15g\n", d.name, d.iter+1, 
+			 u[n-1], u[n-2], func_min);
      func_min = d.do_min ? func_min : -func_min;
+     if (ugrid)
+	  memcpy(ugrid, u, sizeof(double) * (n-2));
+     *nevals = d.iter;
 
      free(cdata);
      free(u);
      free(d.grids);
      free(d.f1s);
+     free(d.gbuf);
+     free(d.as_c); free(d.as_grad); free(d.as_inactive);
+     free(d.as_solved_iter); free(d.as_decided_iter); free(d.as_pruned);
+     field_store_destroy(&d.fields);
+
+     if (d.ngroups > 1) { /* restore the eigensolver data for all processes */
+	  end_divide_parallel();
+	  init_params(parity, 1);
+     }
 
      return(do_min ? func_min : -func_min);
 }
 
+static number material_grids_maxmin_gap(boolean do_min,
+					vector3_list kpoints, 
+					integer band1, integer band2,
+					number func_tol, number eps_tol,
+					integer maxeval, number maxtime)
+{
+     int nevals, converged;
+     return maxmin_gap_run(do_min, kpoints, band1, band2, func_tol, eps_tol,
+			   maxeval, maxtime, NULL, material_grid_kpoint_groups,
+			   -1, &nevals, &converged);
+}
+
+/**************************************************************************/
+/* Multi-start optimization: since the gap optimization is highly
+   nonconvex, we optimize nstarts randomly perturbed copies of the
+   current design (start 0 is the unperturbed design).  The processes
+   are divided into groups that optimize different starts in parallel.
+
+   The optimization proceeds in stages of a fixed number of evaluations
+   ("successive halving"): after each stage, the results of all groups
+   are combined, the worse half of the designs that are still running
+   are stopped, and the processes are divided among the remaining
+   designs for the next stage.  Each stage restarts MMA from the
+   design reached in the previous stage.  maxeval and maxtime (if
+   nonzero) bound the whole multi-start run, not each stage: the
+   remaining time is split evenly among the remaining stages.  At the
+   end, the material grids are set to the best design found. */
+
+#define MULTISTART_STAGE_EVALS 50 /* evaluations per stage if maxeval = 0 */
+
+/* random numbers in [0,1) that are the same on every process, given
+   the same seed (unlike rand(), which is seeded differently for
+   each process) */
+static double multistart_rand(unsigned long *seed)
+{
+     *seed = (*seed * 1103515245UL + 12345UL) & 0x7fffffffUL;
+     return *seed / 2147483648.0;
+}
+
+static number material_grids_maxmin_gap_multistart(boolean do_min,
+						   vector3_list kpoints, 
+						   integer band1,
+						   integer band2,
+						   number func_tol,
+						   number eps_tol,
+						   integer maxeval,
+						   number maxtime,
+						   integer nstarts,
+						   number noise)
+{
+     int ngrids, ntot, s, j, nprocs, parity, stage, nstages, stage_evals;
+     int used = 0, best, *status, *evals, *run, *ibuf;
+     material_grid *grids;
+     double *us, *ubuf, *gaps, *gbuf, best_gap;
+     unsigned long seed0;
+     time_t start_time = time(NULL);
+     enum { RUNNING = 0, CONVERGED = 1, STOPPED = 2 };
+     const char *status_name[3] = { "running", "converged", "stopped" };
+
+     CHECK(mdata, "init-params must be called before material-grid-maxgap");
+     CHECK(nstarts > 0, "need at least one start for multi-start optimization");
+     grids = get_material_grids(geometry, &ngrids);
+     ntot = material_grids_ntot(grids, ngrids);
+     parity = mdata->parity;
+     MPI_Comm_size(mpb_comm, &nprocs);
+
+     CHK_MALLOC(us, double, ((size_t) ntot) * nstarts);
+     CHK_MALLOC(ubuf, double, ((size_t) ntot) * nstarts);
+     CHK_MALLOC(gaps, double, nstarts);
+     CHK_MALLOC(gbuf, double, nstarts);
+     CHK_MALLOC(status, int, nstarts);
+     CHK_MALLOC(evals, int, nstarts);
+     CHK_MALLOC(run, int, nstarts);
+     CHK_MALLOC(ibuf, int, 2 * nstarts);
+
+     /* the starting designs (identical on all processes) */
+     seed0 = rand();
+     MPI_Bcast(&seed0, 1, MPI_UNSIGNED_LONG, 0, mpb_comm);
+     material_grids_get(us, grids, ngrids);
+     for (s = 0; s < nstarts; ++s) {
+	  double *u = us + ((size_t) ntot) * s;
+	  unsigned long seed = (seed0 + 7919UL * s) & 0x7fffffffUL;
+	  if (s > 0)
+	       for (j = 0; j < ntot; ++j) {
+		    double uj = us[j] + noise * (2*multistart_rand(&seed) - 1);
+		    while (uj < 0 || uj > 1) /* mirror boundary conditions */
+			 uj = uj < 0 ? -uj : 2 - uj;
+		    u[j] = uj;
+	       }
+	  status[s] = RUNNING;
+	  evals[s] = 0;
+	  gaps[s] = 0;
+     }
+
+     for (nstages = 1, s = nstarts; s > 1; s = (s + 1) / 2)
+	  ++nstages;
+     stage_evals = maxeval > 0 ? MAX2(1, maxeval / nstages)
+	  : MULTISTART_STAGE_EVALS;
+     mpi_one_printf("material-grid-%sgap-multistart: %d starts, "
+		    "%d stages of %d evaluations\n", do_min ? "min" : "max",
+		    nstarts, nstages, stage_evals);
+
+     for (stage = 0; ; ++stage) {
+	  int nrun, ngroups, mygroup = 0, this_evals, stages_left;
+	  double this_time = 0;
+
+	  for (nrun = s = 0; s < nstarts; ++s)
+	       if (status[s] == RUNNING)
+		    run[nrun++] = s;
+	  if (!nrun)
+	       break;
+
+	  /* the last design running gets the rest of the budget */
+	  this_evals = stage_evals;
+	  if (nrun == 1)
+	       this_evals = maxeval > 0 ? MAX2(1, maxeval - used) : 0;
+
+	  /* split the remaining time among the remaining stages (timed
+	     on the master, so that all processes agree) */
+	  for (stages_left = 1, s = nrun; s > 1; s = (s + 1) / 2)
+	       ++stages_left;
+	  if (maxtime > 0) {
+	       double elapsed = difftime(time(NULL), start_time);
+	       MPI_Bcast(&elapsed, 1, MPI_DOUBLE, 0, mpb_comm);
+	       if (elapsed >= maxtime) {
+		    for (j = 0; j < nrun; ++j) /* out of time */
+			 status[run[j]] = STOPPED;
+		    break;
+	       }
+	       this_time = (maxtime - elapsed) / stages_left;
+	  }
+
+	  ngroups = MIN2(nrun, nprocs);
+	  if (ngroups > 1) {
+	       mygroup = divide_parallel_processes(ngroups);
+	       init_params(parity, 1);
+	  }
+
+	  for (j = 0; j < nrun; ++j)
+	       memset(ubuf + ((size_t) ntot) * run[j], 0,
+		      sizeof(double) * ntot);
+	  for (j = 0; j < nstarts; ++j) gbuf[j] = 0;
+	  for (j = 0; j < 2*nstarts; ++j) ibuf[j] = 0;
+	  for (j = mygroup; j < nrun; j += ngroups) {
+	       int nevals, converged;
+	       double *u = us + ((size_t) ntot) * run[j], gap;
+	       gap = maxmin_gap_run(do_min, kpoints, band1, band2,
+				    func_tol, eps_tol, this_evals, this_time,
+				    u, 1, run[j], &nevals, &converged);
+	       if (mpi_is_master()) { /* contribute once per group */
+		    memcpy(ubuf + ((size_t) ntot) * run[j], u,
+			   sizeof(double) * ntot);
+		    gbuf[run[j]] = gap;
+		    ibuf[2*run[j]] = nevals;
+		    ibuf[2*run[j] + 1] = converged;
+	       }
+	  }
+
+	  /* gather the results of all groups (to all processes), and
+	     restore the eigensolver data for all processes */
+	  if (ngroups > 1) {
+	       end_divide_parallel();
+	       init_params(parity, 1);
+	  }
+	  {
+	       double *gbuf2;
+	       int *ibuf2;
+	       CHK_MALLOC(gbuf2, double, nstarts);
+	       CHK_MALLOC(ibuf2, int, 2 * nstarts);
+	       /* one design at a time, since nstarts * ntot may
+		  overflow an int count */
+	       for (j = 0; j < nrun; ++j) {
+		    size_t off = ((size_t) ntot) * run[j];
+		    mpi_allreduce(ubuf + off, us + off, ntot, double,
+				  MPI_DOUBLE, MPI_SUM, mpb_comm);
+	       }
+	       mpi_allreduce(gbuf, gbuf2, nstarts, double, MPI_DOUBLE,
+			     MPI_SUM, mpb_comm);
+	       mpi_allreduce(ibuf, ibuf2, 2*nstarts, int, MPI_INT,
+			     MPI_SUM, mpb_comm);
+	       for (j = 0; j < nrun; ++j) {
+		    s = run[j];
+		    gaps[s] = gbuf2[s];
+		    evals[s] += ibuf2[2*s];
+		    if (ibuf2[2*s + 1])
+			 status[s] = CONVERGED;
+	       }
+	       free(ibuf2);
+	       free(gbuf2);
+	  }
+	  used += this_evals;
+
+	  /* stop the worse half of the running designs (in the order
+	     of the gap, with ties going to the lower start index) */
+	  if (nrun > 1 && !(maxeval > 0 && used >= maxeval)) {
+	       int nstop = nrun / 2, k;
+	       for (k = 0; k < nstop; ++k) {
+		    int worst = -1;
+		    for (j = 0; j < nrun; ++j)
+			 if (status[run[j]] == RUNNING &&
+			     (worst < 0 || (do_min ? gaps[run[j]] >= gaps[worst]
+					    : gaps[run[j]] <= gaps[worst])))
+			      worst = run[j];
+		    if (worst < 0) break;
+		    status[worst] = STOPPED;
+	       }
+	  }
+	  else
+	       for (j = 0; j < nrun; ++j) /* out of budget */
+		    if (status[run[j]] == RUNNING)
+			 status[run[j]] = STOPPED;
+
+	  /* convergence history */
+	  for (j = 0; j < nrun; ++j)
+	       mpi_one_printf("material-grid-%sgap-multistart:, %d, %d, %d, "
+			      "%0.15g, %s\n", do_min ? "min" : "max", stage,
+			      run[j], evals[run[j]], gaps[run[j]],
+			      status_name[status[run[j]]]);
+     }
+
+     for (best = s = 0; s < nstarts; ++s)
+	  if (do_min ? gaps[s] < gaps[best] : gaps[s] > gaps[best])
+	       best = s;
+     best_gap = gaps[best];
+     mpi_one_printf("material-grid-%sgap-multistart: best gap %0.15g "
+		    "from start %d\n", do_min ? "min" : "max",
+		    best_gap, best);
+
+     material_grids_set(us + ((size_t) ntot) * best, grids, ngrids);
+     reset_epsilon();
+
+     free(ibuf); free(run); free(evals); free(status);
+     free(gbuf); free(gaps); free(ubuf); free(us);
+     free(grids);
+     return best_gap;
+}
+
 number material_grids_maxgap(vector3_list kpoints, 
 			     integer band1, integer band2,
 			     number func_tol, number eps_tol,
@@ -275,4 +996,26 @@ number material_grids_mingap(vector3_list kpoints,
 				      func_tol, eps_tol, maxeval, maxtime);
 }
 
+number material_grids_maxgap_multistart(vector3_list kpoints, 
+					integer band1, integer band2,
+					number func_tol, number eps_tol,
+					integer maxeval, number maxtime,
+					integer nstarts, number noise)
+{
+     return material_grids_maxmin_gap_multistart(0, kpoints, band1, band2,
+						 func_tol, eps_tol, maxeval,
+						 maxtime, nstarts, noise);
+}
+
+number material_grids_mingap_multistart(vector3_list kpoints, 
+					integer band1, integer band2,
+					number func_tol, number eps_tol,
+					integer maxeval, number maxtime,
+					integer nstarts, number noise)
+{
+     return material_grids_maxmin_gap_multistart(1, kpoints, band1, band2,
+						 func_tol, eps_tol, maxeval,
+						 maxtime, nstarts, noise);
+}
+
 /**************************************************************************/
@@ -22,6 +22,7 @@
 #include "config.h"
 
 #include <check.h>
+#include <mpi_utils.h>
 #include <blasglue.h>
 #include <matrices.h>
 #include <matrixio.h>
@@ -308,10 +309,64 @@ void scale_eigenvector(integer b, cnumber scale)
      curfield_reset();
 }
 
+/* Save the eigenvectors m to filename in the layout-independent
+   format of evectmatrixio_write, so that they can be loaded by a run
+   with a different number of processes or bands.  If with_freqs,
+   m is H and the current frequencies are saved too.  If
+   single_precision, the data are stored as floats (never used for
+   checkpoints, which must round-trip exactly). */
+void save_evectmatrix(const char *filename, evectmatrix m, int with_freqs,
+		      int single_precision)
+{
+     int grid[3], b;
+     real k[3], *f = NULL;
+
+     grid[0] = mdata->nx; grid[1] = mdata->ny; grid[2] = mdata->nz;
+     vector3_to_arr(k, cur_kvector);
+     if (with_freqs && freqs.num_items == m.p) {
+	  CHK_MALLOC(f, real, m.p);
+	  for (b = 0; b < m.p; ++b)
+	       f[b] = freqs.items[b];
+     }
+     evectmatrixio_write(filename, m, grid, k, mdata->parity, f,
+			 single_precision);
+     free(f);
+}
+
+/* Load eigenvectors saved by save_evectmatrix (or in the old raw
+   format, which requires the same number of bands) into the columns of
+   m, starting with band band_start (0-based) of the file.  Returns the
+   number of columns that were loaded; the others are unchanged. */
+int load_evectmatrix(const char *filename, evectmatrix m, int band_start)
+{
+     matrixio_id file_id;
+     int grid[3], parity, nb, raw;
+
+     file_id = matrixio_open(filename, 1);
+     raw = !matrixio_dataset_exists(file_id, "evects");
+     matrixio_close(file_id);
+     if (raw) {
+	  CHECK(band_start == 0, "can't load a subset of raw eigenvectors");
+	  evectmatrixio_readall_raw(filename, m);
+	  return m.p;
+     }
+
+     grid[0] = mdata->nx; grid[1] = mdata->ny; grid[2] = mdata->nz;
+     nb = evectmatrixio_read(filename, m, band_start, grid, NULL, &parity);
+     if (parity != mdata->parity)
+	  mpi_one_fprintf(stderr, "warning: eigenvectors in \"%s\" are "
+			  "for a different parity\n", filename);
+     if (nb < m.p)
+	  mpi_one_printf("Loaded %d of %d bands from \"%s\".\n",
+			 nb, m.p, filename);
+     return nb;
+}
+
 void output_eigenvectors(SCM mo, char *filename)
 {
      evectmatrix *m = assert_evectmatrix_smob(mo);
-     evectmatrixio_writeall_raw(filename, *m);
+     CHECK(mdata, "init-params must be called before output-eigenvectors");
+     save_evectmatrix(filename, *m, 0, output_single_precisionp);
      curfield_reset();
      scm_remember_upto_here_1(mo);
 }
@@ -321,7 +376,7 @@ SCM input_eigenvectors(char *filename, integer num_bands)
      SCM mo = get_eigenvectors(1, num_bands);
      {
 	  evectmatrix *m = assert_evectmatrix_smob(mo);
-	  evectmatrixio_readall_raw(filename, *m);
+	  load_evectmatrix(filename, *m, 0);
      }
      scm_remember_upto_here_1(mo);     
      return mo;
@@ -330,15 +385,15 @@ SCM input_eigenvectors(char *filename, integer num_bands)
 void save_eigenvectors(char *filename)
 {
      CHECK(mdata, "init-params must be called before save-eigenvectors");
-     printf("Saving eigenvectors to \"%s\"...\n", filename);
-     evectmatrixio_writeall_raw(filename, H);
+     mpi_one_printf("Saving eigenvectors to \"%s\"...\n", filename);
+     save_evectmatrix(filename, H, 1, output_single_precisionp);
 }
 
 void load_eigenvectors(char *filename)
 {
      CHECK(mdata, "init-params must be called before load-eigenvectors");
-     printf("Loading eigenvectors from \"%s\"...\n", filename);
-     evectmatrixio_readall_raw(filename, H);
+     mpi_one_printf("Loading eigenvectors from \"%s\"...\n", filename);
+     load_evectmatrix(filename, H, 0);
      curfield_reset();
 }
 
@@ -31,6 +31,8 @@ const int negative_mu_okp = 0; /* mu must always be > 0 */
 
 geom_box_tree geometry_tree = NULL; /* recursive tree of geometry 
 				       objects for fast searching */
+int geometry_tree_generation = 0; /* so that data computed from the
+				     tree can tell when it is stale */
 
 /**************************************************************************/
 
@@ -39,6 +41,10 @@ typedef struct {
      void *epsilon_file_func_data;
      maxwell_dielectric_function mu_file_func;
      void *mu_file_func_data;
+     geom_box_tree tree; /* geometry_tree, or its restriction to a tile */
+     /* the default material, if it is a material grid and there
+	are no objects, so that it covers the whole cell; else NULL */
+     const material_grid *cell_grid;
 } medium_func_data;
 
 static material_type make_medium(double epsilon, double mu)
@@ -67,6 +73,73 @@ static int variable_material(int which_subclass)
 	     which_subclass == MATERIAL_FUNCTION);
 }
 
+/* Convert r, in the basis of the lattice vectors, to the point in the
+   lattice unit-vector basis (with the origin at the center of the
+   grid) used by libctl, shifted into the unit cell. */
+static vector3 lattice_point(const real r[3])
+{
+     vector3 p;
+     p.x = no_size_x ? 0 : (r[0] - 0.5) * geometry_lattice.size.x;
+     p.y = no_size_y ? 0 : (r[1] - 0.5) * geometry_lattice.size.y;
+     p.z = no_size_z ? 0 : (r[2] - 0.5) * geometry_lattice.size.z;
+     return shift_to_unit_cell(p);
+}
+
+static int box_contains_box(const geom_box *a, const geom_box *b)
+{
+     return (a->low.x <= b->low.x && b->high.x <= a->high.x &&
+	     a->low.y <= b->low.y && b->high.y <= a->high.y &&
+	     a->low.z <= b->low.z && b->high.z <= a->high.z);
+}
+
+static int boxes_overlap(const geom_box *a, const geom_box *b)
+{
+     return (a->low.x <= b->high.x && b->low.x <= a->high.x &&
+	     a->low.y <= b->high.y && b->low.y <= a->high.y &&
+	     a->low.z <= b->high.z && b->low.z <= a->high.z);
+}
+
+/* Return the subtree of t from which geom_tree_search finds the same
+   results as from t for each of the n points p: we descend as long as
+   the skipped nodes hold no objects of their own, the points all lie
+   in one child, and none lies in the other child's box (which would
+   be searched too).  Searching from the subtree skips the part of the
+   descent that is common to the points of a batch. */
+static geom_box_tree batch_subtree(geom_box_tree t, const vector3 *p, int n)
+{
+     geom_box bb;
+     int i;
+
+     if (!t || n < 1)
+	  return t;
+     bb.low = bb.high = p[0];
+     for (i = 1; i < n; ++i) {
+	  bb.low.x = MIN2(bb.low.x, p[i].x); bb.high.x = MAX2(bb.high.x, p[i].x);
+	  bb.low.y = MIN2(bb.low.y, p[i].y); bb.high.y = MAX2(bb.high.y, p[i].y);
+	  bb.low.z = MIN2(bb.low.z, p[i].z); bb.high.z = MAX2(bb.high.z, p[i].z);
+     }
+     if (!box_contains_box(&t->b, &bb))
+	  return t;
+     while (t->nobjects == 0) {
+	  int in1 = t->t1 && box_contains_box(&t->b1, &bb)
+	       && box_contains_box(&t->t1->b, &bb);
+	  int in2 = t->t2 && box_contains_box(&t->b2, &bb)
+	       && box_contains_box(&t->t2->b, &bb);
+	  int out1 = !t->t1 || !boxes_overlap(&t->b1, &bb);
+	  int out2 = !t->t2 || !boxes_overlap(&t->b2, &bb);
+	  if (in1 && out2)
+	       t = t->t1;
+	  else if (in2 && out1)
+	       t = t->t2;
+	  else
+	       break;
+     }
+     return t;
+}
+
+/* batches of at most this many points don't need a malloc */
+#define BATCH_STACK_POINTS 64
+
 /**************************************************************************/
 
 #define epsilon_CURFIELD_TYPE 'n'
@@ -112,9 +185,121 @@ static int has_mu(medium_func_data *d)
     return 0;
 }
 
+/* return true if the epsilon/mu functions can be called from multiple
+   threads at once: not if they call into Guile for material functions
+   (Scheme procedures); material grids are safe once their arrays are
+   pinned (see material_grids_pin). */
+static int threadsafe_material(int which_subclass)
+{
+    return !variable_material(which_subclass) ||
+        (which_subclass == MATERIAL_GRID && material_grids_pinned());
+}
+
+static int threadsafe_materials(void)
+{
+    int i;
+    if (!threadsafe_material(default_material.which_subclass))
+        return 0;
+    for (i = 0; i < geometry.num_items; ++i)
+        if (!threadsafe_material(geometry.items[i].material.which_subclass))
+            return 0;
+    return 1;
+}
+
+/* Return the object in t with the highest precedence, or top if
+   there is none higher. */
+static const geom_box_object *top_object(geom_box_tree t,
+					 const geom_box_object *top)
+{
+     int i;
+     if (!t)
+	  return top;
+     for (i = 0; i < t->nobjects; ++i)
+	  if (!top || t->objects[i].precedence > top->precedence)
+	       top = t->objects + i;
+     return top_object(t->t2, top_object(t->t1, top));
+}
+
+/* Tile hook for update_maxwell_dielectric (see maxwell.h): the
+   dielectric functions for the tile search a copy of the geometry tree
+   restricted to the tile's bounding box, and the tile is uniform if
+   the box lies entirely inside the highest-precedence object that
+   intersects it (or if it intersects no objects), and the material
+   there is constant. */
+static void *medium_tile(const real lo[3], const real hi[3], int *uniform,
+			 void *edata)
+{
+     medium_func_data *d = (medium_func_data *) edata, *td;
+     const geom_box_object *top;
+     material_type mat;
+     geom_box b;
+     double size[3], center[3], blo[3], bhi[3];
+     int i, inside;
+
+     size[0] = no_size_x ? 0 : geometry_lattice.size.x;
+     size[1] = no_size_y ? 0 : geometry_lattice.size.y;
+     size[2] = no_size_z ? 0 : geometry_lattice.size.z;
+     center[0] = geometry_center.x;
+     center[1] = geometry_center.y;
+     center[2] = geometry_center.z;
+     blo[0] = geometry_tree->b.low.x; bhi[0] = geometry_tree->b.high.x;
+     blo[1] = geometry_tree->b.low.y; bhi[1] = geometry_tree->b.high.y;
+     blo[2] = geometry_tree->b.low.z; bhi[2] = geometry_tree->b.high.z;
+     for (i = 0; i < 3; ++i)
+	  if (size[i] > 0) {
+	       /* the points are shifted into the unit cell before the
+		  search, so the tile's box must be too; if it straddles
+		  the cell boundary, we just use the whole cell. */
+	       double cell_lo = center[i] - 0.5 * size[i];
+	       double plo = (lo[i] - 0.5) * size[i];
+	       double phi = (hi[i] - 0.5) * size[i];
+	       double shift = floor((plo - cell_lo) / size[i]) * size[i];
+	       if (phi - shift < cell_lo + size[i]) {
+		    blo[i] = plo - shift;
+		    bhi[i] = phi - shift;
+	       }
+	  }
+     b.low.x = blo[0]; b.low.y = blo[1]; b.low.z = blo[2];
+     b.high.x = bhi[0]; b.high.y = bhi[1]; b.high.z = bhi[2];
+
+     CHK_MALLOC(td, medium_func_data, 1);
+     *td = *d;
+     td->tree = restrict_geom_box_tree(geometry_tree, &b);
+
+     top = top_object(td->tree, NULL);
+     inside = 1;
+     if (top) {
+	  geom_box bo;
+	  bo.low = vector3_minus(b.low, top->shiftby);
+	  bo.high = vector3_minus(b.high, top->shiftby);
+	  inside = box_inside_object(bo, *top->o);
+     }
+     if (top && top->o->material.which_subclass != MATERIAL_TYPE_SELF)
+	  mat = top->o->material;
+     else { /* "nothing" object: default material or epsilon file */
+	  mat = default_material;
+	  inside = inside && !d->epsilon_file_func && !d->mu_file_func;
+     }
+     *uniform = inside && !variable_material(mat.which_subclass);
+     return td;
+}
+
+static void medium_tile_done(void *tile_data, void *edata)
+{
+     medium_func_data *td = (medium_func_data *) tile_data;
+     (void) edata;
+     destroy_geom_box_tree(td->tree);
+     free(td);
+}
+
 /**************************************************************************/
 
-void reset_epsilon(void)
+/* Recompute the dielectric function (and mu) at the grid points in the
+   given boxes (see update_maxwell_dielectric), or everywhere if boxes
+   is NULL.  Should be called when only part of the structure has
+   changed, and only after the full dielectric function was computed
+   by init_epsilon. */
+void update_epsilon_boxes(int nboxes, const maxwell_grid_box *boxes)
 {
      medium_func_data d;
      int mesh[3];
@@ -127,18 +312,288 @@ void reset_epsilon(void)
 			   &d.epsilon_file_func, &d.epsilon_file_func_data);
      get_epsilon_file_func(mu_input_file,
                            &d.mu_file_func, &d.mu_file_func_data);
-     mpi_one_printf("Initializing epsilon function...\n");
-     set_maxwell_dielectric(mdata, mesh, R, G, 
-			    epsilon_func, mean_epsilon_func, &d);
+     d.tree = geometry_tree;
+     d.cell_grid = (geometry.num_items == 0 &&
+		    default_material.which_subclass == MATERIAL_GRID)
+	  ? default_material.subclass.material_grid_data : NULL;
+     material_grids_pin();
+     mdata->dielectric_threadsafe = threadsafe_materials();
+     mdata->dielectric_tile = medium_tile;
+     mdata->dielectric_tile_done = medium_tile_done;
+     if (boxes)
+	  mpi_one_printf("Updating epsilon function in %d regions...\n",
+			 nboxes);
+     else
+	  mpi_one_printf("Initializing epsilon function...\n");
+     mdata->dielectric_batch = epsilon_func_batch;
+     update_maxwell_dielectric(mdata, mesh, R, G, 
+			       epsilon_func, mean_epsilon_func, &d,
+			       nboxes, boxes);
+     mpi_one_printf("    %d interface points, %d mesh-averaged points "
+		    "(%g evaluations), %d of %d tiles uniform\n",
+		    mdata->num_interface_points, mdata->num_fallback_points,
+		    mdata->num_fallback_evals,
+		    mdata->num_uniform_tiles, mdata->num_tiles);
      if (has_mu(&d)) {
          mpi_one_printf("Initializing mu function...\n");
-         set_maxwell_mu(mdata, mesh, R, G, 
-                        mu_func, mean_mu_func, &d);
+         mdata->dielectric_batch = mu_func_batch;
+         update_maxwell_mu(mdata, mesh, R, G, 
+                           mu_func, mean_mu_func, &d, nboxes, boxes);
+         mpi_one_printf("    %d interface points, %d mesh-averaged points "
+                        "(%g evaluations), %d of %d tiles uniform\n",
+                        mdata->num_interface_points,
+                        mdata->num_fallback_points,
+                        mdata->num_fallback_evals,
+                        mdata->num_uniform_tiles, mdata->num_tiles);
      }
+     mdata->dielectric_batch = NULL; /* only valid for epsilon/mu_func */
+     material_grids_unpin();
      destroy_epsilon_file_func_data(d.epsilon_file_func_data);
      destroy_epsilon_file_func_data(d.mu_file_func_data);
 }
 
+void reset_epsilon(void)
+{
+     material_grids_forget_epsilon();
+     update_epsilon_boxes(0, NULL);
+}
+
+/* Set b to the box of grid points whose dielectric tensor depends on
+   the region gb (in the lattice unit-vector basis, as for geometric
+   objects), including one extra pixel on each side for the sub-pixel
+   averaging. */
+void geom_box_to_grid_box(geom_box gb, maxwell_grid_box *b)
+{
+     double low[3], high[3], size[3];
+     int n[3], i;
+
+     n[0] = mdata->nx; n[1] = mdata->ny; n[2] = mdata->nz;
+     low[0] = gb.low.x; low[1] = gb.low.y; low[2] = gb.low.z;
+     high[0] = gb.high.x; high[1] = gb.high.y; high[2] = gb.high.z;
+     size[0] = no_size_x ? 0 : geometry_lattice.size.x;
+     size[1] = no_size_y ? 0 : geometry_lattice.size.y;
+     size[2] = no_size_z ? 0 : geometry_lattice.size.z;
+     for (i = 0; i < 3; ++i) {
+	  if (size[i] == 0 || high[i] - low[i] >= size[i]) {
+	       b->low[i] = 0;
+	       b->high[i] = n[i] - 1;
+	  }
+	  else { /* grid point j is at (j/n - 0.5) * size */
+	       b->low[i] = floor((low[i] / size[i] + 0.5) * n[i]) - 1;
+	       b->high[i] = ceil((high[i] / size[i] + 0.5) * n[i]) + 1;
+	       if (b->high[i] - b->low[i] >= n[i]) {
+		    b->low[i] = 0;
+		    b->high[i] = n[i] - 1;
+	       }
+	  }
+     }
+}
+
+typedef double rotation3[3][3];
+
+/* Convert the symmetric (or Hermitian) matrix m to full 3x3 arrays
+   of its real and imaginary parts. */
+static void symmetric_matrix_to_arr(const symmetric_matrix *m,
+				    double re[3][3], double im[3][3])
+{
+     re[0][0] = m->m00; re[1][1] = m->m11; re[2][2] = m->m22;
+     im[0][0] = im[1][1] = im[2][2] = 0;
+     re[0][1] = re[1][0] = ESCALAR_RE(m->m01);
+     re[0][2] = re[2][0] = ESCALAR_RE(m->m02);
+     re[1][2] = re[2][1] = ESCALAR_RE(m->m12);
+     im[0][1] = ESCALAR_IM(m->m01); im[1][0] = -im[0][1];
+     im[0][2] = ESCALAR_IM(m->m02); im[2][0] = -im[0][2];
+     im[1][2] = ESCALAR_IM(m->m12); im[2][1] = -im[1][2];
+}
+
+/* Return whether b == Rc a Rc^T, for a Cartesian rotation Rc, i.e.
+   whether the tensor a at a point is mapped by Rc to the tensor b at
+   the image point. */
+static int same_rotated_tensor(const symmetric_matrix *a,
+			       const symmetric_matrix *b,
+			       double Rc[3][3])
+{
+     double are[3][3], aim[3][3], bre[3][3], bim[3][3], norm = 0;
+     int i, j, k, l;
+
+     symmetric_matrix_to_arr(a, are, aim);
+     symmetric_matrix_to_arr(b, bre, bim);
+     for (i = 0; i < 3; ++i)
+	  for (j = 0; j < 3; ++j)
+	       norm += fabs(are[i][j]) + fabs(aim[i][j]);
+     for (i = 0; i < 3; ++i)
+	  for (j = 0; j < 3; ++j) {
+	       double re = 0, im = 0;
+	       for (k = 0; k < 3; ++k)
+		    for (l = 0; l < 3; ++l) {
+			 re += Rc[i][k] * are[k][l] * Rc[j][l];
+			 im += Rc[i][k] * aim[k][l] * Rc[j][l];
+		    }
+	       if (fabs(re - bre[i][j]) + fabs(im - bim[i][j]) > 1e-6 * norm)
+		    return 0;
+	  }
+     return 1;
+}
+
+/* Given nops point operations W[i] (acting on the lattice-basis
+   coordinates about the origin, i.e. the center of the cell), set
+   invariant[i] to whether the dielectric function (and mu, if any)
+   is left invariant by W[i].  This is determined by comparing the
+   tensors at a fixed quasi-random set of points, rotated by the
+   Cartesian equivalent of W[i] (so that anisotropic media are handled
+   correctly), so it cannot catch asymmetries smaller than the
+   sampling, but it is cheap and gives the same answer on every
+   process.  Should only be called after init_epsilon. */
+void check_medium_symmetries(int nops, int (*W)[3][3], int *invariant)
+{
+     const int npoints = 1000;
+     /* generalized golden ratio for an R3 low-discrepancy sequence: */
+     const double phi3 = 1.2207440845731647;
+     medium_func_data d;
+     int i, n, with_mu;
+     rotation3 *Rc;
+     matrix3x3 Rinv = matrix3x3_inverse(Rm);
+
+     CHECK(geometry_tree, "init-params must be called first");
+
+     /* Cartesian rotations Rc = Rm W Rm^-1 corresponding to the W: */
+     CHK_MALLOC(Rc, rotation3, nops ? nops : 1);
+     for (i = 0; i < nops; ++i) {
+	  matrix3x3 Wm;
+	  Wm.c0.x = W[i][0][0]; Wm.c1.x = W[i][0][1]; Wm.c2.x = W[i][0][2];
+	  Wm.c0.y = W[i][1][0]; Wm.c1.y = W[i][1][1]; Wm.c2.y = W[i][1][2];
+	  Wm.c0.z = W[i][2][0]; Wm.c1.z = W[i][2][1]; Wm.c2.z = W[i][2][2];
+	  Wm = matrix3x3_mult(Rm, matrix3x3_mult(Wm, Rinv));
+	  Rc[i][0][0] = Wm.c0.x; Rc[i][0][1] = Wm.c1.x; Rc[i][0][2] = Wm.c2.x;
+	  Rc[i][1][0] = Wm.c0.y; Rc[i][1][1] = Wm.c1.y; Rc[i][1][2] = Wm.c2.y;
+	  Rc[i][2][0] = Wm.c0.z; Rc[i][2][1] = Wm.c1.z; Rc[i][2][2] = Wm.c2.z;
+     }
+
+     d.tree = geometry_tree;
+     d.cell_grid = NULL;
+     get_epsilon_file_func(epsilon_input_file,
+			   &d.epsilon_file_func, &d.epsilon_file_func_data);
+     get_epsilon_file_func(mu_input_file,
+                           &d.mu_file_func, &d.mu_file_func_data);
+     with_mu = has_mu(&d);
+
+     for (i = 0; i < nops; ++i)
+	  invariant[i] = 1;
+
+     for (n = 0; n < npoints; ++n) {
+	  real r[3], r2[3];
+	  symmetric_matrix eps, mu, m2, m2_inv, scratch;
+	  int j, k;
+
+	  r[0] = fmod(0.5 + (n+1) / phi3, 1.0);
+	  r[1] = fmod(0.5 + (n+1) / (phi3*phi3), 1.0);
+	  r[2] = fmod(0.5 + (n+1) / (phi3*phi3*phi3), 1.0);
+	  epsilon_func(&eps, &scratch, r, &d);
+	  if (with_mu)
+	       mu_func(&mu, &scratch, r, &d);
+
+	  for (i = 0; i < nops; ++i) {
+	       if (!invariant[i])
+		    continue;
+	       for (j = 0; j < 3; ++j) {
+		    double x = 0.5;
+		    for (k = 0; k < 3; ++k)
+			 x += W[i][j][k] * (r[k] - 0.5);
+		    r2[j] = x - floor(x);
+	       }
+	       epsilon_func(&m2, &m2_inv, r2, &d);
+	       if (!same_rotated_tensor(&eps, &m2, Rc[i]))
+		    invariant[i] = 0;
+	       else if (with_mu) {
+		    mu_func(&m2, &m2_inv, r2, &d);
+		    if (!same_rotated_tensor(&mu, &m2, Rc[i]))
+			 invariant[i] = 0;
+	       }
+	  }
+     }
+
+     free(Rc);
+
+     destroy_epsilon_file_func_data(d.epsilon_file_func_data);
+     destroy_epsilon_file_func_data(d.mu_file_func_data);
+}
+
+/* For geometries with at least this many objects, index them with
+   a uniform grid (geom_grid.c) rather than libctl's recursive tree,
+   whose construction does not scale to huge supercells. */
+#define GEOM_GRID_THRESHOLD 256
+
+static int geometry_tree_is_grid = 0;
+static geom_grid_stats geometry_grid_stats;
+
+/* Like geom_fix_objects(), but in parallel for large geometries. */
+static void fix_geometry_objects(void)
+{
+#ifdef USE_OPENMP
+     if (geometry.num_items >= GEOM_GRID_THRESHOLD) {
+	  int i;
+#pragma omp parallel for schedule(dynamic,64)
+	  for (i = 0; i < geometry.num_items; ++i)
+	       geom_fix_object(geometry.items[i]);
+	  return;
+     }
+#endif
+     geom_fix_objects();
+}
+
+static void create_geometry_tree(void)
+{
+     geom_box b0;
+
+     destroy_geom_box_tree(geometry_tree);  /* destroy any tree from
+					       previous runs */
+     b0.low = vector3_plus(geometry_center,
+			   vector3_scale(-0.5, geometry_lattice.size));
+     b0.high = vector3_plus(geometry_center,
+			    vector3_scale(0.5, geometry_lattice.size));
+     /* pad tree boundaries to allow for sub-pixel averaging */
+     b0.low.x -= geometry_lattice.size.x / mdata->nx;
+     b0.low.y -= geometry_lattice.size.y / mdata->ny;
+     b0.low.z -= geometry_lattice.size.z / mdata->nz;
+     b0.high.x += geometry_lattice.size.x / mdata->nx;
+     b0.high.y += geometry_lattice.size.y / mdata->ny;
+     b0.high.z += geometry_lattice.size.z / mdata->nz;
+     geometry_tree_is_grid = geometry.num_items >= GEOM_GRID_THRESHOLD;
+     if (geometry_tree_is_grid)
+	  geometry_tree = create_geom_grid_tree(geometry, b0,
+						&geometry_grid_stats);
+     else
+	  geometry_tree = create_geom_box_tree0(geometry, b0);
+     ++geometry_tree_generation;
+}
+
+/* Guile-callable function: update-epsilon, which re-reads the input
+   variables and recomputes the dielectric function only near the
+   given objects, which should include both the old and the new
+   versions of any objects that were changed, added, or removed from
+   the geometry.  Much faster than init-params for small changes to
+   a large structure, but the lattice and grid must not change. */
+void update_epsilon(geometric_object_list changed)
+{
+     maxwell_grid_box *boxes;
+     int i;
+
+     CHECK(mdata, "init-params must be called before update-epsilon");
+     fix_geometry_objects();
+     create_geometry_tree();
+
+     CHK_MALLOC(boxes, maxwell_grid_box, changed.num_items);
+     for (i = 0; i < changed.num_items; ++i) {
+	  geom_box gb;
+	  geom_fix_object(changed.items[i]);
+	  geom_get_bounding_box(changed.items[i], &gb);
+	  geom_box_to_grid_box(gb, boxes + i);
+     }
+     update_epsilon_boxes(changed.num_items, boxes);
+     free(boxes);
+     material_grids_forget_epsilon(); /* objects may have new grids */
+}
+
 /* Initialize the dielectric function of the global mdata structure,
    along with other geometry data.  Should be called from init-params,
    or in general when global input vars have been loaded and mdata
@@ -186,7 +641,7 @@ void init_epsilon(void)
      matrix3x3_to_arr(G, Gm);
 
      /* we must do this to correct for a non-orthogonal lattice basis: */
-     geom_fix_objects();
+     fix_geometry_objects();
 
      mpi_one_printf("Geometric objects:\n");
      if (mpi_is_master())
@@ -202,23 +657,7 @@ void init_epsilon(void)
 			   subclass.medium_data->mu);
 	  }
 
-     destroy_geom_box_tree(geometry_tree);  /* destroy any tree from
-					       previous runs */
-     {
-	  geom_box b0;
-	  b0.low = vector3_plus(geometry_center,
-				vector3_scale(-0.5, geometry_lattice.size));
-	  b0.high = vector3_plus(geometry_center,
-				 vector3_scale(0.5, geometry_lattice.size));
-	  /* pad tree boundaries to allow for sub-pixel averaging */
-	  b0.low.x -= geometry_lattice.size.x / mdata->nx;
-	  b0.low.y -= geometry_lattice.size.y / mdata->ny;
-	  b0.low.z -= geometry_lattice.size.z / mdata->nz;
-	  b0.high.x += geometry_lattice.size.x / mdata->nx;
-	  b0.high.y += geometry_lattice.size.y / mdata->ny;
-	  b0.high.z += geometry_lattice.size.z / mdata->nz;
-	  geometry_tree = create_geom_box_tree0(geometry, b0);
-     }
+     create_geometry_tree();
      if (verbose && mpi_is_master()) {
 	  printf("Geometry object bounding box tree:\n");
 	  display_geom_box_tree(5, geometry_tree);
@@ -227,6 +666,21 @@ void init_epsilon(void)
      mpi_one_printf("Geometric object tree has depth %d and %d object nodes"
 	    " (vs. %d actual objects)\n",
 	    tree_depth, tree_nobjects, geometry.num_items);
+     if (geometry_tree_is_grid) {
+	  geom_grid_stats *gs = &geometry_grid_stats;
+	  mpi_one_printf("    (uniform %dx%dx%d grid index: %d objects+images, "
+			 "%d/%d cells occupied, mean %g / max %d objects "
+			 "per occupied cell, built in %g s)\n",
+			 gs->n[0], gs->n[1], gs->n[2], gs->nentries,
+			 gs->nonempty_cells, gs->n[0] * gs->n[1] * gs->n[2],
+			 gs->nonempty_cells ?
+			 gs->nrefs * 1.0 / gs->nonempty_cells : 0.0,
+			 gs->max_per_cell, gs->build_time);
+	  mpi_one_printf("    (%d sampled lookups: mean %g / max %d tree "
+			 "nodes and mean %g object boxes per lookup)\n",
+			 gs->nqueries, gs->mean_nodes_per_query,
+			 gs->max_nodes_per_query, gs->mean_tests_per_query);
+     }
 
-     reset_epsilon();
+     reset_epsilon_cached();
 }
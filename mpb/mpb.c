@@ -36,6 +36,7 @@
 #include <mpi_utils.h>
 #include <check.h>
 #include <blasglue.h>
+#include <matrixio.h>
 #include <matrices.h>
 #include <eigensolver.h>
 #include <maxwell.h>
@@ -131,6 +132,7 @@ void ctl_start_hook(int *argc, char ***argv)
 
 void ctl_stop_hook(void)
 {
+     matrixio_async_wait(); /* finish any background field output */
 #ifdef HAVE_FFTW3_MPI
      FFTW(mpi_cleanup)();
 #endif
@@ -364,6 +366,18 @@ void set_parity(integer p)
 
 /**************************************************************************/
 
+static void destroy_fields(void)
+{
+     int i;
+     destroy_evectmatrix(H);
+     for (i = 0; i < nwork_alloc; ++i)
+	  destroy_evectmatrix(W[i]);
+     if (Hblock.data != H.data)
+	  destroy_evectmatrix(Hblock);
+     if (muinvH.data != H.data)
+	  destroy_evectmatrix(muinvH);
+}
+
 /* Guile-callable function: init-params, which initializes any data
    that we need for the eigenvalue calculation.  When this function
    is called, the input variables (the geometry, etcetera) have already
@@ -431,19 +445,13 @@ void init_params(integer p, boolean reset_fields)
 	  block_size = num_bands;
 
      if (mdata) {  /* need to clean up from previous init_params call */
+	  matrixio_async_wait(); /* background output may still use mdata */
 	  if (nx == mdata->nx && ny == mdata->ny && nz == mdata->nz &&
 	      block_size == Hblock.alloc_p && num_bands == H.p &&
 	      eigensolver_nwork + (mdata->mu_inv!=NULL) == nwork_alloc)
 	       have_old_fields = 1; /* don't need to reallocate */
-	  else {
-	       destroy_evectmatrix(H);
-	       for (i = 0; i < nwork_alloc; ++i)
-		    destroy_evectmatrix(W[i]);
-	       if (Hblock.data != H.data)
-		    destroy_evectmatrix(Hblock);
-               if (muinvH.data != H.data)
-                   destroy_evectmatrix(muinvH);                   
-	  }
+	  else
+	       destroy_fields();
 	  destroy_maxwell_target_data(mtdata); mtdata = NULL;
 	  destroy_maxwell_data(mdata); mdata = NULL;
 	  curfield_reset();
@@ -464,6 +472,14 @@ void init_params(integer p, boolean reset_fields)
                                  block_size, NUM_FFT_BANDS);
      CHECK(mdata, "NULL mdata");
 
+     /* the old fields can't be reused if the data distribution changed,
+	e.g. after divide_parallel_processes */
+     if (have_old_fields && (local_N != H.localN || N_start != H.Nstart
+			     || alloc_N != H.allocN)) {
+	  destroy_fields();
+	  have_old_fields = 0;
+     }
+
      if (target_freq != 0.0)
 	  mtdata = create_maxwell_target_data(mdata, target_freq);
      else
@@ -37,6 +37,7 @@ extern void get_epsilon_file_func(const char *fname,
 				  maxwell_dielectric_function *func,
 				  void **func_data);
 extern void destroy_epsilon_file_func_data(void *func_data);
+extern int get_file_stamp(const char *fname, double *mtime, double *size);
 
 extern real linear_interpolate(real rx, real ry, real rz,
 			       real *data, int nx, int ny, int nz, int stride);
@@ -70,6 +71,12 @@ extern real Vol; /* computational cell volume = |det Rm| */
 /* index of current kpoint, for labeling output */
 extern int kpoint_index;
 
+/* in matrix-smob.c: layout-independent eigenvector files */
+extern void save_evectmatrix(const char *filename, evectmatrix m,
+			     int with_freqs, int single_precision);
+extern int load_evectmatrix(const char *filename, evectmatrix m,
+			    int band_start);
+
 /* in fields.c */
 extern void compute_field_squared(void);
 void get_efield(integer which_band);
@@ -89,8 +96,48 @@ extern void cvector32cscalar3(scalar_complex *cs, cvector3 v);
 
 extern int no_size_x, no_size_y, no_size_z;
 extern geom_box_tree geometry_tree;
+extern int geometry_tree_generation; /* incremented when tree is rebuilt */
 extern void reset_epsilon(void);
+extern void update_epsilon_boxes(int nboxes, const maxwell_grid_box *boxes);
+extern void geom_box_to_grid_box(geom_box gb, maxwell_grid_box *b);
 extern void init_epsilon(void);
+extern void check_medium_symmetries(int nops, int (*W)[3][3], int *invariant);
+
+/**************************************************************************/
+/* epsilon_cache.c */
+
+extern void reset_epsilon_cached(void);
+
+/**************************************************************************/
+/* checkpoint.c */
+
+extern int h5file_exists(const char *fname);
+
+/**************************************************************************/
+/* overlap.c */
+
+extern double fast_box_overlap_with_object(geom_box b, geometric_object o,
+					   double tol, int maxeval);
+extern int box_inside_object(geom_box b, geometric_object o);
+
+/**************************************************************************/
+/* geom_grid.c */
+
+typedef struct {
+     int n[3]; /* number of grid cells in each direction */
+     int nentries; /* number of objects + periodic images indexed */
+     int nrefs; /* total number of (cell, object) references */
+     int nonempty_cells, max_per_cell;
+     double build_time; /* in seconds */
+     int nqueries; /* number of sampled point lookups */
+     double mean_nodes_per_query; /* tree nodes visited per lookup */
+     double mean_tests_per_query; /* object boxes tested per lookup */
+     int max_nodes_per_query;
+} geom_grid_stats;
+
+extern geom_box_tree create_geom_grid_tree(geometric_object_list geometry,
+					   geom_box b0,
+					   geom_grid_stats *stats);
 
 /**************************************************************************/
 /* material_grid.c */
@@ -99,13 +146,28 @@ typedef enum { U_MIN = 0, U_PROD = 1, U_SUM = 2 } material_grid_kinds;
 extern real material_grid_val(vector3 p, const material_grid *g);
 extern double matgrid_val(vector3 p, geom_box_tree tp, int oi,
 			  const material_grid *mg);
+extern int material_grid_mesh_mean(const material_grid *g, const real r[3],
+				   const real s[3], const int ms[3],
+				   double lo, double hi,
+				   double *mean, double *mean_inv,
+				   double slope[3]);
 material_grid *get_material_grids(geometric_object_list g, int *ngrids);
 int material_grids_ntot(const material_grid *grids, int ngrids);
 void material_grids_set(const double *u, material_grid *grids, int ngrids);
+void material_grids_forget_epsilon(void);
+void material_grids_set_epsilon(const double *u,
+				material_grid *grids, int ngrids);
 void material_grids_get(double *u, const material_grid *grids, int ngrids);
 void material_grids_addgradient(double *v,
 				double scalegrad, int band,
 				const material_grid *grids, int ngrids);
+void material_grids_pin(void);
+void material_grids_unpin(void);
+int material_grids_pinned(void);
+void material_grids_addgradients(double **vs,
+				 const double *scalegrads, const int *bands,
+				 int nbands,
+				 const material_grid *grids, int ngrids);
 
 /**************************************************************************/
 
@@ -0,0 +1,446 @@
+/* Copyright (C) 1999-2014 Massachusetts Institute of Technology.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Fast computation of the fraction of a pixel that lies inside a
+   geometric object, for the subpixel averaging in mean_epsilon_func.
+
+   libctl's box_overlap_with_object does this by adaptive numerical
+   integration of point_in_fixed_objectp, which costs hundreds of
+   point tests per interface pixel.  The libctl primitives, however,
+   are all intersections of at most three "slabs" (lo <= n.p <= hi,
+   which are linear in p) with at most one convex quadric
+   (p-c)^T Q (p-c) <= 1:
+
+      block:      three slabs (the rows of the projection matrix)
+      ellipsoid:  one quadric
+      sphere:     one quadric (the lattice metric / radius^2)
+      cylinder:   one slab (the caps) and one degenerate quadric
+
+   Since p is in the lattice basis, and a linear change of basis
+   preserves both planes and volume fractions, we can work directly in
+   that basis.  If only one slab cuts the pixel, the overlap is given
+   exactly by the closed-form volume of a box cut by a plane; if only
+   slabs parallel to the pixel faces cut it, the overlap is a product
+   of 1d interval overlaps.  A quadric surface is replaced by its
+   tangent plane (a linearization of sqrt of the quadratic form about
+   the pixel center), which is the same planar-interface
+   approximation made in deriving the averaged dielectric tensor
+   anyway, provided that the pixel is small compared to the radius of
+   curvature.  Otherwise (pixels containing edges or corners, or
+   strongly curved surfaces), we subdivide the pixel a few times, and
+   if that fails we fall back on box_overlap_with_object. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "config.h"
+#include <check.h>
+
+#include <ctl-io.h>
+#include <ctlgeom.h>
+
+#include "mpb.h"
+
+/**************************************************************************/
+
+#define MAX_SLABS 3
+
+/* maximum sag of the surface across a pixel (in units of sqrt of the
+   quadratic form), relative to the variation of its tangent-plane
+   approximation across the pixel, for the latter to be used */
+#define MAX_SAG 0.05
+
+/* maximum number of pixel bisections before we give up */
+#define MAX_DEPTH 3
+
+typedef struct {
+     double n[3], lo, hi; /* lo <= n . p <= hi */
+} slab;
+
+typedef struct {
+     int nslabs;
+     slab slabs[MAX_SLABS];
+     int quadric; /* whether there is a constraint: */
+     double c[3], Q[3][3]; /* (p-c)^T Q (p-c) <= 1, Q >= 0 */
+} shape;
+
+static void vector3_to_darr(double a[3], vector3 v)
+{
+     a[0] = v.x; a[1] = v.y; a[2] = v.z;
+}
+
+/* set A[i][j] to the (i,j) entry of m (which is stored by columns) */
+static void matrix3x3_to_rows(double A[3][3], matrix3x3 m)
+{
+     A[0][0] = m.c0.x; A[0][1] = m.c1.x; A[0][2] = m.c2.x;
+     A[1][0] = m.c0.y; A[1][1] = m.c1.y; A[1][2] = m.c2.y;
+     A[2][0] = m.c0.z; A[2][1] = m.c1.z; A[2][2] = m.c2.z;
+}
+
+/* Decompose o into a shape, returning 0 if o is not one of the
+   primitives that we know how to handle. */
+static int object_shape(const geometric_object *o, shape *s)
+{
+     double M[3][3];
+     int i, j;
+
+     s->nslabs = 0;
+     s->quadric = 0;
+     vector3_to_darr(s->c, o->center);
+     matrix3x3_to_rows(M, geometry_lattice.metric);
+
+     switch (o->which_subclass) {
+	 case SPHERE:
+	 {
+	      double r = o->subclass.sphere_data->radius;
+	      if (r <= 0)
+		   return 0;
+	      s->quadric = 1;
+	      for (i = 0; i < 3; ++i)
+		   for (j = 0; j < 3; ++j)
+			s->Q[i][j] = M[i][j] / (r*r);
+	      return 1;
+	 }
+	 case CYLINDER:
+	 {
+	      const cylinder *cyl = o->subclass.cylinder_data;
+	      double a[3], norm;
+	      if (cyl->which_subclass != CYLINDER_SELF || cyl->radius <= 0)
+		   return 0; /* cones & wedges aren't quadrics or slabs */
+	      /* the axial coordinate is a.(M r), with a normalized so
+		 that a.(M a) = 1; the squared radial distance is then
+		 r.(M r) - (a.(M r))^2 */
+	      vector3_to_darr(a, matrix3x3_vector3_mult(geometry_lattice.metric,
+							cyl->axis));
+	      norm = sqrt(vector3_dot(cyl->axis, matrix3x3_vector3_mult(
+					   geometry_lattice.metric,
+					   cyl->axis)));
+	      for (i = 0; i < 3; ++i)
+		   a[i] /= norm;
+	      s->nslabs = 1;
+	      for (i = 0; i < 3; ++i)
+		   s->slabs[0].n[i] = a[i];
+	      norm = a[0]*s->c[0] + a[1]*s->c[1] + a[2]*s->c[2];
+	      s->slabs[0].lo = norm - 0.5 * cyl->height;
+	      s->slabs[0].hi = norm + 0.5 * cyl->height;
+	      s->quadric = 1;
+	      for (i = 0; i < 3; ++i)
+		   for (j = 0; j < 3; ++j)
+			s->Q[i][j] = (M[i][j] - a[i]*a[j])
+			     / (cyl->radius * cyl->radius);
+	      return 1;
+	 }
+	 case BLOCK:
+	 {
+	      const block *b = o->subclass.block_data;
+	      double P[3][3], size[3];
+	      matrix3x3_to_rows(P, b->projection_matrix);
+	      switch (b->which_subclass) {
+		  case BLOCK_SELF:
+		       vector3_to_darr(size, b->size);
+		       s->nslabs = 3;
+		       for (i = 0; i < 3; ++i) {
+			    double nc = 0;
+			    for (j = 0; j < 3; ++j) {
+				 s->slabs[i].n[j] = P[i][j];
+				 nc += P[i][j] * s->c[j];
+			    }
+			    s->slabs[i].lo = nc - 0.5 * size[i];
+			    s->slabs[i].hi = nc + 0.5 * size[i];
+		       }
+		       return 1;
+		  case ELLIPSOID:
+		  {
+		       double isa[3];
+		       int k;
+		       vector3_to_darr(isa, b->subclass.ellipsoid_data
+				       ->inverse_semi_axes);
+		       s->quadric = 1;
+		       for (i = 0; i < 3; ++i)
+			    for (j = 0; j < 3; ++j) {
+				 s->Q[i][j] = 0;
+				 for (k = 0; k < 3; ++k)
+				      s->Q[i][j] += P[k][i] * P[k][j]
+					   * isa[k] * isa[k];
+			    }
+		       return 1;
+		  }
+		  default:
+		       return 0;
+	      }
+	 }
+	 default:
+	      return 0;
+     }
+}
+
+/**************************************************************************/
+
+/* Return the fraction of the box |d_i| <= h_i that satisfies n.d <= c.
+   This is the volume of a box cut by a plane, which is given by
+   inclusion-exclusion over the box corners: in terms of u_i = d_i/2h_i
+   + 1/2 in [0,1] (flipping the axes with n_i < 0), the constraint is
+   w.u <= c' with all w_i >= 0, and the volume is
+
+       sum over corners v of (-1)^|v| max(0, c' - w.v)^dim / (dim! prod w_i)
+
+   where directions with negligible w_i are dropped (evaluating them at
+   the pixel center) to avoid catastrophic cancellation. */
+static double halfspace_fraction(const double n[3], const double h[3],
+				 double c)
+{
+     double w[3], wmax = 0, wsum = 0, f = 0;
+     int dim = 0, i, v;
+
+     for (i = 0; i < 3; ++i)
+	  wmax = MAX2(wmax, 2 * fabs(n[i]) * h[i]);
+     for (i = 0; i < 3; ++i)
+	  if (2 * fabs(n[i]) * h[i] > 1e-4 * wmax)
+	       wsum += (w[dim++] = 2 * fabs(n[i]) * h[i]);
+
+     c += 0.5 * wsum;
+     if (c <= 0)
+	  return 0.0;
+     if (c >= wsum)
+	  return 1.0;
+
+     for (v = 0; v < (1 << dim); ++v) {
+	  double t = c;
+	  int sgn = 1;
+	  for (i = 0; i < dim; ++i)
+	       if (v & (1 << i)) {
+		    t -= w[i];
+		    sgn = -sgn;
+	       }
+	  if (t > 0)
+	       f += sgn * (dim == 3 ? t*t*t : (dim == 2 ? t*t : t));
+     }
+     for (i = 0; i < dim; ++i)
+	  f /= w[i] * (i + 1);
+     return (f < 0 ? 0.0 : (f > 1 ? 1.0 : f));
+}
+
+/* Return the fraction of the box |p_i - x0_i| <= h_i inside s, or -1 if
+   we couldn't compute it to acceptable accuracy. */
+static double shape_overlap(const shape *s, const double x0[3],
+			    const double h[3], int depth)
+{
+     int i, j, icut = -1, ncut = 0, aligned = 1, quadcut = 0;
+     int cut[MAX_SLABS];
+     double fill;
+
+     for (i = 0; i < s->nslabs; ++i) {
+	  const slab *sl = s->slabs + i;
+	  double v = 0, spread = 0;
+	  int nz = 0;
+	  for (j = 0; j < 3; ++j) {
+	       v += sl->n[j] * x0[j];
+	       spread += fabs(sl->n[j]) * h[j];
+	       nz += sl->n[j] != 0 && h[j] > 0;
+	  }
+	  if (v + spread < sl->lo || v - spread > sl->hi)
+	       return 0.0; /* pixel is outside the slab */
+	  cut[i] = v - spread < sl->lo || v + spread > sl->hi;
+	  if (cut[i]) {
+	       icut = i;
+	       ++ncut;
+	       aligned = aligned && nz == 1;
+	  }
+     }
+
+     if (s->quadric) {
+	  double d[3], Qd[3], F0 = 0, Fmax = 0, g0;
+	  int corner;
+	  for (j = 0; j < 3; ++j)
+	       d[j] = x0[j] - s->c[j];
+	  for (i = 0; i < 3; ++i) {
+	       Qd[i] = 0;
+	       for (j = 0; j < 3; ++j)
+		    Qd[i] += s->Q[i][j] * d[j];
+	       F0 += d[i] * Qd[i];
+	  }
+	  /* F is convex, so its maximum over the box is at a corner */
+	  for (corner = 0; corner < 8; ++corner) {
+	       double dc[3], F = 0;
+	       for (j = 0; j < 3; ++j)
+		    dc[j] = d[j] + ((corner >> j) & 1 ? h[j] : -h[j]);
+	       for (i = 0; i < 3; ++i)
+		    for (j = 0; j < 3; ++j)
+			 F += dc[i] * s->Q[i][j] * dc[j];
+	       if (F > Fmax)
+		    Fmax = F;
+	  }
+	  if (Fmax > 1) {
+	       /* G = sqrt(F) is convex too, so it lies above its
+		  tangent plane g0 + grad.(p - x0), with grad = Qd/g0 */
+	       double spread = 0, sag = 0;
+	       g0 = sqrt(F0);
+	       if (g0 > 0) {
+		    for (j = 0; j < 3; ++j) {
+			 spread += fabs(Qd[j]) * h[j] / g0;
+			 sag += sqrt(fabs(s->Q[j][j])) * h[j];
+		    }
+		    if (g0 - spread > 1)
+			 return 0.0; /* pixel is outside the quadric */
+		    /* |second-order term| <= (sum sqrt(Q_jj) h_j)^2 / 2g0 */
+		    sag = 0.5 * sag * sag / g0;
+	       }
+	       quadcut = 1;
+	       if (ncut == 0 && g0 > 0 && sag <= MAX_SAG * spread) {
+		    double grad[3];
+		    for (j = 0; j < 3; ++j)
+			 grad[j] = Qd[j] / g0;
+		    return halfspace_fraction(grad, h, 1 - g0);
+	       }
+	  }
+     }
+
+     if (!quadcut) {
+	  if (ncut == 0)
+	       return 1.0;
+	  if (ncut == 1) {
+	       const slab *sl = s->slabs + icut;
+	       double v = 0;
+	       for (j = 0; j < 3; ++j)
+		    v += sl->n[j] * x0[j];
+	       return (halfspace_fraction(sl->n, h, sl->hi - v)
+		       - halfspace_fraction(sl->n, h, sl->lo - v));
+	  }
+	  if (aligned) { /* product of 1d overlaps along each axis */
+	       double lo[3], hi[3];
+	       for (j = 0; j < 3; ++j) {
+		    lo[j] = x0[j] - h[j];
+		    hi[j] = x0[j] + h[j];
+	       }
+	       for (i = 0; i < s->nslabs; ++i) if (cut[i]) {
+		    const slab *sl = s->slabs + i;
+		    double v = 0; /* n.p from the pixel's empty dimensions */
+		    int k;
+		    for (j = 0; sl->n[j] == 0 || h[j] == 0; ++j)
+			 ;
+		    for (k = 0; k < 3; ++k)
+			 if (k != j)
+			      v += sl->n[k] * x0[k];
+		    if (sl->n[j] > 0) {
+			 lo[j] = MAX2(lo[j], (sl->lo - v) / sl->n[j]);
+			 hi[j] = MIN2(hi[j], (sl->hi - v) / sl->n[j]);
+		    }
+		    else {
+			 lo[j] = MAX2(lo[j], (sl->hi - v) / sl->n[j]);
+			 hi[j] = MIN2(hi[j], (sl->lo - v) / sl->n[j]);
+		    }
+	       }
+	       fill = 1.0;
+	       for (j = 0; j < 3; ++j)
+		    if (h[j] > 0)
+			 fill *= hi[j] > lo[j] ? (hi[j] - lo[j]) / (2*h[j]) : 0;
+	       return fill;
+	  }
+     }
+
+     /* edges, corners, or strong curvature: bisect the pixel */
+     if (depth >= MAX_DEPTH)
+	  return -1;
+     {
+	  double hsub[3], xsub[3];
+	  int nsub = 0, sub;
+	  for (j = 0; j < 3; ++j)
+	       hsub[j] = 0.5 * h[j];
+	  fill = 0;
+	  for (sub = 0; sub < 8; ++sub) {
+	       double f;
+	       for (j = 0; j < 3; ++j)
+		    if (((sub >> j) & 1) && h[j] == 0)
+			 break;
+	       if (j < 3)
+		    continue; /* don't subdivide along empty dimensions */
+	       for (j = 0; j < 3; ++j)
+		    xsub[j] = x0[j] + ((sub >> j) & 1 ? hsub[j] : -hsub[j]);
+	       f = shape_overlap(s, xsub, hsub, depth + 1);
+	       if (f < 0)
+		    return -1;
+	       fill += f;
+	       ++nsub;
+	  }
+	  return fill / nsub;
+     }
+}
+
+/**************************************************************************/
+
+static void geom_box_to_darr(double x0[3], double h[3], geom_box b)
+{
+     x0[0] = 0.5 * (b.low.x + b.high.x); h[0] = 0.5 * (b.high.x - b.low.x);
+     x0[1] = 0.5 * (b.low.y + b.high.y); h[1] = 0.5 * (b.high.y - b.low.y);
+     x0[2] = 0.5 * (b.low.z + b.high.z); h[2] = 0.5 * (b.high.z - b.low.z);
+}
+
+/* Return whether the box b (relative to the object's coordinates) lies
+   entirely inside o.  May return 0 if o is not a primitive that we can
+   analyze.  (Since the primitives are convex, we only need to check
+   the corners against the quadric.) */
+int box_inside_object(geom_box b, geometric_object o)
+{
+     shape s;
+     double x0[3], h[3];
+     int i, j, corner;
+
+     if (!object_shape(&o, &s))
+	  return 0;
+     geom_box_to_darr(x0, h, b);
+     for (i = 0; i < s.nslabs; ++i) {
+	  double v = 0, spread = 0;
+	  for (j = 0; j < 3; ++j) {
+	       v += s.slabs[i].n[j] * x0[j];
+	       spread += fabs(s.slabs[i].n[j]) * h[j];
+	  }
+	  if (v - spread < s.slabs[i].lo || v + spread > s.slabs[i].hi)
+	       return 0;
+     }
+     if (s.quadric)
+	  for (corner = 0; corner < 8; ++corner) {
+	       double d[3], F = 0;
+	       for (j = 0; j < 3; ++j)
+		    d[j] = x0[j] - s.c[j] + ((corner >> j) & 1 ? h[j] : -h[j]);
+	       for (i = 0; i < 3; ++i)
+		    for (j = 0; j < 3; ++j)
+			 F += d[i] * s.Q[i][j] * d[j];
+	       if (F > 1)
+		    return 0;
+	  }
+     return 1;
+}
+
+/* Like box_overlap_with_object from libctl (b is in the lattice basis,
+   relative to the object's coordinates), but using the methods above
+   for the primitive object types, falling back on adaptive integration
+   for everything else. */
+double fast_box_overlap_with_object(geom_box b, geometric_object o,
+				    double tol, int maxeval)
+{
+     shape s;
+
+     if (object_shape(&o, &s)) {
+	  double x0[3], h[3], fill;
+	  geom_box_to_darr(x0, h, b);
+	  fill = shape_overlap(&s, x0, h, 0);
+	  if (fill >= 0)
+	       return fill;
+     }
+     return box_overlap_with_object(b, o, tol, maxeval);
+}
@@ -26,6 +26,8 @@
 
 #include "matrixio.h"
 
+#define MIN2(a,b) ((a) < (b) ? (a) : (b))
+
 void evectmatrixio_writeall_raw(const char *filename, evectmatrix a)
 {
      int dims[4], start[4] = {0, 0, 0, 0};
@@ -67,3 +69,130 @@ void evectmatrixio_readall_raw(const char *filename, evectmatrix a)
 
      matrixio_close(file_id);
 }
+
+/*************************************************************************/
+
+/* The "raw" format above is simply the evectmatrix, so a file can only
+   be read into a matrix with the same number of bands.  The following
+   routines use a self-describing format instead: the dataset "evects"
+   has dimensions N x c x p x (1 or 2 values per scalar), whose rows are
+   the planewaves in row-major order on the grid[0] x grid[1] x grid[2]
+   FFT grid (independent of how the rows are divided among processes),
+   along with attributes giving the grid size, the Bloch wavevector,
+   the parity, and (optionally) the frequencies.  The data may be
+   stored in single precision, and are transferred with collective
+   (parallel HDF5) i/o where possible. */
+
+void evectmatrixio_write(const char *filename, evectmatrix a,
+			 const int grid[3], const real k[3],
+			 int parity, const real *freqs,
+			 int single_precision)
+{
+     int dims[4], start[4] = {0, 0, 0, 0}, attr_dims[1];
+     matrixio_id file_id, data_id;
+     matrixio_dataset_options o = {0, 0, 0, 0};
+     real rgrid[3], rparity = parity;
+
+     CHECK(a.N == grid[0] * grid[1] * grid[2],
+	   "evectmatrix size doesn't match grid size");
+
+     dims[0] = a.N;
+     dims[1] = a.c;
+     dims[2] = a.p;
+     dims[3] = SCALAR_NUMVALS;
+
+     file_id = matrixio_create(filename);
+     o.single_precision = single_precision;
+     matrixio_set_dataset_options(&file_id, &o);
+     data_id = matrixio_create_dataset(file_id, "evects", NULL, 4, dims);
+
+     dims[0] = a.localN;
+     start[0] = a.Nstart;
+     matrixio_write_real_slab(data_id, dims, start, (real *) a.data);
+     matrixio_close_dataset(data_id);
+
+     rgrid[0] = grid[0]; rgrid[1] = grid[1]; rgrid[2] = grid[2];
+     attr_dims[0] = 3;
+     matrixio_write_data_attr(file_id, "grid size", rgrid, 1, attr_dims);
+     matrixio_write_data_attr(file_id, "Bloch wavevector", k, 1, attr_dims);
+     attr_dims[0] = 1;
+     matrixio_write_data_attr(file_id, "parity", &rparity, 1, attr_dims);
+     if (freqs) {
+	  attr_dims[0] = a.p;
+	  matrixio_write_data_attr(file_id, "frequencies", freqs,
+				   1, attr_dims);
+     }
+     matrixio_write_string_attr(file_id, "description",
+				"MPB eigenvectors (planewave coefficients)");
+     matrixio_close(file_id);
+}
+
+/* Read the bands band_start, band_start+1, ... (0-based) of an
+   evectmatrixio_write file into the columns of a, which may have any
+   number of columns and any distribution among processes, returning
+   the number of bands read; any remaining columns of a are left
+   unchanged.  grid must match the file.  If k/parity are non-NULL,
+   they are set to the file's Bloch wavevector/parity. */
+int evectmatrixio_read(const char *filename, evectmatrix a, int band_start,
+		       const int grid[3], real k[3], int *parity)
+{
+     int rank, fdims[4], dims[4], start[4], nb, i;
+     matrixio_id file_id, data_id;
+     real *r;
+
+     file_id = matrixio_open(filename, 1);
+
+     rank = 1;
+     r = matrixio_read_data_attr(file_id, "grid size", &rank, 1, dims);
+     CHECK(r && rank == 1 && dims[0] == 3, "missing grid size in file");
+     CHECK(r[0] == grid[0] && r[1] == grid[1] && r[2] == grid[2],
+	   "eigenvector file has a different grid size");
+     free(r);
+     if (k) {
+	  rank = 1;
+	  r = matrixio_read_data_attr(file_id, "Bloch wavevector",
+				      &rank, 1, dims);
+	  CHECK(r && dims[0] == 3, "missing Bloch wavevector in file");
+	  k[0] = r[0]; k[1] = r[1]; k[2] = r[2];
+	  free(r);
+     }
+     if (parity) {
+	  rank = 1;
+	  r = matrixio_read_data_attr(file_id, "parity", &rank, 1, dims);
+	  CHECK(r, "missing parity in file");
+	  *parity = (int) r[0];
+	  free(r);
+     }
+
+     CHECK(matrixio_dataset_dims(file_id, "evects", 4, fdims) == 4
+	   && fdims[0] == a.N && fdims[1] == a.c,
+	   "invalid eigenvector dataset in file");
+     CHECK(fdims[3] <= SCALAR_NUMVALS,
+	   "can't read complex eigenvectors into real (mpbi) eigenvectors");
+     nb = MIN2(a.p, fdims[2] - band_start);
+     if (nb < 0) nb = 0;
+
+     dims[0] = a.localN; dims[1] = a.c; dims[2] = nb; dims[3] = fdims[3];
+     start[0] = a.Nstart; start[1] = 0; start[2] = band_start; start[3] = 0;
+     data_id = matrixio_open_dataset(file_id, "evects", 4, fdims);
+     if (nb == a.p && fdims[3] == SCALAR_NUMVALS) /* read in place */
+	  matrixio_read_real_slab(data_id, dims, start, (real *) a.data);
+     else {
+	  /* read into a temporary array, and copy to the first nb
+	     columns of a (converting real to complex if needed) */
+	  int nrows = a.localN * a.c, nv = fdims[3], b;
+	  real *buf;
+	  CHK_MALLOC(buf, real, nrows * nb * nv + 1);
+	  matrixio_read_real_slab(data_id, dims, start, buf);
+	  for (i = 0; i < nrows; ++i)
+	       for (b = 0; b < nb; ++b) {
+		    real *x = buf + (i * nb + b) * nv;
+		    ASSIGN_SCALAR(a.data[i * a.p + b],
+				  x[0], nv > 1 ? x[1] : 0.0);
+	       }
+	  free(buf);
+     }
+     matrixio_close_dataset(data_id);
+     matrixio_close(file_id);
+     return nb;
+}
@@ -30,6 +30,74 @@
 #define TWOPI 6.2831853071795864769252867665590057683943388
 #define MAX2(a,b) ((a) > (b) ? (a) : (b))
 
+/* multiply field by exp(i k*r), where kvector is given in the
+   reciprocal basis */
+static void fieldio_multiply_phase(scalar_complex *field,
+				   const int dims[3],
+				   const int local_dims[3],
+				   const int start[3],
+				   const real *kvector)
+{
+     int i, j, k, component;
+     real s[3]; /* the step size between grid points dotted with k */
+     scalar_complex *phasex, *phasey, *phasez;
+
+     for (i = 0; i < 3; ++i)
+	  s[i] = TWOPI * kvector[i] / dims[i];
+
+     /* cache exp(ikx) along each of the directions, for speed */
+     CHK_MALLOC(phasex, scalar_complex, local_dims[0]);
+     CHK_MALLOC(phasey, scalar_complex, local_dims[1]);
+     CHK_MALLOC(phasez, scalar_complex, local_dims[2]);
+     for (i = 0; i < local_dims[0]; ++i) {
+	  real phase = s[0] * (i + start[0]);
+	  phasex[i].re = cos(phase);
+	  phasex[i].im = sin(phase);
+     }
+     for (j = 0; j < local_dims[1]; ++j) {
+	  real phase = s[1] * (j + start[1]);
+	  phasey[j].re = cos(phase);
+	  phasey[j].im = sin(phase);
+     }
+     for (k = 0; k < local_dims[2]; ++k) {
+	  real phase = s[2] * (k + start[2]);
+	  phasez[k].re = cos(phase);
+	  phasez[k].im = sin(phase);
+     }
+
+     /* Now, multiply field by exp(i k*r): */
+     for (i = 0; i < local_dims[0]; ++i) {
+	  scalar_complex px = phasex[i];
+
+	  for (j = 0; j < local_dims[1]; ++j) {
+	       scalar_complex py;
+	       real re = phasey[j].re, im = phasey[j].im;
+	       py.re = px.re * re - px.im * im;
+	       py.im = px.re * im + px.im * re;
+
+	       for (k = 0; k < local_dims[2]; ++k) {
+		    int ijk = ((i*local_dims[1] + j)*local_dims[2] + k)*3;
+		    real p_re, p_im;
+		    real re = phasez[k].re, im = phasez[k].im;
+
+		    p_re = py.re * re - py.im * im;
+		    p_im = py.re * im + py.im * re;
+
+		    for (component = 0; component < 3; ++component) {
+			 int ijkc = ijk + component;
+			 re = field[ijkc].re; im = field[ijkc].im;
+			 field[ijkc].re = re * p_re - im * p_im;
+			 field[ijkc].im = im * p_re + re * p_im;
+		    }
+	       }
+	  }
+     }
+
+     free(phasez);
+     free(phasey);
+     free(phasex);
+}
+
 /* note that kvector here is given in the reciprocal basis 
    ...data_id should be of length at 2*num_components */
 void fieldio_write_complex_field(scalar_complex *field,
@@ -43,68 +111,68 @@ void fieldio_write_complex_field(scalar_complex *field,
 				 int append,
 				 matrixio_id data_id[])
 {
-     int i, j, k, component, ri_part;
+     int component, ri_part;
 
      rank = dims[2] == 1 ? (dims[1] == 1 ? 1 : 2) : 3;
 
-     if (kvector) {
-	  real s[3]; /* the step size between grid points dotted with k */
-	  scalar_complex *phasex, *phasey, *phasez;
-
-	  for (i = 0; i < 3; ++i)
-	       s[i] = TWOPI * kvector[i] / dims[i];
-	  
-	  /* cache exp(ikx) along each of the directions, for speed */
-	  CHK_MALLOC(phasex, scalar_complex, local_dims[0]);
-	  CHK_MALLOC(phasey, scalar_complex, local_dims[1]);
-	  CHK_MALLOC(phasez, scalar_complex, local_dims[2]);
-	  for (i = 0; i < local_dims[0]; ++i) {
-	       real phase = s[0] * (i + start[0]);
-	       phasex[i].re = cos(phase);
-	       phasex[i].im = sin(phase);
-	  }
-	  for (j = 0; j < local_dims[1]; ++j) {
-	       real phase = s[1] * (j + start[1]);
-	       phasey[j].re = cos(phase);
-	       phasey[j].im = sin(phase);
-	  }
-	  for (k = 0; k < local_dims[2]; ++k) {
-	       real phase = s[2] * (k + start[2]);
-	       phasez[k].re = cos(phase);
-	       phasez[k].im = sin(phase);
-	  }
+     if (kvector)
+	  fieldio_multiply_phase(field, dims, local_dims, start, kvector);
 
-	  /* Now, multiply field by exp(i k*r): */
-	  for (i = 0; i < local_dims[0]; ++i) {
-	       scalar_complex px = phasex[i];
-	       
-	       for (j = 0; j < local_dims[1]; ++j) {
-		    scalar_complex py;
-		    real re = phasey[j].re, im = phasey[j].im;
-		    py.re = px.re * re - px.im * im;
-		    py.im = px.re * im + px.im * re;
+     /* write hyperslabs for each field component: */
+     for (component = 0; component < num_components; ++component)
+	  if (component == which_component ||
+	      which_component < 0)
+	       for (ri_part = 0; ri_part < 2; ++ri_part) {
+		    char name[] = "x.i";
+		    name[0] = (num_components == 1 ? 'c' : 'x') + component;
+		    name[2] = ri_part ? 'i' : 'r';
+
+		    if (!append)
+			 data_id[component*2 + ri_part] =
+			      matrixio_create_dataset(file_id, name, NULL,
+						      rank, dims);
 		    
-		    for (k = 0; k < local_dims[2]; ++k) {
-			 int ijk = ((i*local_dims[1] + j)*local_dims[2] + k)*3;
-			 real p_re, p_im;
-			 real re = phasez[k].re, im = phasez[k].im;
-			 
-			 p_re = py.re * re - py.im * im;
-			 p_im = py.re * im + py.im * re;
-			 
-			 for (component = 0; component < 3; ++component) {
-			      int ijkc = ijk + component;
-			      re = field[ijkc].re; im = field[ijkc].im;
-			      field[ijkc].re = re * p_re - im * p_im;
-			      field[ijkc].im = im * p_re + re * p_im;
-			 }
-		    }
+		    matrixio_write_real_data(
+			 data_id[component*2 + ri_part], local_dims, start, 
+			 2 * num_components,
+			 ri_part ? &field[component].im
+			 : &field[component].re);
 	       }
-	  }
-	  
-	  free(phasez);
-	  free(phasey);
-	  free(phasex);
+}
+
+/* Like fieldio_write_complex_field, but writes the field as the slice
+   band (0 <= band < nbands) of datasets with an additional first
+   dimension of length nbands, so that many bands can be stored in
+   one file.  The band index is the slowest-varying one, so that each
+   band is a contiguous block of the file (and of its chunks) rather
+   than being strided over every grid point.  The datasets are created
+   if data_id[...].id < 0. */
+void fieldio_write_complex_field_band(scalar_complex *field,
+				      int rank,
+				      const int dims[3],
+				      const int local_dims[3],
+				      const int start[3],
+				      int which_component, int num_components,
+				      const real *kvector,
+				      matrixio_id file_id,
+				      int nbands, int band,
+				      matrixio_id data_id[])
+{
+     int i, component, ri_part;
+     int band_dims[4], band_local_dims[4], band_start[4];
+
+     rank = dims[2] == 1 ? (dims[1] == 1 ? 1 : 2) : 3;
+
+     if (kvector)
+	  fieldio_multiply_phase(field, dims, local_dims, start, kvector);
+
+     band_dims[0] = nbands;
+     band_local_dims[0] = 1;
+     band_start[0] = band;
+     for (i = 0; i < rank; ++i) {
+	  band_dims[i+1] = dims[i];
+	  band_local_dims[i+1] = local_dims[i];
+	  band_start[i+1] = start[i];
      }
 
      /* write hyperslabs for each field component: */
@@ -116,13 +184,14 @@ void fieldio_write_complex_field(scalar_complex *field,
 		    name[0] = (num_components == 1 ? 'c' : 'x') + component;
 		    name[2] = ri_part ? 'i' : 'r';
 
-		    if (!append)
+		    if (data_id[component*2 + ri_part].id < 0)
 			 data_id[component*2 + ri_part] =
 			      matrixio_create_dataset(file_id, name, NULL,
-						      rank, dims);
+						      rank + 1, band_dims);
 		    
 		    matrixio_write_real_data(
-			 data_id[component*2 + ri_part], local_dims, start, 
+			 data_id[component*2 + ri_part],
+			 band_local_dims, band_start, 
 			 2 * num_components,
 			 ri_part ? &field[component].im
 			 : &field[component].re);
@@ -328,6 +328,74 @@ static char *add_fname_suffix(const char *fname)
 
 /*****************************************************************************/
 
+/* Asynchronous output: matrixio_async_run(job, data) runs job(data) in
+   a background thread, so that the caller can go on computing while
+   job writes its output.  Only one job runs at a time (a new job waits
+   for the previous one), and since HDF5 is not necessarily thread-safe,
+   any other matrixio file operation from the main thread first waits
+   for the job to finish, as does matrixio_async_wait.  With MPI, or
+   without pthreads, the job is simply run immediately. */
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD) && !defined(HAVE_MPI)
+#  include <pthread.h>
+#  define USE_ASYNC_OUTPUT 1
+static int async_running = 0;
+static pthread_t async_thread, async_main_thread;
+static void (*async_job)(void *);
+static void *async_data;
+
+static void *async_thread_func(void *data)
+{
+     async_job(async_data);
+     return data;
+}
+#endif
+
+void matrixio_async_wait(void)
+{
+#ifdef USE_ASYNC_OUTPUT
+     /* the job itself uses matrixio, and must not wait for itself */
+     if (async_running && pthread_equal(pthread_self(), async_main_thread)) {
+	  CHECK(!pthread_join(async_thread, NULL),
+		"error waiting for output thread");
+	  async_running = 0;
+     }
+#endif
+}
+
+void matrixio_async_run(void (*job)(void *), void *data)
+{
+#ifdef USE_ASYNC_OUTPUT
+     matrixio_async_wait();
+     async_job = job;
+     async_data = data;
+     async_main_thread = pthread_self();
+     if (!pthread_create(&async_thread, NULL, async_thread_func, NULL)) {
+	  async_running = 1;
+	  return;
+     }
+#endif
+     job(data);
+}
+
+/*****************************************************************************/
+
+static const matrixio_dataset_options default_options = {0, 0, 0, 0};
+static int warned_filters = 0; /* only warn once about unusable filters */
+
+/* Set the options (o == NULL for the defaults) for datasets that are
+   subsequently created in the file or group id.  The options are
+   stored in id itself, not globally, so that a background output job
+   (matrixio_async_run) and the main thread cannot clobber each
+   other's settings. */
+void matrixio_set_dataset_options(matrixio_id *id,
+				  const matrixio_dataset_options *o)
+{
+     id->options = o ? *o : default_options;
+}
+
+/*****************************************************************************/
+
 #ifndef HAVE_H5PSET_FAPL_MPIO
 static int matrixio_critical_section_tag = 0;
 #endif
@@ -339,6 +407,8 @@ static matrixio_id matrixio_create_(const char *fname, int parallel)
      matrixio_id id;
      hid_t access_props;
 
+     matrixio_async_wait();
+
      access_props = H5Pcreate (H5P_FILE_ACCESS);
      
 #  if defined(HAVE_MPI) && defined(HAVE_H5PSET_FAPL_MPIO)
@@ -359,6 +429,7 @@ static matrixio_id matrixio_create_(const char *fname, int parallel)
 	  id.id = H5Fopen(new_fname, H5F_ACC_RDWR, access_props);
 #  endif
      id.parallel = parallel;
+     id.options = default_options;
 
      CHECK(id.id >= 0, "error creating HDF output file");
 
@@ -372,7 +443,7 @@ static matrixio_id matrixio_create_(const char *fname, int parallel)
 		     "matrixio: cannot output \"%s\" (compiled without HDF)\n",
 		     fname);
      {
-	  matrixio_id id = {0,0};
+	  matrixio_id id = {0,0,{0,0,0,0}};
 	  return id;
      }
 #endif
@@ -393,6 +464,8 @@ static matrixio_id matrixio_open_(const char *fname, int read_only, int parallel
      matrixio_id id;
      hid_t access_props;
 
+     matrixio_async_wait();
+
      access_props = H5Pcreate (H5P_FILE_ACCESS);
      
 #  if defined(HAVE_MPI) && defined(HAVE_H5PSET_FAPL_MPIO)
@@ -409,6 +482,7 @@ static matrixio_id matrixio_open_(const char *fname, int read_only, int parallel
      else
 	  id.id = H5Fopen(new_fname, H5F_ACC_RDWR, access_props);
      id.parallel = parallel;
+     id.options = default_options;
      CHECK(id.id >= 0, "error opening HDF input file");
 
      free(new_fname);
@@ -419,7 +493,7 @@ static matrixio_id matrixio_open_(const char *fname, int read_only, int parallel
 #else
      CHECK(0, "no matrixio implementation is linked");
      {
-	  matrixio_id id = {0,0};
+	  matrixio_id id = {0,0,{0,0,0,0}};
 	  return id;
      }
 #endif
@@ -449,6 +523,7 @@ matrixio_id matrixio_create_sub(matrixio_id id,
      matrixio_id sub_id;
      sub_id.id = 0;
      sub_id.parallel = id.parallel;
+     sub_id.options = id.options;
 #if defined(HAVE_HDF5)
 
 #  ifdef HAVE_H5PSET_FAPL_MPIO /* H5Gcreate is collective */
@@ -494,6 +569,7 @@ matrixio_id matrixio_open_dataset(matrixio_id id,
      matrixio_id data_id;
      data_id.id = 0;
      data_id.parallel = id.parallel;
+     data_id.options = id.options;
 #if defined(HAVE_HDF5)
  {
      int i, rank_copy;
@@ -533,11 +609,13 @@ matrixio_id matrixio_create_dataset(matrixio_id id,
      matrixio_id data_id;
      data_id.id = 0;
      data_id.parallel = id.parallel;
+     data_id.options = id.options;
 #if defined(HAVE_HDF5)
  {
      int i;
-     hid_t space_id, type_id;
+     hid_t space_id, type_id, create_props;
      hsize_t *dims_copy;
+     matrixio_dataset_options o = id.options;
 
      /* delete pre-existing datasets, or we'll have an error; I think
         we can only do this on the master process. (?) */
@@ -570,16 +648,67 @@ matrixio_id matrixio_create_dataset(matrixio_id id,
 #else
      type_id = H5T_NATIVE_DOUBLE;
 #endif
+     if (o.single_precision) /* HDF5 converts from real when writing */
+	  type_id = H5T_NATIVE_FLOAT;
+
+     create_props = H5Pcreate(H5P_DATASET_CREATE);
+
+#  ifdef HAVE_H5PSET_FAPL_MPIO
+     /* filters require collective writes, which we don't do */
+     if (id.parallel && (o.deflate_level > 0 || o.shuffle)) {
+	  if (!warned_filters)
+	       mpi_one_fprintf(stderr, "matrixio: compression is not "
+			       "supported for parallel HDF5 output\n");
+	  warned_filters = 1;
+	  o.deflate_level = o.shuffle = 0;
+     }
+#  endif
+     if (o.deflate_level > 0 || o.shuffle) {
+	  if (!H5Zfilter_avail(H5Z_FILTER_DEFLATE)) {
+	       if (!warned_filters)
+		    mpi_one_fprintf(stderr, "matrixio: HDF5 lacks deflate "
+				    "compression; writing uncompressed data\n");
+	       warned_filters = 1;
+	       o.deflate_level = o.shuffle = 0;
+	  }
+	  else if (o.chunk_size <= 0) /* filters require chunking */
+	       o.chunk_size = 1 << 18;
+     }
+
+     if (o.chunk_size > 0) {
+	  /* chunks span the whole trailing dimensions, as far as
+	     chunk_size allows, which matches our hyperslab writes */
+	  hsize_t *chunk_dims, remaining = o.chunk_size;
+
+	  CHK_MALLOC(chunk_dims, hsize_t, rank);
+	  for (i = rank - 1; i >= 0; --i) {
+	       chunk_dims[i] = remaining < 1 ? 1 : remaining;
+	       if (chunk_dims[i] > (hsize_t) dims[i])
+		    chunk_dims[i] = dims[i];
+	       remaining /= chunk_dims[i];
+	  }
+	  H5Pset_chunk(create_props, rank, chunk_dims);
+	  free(chunk_dims);
+
+	  if (o.shuffle)
+	       H5Pset_shuffle(create_props);
+	  if (o.deflate_level > 0)
+	       H5Pset_deflate(create_props, o.deflate_level > 9 ? 9
+			      : o.deflate_level);
+     }
      
      /* Create the dataset.  Note that, on parallel machines, H5Dcreate
 	should do the right thing; it is supposedly a collective operation. */
      IF_EXCLUSIVE(
 	  if (mpi_is_master() || !id.parallel)
-	       data_id.id = H5Dcreate(id.id,name,type_id,space_id,H5P_DEFAULT);
+	       data_id.id = H5Dcreate(id.id,name,type_id,space_id,
+				      create_props);
 	  else
 	       data_id.id = H5Dopen(id.id, name),
-	  data_id.id = H5Dcreate(id.id, name, type_id, space_id, H5P_DEFAULT));
+	  data_id.id = H5Dcreate(id.id, name, type_id, space_id,
+				 create_props));
 
+     H5Pclose(create_props);
      H5Sclose(space_id);  /* the dataset should have its own copy now */
      
      matrixio_write_string_attr(data_id, "description", description);
@@ -742,6 +871,122 @@ void matrixio_write_real_data(matrixio_id data_id,
 #endif
 }
 
+/*****************************************************************************/
+
+/* Read or write (if write != 0) the hyperslab of data_id given by
+   local_dims and local_start (in all dimensions) from/to the
+   contiguous array data.  Unlike matrixio_write_real_data, every
+   process must call this for a parallel file, since we use collective
+   MPI-IO transfers when possible. */
+static void real_slab_io(matrixio_id data_id,
+			 const int *local_dims, const int *local_start,
+			 real *data, int write)
+{
+#if defined(HAVE_HDF5)
+     int rank, i, have_data = 1, all_have_data;
+     hid_t space_id, mem_space_id, type_id, xfer_props = H5P_DEFAULT;
+     start_t *start;
+     hsize_t *count;
+
+     space_id = H5Dget_space(data_id.id);
+     rank = H5Sget_simple_extent_ndims(space_id);
+
+#if defined(SCALAR_SINGLE_PREC)
+     type_id = H5T_NATIVE_FLOAT;
+#elif defined(SCALAR_LONG_DOUBLE_PREC)
+     type_id = H5T_NATIVE_LDOUBLE;
+#else
+     type_id = H5T_NATIVE_DOUBLE;
+#endif
+
+     CHK_MALLOC(start, start_t, rank);
+     CHK_MALLOC(count, hsize_t, rank);
+     for (i = 0; i < rank; ++i) {
+	  start[i] = local_start[i];
+	  count[i] = local_dims[i];
+	  if (local_dims[i] <= 0)
+	       have_data = 0;
+     }
+
+     /* HDF5 is unhappy with empty collective transfers, so only use
+	collective i/o if every process has some data */
+     all_have_data = have_data;
+#if defined(HAVE_MPI) && defined(HAVE_H5PSET_FAPL_MPIO)
+     if (data_id.parallel) {
+	  mpi_allreduce(&have_data, &all_have_data, 1, int, MPI_INT,
+			MPI_MIN, mpb_comm);
+	  if (all_have_data) {
+	       xfer_props = H5Pcreate(H5P_DATASET_XFER);
+	       H5Pset_dxpl_mpio(xfer_props, H5FD_MPIO_COLLECTIVE);
+	  }
+     }
+#endif
+
+     if (have_data) {
+	  H5Sselect_hyperslab(space_id, H5S_SELECT_SET,
+			      start, NULL, count, NULL);
+	  mem_space_id = H5Screate_simple(rank, count, NULL);
+	  if (write)
+	       H5Dwrite(data_id.id, type_id, mem_space_id, space_id,
+			xfer_props, data);
+	  else
+	       CHECK(H5Dread(data_id.id, type_id, mem_space_id, space_id,
+			     xfer_props, data) >= 0,
+		     "error reading HDF5 dataset");
+	  H5Sclose(mem_space_id);
+     }
+
+     if (xfer_props != H5P_DEFAULT)
+	  H5Pclose(xfer_props);
+     free(count);
+     free(start);
+     H5Sclose(space_id);
+#endif
+}
+
+void matrixio_write_real_slab(matrixio_id data_id,
+			      const int *local_dims, const int *local_start,
+			      real *data)
+{
+     real_slab_io(data_id, local_dims, local_start, data, 1);
+}
+
+void matrixio_read_real_slab(matrixio_id data_id,
+			     const int *local_dims, const int *local_start,
+			     real *data)
+{
+     real_slab_io(data_id, local_dims, local_start, data, 0);
+}
+
+/* Return the rank of the dataset name in id, storing its dimensions
+   in dims (of length max_rank), or return 0 if there is no such
+   dataset. */
+int matrixio_dataset_dims(matrixio_id id, const char *name,
+			  int max_rank, int *dims)
+{
+     int rank = 0;
+#if defined(HAVE_HDF5)
+     hid_t data_id, space_id;
+     hsize_t *dims_copy;
+     int i;
+
+     SUPPRESS_HDF5_ERRORS(data_id = H5Dopen(id.id, name));
+     if (data_id < 0)
+	  return 0;
+     space_id = H5Dget_space(data_id);
+     rank = H5Sget_simple_extent_ndims(space_id);
+     CHECK(rank <= max_rank, "rank in HDF5 file is too big");
+     CHK_MALLOC(dims_copy, hsize_t, rank);
+     H5Sget_simple_extent_dims(space_id, dims_copy, NULL);
+     for (i = 0; i < rank; ++i)
+	  dims[i] = dims_copy[i];
+     free(dims_copy);
+     H5Sclose(space_id);
+     H5Dclose(data_id);
+#endif
+     return rank;
+}
+
 #if defined(HAVE_HDF5)
 /* check if the given name is a dataset in group_id, and if so set d
    to point to a char** with a copy of name. */
@@ -37,11 +37,28 @@ typedef hssize_t start_t;
 typedef int matrixio_id_; /* dummy */
 #endif
 
+/* options for datasets created by matrixio_create_dataset; the
+   defaults (all zero) give contiguous, uncompressed datasets of
+   the same precision as real */
+typedef struct {
+     int chunk_size; /* approx. # elements per chunk, 0 for contiguous */
+     int deflate_level; /* gzip compression level 1-9, or 0 for none */
+     int shuffle; /* whether to apply the shuffle filter before deflate */
+     int single_precision; /* whether to store as 32-bit floats */
+} matrixio_dataset_options;
+
 typedef struct {
      matrixio_id_ id;
      int parallel;
+     matrixio_dataset_options options; /* for datasets created in id */
 } matrixio_id;
 
+extern void matrixio_set_dataset_options(matrixio_id *id,
+					 const matrixio_dataset_options *o);
+
+extern void matrixio_async_run(void (*job)(void *), void *data);
+extern void matrixio_async_wait(void);
+
 extern matrixio_id matrixio_create(const char *fname);
 matrixio_id matrixio_create_serial(const char *fname);
 extern matrixio_id matrixio_open(const char *fname, int read_only);
@@ -72,6 +89,14 @@ extern real *matrixio_read_real_data(matrixio_id id,
 				     int local_dim0, int local_dim0_start,
 				     int stride,
 				     real *data);
+extern void matrixio_write_real_slab(matrixio_id data_id,
+				     const int *local_dims,
+				     const int *local_start, real *data);
+extern void matrixio_read_real_slab(matrixio_id data_id,
+				    const int *local_dims,
+				    const int *local_start, real *data);
+extern int matrixio_dataset_dims(matrixio_id id, const char *name,
+				 int max_rank, int *dims);
 
 extern void matrixio_write_string_attr(matrixio_id id, const char *name,
 				       const char *val);
@@ -84,6 +109,13 @@ extern real *matrixio_read_data_attr(matrixio_id id, const char *name,
 
 extern void evectmatrixio_writeall_raw(const char *filename, evectmatrix a);
 extern void evectmatrixio_readall_raw(const char *filename, evectmatrix a);
+extern void evectmatrixio_write(const char *filename, evectmatrix a,
+				const int grid[3], const real k[3],
+				int parity, const real *freqs,
+				int single_precision);
+extern int evectmatrixio_read(const char *filename, evectmatrix a,
+			      int band_start, const int grid[3],
+			      real k[3], int *parity);
 
 extern void fieldio_write_complex_field(scalar_complex *field,
 					int rank,
@@ -96,6 +128,17 @@ extern void fieldio_write_complex_field(scalar_complex *field,
 					matrixio_id file_id,
 					int append,
 					matrixio_id data_id[]);
+extern void fieldio_write_complex_field_band(scalar_complex *field,
+					     int rank,
+					     const int dims[3],
+					     const int local_dims[3],
+					     const int start[3],
+					     int which_component,
+					     int num_components,
+					     const real *kvector,
+					     matrixio_id file_id,
+					     int nbands, int band,
+					     matrixio_id data_id[]);
 extern void fieldio_write_real_vals(real *vals,
 				    int rank,
 				    const int dims[3],
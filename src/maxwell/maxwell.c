@@ -237,6 +237,13 @@ maxwell_data *create_maxwell_data(int nx, int ny, int nz,
 
      d->eps_inv_mean = 1.0;
      d->mu_inv_mean = 1.0;
+     d->dielectric_threadsafe = 0;
+     d->dielectric_tile = NULL;
+     d->dielectric_tile_done = NULL;
+     d->dielectric_batch = NULL;
+     d->num_interface_points = d->num_fallback_points = 0;
+     d->num_tiles = d->num_uniform_tiles = 0;
+     d->num_fallback_evals = 0;
 
      d->local_N = *local_N;
      d->N_start = *N_start;
@@ -83,6 +83,33 @@ typedef struct {
 
 #define MAX_NPLANS 32
 
+/* Optional hooks for set_maxwell_dielectric, which computes the
+   dielectric tensor in tiles of nearby grid points.  Before each
+   tile, tile(lo, hi, &uniform, epsilon_data) is called with the
+   bounding box [lo,hi] (in lattice coordinates) of all the points
+   where the dielectric functions will be evaluated for that tile.  It
+   returns the data to pass to the dielectric functions in place of
+   epsilon_data for the tile (e.g. with a geometry search restricted
+   to the box), and may set uniform to 1 if the dielectric function is
+   constant over the box, in which case the tensor is only computed at
+   one point of the tile.  Afterwards, tile_done(tile_data,
+   epsilon_data) is called. */
+typedef void *(*maxwell_dielectric_tile_function) (const real lo[3],
+						   const real hi[3],
+						   int *uniform,
+						   void *epsilon_data);
+typedef void (*maxwell_dielectric_tile_done_function) (void *tile_data,
+						       void *epsilon_data);
+
+/* Optional batched version of the dielectric function, used for the
+   brute-force mesh averages in set_maxwell_dielectric: computes
+   eps[i] and eps_inv[i] at the n points r[3*i..3*i+2], exactly like
+   n calls to the dielectric function (with the same epsilon_data). */
+typedef void (*maxwell_dielectric_batch_function) (symmetric_matrix *eps,
+						   symmetric_matrix *eps_inv,
+						   int n, const real *r,
+						   void *epsilon_data);
+
 typedef struct {
      int nx, ny, nz;
      int local_nx, local_ny;
@@ -112,6 +139,27 @@ typedef struct {
      real eps_inv_mean;
      symmetric_matrix *mu_inv;
      real mu_inv_mean;
+
+     /* set_maxwell_dielectric may call the dielectric functions from
+	multiple threads only if this is non-zero (default 0): */
+     int dielectric_threadsafe;
+     /* optional tile hooks (see above), default NULL: */
+     maxwell_dielectric_tile_function dielectric_tile;
+     maxwell_dielectric_tile_done_function dielectric_tile_done;
+     /* optional batch version of the dielectric function passed to
+	set_maxwell_dielectric (see above), default NULL: */
+     maxwell_dielectric_batch_function dielectric_batch;
+     /* statistics from the last set_maxwell_dielectric (over all
+	processes): the number of grid points at a dielectric interface,
+	and the number that needed the brute-force mesh average because
+	the mean-dielectric function could not handle them: */
+     int num_interface_points, num_fallback_points;
+     /* ...and the number of tiles, and of uniform tiles: */
+     int num_tiles, num_uniform_tiles;
+     /* ...and the number of dielectric-function evaluations for those
+	points (for the mesh averages, which skip regions of the mesh
+	where epsilon is found to be constant, and for the normals): */
+     double num_fallback_evals;
 } maxwell_data;
 
 extern maxwell_data *create_maxwell_data(int nx, int ny, int nz,
@@ -140,12 +188,26 @@ typedef int (*maxwell_dielectric_mean_function) (symmetric_matrix *meps,
 						 const real r[3],
 						 void *epsilon_data);
 
+/* A box of grid points, from low to high (inclusive) in each
+   direction.  The indices may extend outside the grid, in which case
+   they are wrapped periodically. */
+typedef struct {
+     int low[3], high[3];
+} maxwell_grid_box;
+
 extern void set_maxwell_dielectric(maxwell_data *md,
 				   const int mesh_size[3],
 				   real R[3][3], real G[3][3],
 				   maxwell_dielectric_function epsilon,
 				   maxwell_dielectric_mean_function mepsilon,
 				   void *epsilon_data);
+extern void update_maxwell_dielectric(maxwell_data *md,
+				      const int mesh_size[3],
+				      real R[3][3], real G[3][3],
+				      maxwell_dielectric_function epsilon,
+				      maxwell_dielectric_mean_function mepsilon,
+				      void *epsilon_data,
+				      int nboxes, const maxwell_grid_box *boxes);
 
 extern void set_maxwell_mu(maxwell_data *md,
                            const int mesh_size[3],
@@ -153,6 +215,13 @@ extern void set_maxwell_mu(maxwell_data *md,
                            maxwell_dielectric_function mu,
                            maxwell_dielectric_mean_function mmu,
                            void *mu_data);
+extern void update_maxwell_mu(maxwell_data *md,
+                              const int mesh_size[3],
+                              real R[3][3], real G[3][3],
+                              maxwell_dielectric_function mu,
+                              maxwell_dielectric_mean_function mmu,
+                              void *mu_data,
+                              int nboxes, const maxwell_grid_box *boxes);
     
 extern void maxwell_sym_matrix_eigs(real eigs[3], const symmetric_matrix *V);
 extern void maxwell_sym_matrix_invert(symmetric_matrix *Vinv,
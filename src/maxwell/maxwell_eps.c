@@ -176,7 +176,7 @@ int maxwell_sym_matrix_positive_definite(symmetric_matrix *V)
      return (m00 > 0.0 && det2 > 0.0 && det3 > 0.0);
 }
 
-#define EQ(x1,x2) (fabs((x1) - (x2)) < tol)
+#define EQ(x1,x2) (fabs((x1) - (x2)) <= tol)
 static int sym_matrix_eq(symmetric_matrix V1, symmetric_matrix V2, double tol)
 {
      if (!EQ(V1.m00,V2.m00) || !EQ(V1.m11,V2.m11) || !EQ(V1.m22,V2.m22))
@@ -385,15 +385,328 @@ void set_maxwell_dielectric(maxwell_data *md,
 			    maxwell_dielectric_function epsilon,
 			    maxwell_dielectric_mean_function mepsilon,
 			    void *epsilon_data)
+{
+     update_maxwell_dielectric(md, mesh_size, R, G, epsilon, mepsilon,
+			       epsilon_data, 0, NULL);
+}
+
+/* return whether the grid point (i,j,k) of an n[0] x n[1] x n[2] grid
+   lies in any of the (periodically wrapped) boxes */
+static int in_grid_boxes(int i, int j, int k, const int n[3],
+			 int nboxes, const maxwell_grid_box *boxes)
+{
+     int b, x[3], d;
+     x[0] = i; x[1] = j; x[2] = k;
+     for (b = 0; b < nboxes; ++b) {
+	  for (d = 0; d < 3; ++d) {
+	       int len = boxes[b].high[d] - boxes[b].low[d];
+	       int dx = (x[d] - boxes[b].low[d]) % n[d];
+	       if (dx < 0) dx += n[d];
+	       if (len < n[d] - 1 && dx > len)
+		    break;
+	  }
+	  if (d == 3)
+	       return 1;
+     }
+     return 0;
+}
+
+/**************************************************************************/
+
+/* Adaptive evaluation of the dielectric function on the sub-mesh used
+   for the brute-force average at a grid point.  Most such points lie in
+   regions where epsilon is constant over much of the sub-mesh (e.g. the
+   saturated parts of material grids, or the interior of uniform regions
+   of an epsilon file), so rather than evaluating epsilon at all
+   mesh_size^3 points, we first probe the corners and center of the
+   whole sub-mesh.  If these are all identical, epsilon is assumed
+   constant over the sub-mesh; otherwise, the sub-mesh is bisected and
+   the same test is applied to each half, and so on.  Points are
+   evaluated a level at a time, in batches (see dielectric_batch).
+   The sums are then taken in the same order as for the full sub-mesh,
+   so that the result is identical whenever epsilon really is constant
+   over the skipped regions. */
+
+typedef struct { int lo[3], hi[3]; } mesh_box;
+
+typedef struct {
+     int ms[3], mesh_prod; /* sub-mesh dimensions and size */
+     symmetric_matrix *eps, *eps_inv; /* results of the current batch */
+     symmetric_matrix *veps, *veps_inv; /* values at each point */
+     char *known; /* whether eps is known at each point */
+     int *pending; /* points to evaluate in the current batch */
+     real *r; /* coordinates of the pending points */
+     mesh_box *boxes, *boxes2;
+     int nevals; /* number of dielectric-function evaluations */
+} mesh_sampler;
+
+static mesh_sampler *create_mesh_sampler(const int mesh_size[3])
+{
+     mesh_sampler *ms;
+     int d, nr;
+     CHK_MALLOC(ms, mesh_sampler, 1);
+     ms->mesh_prod = 1;
+     for (d = 0; d < 3; ++d)
+	  ms->mesh_prod *= (ms->ms[d] = MAX2(mesh_size[d], 1));
+     nr = MAX2(ms->mesh_prod, MAX_MOMENT_MESH);
+     CHK_MALLOC(ms->eps, symmetric_matrix, nr);
+     CHK_MALLOC(ms->eps_inv, symmetric_matrix, nr);
+     CHK_MALLOC(ms->veps, symmetric_matrix, ms->mesh_prod);
+     CHK_MALLOC(ms->veps_inv, symmetric_matrix, ms->mesh_prod);
+     CHK_MALLOC(ms->known, char, ms->mesh_prod);
+     CHK_MALLOC(ms->pending, int, ms->mesh_prod);
+     CHK_MALLOC(ms->r, real, 3 * nr);
+     /* each level of bisection has at most mesh_prod boxes */
+     CHK_MALLOC(ms->boxes, mesh_box, ms->mesh_prod);
+     CHK_MALLOC(ms->boxes2, mesh_box, ms->mesh_prod);
+     ms->nevals = 0;
+     return ms;
+}
+
+static void destroy_mesh_sampler(mesh_sampler *ms)
+{
+     if (ms) {
+	  free(ms->boxes2); free(ms->boxes);
+	  free(ms->r); free(ms->pending); free(ms->known);
+	  free(ms->veps_inv); free(ms->veps);
+	  free(ms->eps_inv); free(ms->eps);
+	  free(ms);
+     }
+}
+
+/* evaluate the dielectric function at the n points in ms->r, storing
+   the results in ms->eps and ms->eps_inv */
+static void mesh_sampler_eval(mesh_sampler *ms, int n,
+			      maxwell_dielectric_function epsilon,
+			      maxwell_dielectric_batch_function epsilon_batch,
+			      void *epsilon_data)
+{
+     int i;
+     if (epsilon_batch)
+	  epsilon_batch(ms->eps, ms->eps_inv, n, ms->r, epsilon_data);
+     else
+	  for (i = 0; i < n; ++i)
+	       epsilon(ms->eps + i, ms->eps_inv + i, ms->r + 3*i,
+		       epsilon_data);
+     ms->nevals += n;
+}
+
+#define MESH_INDEX(s, i, j, k) (((i) * (s)->ms[1] + (j)) * (s)->ms[2] + (k))
+
+/* Compute ms->veps[p] and ms->veps_inv[p], for p = MESH_INDEX(mi,mj,mk),
+   at every sub-mesh point r0 + (mi - mesh_center[0]) * m[0], etcetera,
+   adaptively as described above. */
+static void mesh_sampler_fill(mesh_sampler *ms, const real r0[3],
+			      const real m[3], const real mesh_center[3],
+			      maxwell_dielectric_function epsilon,
+			      maxwell_dielectric_batch_function epsilon_batch,
+			      void *epsilon_data)
+{
+     symmetric_matrix *eps = ms->veps, *eps_inv = ms->veps_inv;
+     int nboxes = 1, d, i;
+
+     for (i = 0; i < ms->mesh_prod; ++i)
+	  ms->known[i] = 0;
+     for (d = 0; d < 3; ++d) {
+	  ms->boxes[0].lo[d] = 0;
+	  ms->boxes[0].hi[d] = ms->ms[d] - 1;
+     }
+
+     while (nboxes > 0) {
+	  int npending = 0, nboxes2 = 0, b;
+	  mesh_box *tmp;
+
+	  /* evaluate the unknown corners & centers of all the boxes */
+	  for (b = 0; b < nboxes; ++b) {
+	       const mesh_box *bx = ms->boxes + b;
+	       int c;
+	       for (c = 0; c < 9; ++c) {
+		    int x[3], p;
+		    for (d = 0; d < 3; ++d)
+			 x[d] = c == 8 ? (bx->lo[d] + bx->hi[d]) / 2
+			      : ((c >> d) & 1 ? bx->hi[d] : bx->lo[d]);
+		    p = MESH_INDEX(ms, x[0], x[1], x[2]);
+		    if (!ms->known[p]) {
+			 ms->known[p] = 1;
+			 for (d = 0; d < 3; ++d)
+			      ms->r[3*npending + d] = r0[d]
+				   + (x[d] - mesh_center[d]) * m[d];
+			 ms->pending[npending++] = p;
+		    }
+	       }
+	  }
+	  if (npending > 0) {
+	       mesh_sampler_eval(ms, npending,
+				 epsilon, epsilon_batch, epsilon_data);
+	       for (i = 0; i < npending; ++i) {
+		    eps[ms->pending[i]] = ms->eps[i];
+		    eps_inv[ms->pending[i]] = ms->eps_inv[i];
+	       }
+	  }
+
+	  /* fill the boxes where these are all the same, and bisect
+	     the others (unless they have no interior points) */
+	  for (b = 0; b < nboxes; ++b) {
+	       const mesh_box *bx = ms->boxes + b;
+	       int c, p0 = MESH_INDEX(ms, bx->lo[0], bx->lo[1], bx->lo[2]);
+	       int same = 1, dmax = 0;
+	       for (c = 1; c < 9 && same; ++c) {
+		    int x[3], p;
+		    for (d = 0; d < 3; ++d)
+			 x[d] = c == 8 ? (bx->lo[d] + bx->hi[d]) / 2
+			      : ((c >> d) & 1 ? bx->hi[d] : bx->lo[d]);
+		    p = MESH_INDEX(ms, x[0], x[1], x[2]);
+		    same = sym_matrix_eq(eps[p], eps[p0], 0.0)
+			 && sym_matrix_eq(eps_inv[p], eps_inv[p0], 0.0);
+	       }
+	       if (same) {
+		    int mi, mj, mk;
+		    for (mi = bx->lo[0]; mi <= bx->hi[0]; ++mi)
+			 for (mj = bx->lo[1]; mj <= bx->hi[1]; ++mj)
+			      for (mk = bx->lo[2]; mk <= bx->hi[2]; ++mk) {
+				   int p = MESH_INDEX(ms, mi, mj, mk);
+				   if (!ms->known[p]) {
+					ms->known[p] = 1;
+					eps[p] = eps[p0];
+					eps_inv[p] = eps_inv[p0];
+				   }
+			      }
+		    continue;
+	       }
+	       for (d = 1; d < 3; ++d)
+		    if (bx->hi[d] - bx->lo[d] > bx->hi[dmax] - bx->lo[dmax])
+			 dmax = d;
+	       if (bx->hi[dmax] - bx->lo[dmax] >= 2) {
+		    int mid = (bx->lo[dmax] + bx->hi[dmax]) / 2;
+		    CHECK(nboxes2 + 2 <= ms->mesh_prod,
+			  "bug: too many boxes in mesh_sampler_fill");
+		    ms->boxes2[nboxes2] = ms->boxes2[nboxes2 + 1] = *bx;
+		    ms->boxes2[nboxes2].hi[dmax] = mid;
+		    ms->boxes2[nboxes2 + 1].lo[dmax] = mid;
+		    nboxes2 += 2;
+	       }
+	       /* otherwise, every point of the box is a corner */
+	  }
+
+	  tmp = ms->boxes; ms->boxes = ms->boxes2; ms->boxes2 = tmp;
+	  nboxes = nboxes2;
+     }
+}
+
+/**************************************************************************/
+
+/* Set *ei to the effective inverse dielectric tensor at an interface
+   with unit normal (norm0,norm1,norm2), given the mean eps_inv_mean of
+   the inverse dielectric tensor and the inverse eps_mean_inv of the
+   mean dielectric tensor over the pixel.  diag_eps_p indicates that
+   both means are diagonal. */
+static void effective_eps_inv(symmetric_matrix *ei,
+			      symmetric_matrix eps_inv_mean,
+			      symmetric_matrix eps_mean_inv,
+			      real norm0, real norm1, real norm2,
+			      short diag_eps_p)
+{
+     real x0, x1, x2;
+
+     /* Compute the effective inverse dielectric tensor.
+	We define this as:
+	   1/2 ( {eps_inv_mean, P} + {eps_mean_inv, 1-P} )
+	where P is the projection matrix onto the normal direction
+	(P = norm ^ norm), and {a,b} is the anti-commutator ab+ba.
+	 = 1/2 {eps_inv_mean - eps_mean_inv, P} + eps_mean_inv
+	 = 1/2 (n_i conj(x_j) + x_i n_j) + (eps_mean_inv)_ij
+	where n_k is the kth component of the normal vector and 
+	   x_i = (eps_inv_mean - eps_mean_inv)_ik n_k  
+	Note the implied summations (Einstein notation).
+
+	Note that the resulting matrix is symmetric, and we get just
+	eps_inv_mean if eps_inv_mean == eps_mean_inv, as desired.
+
+	Note that P is idempotent, so for scalar epsilon this
+	is just eps_inv_mean * P + eps_mean_inv * (1-P)
+	      = (1/eps_inv_mean * P + eps_mean * (1-P)) ^ (-1),
+	which corresponds to the expression in the Meade paper. */
+
+     x0 = (eps_inv_mean.m00 - eps_mean_inv.m00) * norm0;
+     x1 = (eps_inv_mean.m11 - eps_mean_inv.m11) * norm1;
+     x2 = (eps_inv_mean.m22 - eps_mean_inv.m22) * norm2;
+     if (diag_eps_p) {
+#ifdef WITH_HERMITIAN_EPSILON
+	  ei->m01.re = 0.5*(x0*norm1 + x1*norm0);
+	  ei->m01.im = 0.0;
+	  ei->m02.re = 0.5*(x0*norm2 + x2*norm0);
+	  ei->m02.im = 0.0;
+	  ei->m12.re = 0.5*(x1*norm2 + x2*norm1);
+	  ei->m12.im = 0.0;
+#else
+	  ei->m01 = 0.5*(x0*norm1 + x1*norm0);
+	  ei->m02 = 0.5*(x0*norm2 + x2*norm0);
+	  ei->m12 = 0.5*(x1*norm2 + x2*norm1);
+#endif
+     }
+     else {
+#ifdef WITH_HERMITIAN_EPSILON
+	  real x0i, x1i, x2i;
+	  x0 += ((eps_inv_mean.m01.re - eps_mean_inv.m01.re)*norm1 + 
+		 (eps_inv_mean.m02.re - eps_mean_inv.m02.re)*norm2);
+	  x1 += ((eps_inv_mean.m01.re - eps_mean_inv.m01.re)*norm0 + 
+		 (eps_inv_mean.m12.re - eps_mean_inv.m12.re)*norm2);
+	  x2 += ((eps_inv_mean.m02.re - eps_mean_inv.m02.re)*norm0 +
+		 (eps_inv_mean.m12.re - eps_mean_inv.m12.re)*norm1);
+	  x0i = ((eps_inv_mean.m01.im - eps_mean_inv.m01.im)*norm1 + 
+		 (eps_inv_mean.m02.im - eps_mean_inv.m02.im)*norm2);
+	  x1i = (-(eps_inv_mean.m01.im - eps_mean_inv.m01.im)*norm0+ 
+		 (eps_inv_mean.m12.im - eps_mean_inv.m12.im)*norm2);
+	  x2i = -((eps_inv_mean.m02.im - eps_mean_inv.m02.im)*norm0 +
+		  (eps_inv_mean.m12.im - eps_mean_inv.m12.im)*norm1);
+
+	  ei->m01.re = 0.5*(x0*norm1 + x1*norm0) + eps_mean_inv.m01.re;
+	  ei->m02.re = 0.5*(x0*norm2 + x2*norm0) + eps_mean_inv.m02.re;
+	  ei->m12.re = 0.5*(x1*norm2 + x2*norm1) + eps_mean_inv.m12.re;
+	  ei->m01.im = 0.5*(x0i*norm1-x1i*norm0) + eps_mean_inv.m01.im;
+	  ei->m02.im = 0.5*(x0i*norm2-x2i*norm0) + eps_mean_inv.m02.im;
+	  ei->m12.im = 0.5*(x1i*norm2-x2i*norm1) + eps_mean_inv.m12.im;
+#else
+	  x0 += ((eps_inv_mean.m01 - eps_mean_inv.m01) * norm1 + 
+		 (eps_inv_mean.m02 - eps_mean_inv.m02) * norm2);
+	  x1 += ((eps_inv_mean.m01 - eps_mean_inv.m01) * norm0 + 
+		 (eps_inv_mean.m12 - eps_mean_inv.m12) * norm2);
+	  x2 += ((eps_inv_mean.m02 - eps_mean_inv.m02) * norm0 +
+		 (eps_inv_mean.m12 - eps_mean_inv.m12) * norm1);
+
+	  ei->m01 = 0.5*(x0*norm1 + x1*norm0) + eps_mean_inv.m01;
+	  ei->m02 = 0.5*(x0*norm2 + x2*norm0) + eps_mean_inv.m02;
+	  ei->m12 = 0.5*(x1*norm2 + x2*norm1) + eps_mean_inv.m12;
+#endif
+     }
+     ei->m00 = x0*norm0 + eps_mean_inv.m00;
+     ei->m11 = x1*norm1 + eps_mean_inv.m11;
+     ei->m22 = x2*norm2 + eps_mean_inv.m22;
+}
+
+/* Like set_maxwell_dielectric, but only recompute the dielectric
+   tensor at the grid points in the given boxes, keeping the existing
+   md->eps_inv elsewhere (e.g. when only part of the structure has
+   changed).  If boxes is NULL, all points are computed. */
+void update_maxwell_dielectric(maxwell_data *md,
+			       const int mesh_size[3],
+			       real R[3][3], real G[3][3],
+			       maxwell_dielectric_function epsilon,
+			       maxwell_dielectric_mean_function mepsilon,
+			       void *epsilon_data,
+			       int nboxes, const maxwell_grid_box *boxes)
 {
      real s1, s2, s3, m1, m2, m3;  /* grid/mesh steps */
      real mesh_center[3];
      real moment_mesh[MAX_MOMENT_MESH][3];
      real moment_mesh_weights[MAX_MOMENT_MESH];
      real eps_inv_total = 0.0;
-     int i, j, k;
+     int i, tile, n_tiles, na, nb, nc, coord[3], offset[3];
+     int num_interface = 0, num_fallback = 0, num_uniform = 0;
+     double num_evals = 0;
+     int n[3];
      int mesh_prod;
-     real mesh_prod_inv;
+     real mesh_prod_inv, margin[3];
      int size_moment_mesh = 0;
      int n1, n2, n3;
 #ifdef HAVE_MPI
@@ -403,7 +716,7 @@ void set_maxwell_dielectric(maxwell_data *md,
      int n_other, n_last, rank;
 #endif
 
-     n1 = md->nx; n2 = md->ny; n3 = md->nz;
+     n[0] = n1 = md->nx; n[1] = n2 = md->ny; n[2] = n3 = md->nz;
 
      get_mesh(n1, n2, n3, mesh_size, R, G, 
 	      mesh_center, &mesh_prod, moment_mesh, moment_mesh_weights,
@@ -417,66 +730,49 @@ void set_maxwell_dielectric(maxwell_data *md,
      m2 = s2 / MAX2(1, mesh_size[1]);
      m3 = s3 / MAX2(1, mesh_size[2]);
 
-     /* Here we have different loops over the coordinates, depending
+     /* the dielectric functions are called within margin[i] of a grid
+	point (in lattice coordinates): */
+     margin[0] = s1; margin[1] = s2; margin[2] = s3;
+     for (i = 0; i < size_moment_mesh; ++i) {
+	  margin[0] = MAX2(margin[0], fabs(moment_mesh[i][0]));
+	  margin[1] = MAX2(margin[1], fabs(moment_mesh[i][1]));
+	  margin[2] = MAX2(margin[2], fabs(moment_mesh[i][2]));
+     }
+
+     /* Here we have different orderings of the coordinates, depending
 	upon whether we are using complex or real and serial or
-        parallel transforms.  Each loop must define, in its body,
-        variables (i2,j2,k2) describing the coordinate of the current
-        point, and eps_index describing the corresponding index in 
-	the array md->eps_inv[]. */
+        parallel transforms.  In each case, the index in the array
+	md->eps_inv[] is (a * nb + b) * nc + c for 0 <= a < na, etc.,
+	and the grid coordinate (i2,j2,k2)[d] of the corresponding point
+	is (a,b,c)[coord[d]] + offset[d], or just offset[d] if
+	coord[d] < 0. */
+     offset[0] = offset[1] = offset[2] = 0;
 
 #ifdef SCALAR_COMPLEX
-
 #  ifndef HAVE_MPI
-     
-     for (i = 0; i < n1; ++i)
-	  for (j = 0; j < n2; ++j)
-	       for (k = 0; k < n3; ++k)
-     {
-#         define i2 i
-#         define j2 j
-#         define k2 k
-	  int eps_index = ((i * n2 + j) * n3 + k);
-
+     na = n1; nb = n2; nc = n3;
+     coord[0] = 0; coord[1] = 1; coord[2] = 2;
 #  else /* HAVE_MPI */
-
      local_n2 = md->local_ny;
      local_y_start = md->local_y_start;
-
      /* first two dimensions are transposed in MPI output: */
-     for (j = 0; j < local_n2; ++j)
-          for (i = 0; i < n1; ++i)
-	       for (k = 0; k < n3; ++k)
-     {
-#         define i2 i
-	  int j2 = j + local_y_start;
-#         define k2 k
-	  int eps_index = ((j * n1 + i) * n3 + k);
-
+     na = local_n2; nb = n1; nc = n3;
+     coord[0] = 1; coord[1] = 0; coord[2] = 2;
+     offset[1] = local_y_start;
 #  endif /* HAVE_MPI */
-
 #else /* not SCALAR_COMPLEX */
-
 #  ifndef HAVE_MPI
-
-     (void) k; /* unused */
-
      n_other = md->other_dims;
      n_last = md->last_dim_size / 2;
      rank = (n3 == 1) ? (n2 == 1 ? 1 : 2) : 3;
-
-     for (i = 0; i < n_other; ++i)
-	  for (j = 0; j < n_last; ++j)
-     {
-	  int eps_index = i * n_last + j;
-	  int i2, j2, k2;
-	  switch (rank) {
-	      case 2: i2 = i; j2 = j; k2 = 0; break;
-	      case 3: i2 = i / n2; j2 = i % n2; k2 = j; break;
-	      default: i2 = j; j2 = k2 = 0;  break;
-	  }
-
+     nb = rank == 3 ? n2 : 1;
+     na = n_other / nb; nc = n_last;
+     switch (rank) {
+	 case 2: coord[0] = 0; coord[1] = 2; coord[2] = -1; break;
+	 case 3: coord[0] = 0; coord[1] = 1; coord[2] = 2; break;
+	 default: coord[0] = 2; coord[1] = coord[2] = -1; break;
+     }
 #  else /* HAVE_MPI */
-
      local_n2 = md->local_ny;
      local_y_start = md->local_y_start;
 
@@ -487,329 +783,367 @@ void set_maxwell_dielectric(maxwell_data *md,
 	  local_n3 = md->last_dim_size / 2;
      else
 	  local_n3 = 1;
-     
      /* first two dimensions are transposed in MPI output: */
-     for (j = 0; j < local_n2; ++j)
-          for (i = 0; i < n1; ++i)
-	       for (k = 0; k < local_n3; ++k)
-     {
-#         define i2 i
-	  int j2 = j + local_y_start;
-#         define k2 k
-	  int eps_index = ((j * n1 + i) * local_n3 + k);
-
+     na = local_n2; nb = n1; nc = local_n3;
+     coord[0] = 1; coord[1] = 0; coord[2] = 2;
+     offset[1] = local_y_start;
 #  endif  /* HAVE_MPI */
-
 #endif /* not SCALAR_COMPLEX */
 
-     {
-	  int mi, mj, mk;
-#ifdef WITH_HERMITIAN_EPSILON
-	  symmetric_matrix eps_mean, eps_inv_mean, eps_mean_inv;
-#else
-	  symmetric_matrix eps_mean, eps_inv_mean, eps_mean_inv;
+     /* We loop over tiles of DIELECTRIC_TILE^3 points in (a,b,c), so
+	that the dielectric functions are called for nearby points in
+	succession, and so that the tile hook can exploit this.  The
+	loop is parallelized over threads (if the dielectric functions
+	allow it), with dynamic scheduling since points at interfaces
+	are far more expensive than points in bulk. */
+#define DIELECTRIC_TILE 8
+#define NTILES(n) (((n) + DIELECTRIC_TILE - 1) / DIELECTRIC_TILE)
+     n_tiles = NTILES(na) * NTILES(nb) * NTILES(nc);
+
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(dynamic,1) \
+     if (md->dielectric_threadsafe) \
+     reduction(+:eps_inv_total,num_interface,num_fallback,num_uniform) \
+     reduction(+:num_evals)
 #endif
-	  real norm_len;
-	  real norm0, norm1, norm2;
-	  short means_different_p, diag_eps_p;
+     for (tile = 0; tile < n_tiles; ++tile) {
+	  int a0, b0, c0, a1, b1, c1, a, b, c;
+	  int uniform = 0, uniform_index = -1;
+	  void *tile_data = epsilon_data;
+	  mesh_sampler *sampler = NULL; /* allocated if needed */
+
+	  a0 = (tile / (NTILES(nb) * NTILES(nc))) * DIELECTRIC_TILE;
+	  b0 = ((tile / NTILES(nc)) % NTILES(nb)) * DIELECTRIC_TILE;
+	  c0 = (tile % NTILES(nc)) * DIELECTRIC_TILE;
+	  a1 = MIN2(na, a0 + DIELECTRIC_TILE);
+	  b1 = MIN2(nb, b0 + DIELECTRIC_TILE);
+	  c1 = MIN2(nc, c0 + DIELECTRIC_TILE);
+
+	  if (md->dielectric_tile) {
+	       /* grid coordinates are nondecreasing in a, b, and c, so the
+		  bounding box is given by the first and last points */
+	       int first[3], last[3], d;
+	       real lo[3], hi[3], s[3];
+	       first[0] = a0; first[1] = b0; first[2] = c0;
+	       last[0] = a1 - 1; last[1] = b1 - 1; last[2] = c1 - 1;
+	       s[0] = s1; s[1] = s2; s[2] = s3;
+	       for (d = 0; d < 3; ++d) {
+		    int x0 = offset[d], x1 = offset[d];
+		    if (coord[d] >= 0) {
+			 x0 += first[coord[d]];
+			 x1 += last[coord[d]];
+		    }
+		    lo[d] = x0 * s[d] - margin[d];
+		    hi[d] = x1 * s[d] + margin[d];
+	       }
+	       tile_data = md->dielectric_tile(lo, hi, &uniform, epsilon_data);
+	       num_uniform += uniform != 0;
+	  }
 
+	  for (a = a0; a < a1; ++a)
+	       for (b = b0; b < b1; ++b)
+		    for (c = c0; c < c1; ++c)
 	  {
-	       real r[3], normal[3];
-	       r[0] = i2 * s1;
-	       r[1] = j2 * s2;
-	       r[2] = k2 * s3;
-	       if (mepsilon && mepsilon(&eps_mean, &eps_inv_mean, normal,
-					s1, s2, s3, mesh_prod_inv,
-					r, epsilon_data)) {
+	       int eps_index = (a * nb + b) * nc + c;
+	       int i2, j2, k2;
+	       int mi, mj, mk;
+	       symmetric_matrix eps_mean, eps_inv_mean, eps_mean_inv;
+	       real norm_len;
+	       real norm0, norm1, norm2;
+	       short means_different_p, diag_eps_p;
+
+	       {
+		    int x[3];
+		    x[0] = a; x[1] = b; x[2] = c;
+		    i2 = offset[0] + (coord[0] >= 0 ? x[coord[0]] : 0);
+		    j2 = offset[1] + (coord[1] >= 0 ? x[coord[1]] : 0);
+		    k2 = offset[2] + (coord[2] >= 0 ? x[coord[2]] : 0);
+	       }
+
+	       if (boxes && !in_grid_boxes(i2, j2, k2, n, nboxes, boxes)) {
+		    eps_inv_total += (md->eps_inv[eps_index].m00 + 
+				      md->eps_inv[eps_index].m11 + 
+				      md->eps_inv[eps_index].m22);
+		    continue;
+	       }
+
+	       if (uniform_index >= 0) { /* same as the rest of the tile */
+		    md->eps_inv[eps_index] = md->eps_inv[uniform_index];
+		    eps_inv_total += (md->eps_inv[eps_index].m00 + 
+				      md->eps_inv[eps_index].m11 + 
+				      md->eps_inv[eps_index].m22);
+		    continue;
+	       }
+
+	       {
+		    real r[3], normal[3];
+		    r[0] = i2 * s1;
+		    r[1] = j2 * s2;
+		    r[2] = k2 * s3;
+		    if (mepsilon && mepsilon(&eps_mean, &eps_inv_mean, normal,
+					     s1, s2, s3, mesh_prod_inv,
+					     r, tile_data)) {
 
 #ifdef KOTTKE /* mepsilon did new anisotropic smoothing w/Kottke algorithm */
-		    maxwell_sym_matrix_invert(md->eps_inv + eps_index, 
-					      &eps_mean);
-		    goto got_eps_inv;
+			 maxwell_sym_matrix_invert(md->eps_inv + eps_index, 
+						   &eps_mean);
+			 num_interface += (normal[0] != 0 || normal[1] != 0
+					   || normal[2] != 0);
+			 goto got_eps_inv;
 #endif
 
-		    norm0 = R[0][0] * normal[0] + R[1][0] * normal[1]
-			 + R[2][0] * normal[2];
-		    norm1 = R[0][1] * normal[0] + R[1][1] * normal[1]
-			 + R[2][1] * normal[2];
-		    norm2 = R[0][2] * normal[0] + R[1][2] * normal[1]
-			 + R[2][2] * normal[2];
-		    means_different_p = 1;
-		    diag_eps_p = DIAG_SYMMETRIC_MATRIX(eps_mean);
-		    maxwell_sym_matrix_invert(&eps_mean_inv, &eps_mean);
+			 norm0 = R[0][0] * normal[0] + R[1][0] * normal[1]
+			      + R[2][0] * normal[2];
+			 norm1 = R[0][1] * normal[0] + R[1][1] * normal[1]
+			      + R[2][1] * normal[2];
+			 norm2 = R[0][2] * normal[0] + R[1][2] * normal[1]
+			      + R[2][2] * normal[2];
+			 means_different_p = 1;
+			 diag_eps_p = DIAG_SYMMETRIC_MATRIX(eps_mean);
+			 maxwell_sym_matrix_invert(&eps_mean_inv, &eps_mean);
 
 #if !defined(SCALAR_COMPLEX) && 0 /* check inversion symmetry */
-		    {
-			 symmetric_matrix eps_mean2, eps_inv_mean2;
-			 real normal2[3], r2[3], nc[3];
-			 r2[0] = n1 == 0 ? r[0] : 1.0 - r[0];
-			 r2[1] = n2 == 0 ? r[1] : 1.0 - r[1];
-			 r2[2] = n3 == 0 ? r[2] : 1.0 - r[2];
-			 CHECK(mepsilon(&eps_mean2, &eps_inv_mean2, normal2,
-					s1, s2, s3, mesh_prod_inv,
-					r2, epsilon_data),
-			       "mepsilon symmetry is broken");
-			 CHECK(sym_matrix_eq(eps_mean,eps_mean2,1e-10) &&
-			       sym_matrix_eq(eps_inv_mean,eps_inv_mean2,1e-10),
-			       "inversion symmetry is broken");
-			 nc[0] = normal[1]*normal2[2] - normal[2]*normal2[1];
-			 nc[1] = normal[2]*normal2[0] - normal[0]*normal2[2];
-			 nc[2] = normal[0]*normal2[1] - normal[1]*normal2[0];
-			 CHECK(sqrt(nc[0]*nc[0]+nc[1]*nc[1]+nc[2]*nc[2])<1e-6,
-			       "normal-vector symmetry is broken");
-		    }
+			 {
+			      symmetric_matrix eps_mean2, eps_inv_mean2;
+			      real normal2[3], r2[3], nc[3];
+			      r2[0] = n1 == 0 ? r[0] : 1.0 - r[0];
+			      r2[1] = n2 == 0 ? r[1] : 1.0 - r[1];
+			      r2[2] = n3 == 0 ? r[2] : 1.0 - r[2];
+			      CHECK(mepsilon(&eps_mean2, &eps_inv_mean2,
+					     normal2, s1, s2, s3,
+					     mesh_prod_inv, r2, tile_data),
+				    "mepsilon symmetry is broken");
+			      CHECK(sym_matrix_eq(eps_mean,eps_mean2,1e-10)
+				    && sym_matrix_eq(eps_inv_mean,
+						     eps_inv_mean2,1e-10),
+				    "inversion symmetry is broken");
+			      nc[0] = normal[1]*normal2[2]
+				   - normal[2]*normal2[1];
+			      nc[1] = normal[2]*normal2[0]
+				   - normal[0]*normal2[2];
+			      nc[2] = normal[0]*normal2[1]
+				   - normal[1]*normal2[0];
+			      CHECK(sqrt(nc[0]*nc[0] + nc[1]*nc[1]
+					 + nc[2]*nc[2]) < 1e-6,
+				    "normal-vector symmetry is broken");
+			 }
 #endif
 
-		    goto got_mean;
+			 goto got_mean;
+		    }
 	       }
-	  }
 
-	  eps_mean.m00 = eps_mean.m11 = eps_mean.m22 =
+	       /* mepsilon couldn't handle this point: brute-force average */
+	       ++num_fallback;
+	       if (!sampler)
+		    sampler = create_mesh_sampler(mesh_size);
+	       {
+		    real r0[3], m[3];
+		    r0[0] = i2 * s1; r0[1] = j2 * s2; r0[2] = k2 * s3;
+		    m[0] = m1; m[1] = m2; m[2] = m3;
+		    mesh_sampler_fill(sampler, r0, m, mesh_center, epsilon,
+				      md->dielectric_batch, tile_data);
+	       }
+	       eps_mean.m00 = eps_mean.m11 = eps_mean.m22 = 0.0;
 	       eps_inv_mean.m00 = eps_inv_mean.m11 = eps_inv_mean.m22 = 0.0;
-	  ASSIGN_ESCALAR(eps_mean.m01, 0,0);
-	  ASSIGN_ESCALAR(eps_mean.m02, 0,0);
-	  ASSIGN_ESCALAR(eps_mean.m12, 0,0);
-	  ASSIGN_ESCALAR(eps_inv_mean.m01, 0,0);
-	  ASSIGN_ESCALAR(eps_inv_mean.m02, 0,0);
-	  ASSIGN_ESCALAR(eps_inv_mean.m12, 0,0);
-
-	  for (mi = 0; mi < mesh_size[0]; ++mi)
-	       for (mj = 0; mj < mesh_size[1]; ++mj)
-		    for (mk = 0; mk < mesh_size[2]; ++mk) {
-			 real r[3];
-			 symmetric_matrix eps, eps_inv;
-			 r[0] = i2 * s1 + (mi - mesh_center[0]) * m1;
-			 r[1] = j2 * s2 + (mj - mesh_center[1]) * m2;
-			 r[2] = k2 * s3 + (mk - mesh_center[2]) * m3;
-			 epsilon(&eps, &eps_inv, r, epsilon_data);
-			 eps_mean.m00 += eps.m00;
-			 eps_mean.m11 += eps.m11;
-			 eps_mean.m22 += eps.m22;
-			 eps_inv_mean.m00 += eps_inv.m00;
-			 eps_inv_mean.m11 += eps_inv.m11;
-			 eps_inv_mean.m22 += eps_inv.m22;
+	       ASSIGN_ESCALAR(eps_mean.m01, 0,0);
+	       ASSIGN_ESCALAR(eps_mean.m02, 0,0);
+	       ASSIGN_ESCALAR(eps_mean.m12, 0,0);
+	       ASSIGN_ESCALAR(eps_inv_mean.m01, 0,0);
+	       ASSIGN_ESCALAR(eps_inv_mean.m02, 0,0);
+	       ASSIGN_ESCALAR(eps_inv_mean.m12, 0,0);
+
+	       for (mi = 0; mi < sampler->ms[0]; ++mi)
+		    for (mj = 0; mj < sampler->ms[1]; ++mj)
+			 for (mk = 0; mk < sampler->ms[2]; ++mk) {
+			      int p = MESH_INDEX(sampler, mi, mj, mk);
+			      symmetric_matrix eps = sampler->veps[p];
+			      symmetric_matrix eps_inv = sampler->veps_inv[p];
+			      eps_mean.m00 += eps.m00;
+			      eps_mean.m11 += eps.m11;
+			      eps_mean.m22 += eps.m22;
+			      eps_inv_mean.m00 += eps_inv.m00;
+			      eps_inv_mean.m11 += eps_inv.m11;
+			      eps_inv_mean.m22 += eps_inv.m22;
 #ifdef WITH_HERMITIAN_EPSILON
-			 CACCUMULATE_SUM(eps_mean.m01, eps.m01);
-			 CACCUMULATE_SUM(eps_mean.m02, eps.m02);
-			 CACCUMULATE_SUM(eps_mean.m12, eps.m12);
-			 CACCUMULATE_SUM(eps_inv_mean.m01, eps_inv.m01);
-			 CACCUMULATE_SUM(eps_inv_mean.m02, eps_inv.m02);
-			 CACCUMULATE_SUM(eps_inv_mean.m12, eps_inv.m12);
+			      CACCUMULATE_SUM(eps_mean.m01, eps.m01);
+			      CACCUMULATE_SUM(eps_mean.m02, eps.m02);
+			      CACCUMULATE_SUM(eps_mean.m12, eps.m12);
+			      CACCUMULATE_SUM(eps_inv_mean.m01, eps_inv.m01);
+			      CACCUMULATE_SUM(eps_inv_mean.m02, eps_inv.m02);
+			      CACCUMULATE_SUM(eps_inv_mean.m12, eps_inv.m12);
 #else
-			 eps_mean.m01 += eps.m01;
-			 eps_mean.m02 += eps.m02;
-			 eps_mean.m12 += eps.m12;
-			 eps_inv_mean.m01 += eps_inv.m01;
-			 eps_inv_mean.m02 += eps_inv.m02;
-			 eps_inv_mean.m12 += eps_inv.m12;
+			      eps_mean.m01 += eps.m01;
+			      eps_mean.m02 += eps.m02;
+			      eps_mean.m12 += eps.m12;
+			      eps_inv_mean.m01 += eps_inv.m01;
+			      eps_inv_mean.m02 += eps_inv.m02;
+			      eps_inv_mean.m12 += eps_inv.m12;
 #endif
-		    }
-     
-	  diag_eps_p = DIAG_SYMMETRIC_MATRIX(eps_mean);
-	  if (diag_eps_p) { /* handle the common case of diagonal matrices: */
-	       eps_mean_inv.m00 = mesh_prod / eps_mean.m00;
-	       eps_mean_inv.m11 = mesh_prod / eps_mean.m11;
-	       eps_mean_inv.m22 = mesh_prod / eps_mean.m22;
+			 }
+
+	       diag_eps_p = DIAG_SYMMETRIC_MATRIX(eps_mean);
+	       /* handle the common case of diagonal matrices: */
+	       if (diag_eps_p) {
+		    eps_mean_inv.m00 = mesh_prod / eps_mean.m00;
+		    eps_mean_inv.m11 = mesh_prod / eps_mean.m11;
+		    eps_mean_inv.m22 = mesh_prod / eps_mean.m22;
 #ifdef WITH_HERMITIAN_EPSILON
-	       CASSIGN_ZERO(eps_mean_inv.m01);
-	       CASSIGN_ZERO(eps_mean_inv.m02);
-	       CASSIGN_ZERO(eps_mean_inv.m12);
+		    CASSIGN_ZERO(eps_mean_inv.m01);
+		    CASSIGN_ZERO(eps_mean_inv.m02);
+		    CASSIGN_ZERO(eps_mean_inv.m12);
 #else
-	       eps_mean_inv.m01 = eps_mean_inv.m02 = eps_mean_inv.m12 = 0.0;
+		    eps_mean_inv.m01 = eps_mean_inv.m02 = 0.0;
+		    eps_mean_inv.m12 = 0.0;
 #endif
-	       eps_inv_mean.m00 *= mesh_prod_inv;
-	       eps_inv_mean.m11 *= mesh_prod_inv;
-	       eps_inv_mean.m22 *= mesh_prod_inv;
-
-	       means_different_p = 
-		    fabs(eps_mean_inv.m00 - eps_inv_mean.m00) > SMALL ||
-		    fabs(eps_mean_inv.m11 - eps_inv_mean.m11) > SMALL ||
-		    fabs(eps_mean_inv.m22 - eps_inv_mean.m22) > SMALL;
-	  }
-	  else {
-	       eps_inv_mean.m00 *= mesh_prod_inv;
-	       eps_inv_mean.m11 *= mesh_prod_inv;
-	       eps_inv_mean.m22 *= mesh_prod_inv;
-	       eps_mean.m00 *= mesh_prod_inv;
-	       eps_mean.m11 *= mesh_prod_inv;
-	       eps_mean.m22 *= mesh_prod_inv;
+		    eps_inv_mean.m00 *= mesh_prod_inv;
+		    eps_inv_mean.m11 *= mesh_prod_inv;
+		    eps_inv_mean.m22 *= mesh_prod_inv;
+
+		    means_different_p = 
+			 fabs(eps_mean_inv.m00 - eps_inv_mean.m00) > SMALL ||
+			 fabs(eps_mean_inv.m11 - eps_inv_mean.m11) > SMALL ||
+			 fabs(eps_mean_inv.m22 - eps_inv_mean.m22) > SMALL;
+	       }
+	       else {
+		    eps_inv_mean.m00 *= mesh_prod_inv;
+		    eps_inv_mean.m11 *= mesh_prod_inv;
+		    eps_inv_mean.m22 *= mesh_prod_inv;
+		    eps_mean.m00 *= mesh_prod_inv;
+		    eps_mean.m11 *= mesh_prod_inv;
+		    eps_mean.m22 *= mesh_prod_inv;
 #ifdef WITH_HERMITIAN_EPSILON
-	       eps_mean.m01.re *= mesh_prod_inv;
-	       eps_mean.m01.im *= mesh_prod_inv;
-	       eps_mean.m02.re *= mesh_prod_inv;
-	       eps_mean.m02.im *= mesh_prod_inv;
-	       eps_mean.m12.re *= mesh_prod_inv;
-	       eps_mean.m12.im *= mesh_prod_inv;
-	       eps_inv_mean.m01.re *= mesh_prod_inv;
-	       eps_inv_mean.m01.im *= mesh_prod_inv;
-	       eps_inv_mean.m02.re *= mesh_prod_inv;
-	       eps_inv_mean.m02.im *= mesh_prod_inv;
-	       eps_inv_mean.m12.re *= mesh_prod_inv;
-	       eps_inv_mean.m12.im *= mesh_prod_inv;
+		    eps_mean.m01.re *= mesh_prod_inv;
+		    eps_mean.m01.im *= mesh_prod_inv;
+		    eps_mean.m02.re *= mesh_prod_inv;
+		    eps_mean.m02.im *= mesh_prod_inv;
+		    eps_mean.m12.re *= mesh_prod_inv;
+		    eps_mean.m12.im *= mesh_prod_inv;
+		    eps_inv_mean.m01.re *= mesh_prod_inv;
+		    eps_inv_mean.m01.im *= mesh_prod_inv;
+		    eps_inv_mean.m02.re *= mesh_prod_inv;
+		    eps_inv_mean.m02.im *= mesh_prod_inv;
+		    eps_inv_mean.m12.re *= mesh_prod_inv;
+		    eps_inv_mean.m12.im *= mesh_prod_inv;
 #else
-	       eps_mean.m01 *= mesh_prod_inv;
-	       eps_mean.m02 *= mesh_prod_inv;
-	       eps_mean.m12 *= mesh_prod_inv;
-	       eps_inv_mean.m01 *= mesh_prod_inv;
-	       eps_inv_mean.m02 *= mesh_prod_inv;
-	       eps_inv_mean.m12 *= mesh_prod_inv;
+		    eps_mean.m01 *= mesh_prod_inv;
+		    eps_mean.m02 *= mesh_prod_inv;
+		    eps_mean.m12 *= mesh_prod_inv;
+		    eps_inv_mean.m01 *= mesh_prod_inv;
+		    eps_inv_mean.m02 *= mesh_prod_inv;
+		    eps_inv_mean.m12 *= mesh_prod_inv;
 #endif
-	       maxwell_sym_matrix_invert(&eps_mean_inv, &eps_mean);
-	       
-	       means_different_p = 
-		    fabs(eps_mean_inv.m00 - eps_inv_mean.m00) > SMALL ||
-		    fabs(eps_mean_inv.m11 - eps_inv_mean.m11) > SMALL ||
-		    fabs(eps_mean_inv.m22 - eps_inv_mean.m22) > SMALL;
+		    maxwell_sym_matrix_invert(&eps_mean_inv, &eps_mean);
+
+		    means_different_p = 
+			 fabs(eps_mean_inv.m00 - eps_inv_mean.m00) > SMALL ||
+			 fabs(eps_mean_inv.m11 - eps_inv_mean.m11) > SMALL ||
+			 fabs(eps_mean_inv.m22 - eps_inv_mean.m22) > SMALL;
 #ifdef WITH_HERMITIAN_EPSILON
-	       means_different_p = means_different_p ||
-		    fabs(eps_mean_inv.m01.re - eps_inv_mean.m01.re) > SMALL ||
-		    fabs(eps_mean_inv.m02.re - eps_inv_mean.m02.re) > SMALL ||
-		    fabs(eps_mean_inv.m12.re - eps_inv_mean.m12.re) > SMALL ||
-		    fabs(eps_mean_inv.m01.im - eps_inv_mean.m01.im) > SMALL ||
-		    fabs(eps_mean_inv.m02.im - eps_inv_mean.m02.im) > SMALL ||
-		    fabs(eps_mean_inv.m12.im - eps_inv_mean.m12.im) > SMALL;
+		    means_different_p = means_different_p ||
+			 fabs(eps_mean_inv.m01.re
+			      - eps_inv_mean.m01.re) > SMALL ||
+			 fabs(eps_mean_inv.m02.re
+			      - eps_inv_mean.m02.re) > SMALL ||
+			 fabs(eps_mean_inv.m12.re
+			      - eps_inv_mean.m12.re) > SMALL ||
+			 fabs(eps_mean_inv.m01.im
+			      - eps_inv_mean.m01.im) > SMALL ||
+			 fabs(eps_mean_inv.m02.im
+			      - eps_inv_mean.m02.im) > SMALL ||
+			 fabs(eps_mean_inv.m12.im
+			      - eps_inv_mean.m12.im) > SMALL;
 #else
-	       means_different_p = means_different_p ||
-		    fabs(eps_mean_inv.m01 - eps_inv_mean.m01) > SMALL ||
-		    fabs(eps_mean_inv.m02 - eps_inv_mean.m02) > SMALL ||
-		    fabs(eps_mean_inv.m12 - eps_inv_mean.m12) > SMALL;
+		    means_different_p = means_different_p ||
+			 fabs(eps_mean_inv.m01 - eps_inv_mean.m01) > SMALL ||
+			 fabs(eps_mean_inv.m02 - eps_inv_mean.m02) > SMALL ||
+			 fabs(eps_mean_inv.m12 - eps_inv_mean.m12) > SMALL;
 #endif
-	  }
+	       }
+
+	       /* if the two averaging methods yielded different results,
+		  which usually happens if epsilon is not constant, then
+		  we need to find the normal vector to the dielectric
+		  interface: */
+	       if (means_different_p) {
+		    real moment0 = 0, moment1 = 0, moment2 = 0;
+
+		    if (!sampler)
+			 sampler = create_mesh_sampler(mesh_size);
+		    for (mi = 0; mi < size_moment_mesh; ++mi) {
+			 sampler->r[3*mi + 0] = i2 * s1 + moment_mesh[mi][0];
+			 sampler->r[3*mi + 1] = j2 * s2 + moment_mesh[mi][1];
+			 sampler->r[3*mi + 2] = k2 * s3 + moment_mesh[mi][2];
+		    }
+		    mesh_sampler_eval(sampler, size_moment_mesh, epsilon,
+				      md->dielectric_batch, tile_data);
+		    for (mi = 0; mi < size_moment_mesh; ++mi) {
+			 real eps_trace;
+			 symmetric_matrix eps = sampler->eps[mi];
+			 eps_trace = eps.m00 + eps.m11 + eps.m22;
+			 eps_trace *= moment_mesh_weights[mi];
+			 moment0 += eps_trace * moment_mesh[mi][0];
+			 moment1 += eps_trace * moment_mesh[mi][1];
+			 moment2 += eps_trace * moment_mesh[mi][2];
+		    }
+
+		    /* need to convert moment from lattice to cartesian
+		       coords: */
+		    norm0 = R[0][0]*moment0 + R[1][0]*moment1
+			 + R[2][0]*moment2;
+		    norm1 = R[0][1]*moment0 + R[1][1]*moment1
+			 + R[2][1]*moment2;
+		    norm2 = R[0][2]*moment0 + R[1][2]*moment1
+			 + R[2][2]*moment2;
+
+	       got_mean:
 
-	  /* if the two averaging methods yielded different results,
-	     which usually happens if epsilon is not constant, then
-	     we need to find the normal vector to the dielectric interface: */
-	  if (means_different_p) {
-	       real moment0 = 0, moment1 = 0, moment2 = 0;
-
-	       for (mi = 0; mi < size_moment_mesh; ++mi) {
-		    real r[3], eps_trace;
-		    symmetric_matrix eps, eps_inv;
-		    r[0] = i2 * s1 + moment_mesh[mi][0];
-		    r[1] = j2 * s2 + moment_mesh[mi][1];
-		    r[2] = k2 * s3 + moment_mesh[mi][2];
-		    epsilon(&eps, &eps_inv, r, epsilon_data);
-		    eps_trace = eps.m00 + eps.m11 + eps.m22;
-		    eps_trace *= moment_mesh_weights[mi];
-		    moment0 += eps_trace * moment_mesh[mi][0];
-		    moment1 += eps_trace * moment_mesh[mi][1];
-		    moment2 += eps_trace * moment_mesh[mi][2];
+		    norm_len = sqrt(norm0*norm0 + norm1*norm1 + norm2*norm2);
 	       }
 
-	       /* need to convert moment from lattice to cartesian coords: */
-	       norm0 = R[0][0]*moment0 + R[1][0]*moment1 + R[2][0]*moment2;
-	       norm1 = R[0][1]*moment0 + R[1][1]*moment1 + R[2][1]*moment2;
-	       norm2 = R[0][2]*moment0 + R[1][2]*moment1 + R[2][2]*moment2;
-	  
-	  got_mean:
+	       if (means_different_p && norm_len > SMALL) {
+		    ++num_interface;
+		    norm_len = 1.0/norm_len;
+		    norm0 *= norm_len;
+		    norm1 *= norm_len;
+		    norm2 *= norm_len;
 
-	       norm_len = sqrt(norm0*norm0 + norm1*norm1 + norm2*norm2);
-	  }
-	  
-	  if (means_different_p && norm_len > SMALL) {
-	       real x0, x1, x2;
-
-	       norm_len = 1.0/norm_len;
-	       norm0 *= norm_len;
-	       norm1 *= norm_len;
-	       norm2 *= norm_len;
-
-	       /* Compute the effective inverse dielectric tensor.
-		  We define this as:
-                     1/2 ( {eps_inv_mean, P} + {eps_mean_inv, 1-P} )
-	          where P is the projection matrix onto the normal direction
-                  (P = norm ^ norm), and {a,b} is the anti-commutator ab+ba.
-		   = 1/2 {eps_inv_mean - eps_mean_inv, P} + eps_mean_inv
-		   = 1/2 (n_i conj(x_j) + x_i n_j) + (eps_mean_inv)_ij
-		  where n_k is the kth component of the normal vector and 
-		     x_i = (eps_inv_mean - eps_mean_inv)_ik n_k  
-		  Note the implied summations (Einstein notation).
-
-		  Note that the resulting matrix is symmetric, and we get just
-		  eps_inv_mean if eps_inv_mean == eps_mean_inv, as desired.
-
-	          Note that P is idempotent, so for scalar epsilon this
-	          is just eps_inv_mean * P + eps_mean_inv * (1-P)
-                        = (1/eps_inv_mean * P + eps_mean * (1-P)) ^ (-1),
-	          which corresponds to the expression in the Meade paper. */
-	       
-	       x0 = (eps_inv_mean.m00 - eps_mean_inv.m00) * norm0;
-	       x1 = (eps_inv_mean.m11 - eps_mean_inv.m11) * norm1;
-	       x2 = (eps_inv_mean.m22 - eps_mean_inv.m22) * norm2;
-	       if (diag_eps_p) {
-#ifdef WITH_HERMITIAN_EPSILON
-		    md->eps_inv[eps_index].m01.re = 0.5*(x0*norm1 + x1*norm0);
-		    md->eps_inv[eps_index].m01.im = 0.0;
-		    md->eps_inv[eps_index].m02.re = 0.5*(x0*norm2 + x2*norm0);
-		    md->eps_inv[eps_index].m02.im = 0.0;
-		    md->eps_inv[eps_index].m12.re = 0.5*(x1*norm2 + x2*norm1);
-		    md->eps_inv[eps_index].m12.im = 0.0;
-#else
-		    md->eps_inv[eps_index].m01 = 0.5*(x0*norm1 + x1*norm0);
-		    md->eps_inv[eps_index].m02 = 0.5*(x0*norm2 + x2*norm0);
-		    md->eps_inv[eps_index].m12 = 0.5*(x1*norm2 + x2*norm1);
-#endif
+		    effective_eps_inv(md->eps_inv + eps_index,
+				      eps_inv_mean, eps_mean_inv,
+				      norm0, norm1, norm2, diag_eps_p);
 	       }
-	       else {
-#ifdef WITH_HERMITIAN_EPSILON
-		    real x0i, x1i, x2i;
-		    x0 += ((eps_inv_mean.m01.re - eps_mean_inv.m01.re)*norm1 + 
-			   (eps_inv_mean.m02.re - eps_mean_inv.m02.re)*norm2);
-		    x1 += ((eps_inv_mean.m01.re - eps_mean_inv.m01.re)*norm0 + 
-			   (eps_inv_mean.m12.re - eps_mean_inv.m12.re)*norm2);
-		    x2 += ((eps_inv_mean.m02.re - eps_mean_inv.m02.re)*norm0 +
-			   (eps_inv_mean.m12.re - eps_mean_inv.m12.re)*norm1);
-		    x0i = ((eps_inv_mean.m01.im - eps_mean_inv.m01.im)*norm1 + 
-			   (eps_inv_mean.m02.im - eps_mean_inv.m02.im)*norm2);
-		    x1i = (-(eps_inv_mean.m01.im - eps_mean_inv.m01.im)*norm0+ 
-			   (eps_inv_mean.m12.im - eps_mean_inv.m12.im)*norm2);
-		    x2i = -((eps_inv_mean.m02.im - eps_mean_inv.m02.im)*norm0 +
-			    (eps_inv_mean.m12.im - eps_mean_inv.m12.im)*norm1);
-
-		    md->eps_inv[eps_index].m01.re = (0.5*(x0*norm1 + x1*norm0) 
-						     + eps_mean_inv.m01.re);
-		    md->eps_inv[eps_index].m02.re = (0.5*(x0*norm2 + x2*norm0) 
-						     + eps_mean_inv.m02.re);
-		    md->eps_inv[eps_index].m12.re = (0.5*(x1*norm2 + x2*norm1) 
-						     + eps_mean_inv.m12.re);
-		    md->eps_inv[eps_index].m01.im = (0.5*(x0i*norm1-x1i*norm0) 
-						     + eps_mean_inv.m01.im);
-		    md->eps_inv[eps_index].m02.im = (0.5*(x0i*norm2-x2i*norm0) 
-						     + eps_mean_inv.m02.im);
-		    md->eps_inv[eps_index].m12.im = (0.5*(x1i*norm2-x2i*norm1) 
-						     + eps_mean_inv.m12.im);
-#else
-		    x0 += ((eps_inv_mean.m01 - eps_mean_inv.m01) * norm1 + 
-			   (eps_inv_mean.m02 - eps_mean_inv.m02) * norm2);
-		    x1 += ((eps_inv_mean.m01 - eps_mean_inv.m01) * norm0 + 
-			   (eps_inv_mean.m12 - eps_mean_inv.m12) * norm2);
-		    x2 += ((eps_inv_mean.m02 - eps_mean_inv.m02) * norm0 +
-			   (eps_inv_mean.m12 - eps_mean_inv.m12) * norm1);
-
-		    md->eps_inv[eps_index].m01 = (0.5*(x0*norm1 + x1*norm0) 
-						  + eps_mean_inv.m01);
-		    md->eps_inv[eps_index].m02 = (0.5*(x0*norm2 + x2*norm0) 
-						  + eps_mean_inv.m02);
-		    md->eps_inv[eps_index].m12 = (0.5*(x1*norm2 + x2*norm1) 
-						  + eps_mean_inv.m12);
-#endif
+	       else { /* undetermined normal vector and/or constant eps */
+		    md->eps_inv[eps_index] = eps_mean_inv;
 	       }
-	       md->eps_inv[eps_index].m00 = x0*norm0 + eps_mean_inv.m00;
-	       md->eps_inv[eps_index].m11 = x1*norm1 + eps_mean_inv.m11;
-	       md->eps_inv[eps_index].m22 = x2*norm2 + eps_mean_inv.m22;
-	  }
-	  else { /* undetermined normal vector and/or constant eps */
-	       md->eps_inv[eps_index] = eps_mean_inv;
+	  got_eps_inv:
+
+	       if (uniform)
+		    uniform_index = eps_index;
+	       eps_inv_total += (md->eps_inv[eps_index].m00 + 
+				 md->eps_inv[eps_index].m11 + 
+				 md->eps_inv[eps_index].m22);
+	  }  /* end of loop body */
+
+	  if (sampler) {
+	       num_evals += sampler->nevals;
+	       destroy_mesh_sampler(sampler);
 	  }
-     got_eps_inv:
-	  
-	  eps_inv_total += (md->eps_inv[eps_index].m00 + 
-			    md->eps_inv[eps_index].m11 + 
-			    md->eps_inv[eps_index].m22);
-     }}  /* end of loop body */
+	  if (md->dielectric_tile_done)
+	       md->dielectric_tile_done(tile_data, epsilon_data);
+     }  /* end of loop over tiles */
 
      mpi_allreduce_1(&eps_inv_total, real, SCALAR_MPI_TYPE,
 		     MPI_SUM, mpb_comm);
+     mpi_allreduce_1(&num_interface, int, MPI_INT, MPI_SUM, mpb_comm);
+     mpi_allreduce_1(&num_fallback, int, MPI_INT, MPI_SUM, mpb_comm);
+     mpi_allreduce_1(&n_tiles, int, MPI_INT, MPI_SUM, mpb_comm);
+     mpi_allreduce_1(&num_uniform, int, MPI_INT, MPI_SUM, mpb_comm);
+     mpi_allreduce_1(&num_evals, double, MPI_DOUBLE, MPI_SUM, mpb_comm);
+     md->num_interface_points = num_interface;
+     md->num_fallback_points = num_fallback;
+     md->num_tiles = n_tiles;
+     md->num_uniform_tiles = num_uniform;
+     md->num_fallback_evals = num_evals;
      n1 = md->fft_output_size;
      mpi_allreduce_1(&n1, int, MPI_INT, MPI_SUM, mpb_comm);
      md->eps_inv_mean = eps_inv_total / (3 * n1);
@@ -821,14 +1155,26 @@ void set_maxwell_mu(maxwell_data *md,
                     maxwell_dielectric_function mu,
                     maxwell_dielectric_mean_function mmu,
                     void *mu_data) {
+    update_maxwell_mu(md, mesh_size, R, G, mu, mmu, mu_data, 0, NULL);
+}
+
+void update_maxwell_mu(maxwell_data *md,
+                       const int mesh_size[3],
+                       real R[3][3], real G[3][3],
+                       maxwell_dielectric_function mu,
+                       maxwell_dielectric_mean_function mmu,
+                       void *mu_data,
+                       int nboxes, const maxwell_grid_box *boxes) {
     symmetric_matrix *eps_inv = md->eps_inv;
     real eps_inv_mean = md->eps_inv_mean;
     if (md->mu_inv == NULL) {
         CHK_MALLOC(md->mu_inv, symmetric_matrix, md->fft_output_size);        
+        boxes = NULL; /* no previous mu to update */
     }
     /* just re-use code to set epsilon, but initialize mu_inv instead */
     md->eps_inv = md->mu_inv;
-    set_maxwell_dielectric(md, mesh_size, R, G, mu, mmu, mu_data);
+    update_maxwell_dielectric(md, mesh_size, R, G, mu, mmu, mu_data,
+                              nboxes, boxes);
     md->eps_inv = eps_inv;
     md->mu_inv_mean = md->eps_inv_mean;
     md->eps_inv_mean = eps_inv_mean;
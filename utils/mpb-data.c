@@ -25,6 +25,12 @@
 
 #include "config.h"
 
+#if defined(HAVE_FORK) && defined(HAVE_SYS_WAIT_H)
+#  include <sys/types.h>
+#  include <sys/wait.h>
+#  define USE_FORK 1
+#endif
+
 #include "check.h"
 #include "matrixio.h"
 
@@ -62,234 +68,281 @@ int verbose = 0;
      } \
 }
 
-void add_cmplx_times_phase(real *sum_re, real *sum_im,
-			   real d_re, real d_im,
-			   double ix, double iy, double iz, real *s,
-			   real scale_by)
-{
-     static real phase = 0.0, p_re = 1.0, p_im = 0.0;
-     real new_phase;
-
-     new_phase = ix * s[0] + iy * s[1] + iz * s[2];
-     if (new_phase != phase) {
-	  phase = new_phase;
-	  p_re = cos(phase);
-	  p_im = sin(phase);
-     }
-     *sum_re += (d_re * p_re - d_im * p_im) * scale_by;
-     *sum_im += (d_re * p_im + d_im * p_re) * scale_by;
-}
-
 #define TWOPI 6.2831853071795864769252867665590057683943388
 
 #define MAX2(a,b) ((a) >= (b) ? (a) : (b))
 #define MIN2(a,b) ((a) < (b) ? (a) : (b))
 
-void map_data(real *d_in_re, real *d_in_im, int n_in[3], 
-	      real *d_out_re, real *d_out_im, int n_out[3], 
+/* if > 0, process the output in slabs of at most this many megabytes
+   (per output array), reading only the input rows each slab needs */
+double stream_mb = 0;
+
+/* Compute the map from output grid point (i,j,k) to fractional
+   coordinates (x,y,z) in the input cell, where x = cm.c0.x*i +
+   cm.c1.x*j + cm.c2.x*k + shift.x, etcetera. */
+static void output_to_input(matrix3x3 coord_map, const int n_out[3],
+			    matrix3x3 *cm, vector3 *shift)
+{
+     coord_map.c0 = vector3_scale(1.0 / n_out[0], coord_map.c0);
+     coord_map.c1 = vector3_scale(1.0 / n_out[1], coord_map.c1);
+     coord_map.c2 = vector3_scale(1.0 / n_out[2], coord_map.c2);
+
+     /* Compute shift so that the origin of the output cell
+	is mapped to the origin of the original primitive cell: */
+     shift->x = 0.5 - (coord_map.c0.x*0.5*n_out[0] +
+		       coord_map.c1.x*0.5*n_out[1] +
+		       coord_map.c2.x*0.5*n_out[2]);
+     shift->y = 0.5 - (coord_map.c0.y*0.5*n_out[0] +
+		       coord_map.c1.y*0.5*n_out[1] +
+		       coord_map.c2.y*0.5*n_out[2]);
+     shift->z = 0.5 - (coord_map.c0.z*0.5*n_out[0] +
+		       coord_map.c1.z*0.5*n_out[1] +
+		       coord_map.c2.z*0.5*n_out[2]);
+     *cm = coord_map;
+}
+
+/* (re,im) = a * wa + b * wb * q, for complex a, b, and q */
+#define CINTERP(re, im, a_re, a_im, wa, b_re, b_im, wb, q_re, q_im) { \
+     real bw_re = (b_re) * (wb), bw_im = (b_im) * (wb); \
+     re = (a_re) * (wa) + bw_re * (q_re) - bw_im * (q_im); \
+     im = (a_im) * (wa) + bw_re * (q_im) + bw_im * (q_re); \
+}
+
+/* Set (q_re,q_im) to the phase exp(i*s*(n2-n)) for n2-n = 0 or +/-1,
+   given cos_s = cos(s) and sin_s = sin(s). */
+#define REL_PHASE(q_re, q_im, n2, n, cos_s, sin_s) { \
+     if ((n2) == (n)) { q_re = 1.0; q_im = 0.0; } \
+     else { q_re = (cos_s); q_im = (n2) > (n) ? (sin_s) : -(sin_s); } \
+}
+
+/* Interpolate the input data d_in_re/d_in_im (on an n_in grid) onto
+   the output rows out_start <= i < out_start + out_rows of the n_out
+   grid, storing them in d_out_re/d_out_im (whose first two dimensions
+   are transposed if transpose is true).  d_in holds only the input
+   rows in_start, in_start + 1, ... (mod n_in[0]), which must include
+   every row needed for the output rows (see input_rows).  The minimum
+   and maximum of the output real and imaginary parts are accumulated
+   in range[0..1] and range[2..3], respectively.  The output rows are
+   divided among threads, if OpenMP is enabled. */
+void map_data(real *d_in_re, real *d_in_im, int n_in[3], int in_start,
+	      real *d_out_re, real *d_out_im, int n_out[3],
+	      int out_start, int out_rows,
 	      matrix3x3 coord_map,
 	      real *kvector,
-	      short pick_nearest, short transpose)
+	      short pick_nearest, short transpose, real range[4])
 {
-     int i, j, k;
+     int ij, nij = out_rows * n_out[1];
      real s[3]; /* phase difference per cell in each lattice direction */
-     real min_out_re = 1e20, max_out_re = -1e20, 
-	  min_out_im = 1e20, max_out_im = -1e20;
-     real shiftx, shifty, shiftz;
+     real cos_s[3], sin_s[3];
+     matrix3x3 cm;
+     vector3 shift;
 
      CHECK(d_in_re && d_out_re, "invalid arguments");
      CHECK((d_out_im && d_in_im) || (!d_out_im && !d_in_im),
 	   "both input and output must be real or complex");
 
-     coord_map.c0 = vector3_scale(1.0 / n_out[0], coord_map.c0);
-     coord_map.c1 = vector3_scale(1.0 / n_out[1], coord_map.c1);
-     coord_map.c2 = vector3_scale(1.0 / n_out[2], coord_map.c2);
+     output_to_input(coord_map, n_out, &cm, &shift);
 
-     for (i = 0; i < 3; ++i) {
+     for (ij = 0; ij < 3; ++ij) {
 	  if (kvector)
-	       s[i] = kvector[i] * TWOPI;
+	       s[ij] = kvector[ij] * TWOPI;
 	  else
-	       s[i] = 0;
+	       s[ij] = 0;
+	  cos_s[ij] = cos(s[ij]);
+	  sin_s[ij] = sin(s[ij]);
      }
 
-     /* Compute shift so that the origin of the output cell
-	is mapped to the origin of the original primitive cell: */
-     shiftx = 0.5 - (coord_map.c0.x*0.5*n_out[0] +
-		     coord_map.c1.x*0.5*n_out[1] +
-		     coord_map.c2.x*0.5*n_out[2]);
-     shifty = 0.5 - (coord_map.c0.y*0.5*n_out[0] +
-		     coord_map.c1.y*0.5*n_out[1] +
-		     coord_map.c2.y*0.5*n_out[2]);
-     shiftz = 0.5 - (coord_map.c0.z*0.5*n_out[0] +
-		     coord_map.c1.z*0.5*n_out[1] +
-		     coord_map.c2.z*0.5*n_out[2]);
-
-     for (i = 0; i < n_out[0]; ++i)
-	  for (j = 0; j < n_out[1]; ++j)
-	       for (k = 0; k < n_out[2]; ++k) {
-		    real x, y, z;
-		    double xi, yi, zi, xi2, yi2, zi2;
-		    double dx, dy, dz, mdx, mdy, mdz;
-		    int i1, j1, k1, i2, j2, k2;
-		    int ijk;
-
-		    if (transpose)
-			 ijk = (j * n_out[0] + i) * n_out[2] + k;
-		    else
-			 ijk = (i * n_out[1] + j) * n_out[2] + k;
+#pragma omp parallel
+{
+     real min_out_re = range[0], max_out_re = range[1], 
+	  min_out_im = range[2], max_out_im = range[3];
+     real phase = 0.0, p_re = 1.0, p_im = 0.0; /* cached exp(i*phase) */
+
+#pragma omp for schedule(static)
+     for (ij = 0; ij < nij; ++ij) {
+	  int i = out_start + ij / n_out[1], j = ij % n_out[1], k;
+
+	  for (k = 0; k < n_out[2]; ++k) {
+	       real x, y, z;
+	       double xi, yi, zi, xi2, yi2, zi2;
+	       double dx, dy, dz, mdx, mdy, mdz;
+	       int i1, j1, k1, i2, j2, k2;
+	       int ijk;
+
+	       if (transpose)
+		    ijk = (j * out_rows + (i - out_start)) * n_out[2] + k;
+	       else
+		    ijk = ij * n_out[2] + k;
 		    
-		    /* find the point corresponding to d_out[i,j,k] in
-		       the input array, and also find the next-nearest
-		       points. */
-		    x = coord_map.c0.x*i + coord_map.c1.x*j + coord_map.c2.x*k
-			 + shiftx;
-		    y = coord_map.c0.y*i + coord_map.c1.y*j + coord_map.c2.y*k
-			 + shifty;
-		    z = coord_map.c0.z*i + coord_map.c1.z*j + coord_map.c2.z*k
-			 + shiftz;
-		    MODF_POSITIVE(x, xi);
-		    MODF_POSITIVE(y, yi);
-		    MODF_POSITIVE(z, zi);
-		    i1 = x * n_in[0]; j1 = y * n_in[1]; k1 = z * n_in[2];
-		    dx = x * n_in[0] - i1;
-		    dy = y * n_in[1] - j1;
-		    dz = z * n_in[2] - k1;
-		    ADJ_POINT(i1, i2, n_in[0], dx, xi, xi2);
-		    ADJ_POINT(j1, j2, n_in[1], dy, yi, yi2);
-		    ADJ_POINT(k1, k2, n_in[2], dz, zi, zi2);
-
-		    /* dx, mdx, etcetera, are the weights for the various
-		       points in the input data, which we use for linearly
-		       interpolating to get the output point. */
-		    if (pick_nearest) {
-			 /* don't interpolate */
-			 dx = dx <= 0.5 ? 0.0 : 1.0;
-			 dy = dy <= 0.5 ? 0.0 : 1.0;
-			 dz = dz <= 0.5 ? 0.0 : 1.0;
-		    }
-		    mdx = 1.0 - dx;
-		    mdy = 1.0 - dy;
-		    mdz = 1.0 - dz;
+	       /* find the point corresponding to d_out[i,j,k] in
+		  the input array, and also find the next-nearest
+		  points. */
+	       x = cm.c0.x*i + cm.c1.x*j + cm.c2.x*k + shift.x;
+	       y = cm.c0.y*i + cm.c1.y*j + cm.c2.y*k + shift.y;
+	       z = cm.c0.z*i + cm.c1.z*j + cm.c2.z*k + shift.z;
+	       MODF_POSITIVE(x, xi);
+	       MODF_POSITIVE(y, yi);
+	       MODF_POSITIVE(z, zi);
+	       i1 = x * n_in[0]; j1 = y * n_in[1]; k1 = z * n_in[2];
+	       dx = x * n_in[0] - i1;
+	       dy = y * n_in[1] - j1;
+	       dz = z * n_in[2] - k1;
+	       ADJ_POINT(i1, i2, n_in[0], dx, xi, xi2);
+	       ADJ_POINT(j1, j2, n_in[1], dy, yi, yi2);
+	       ADJ_POINT(k1, k2, n_in[2], dz, zi, zi2);
+
+	       /* convert the input rows to rows of d_in */
+	       i1 = (i1 - in_start + n_in[0]) % n_in[0];
+	       i2 = (i2 - in_start + n_in[0]) % n_in[0];
+
+	       /* dx, mdx, etcetera, are the weights for the various
+		  points in the input data, which we use for linearly
+		  interpolating to get the output point. */
+	       if (pick_nearest) {
+		    /* don't interpolate */
+		    dx = dx <= 0.5 ? 0.0 : 1.0;
+		    dy = dy <= 0.5 ? 0.0 : 1.0;
+		    dz = dz <= 0.5 ? 0.0 : 1.0;
+	       }
+	       mdx = 1.0 - dx;
+	       mdy = 1.0 - dy;
+	       mdz = 1.0 - dz;
 		    
-		    /* Now, linearly interpolate the input to get the
-		       output.  If the input/output are complex, we
-		       also need to multiply by the appropriate phase
-		       factor, depending upon which unit cell we are in. */
+	       /* Now, linearly interpolate the input to get the
+		  output.  If the input/output are complex, we
+		  also need to multiply by the appropriate phase
+		  factor, depending upon which unit cell we are in:
+		  we interpolate along z, then y, then x, multiplying
+		  the second point by its phase relative to the first
+		  at each step, and multiply the result by the phase
+		  of the first point. */
 
 #define IN_INDEX(i,j,k) ((i * n_in[1] + j) * n_in[2] + k)
-		    if (d_out_im) {
-			 d_out_re[ijk] = 0.0;
-			 d_out_im[ijk] = 0.0;
-			 add_cmplx_times_phase(d_out_re + ijk, d_out_im + ijk,
-					       d_in_re[IN_INDEX(i1,j1,k1)],
-					       d_in_im[IN_INDEX(i1,j1,k1)],
-					       xi, yi, zi, s,
-					       mdx * mdy * mdz);
-			 add_cmplx_times_phase(d_out_re + ijk, d_out_im + ijk,
-					       d_in_re[IN_INDEX(i1,j1,k2)],
-					       d_in_im[IN_INDEX(i1,j1,k2)],
-					       xi, yi, zi2, s,
-					       mdx * mdy * dz);
-			 add_cmplx_times_phase(d_out_re + ijk, d_out_im + ijk,
-					       d_in_re[IN_INDEX(i1,j2,k1)],
-					       d_in_im[IN_INDEX(i1,j2,k1)],
-					       xi, yi2, zi, s,
-					       mdx * dy * mdz);
-			 add_cmplx_times_phase(d_out_re + ijk, d_out_im + ijk,
-					       d_in_re[IN_INDEX(i1,j2,k2)],
-					       d_in_im[IN_INDEX(i1,j2,k2)],
-					       xi, yi2, zi2, s,
-					       mdx * dy * dz);
-			 add_cmplx_times_phase(d_out_re + ijk, d_out_im + ijk,
-					       d_in_re[IN_INDEX(i2,j1,k1)],
-					       d_in_im[IN_INDEX(i2,j1,k1)],
-					       xi2, yi, zi, s,
-					       dx * mdy * mdz);
-			 add_cmplx_times_phase(d_out_re + ijk, d_out_im + ijk,
-					       d_in_re[IN_INDEX(i2,j1,k2)],
-					       d_in_im[IN_INDEX(i2,j1,k2)],
-					       xi2, yi, zi2, s,
-					       dx * mdy * dz);
-			 add_cmplx_times_phase(d_out_re + ijk, d_out_im + ijk,
-					       d_in_re[IN_INDEX(i2,j2,k1)],
-					       d_in_im[IN_INDEX(i2,j2,k1)],
-					       xi2, yi2, zi, s,
-					       dx * dy * mdz);
-			 add_cmplx_times_phase(d_out_re + ijk, d_out_im + ijk,
-					       d_in_re[IN_INDEX(i2,j2,k2)],
-					       d_in_im[IN_INDEX(i2,j2,k2)],
-					       xi2, yi2, zi2, s,
-					       dx * dy * dz);
-			 min_out_im = MIN2(min_out_im, d_out_im[ijk]);
-			 max_out_im = MAX2(max_out_im, d_out_im[ijk]);
+	       if (d_out_im) {
+		    real t_re[2][2], t_im[2][2], u_re[2], u_im[2];
+		    real v_re, v_im, q_re[3], q_im[3], new_phase;
+		    int a, b;
+
+		    REL_PHASE(q_re[0], q_im[0], xi2, xi, cos_s[0], sin_s[0]);
+		    REL_PHASE(q_re[1], q_im[1], yi2, yi, cos_s[1], sin_s[1]);
+		    REL_PHASE(q_re[2], q_im[2], zi2, zi, cos_s[2], sin_s[2]);
+		    for (a = 0; a < 2; ++a)
+			 for (b = 0; b < 2; ++b) {
+			      int ia = a ? i2 : i1, jb = b ? j2 : j1;
+			      CINTERP(t_re[a][b], t_im[a][b],
+				      d_in_re[IN_INDEX(ia,jb,k1)],
+				      d_in_im[IN_INDEX(ia,jb,k1)], mdz,
+				      d_in_re[IN_INDEX(ia,jb,k2)],
+				      d_in_im[IN_INDEX(ia,jb,k2)], dz,
+				      q_re[2], q_im[2]);
+			 }
+		    for (a = 0; a < 2; ++a)
+			 CINTERP(u_re[a], u_im[a],
+				 t_re[a][0], t_im[a][0], mdy,
+				 t_re[a][1], t_im[a][1], dy,
+				 q_re[1], q_im[1]);
+		    CINTERP(v_re, v_im, u_re[0], u_im[0], mdx,
+			    u_re[1], u_im[1], dx, q_re[0], q_im[0]);
+
+		    new_phase = xi * s[0] + yi * s[1] + zi * s[2];
+		    if (new_phase != phase) {
+			 phase = new_phase;
+			 p_re = cos(phase);
+			 p_im = sin(phase);
 		    }
-		    else {
-			 d_out_re[ijk] =
-			      d_in_re[IN_INDEX(i1,j1,k1)] * mdx * mdy * mdz +
-			      d_in_re[IN_INDEX(i1,j1,k2)] * mdx * mdy * dz +
-			      d_in_re[IN_INDEX(i1,j2,k1)] * mdx * dy * mdz +
-			      d_in_re[IN_INDEX(i1,j2,k2)] * mdx * dy * dz +
-			      d_in_re[IN_INDEX(i2,j1,k1)] * dx * mdy * mdz +
-			      d_in_re[IN_INDEX(i2,j1,k2)] * dx * mdy * dz +
-			      d_in_re[IN_INDEX(i2,j2,k1)] * dx * dy * mdz +
-			      d_in_re[IN_INDEX(i2,j2,k2)] * dx * dy * dz;
-		    }
-		    min_out_re = MIN2(min_out_re, d_out_re[ijk]);
-		    max_out_re = MAX2(max_out_re, d_out_re[ijk]);
-#undef IN_INDEX
+		    d_out_re[ijk] = v_re * p_re - v_im * p_im;
+		    d_out_im[ijk] = v_re * p_im + v_im * p_re;
+		    min_out_im = MIN2(min_out_im, d_out_im[ijk]);
+		    max_out_im = MAX2(max_out_im, d_out_im[ijk]);
 	       }
+	       else {
+		    d_out_re[ijk] =
+			 d_in_re[IN_INDEX(i1,j1,k1)] * mdx * mdy * mdz +
+			 d_in_re[IN_INDEX(i1,j1,k2)] * mdx * mdy * dz +
+			 d_in_re[IN_INDEX(i1,j2,k1)] * mdx * dy * mdz +
+			 d_in_re[IN_INDEX(i1,j2,k2)] * mdx * dy * dz +
+			 d_in_re[IN_INDEX(i2,j1,k1)] * dx * mdy * mdz +
+			 d_in_re[IN_INDEX(i2,j1,k2)] * dx * mdy * dz +
+			 d_in_re[IN_INDEX(i2,j2,k1)] * dx * dy * mdz +
+			 d_in_re[IN_INDEX(i2,j2,k2)] * dx * dy * dz;
+	       }
+	       min_out_re = MIN2(min_out_re, d_out_re[ijk]);
+	       max_out_re = MAX2(max_out_re, d_out_re[ijk]);
+#undef IN_INDEX
+	  }
+     }
 
-     if (verbose) {
-	  printf("real part range: %g .. %g\n", min_out_re, max_out_re);
-	  if (d_out_im)
-	       printf("imag part range: %g .. %g\n", min_out_im, max_out_im);
+#pragma omp critical
+     {
+	  range[0] = MIN2(range[0], min_out_re);
+	  range[1] = MAX2(range[1], max_out_re);
+	  range[2] = MIN2(range[2], min_out_im);
+	  range[3] = MAX2(range[3], max_out_im);
      }
 }
+}
 
-void handle_dataset(matrixio_id in_file, matrixio_id out_file, 
-		    const char *name_re, const char *name_im,
-		    matrix3x3 Rout, matrix3x3 coord_map,
-		    real *kvector, double resolution, 
-		    scalar_complex scaleby, real multiply_size[3],
-		    int pick_nearest, int transpose)
+/* Set *in_start and *in_rows to a range of input rows (first index,
+   mod n_in[0]) containing every row that map_data needs for the
+   output rows out_start .. out_start + out_rows - 1.  This is the whole
+   input unless the first input coordinate varies by less than a
+   period over those output rows (e.g. if the first lattice direction
+   is not rotated). */
+static void input_rows(matrix3x3 coord_map, int n_in[3], int n_out[3],
+		       int out_start, int out_rows,
+		       int *in_start, int *in_rows)
 {
-     real *d_in_re = NULL, *d_in_im = NULL, *d_out_re = NULL, *d_out_im = NULL;
-     int in_dims[3] = {1,1,1}, out_dims[3] = {1,1,1}, out_dims2[3], rank = 3;
-     int i, N;
-     int start[3] = {0,0,0};
-     matrixio_id data_id;
-     char out_name[1000];
-
-     d_in_re = matrixio_read_real_data(in_file, name_re, &rank, in_dims,
-				       0, 0, 0, NULL);
-     if (!d_in_re)
-	  goto done;
-
-     if (verbose)
-	  printf("Found dataset %s...\n", name_re);
-
-     if (name_im) {
-	  d_in_im = matrixio_read_real_data(in_file, name_im, &rank, out_dims,
-					    0, 0, 0, NULL);
-	  if (!d_in_im) {
-	       fprintf(stderr, "mpb-data: found %s dataset but not %s\n",
-		       name_re, name_im);
-	       goto done;
-	  }
-	  
-	  for (i = 0; i < 3; ++i) {
-	       CHECK(out_dims[i] == in_dims[i],
-		     "re/im datasets must have same size!");
-	  }
-
-	  if (verbose)
-	       printf("   and imaginary part dataset %s...\n", name_im);
-
+     matrix3x3 cm;
+     vector3 shift;
+     double x0, x1, var;
+     int lo, hi;
+
+     output_to_input(coord_map, n_out, &cm, &shift);
+     x0 = cm.c0.x * out_start + shift.x;
+     x1 = cm.c0.x * (out_start + out_rows - 1) + shift.x;
+     var = fabs(cm.c1.x) * (n_out[1] - 1) + fabs(cm.c2.x) * (n_out[2] - 1);
+
+     /* allow for the next-nearest points, and for roundoff */
+     lo = floor((MIN2(x0, x1) - var) * n_in[0]) - 2;
+     hi = floor((MAX2(x0, x1) + var) * n_in[0]) + 2;
+     if (hi - lo + 1 >= n_in[0]) {
+	  *in_start = 0;
+	  *in_rows = n_in[0];
+     }
+     else {
+	  *in_start = (lo % n_in[0] + n_in[0]) % n_in[0];
+	  *in_rows = hi - lo + 1;
      }
+}
 
-     if (verbose)
-	  printf("Input data is rank %d, size %dx%dx%d.\n",
-		 rank, in_dims[0], in_dims[1], in_dims[2]);
+/* Read the rows in_start .. in_start + in_rows - 1 (mod dims[0]) of the
+   dataset name, which has the given rank and dims, into a newly
+   allocated array. */
+static real *read_rows(matrixio_id file, const char *name,
+		       int rank, const int dims[3], int in_start, int in_rows)
+{
+     int n = MIN2(in_rows, dims[0] - in_start), r = rank, d[3];
+     int plane = dims[1] * dims[2];
+     real *data;
+
+     CHK_MALLOC(data, real, in_rows * plane);
+     d[0] = dims[0]; d[1] = dims[1]; d[2] = dims[2];
+     CHECK(matrixio_read_real_data(file, name, &r, d, n, in_start, 1, data),
+	   "error reading dataset");
+     if (in_rows > n) /* wrapped around to the first rows */
+	  CHECK(matrixio_read_real_data(file, name, &r, d, in_rows - n, 0, 1,
+					data + n * plane),
+		"error reading dataset");
+     return data;
+}
+
+/* Compute the output dimensions for input data of the given rank
+   and size, resampled to the output lattice Rout. */
+static void get_out_dims(int rank, const int in_dims[3], matrix3x3 Rout,
+			 double resolution, real multiply_size[3],
+			 int out_dims[3])
+{
+     int i;
 
      if (resolution > 0) {
 	  out_dims[0] = vector3_norm(Rout.c0) * resolution + 0.5;
@@ -302,8 +355,36 @@ void handle_dataset(matrixio_id in_file, matrixio_id out_file,
      }
      for (i = rank; i < 3; ++i)
 	  out_dims[i] = 1;
-     for (N = 1, i = 0; i < 3; ++i)
-	  N *= (out_dims[i] = MAX2(out_dims[i], 1));
+     for (i = 0; i < 3; ++i)
+	  out_dims[i] = MAX2(out_dims[i], 1);
+}
+
+/* Resample the ncomp datasets in_names[c][0] (real parts) and, if
+   cmplx, in_names[c][1] (imaginary parts) of in_file, all of the given
+   rank and size in_dims, to the datasets out_names[c][0/1] of size
+   out_dims (transposed if transpose) in out_file.  If cart_map is
+   non-NULL, the ncomp == 3 components are a vector field, which is
+   rotated by cart_map.  Complex outputs are multiplied by scaleby.
+
+   The output is computed and written in slabs of rows (first
+   dimension) according to stream_mb, and only the input rows needed
+   for each slab are read, so that memory use is bounded. */
+static void map_datasets(matrixio_id in_file, matrixio_id out_file,
+			 int ncomp, int cmplx,
+			 const char *in_names[3][2],
+			 const char *out_names[3][2],
+			 int rank, int in_dims[3], int out_dims[3],
+			 matrix3x3 coord_map, const matrix3x3 *cart_map,
+			 real *kvector, scalar_complex scaleby,
+			 int pick_nearest, int transpose)
+{
+     real *d_in[3][2] = { {0,0},{0,0},{0,0} }, *d_out[2] = {0,0};
+     real range[3][4];
+     matrixio_id data_id[3][2];
+     int out_dims2[3], in_start = 0, in_rows = 0, out_start, rows;
+     int plane_in = in_dims[1] * in_dims[2];
+     int plane_out = out_dims[1] * out_dims[2];
+     int nri = cmplx ? 2 : 1, c, ri, i;
 
      if (transpose) {
 	  out_dims2[0] = out_dims[1];
@@ -320,53 +401,169 @@ void handle_dataset(matrixio_id in_file, matrixio_id out_file,
 	  printf("Output data %dx%dx%d.\n",
 		 out_dims2[0], out_dims2[1], out_dims2[2]);
 
-     CHK_MALLOC(d_out_re, real, N);
-     if (d_in_im) {
-	  CHK_MALLOC(d_out_im, real, N);
+     rows = out_dims[0];
+     if (stream_mb > 0) {
+	  double r = stream_mb * 1048576.0 / (sizeof(real) * plane_out);
+	  if (r < rows)
+	       rows = MAX2(1, (int) r);
+     }
+     if (verbose && rows < out_dims[0])
+	  printf("Streaming output in slabs of %d rows.\n", rows);
+
+     for (c = 0; c < ncomp; ++c) {
+	  range[c][0] = range[c][2] = 1e20;
+	  range[c][1] = range[c][3] = -1e20;
+	  for (ri = 0; ri < nri; ++ri) {
+	       if (verbose)
+		    printf("Writing dataset to %s...\n", out_names[c][ri]);
+	       data_id[c][ri] = matrixio_create_dataset(out_file,
+							out_names[c][ri], "",
+							rank, out_dims2);
+	  }
      }
+     for (ri = 0; ri < nri; ++ri)
+	  CHK_MALLOC(d_out[ri], real, rows * plane_out);
+
+     for (out_start = 0; out_start < out_dims[0]; out_start += rows) {
+	  int nrows = MIN2(rows, out_dims[0] - out_start);
+	  int start, nin, local_dims[3], local_start[3] = {0,0,0};
+
+	  /* read the input rows needed for this slab, if we don't
+	     have them already */
+	  input_rows(coord_map, in_dims, out_dims, out_start, nrows,
+		     &start, &nin);
+	  if (!d_in[0][0] || (in_rows < in_dims[0] &&
+			      (start - in_start + in_dims[0]) % in_dims[0]
+			      + nin > in_rows)) {
+	       in_start = start;
+	       in_rows = nin;
+	       for (c = 0; c < ncomp; ++c)
+		    for (ri = 0; ri < nri; ++ri) {
+			 free(d_in[c][ri]);
+			 d_in[c][ri] = read_rows(in_file, in_names[c][ri],
+						 rank, in_dims,
+						 in_start, in_rows);
+		    }
+	       if (cart_map) /* rotate vector field */
+		    for (ri = 0; ri < nri; ++ri)
+			 for (i = 0; i < in_rows * plane_in; ++i) {
+			      vector3 v;
+			      v.x = d_in[0][ri][i];
+			      v.y = d_in[1][ri][i];
+			      v.z = d_in[2][ri][i];
+			      v = matrix3x3_vector3_mult(*cart_map, v);
+			      d_in[0][ri][i] = v.x;
+			      d_in[1][ri][i] = v.y;
+			      d_in[2][ri][i] = v.z;
+			 }
+	  }
+
+	  if (transpose) {
+	       local_dims[0] = out_dims[1];
+	       local_dims[1] = nrows;
+	       local_start[1] = out_start;
+	  }
+	  else {
+	       local_dims[0] = nrows;
+	       local_dims[1] = out_dims[1];
+	       local_start[0] = out_start;
+	  }
+	  local_dims[2] = out_dims[2];
+
+	  for (c = 0; c < ncomp; ++c) {
+	       map_data(d_in[c][0], d_in[c][1], in_dims, in_start,
+			d_out[0], d_out[1], out_dims, out_start, nrows,
+			coord_map, kvector, pick_nearest, transpose,
+			range[c]);
+
+	       if (cmplx) /* multiply * scaleby for complex data */
+		    for (i = 0; i < nrows * plane_out; ++i) {
+			 scalar_complex d;
+			 CASSIGN_SCALAR(d, d_out[0][i], d_out[1][i]);
+			 CASSIGN_MULT(d, scaleby, d);
+			 d_out[0][i] = CSCALAR_RE(d);
+			 d_out[1][i] = CSCALAR_IM(d);
+		    }
 
-     map_data(d_in_re, d_in_im, in_dims, d_out_re, d_out_im, out_dims,
-	      coord_map, kvector, pick_nearest, transpose);
+	       for (ri = 0; ri < nri; ++ri)
+		    matrixio_write_real_data(data_id[c][ri], local_dims,
+					     local_start, 1, d_out[ri]);
+	  }
+     }
 
-     if (d_out_im) { /* multiply * scaleby for complex data */
-	  for (i = 0; i < N; ++i) {
-	       scalar_complex d;
-	       CASSIGN_SCALAR(d, d_out_re[i], d_out_im[i]);
-	       CASSIGN_MULT(d, scaleby, d);
-	       d_out_re[i] = CSCALAR_RE(d);
-	       d_out_im[i] = CSCALAR_IM(d);
+     for (c = 0; c < ncomp; ++c) {
+	  for (ri = 0; ri < nri; ++ri) {
+	       matrixio_close_dataset(data_id[c][ri]);
+	       free(d_in[c][ri]);
+	  }
+	  if (verbose) {
+	       printf("real part range: %g .. %g\n", 
+		      range[c][0], range[c][1]);
+	       if (cmplx)
+		    printf("imag part range: %g .. %g\n", 
+			   range[c][2], range[c][3]);
 	  }
      }
+     free(d_out[0]);
+     free(d_out[1]);
+
+     if (verbose)
+	  printf("Successfully wrote out data.\n");
+}
+
+void handle_dataset(matrixio_id in_file, matrixio_id out_file, 
+		    const char *name_re, const char *name_im,
+		    matrix3x3 Rout, matrix3x3 coord_map,
+		    real *kvector, double resolution, 
+		    scalar_complex scaleby, real multiply_size[3],
+		    int pick_nearest, int transpose)
+{
+     int in_dims[3] = {1,1,1}, dims[3] = {1,1,1}, out_dims[3], rank, i;
+     const char *in_names[3][2], *out_names[3][2];
+     char out_name_re[1000], out_name_im[1000];
+
+     rank = matrixio_dataset_dims(in_file, name_re, 3, in_dims);
+     if (!rank)
+	  return;
 
-     strcpy(out_name, name_re);
-     if (out_file.id == in_file.id)
-	  strcat(out_name, "-new");
      if (verbose)
-	  printf("Writing dataset to %s...\n", out_name);
-     data_id = matrixio_create_dataset(out_file, out_name,"", rank, out_dims2);
-     matrixio_write_real_data(data_id, out_dims2, start, 1, d_out_re);
-     matrixio_close_dataset(data_id);
-
-     if (d_out_im) {
-	  strcpy(out_name, name_im);
-	  if (out_file.id == in_file.id)
-	       strcat(out_name, "-new");
+	  printf("Found dataset %s...\n", name_re);
+
+     if (name_im) {
+	  if (!matrixio_dataset_dims(in_file, name_im, 3, dims)) {
+	       fprintf(stderr, "mpb-data: found %s dataset but not %s\n",
+		       name_re, name_im);
+	       return;
+	  }
+	  
+	  for (i = 0; i < 3; ++i) {
+	       CHECK(dims[i] == in_dims[i],
+		     "re/im datasets must have same size!");
+	  }
+
 	  if (verbose)
-	       printf("Writing dataset to %s...\n", out_name);
-	  data_id = matrixio_create_dataset(out_file, out_name, "",
-					    rank, out_dims2);
-	  matrixio_write_real_data(data_id, out_dims2, start, 1, d_out_im);
-	  matrixio_close_dataset(data_id);
+	       printf("   and imaginary part dataset %s...\n", name_im);
+
      }
 
      if (verbose)
-	  printf("Successfully wrote out data.\n");
+	  printf("Input data is rank %d, size %dx%dx%d.\n",
+		 rank, in_dims[0], in_dims[1], in_dims[2]);
+
+     get_out_dims(rank, in_dims, Rout, resolution, multiply_size, out_dims);
 
- done:
-     free(d_in_re);
-     free(d_in_im);
-     free(d_out_re);
-     free(d_out_im);
+     strcpy(out_name_re, name_re);
+     strcpy(out_name_im, name_im ? name_im : "");
+     if (out_file.id == in_file.id) {
+	  strcat(out_name_re, "-new");
+	  strcat(out_name_im, "-new");
+     }
+     in_names[0][0] = name_re; in_names[0][1] = name_im;
+     out_names[0][0] = out_name_re; out_names[0][1] = out_name_im;
+
+     map_datasets(in_file, out_file, 1, name_im != NULL, in_names, out_names,
+		  rank, in_dims, out_dims, coord_map, NULL,
+		  kvector, scaleby, pick_nearest, transpose);
 }
 
 void handle_cvector_dataset(matrixio_id in_file, matrixio_id out_file, 
@@ -379,23 +576,23 @@ void handle_cvector_dataset(matrixio_id in_file, matrixio_id out_file,
 			    real multiply_size[3],
 			    int pick_nearest, int transpose)
 {
-     real *d_in[3][2] = { {0,0},{0,0},{0,0} };
-     int in_dims[3] = {1,1,1}, out_dims[3] = {1,1,1}, out_dims2[3], rank = 3;
-     int i, N, dim, ri;
-     int start[3] = {0,0,0};
-     matrixio_id data_id;
+     char names[3][2][4], new_names[3][2][8];
+     const char *in_names[3][2], *out_names[3][2];
+     int in_dims[3] = {1,1,1}, out_dims[3], rank = 3;
+     int i, dim, ri;
 
      for (dim = 0; dim < 3; ++dim)
 	  for (ri = 0; ri < 2; ++ri) {
-	       char nam[] = "x.r";
-	       int dims[3] = {1,1,1}, rnk = 3;
-
-	       nam[0] = 'x' + dim;
-	       nam[2] = ri ? 'i' : 'r';
-	       d_in[dim][ri] 
-		    = matrixio_read_real_data(in_file, nam, &rnk, dims,
-					      0, 0, 0, NULL);
-	       if (!d_in[dim][ri])
+	       int dims[3] = {1,1,1}, rnk;
+
+	       sprintf(names[dim][ri], "%c.%c", 'x' + dim, ri ? 'i' : 'r');
+	       sprintf(new_names[dim][ri], "%s%s", names[dim][ri],
+		       out_file.id == in_file.id ? "-new" : "");
+	       in_names[dim][ri] = names[dim][ri];
+	       out_names[dim][ri] = new_names[dim][ri];
+
+	       rnk = matrixio_dataset_dims(in_file, names[dim][ri], 3, dims);
+	       if (!rnk)
 		    goto bad;
 	       if (!dim && !ri) {
 		    rank = rnk;
@@ -423,96 +620,15 @@ void handle_cvector_dataset(matrixio_id in_file, matrixio_id out_file,
 		 cart_map.c0.x, cart_map.c1.x, cart_map.c2.x,
 		 cart_map.c0.y, cart_map.c1.y, cart_map.c2.y,
 		 cart_map.c0.z, cart_map.c1.z, cart_map.c2.z);
-     N = in_dims[0] * in_dims[1] * in_dims[2];
-     for (ri = 0; ri < 2; ++ri)
-	  for (i = 0; i < N; ++i) {
-	       vector3 v;
-	       v.x = d_in[0][ri][i];
-	       v.y = d_in[1][ri][i];
-	       v.z = d_in[2][ri][i];
-	       v = matrix3x3_vector3_mult(cart_map, v);
-	       d_in[0][ri][i] = v.x;
-	       d_in[1][ri][i] = v.y;
-	       d_in[2][ri][i] = v.z;
-	  }
 
-     if (resolution > 0) {
-	  out_dims[0] = vector3_norm(Rout.c0) * resolution + 0.5;
-	  out_dims[1] = vector3_norm(Rout.c1) * resolution + 0.5;
-	  out_dims[2] = vector3_norm(Rout.c2) * resolution + 0.5;
-     }
-     else {
-	  for (i = 0; i < 3; ++i)
-	       out_dims[i] = in_dims[i] * multiply_size[i];
-     }
-     for (i = rank; i < 3; ++i)
-	  out_dims[i] = 1;
-     for (N = 1, i = 0; i < 3; ++i)
-	  N *= (out_dims[i] = MAX2(out_dims[i], 1));
-
-     if (transpose) {
-	  out_dims2[0] = out_dims[1];
-	  out_dims2[1] = out_dims[0];
-	  out_dims2[2] = out_dims[2];
-     }
-     else {
-	  out_dims2[0] = out_dims[0];
-	  out_dims2[1] = out_dims[1];
-	  out_dims2[2] = out_dims[2];
-     }
-
-     if (verbose)
-	  printf("Output data %dx%dx%d.\n",
-		 out_dims2[0], out_dims2[1], out_dims2[2]);
-
-     for (dim = 0; dim < 3; ++dim) {
-	  real *d_out_re, *d_out_im;
-	  char nam[] = "x.r-new";
-
-	  CHK_MALLOC(d_out_re, real, N);
-	  CHK_MALLOC(d_out_im, real, N);
-
-	  map_data(d_in[dim][0], d_in[dim][1], in_dims, 
-		   d_out_re, d_out_im, out_dims,
-		   coord_map, kvector, pick_nearest, transpose);
-
-	  for (i = 0; i < N; ++i) { /* multiply * scaleby */
-	       scalar_complex d;
-	       CASSIGN_SCALAR(d, d_out_re[i], d_out_im[i]);
-	       CASSIGN_MULT(d, scaleby, d);
-	       d_out_re[i] = CSCALAR_RE(d);
-	       d_out_im[i] = CSCALAR_IM(d);
-	  }
+     get_out_dims(rank, in_dims, Rout, resolution, multiply_size, out_dims);
 
-	  nam[0] = 'x' + dim;
-	  if (out_file.id != in_file.id)
-	       nam[3] = 0;
-	  if (verbose)
-	       printf("Writing dataset to %s...\n", nam);
-	  data_id = matrixio_create_dataset(out_file, nam,"", rank, out_dims2);
-	  matrixio_write_real_data(data_id, out_dims2, start,1, d_out_re);
-	  matrixio_close_dataset(data_id);
-
-	  nam[2] = 'i';
-	  if (verbose)
-	       printf("Writing dataset to %s...\n", nam);
-	  data_id = matrixio_create_dataset(out_file, nam,"", rank, out_dims2);
-	  matrixio_write_real_data(data_id, out_dims2, start,1, d_out_im);
-	  matrixio_close_dataset(data_id);
-
-	  if (verbose)
-	       printf("Successfully wrote out data.\n");
-     }
-
-     for (dim = 0; dim < 3; ++dim)
-          for (ri = 0; ri < 2; ++ri)
-	       free(d_in[dim][ri]);
+     map_datasets(in_file, out_file, 3, 1, in_names, out_names,
+		  rank, in_dims, out_dims, coord_map, &cart_map,
+		  kvector, scaleby, pick_nearest, transpose);
      return;
 
  bad:
-     for (dim = 0; dim < 3; ++dim)
-          for (ri = 0; ri < 2; ++ri)
-	       free(d_in[dim][ri]);
      /* try individual datasets */
      for (dim = 0; dim < 3; ++dim) {
 	  char namr[] = "x.r";
@@ -742,6 +858,8 @@ void usage(FILE *f)
 	     "         -p : pixellized output (no grid interpolation)\n"
 	     "  -d <name> : use dataset <name> in the input files (default: all mpb datasets)\n"
 	     "           -- you can also specify a dataset via <filename>:<name>\n"
+	     "    -s <mb> : stream output in slabs of at most <mb> megabytes\n"
+	     "     -j <n> : process up to <n> input files in parallel\n"
 	  );
 }
 
@@ -773,6 +891,16 @@ else { /* treat as if ":" were at the end of fname */
      return filename;
 }
 
+#ifdef USE_FORK
+/* wait for a child process to finish, returning nonzero if it failed */
+static int wait_job(void)
+{
+     int status;
+     CHECK(wait(&status) >= 0, "error waiting for child process");
+     return !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+}
+#endif
+
 int main(int argc, char **argv)
 {
      char *out_fname = NULL, *data_name = NULL;
@@ -782,12 +910,16 @@ int main(int argc, char **argv)
      vector3 ve = {1,0,0};
      real multiply_size[3] = {1,1,1};
      int pick_nearest = 0, transpose = 0;
-     int ifile, c;
+     int ifile, c, njobs = 1, failed = 0;
+#ifdef USE_FORK
+     int i, running = 0;
+     pid_t pid;
+#endif
      extern char *optarg;
      extern int optind;
      scalar_complex scaleby = {1,0}, phase;
 
-     while ((c = getopt(argc, argv, "hVvo:x:y:z:m:d:n:prTe:P:")) != -1)
+     while ((c = getopt(argc, argv, "hVvo:x:y:z:m:d:n:prTe:P:s:j:")) != -1)
           switch (c) {
               case 'h':
                    usage(stdout);
@@ -838,6 +970,21 @@ int main(int argc, char **argv)
               case 'P':
                    phaseangle = atof(optarg);
 		   break;
+              case 's':
+                   stream_mb = atof(optarg);
+		   CHECK(stream_mb > 0,
+			 "invalid slab size for -s (must be positive)");
+                   break;
+              case 'j':
+                   njobs = atoi(optarg);
+		   CHECK(njobs > 0,
+			 "invalid number of jobs for -j (must be positive)");
+#ifndef USE_FORK
+		   if (njobs > 1)
+			fprintf(stderr, "mpb-data: -j is not supported on "
+				"this system, ignoring it\n");
+#endif
+                   break;
               case 'p':
                    pick_nearest = 1;
                    break;
@@ -879,6 +1026,40 @@ int main(int argc, char **argv)
 	  if (!dname[0])
                dname = data_name;
 
+#ifdef USE_FORK
+	  if (njobs > 1) {
+	       /* handle each file in a child process, with at most
+		  njobs at once; files appearing more than once
+		  (with different datasets) must not be written
+		  concurrently, so wait for everything in that case */
+	       for (i = optind; i < ifile && running > 0; ++i) {
+		    char *dn, *fn = split_fname(argv[i], &dn);
+		    if (!strcmp(fn, h5_fname))
+			 while (running > 0) {
+			      failed |= wait_job();
+			      --running;
+			 }
+		    free(fn);
+	       }
+	       if (running == njobs) {
+		    failed |= wait_job();
+		    --running;
+	       }
+	       fflush(stdout);
+	       fflush(stderr);
+	       pid = fork();
+	       CHECK(pid >= 0, "fork failed");
+	       if (pid == 0) {
+		    handle_file(h5_fname, out_fname, dname, 
+				rectify, have_ve, ve, resolution, 
+				scaleby, multiply_size, pick_nearest, 
+				transpose);
+		    exit(EXIT_SUCCESS);
+	       }
+	       ++running;
+	  }
+	  else
+#endif
 	  handle_file(h5_fname, out_fname, dname, 
 		      rectify, have_ve, ve, resolution, 
 		      scaleby, multiply_size, pick_nearest, transpose);
@@ -888,7 +1069,13 @@ int main(int argc, char **argv)
           out_fname = NULL;
           free(h5_fname);
      }
+#ifdef USE_FORK
+     while (running > 0) {
+	  failed |= wait_job();
+	  --running;
+     }
+#endif
      free(data_name);
 
-     return EXIT_SUCCESS;
+     return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }